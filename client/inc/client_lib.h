@@ -2,12 +2,16 @@
 #define CLIENT_LIB_H
 
 #include <stdbool.h>
-#include <pthread.h>
 #include "chat_app_common.h"
-#include "user_iterectaions.h"
 
 #define SERVER_PORT 12345
 #define SERVER_IP   "127.0.0.1"
+#define FILE_RECV_PREFIX  "recv_"
+#define FILE_RX_BUF_LEN   (64*1024)
+/* Bytes read from the server per client_process_io() call before yielding to the caller. */
+#define CLIENT_READ_BUDGET (256*1024)
+#define MAX_PENDING_REQS  64
+#define REQ_DEFAULT_TIMEOUT_MS 5000
 
 typedef enum
 {
@@ -20,6 +24,11 @@ typedef enum
     CLIENT_READ_TIMEOUT,
     CLIENT_CB_PARAMS_NOT_SET,
     CLIENT_ERR_NULL_PTR,
+    CLIENT_NOT_IN_CHAT,
+    CLIENT_FILE_ERR,
+    CLIENT_FILE_BUSY,
+    CLIENT_REQ_LIMIT,
+    CLIENT_WOULD_BLOCK,
     CLIENT_MAX_ERR
 }client_err_type_t;
 
@@ -29,25 +38,105 @@ typedef enum{
     CHAT_CLIENT_
 }chat_client_err_t;
 
+/* Conversation state of one channel, see channel_id in msg_t. */
+typedef enum
+{
+    CHANNEL_FREE=0,
+    CHANNEL_REQ_SENT,
+    CHANNEL_REQ_RX,
+    CHANNEL_CHAT
+}client_channel_state_t;
+
+/* One connection to the server, created by client_session_new(). */
+typedef struct client_session client_session_t;
+
+/*
+ * Completion of a request started with one of the *_async calls. status is
+ * CLIENT_SUCCESS with the first frame the server sent back for it,
+ * CLIENT_READ_TIMEOUT or CLIENT_NOT_CONNECTED with resp NULL. Runs inside
+ * client_process_io(), after msg_handle_cb saw the same frame.
+ */
+typedef void (*req_done_cb_t)(uint16_t req_id, client_err_type_t status, const msg_t* resp, void* user_data);
+
 typedef struct
 {
-    bool *client_shut_down_flag;
-    bool *server_shut_down_flag;
-    bool *conn_request_rx;
-    bool *busy_in_chat;
-    char* connected_client_name;
-    client_err_type_t (*msg_handle_cb)(msg_t rx_msg);
+    /* Handed back by client_user_data(), e.g. to find the application's own state. */
+    void* user_data;
+    client_err_type_t (*msg_handle_cb)(client_session_t* session, const msg_t* rx_msg);
+    /* Optional, called after every file chunk sent or received. */
+    void (*file_progress_cb)(client_session_t* session, bool sending, const char* file_name, uint64_t done, uint64_t total);
+    /* Optional, SERVER_IP and SERVER_PORT when unset, e.g. to pick a node of a server cluster. */
+    const char* server_ip;
+    uint16_t server_port;
+    /* Optional, connects to this UNIX socket instead, for clients on the server's host. */
+    const char* server_path;
+    /* With server_path: after the handshake, frames go through shared-memory rings. */
+    bool use_shm;
 }lib_params_t;
 
+/*
+ * A session owns its socket, queues and chat state, nothing is kept in
+ * globals. Any number of sessions can live in one process; each one must be
+ * driven by one thread at a time. params is copied.
+ */
+client_session_t* client_session_new(const lib_params_t* params);
+void client_session_free(client_session_t* session);
+void* client_user_data(client_session_t* session);
 
-client_err_type_t connect_to_server(void);
-void set_my_name(char *name_to_set);
+/*
+ * A session chats with up to MAX_CHANNELS peers at once, each on its own
+ * channel. The channel_id of every frame handed to msg_handle_cb tells which
+ * conversation it belongs to. The active channel is the one the last
+ * conversation was opened on, or picked with client_switch_channel(); the
+ * send calls below use it when given NO_CHANNEL.
+ */
+client_channel_state_t client_channel_state(client_session_t* session, uint8_t channel);
+const char* client_peer_name(client_session_t* session, uint8_t channel);
+/* Channel of the conversation with name in any state, NO_CHANNEL if none. */
+uint8_t client_find_channel(client_session_t* session, const char* name);
+uint8_t client_active_channel(client_session_t* session);
+client_err_type_t client_switch_channel(client_session_t* session, uint8_t channel);
+
+void print_bin_info(void);
+client_err_type_t connect_to_server(client_session_t* session);
+void set_my_name(client_session_t* session, char *name_to_set);
 const char *errTostr(client_err_type_t err);
 const char *msgTypeToStr(msg_type_t type);
-void get_client_list(void);
-void set_lib_params(lib_params_t* params);
-client_err_type_t chat_on(void);
-void connect_with_client(char *name);
-client_err_type_t send_msg_to_server(msg_t msg_to_send);
+void get_client_list(client_session_t* session);
+void connect_with_client(client_session_t* session, char *name);
+client_err_type_t send_msg_to_server(client_session_t* session, const msg_t* msg_to_send);
+/* Sending DISCONNECT_CMD ends the conversation, like disconnect_channel(). */
+client_err_type_t send_chat_text(client_session_t* session, uint8_t channel, const char* text);
+client_err_type_t accept_connection(client_session_t* session, uint8_t channel);
+client_err_type_t decline_connection(client_session_t* session, uint8_t channel);
+client_err_type_t disconnect_channel(client_session_t* session, uint8_t channel);
+
+/* timeout_ms <= 0 picks REQ_DEFAULT_TIMEOUT_MS, req_id may be NULL. */
+client_err_type_t set_my_name_async(client_session_t* session, const char* name, req_done_cb_t cb, void* user_data, int timeout_ms, uint16_t* req_id);
+client_err_type_t get_client_list_async(client_session_t* session, req_done_cb_t cb, void* user_data, int timeout_ms, uint16_t* req_id);
+client_err_type_t connect_with_client_async(client_session_t* session, const char* name, req_done_cb_t cb, void* user_data, int timeout_ms, uint16_t* req_id);
+/* One file in each direction per session, bound to the channel it started on. */
+client_err_type_t send_file(client_session_t* session, uint8_t channel, const char* path);
+void cancel_file_transfer(client_session_t* session);
+void abort_file_transfers(client_session_t* session);
+
+/*
+ * Non-blocking driver for embedding the client in an external event loop.
+ * The library never blocks or spawns threads after connect_to_server():
+ * poll client_get_fd() for client_poll_events(), with client_next_timeout_ms()
+ * as timeout, then pass the returned revents (0 on timeout) to
+ * client_process_io(). Sends are queued and flushed from there. On shared
+ * memory the fd is an epoll set, which only ever wants POLLIN. Any other
+ * return than CLIENT_SUCCESS means the connection is gone and was closed,
+ * client_get_fd() is INVALID_FD from then on.
+ */
+int client_get_fd(client_session_t* session);
+short client_poll_events(client_session_t* session);
+int client_next_timeout_ms(client_session_t* session);
+client_err_type_t client_process_io(client_session_t* session, short revents);
+void client_close(client_session_t* session);
+
+// Needs client_session_t.
+#include "user_iterectaions.h"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include <string.h>
+#include <zlib.h>
+#include "client_compress.h"
+#include "chat_compress_dict.h"
+#include "logger.h"
+
+bool client_deflate_text(const char* text, size_t len, msg_t* out)
+{
+	if( (!text) || (!out) || (len > CHAT_TEXT_MAX_LEN) ) return false;
+
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	// Level 1: chat text is small, latency matters more than the last few bytes.
+	if(Z_OK != deflateInit(&zs, Z_BEST_SPEED))
+		return false;
+	deflateSetDictionary(&zs, (const Bytef*)chat_compress_dict, sizeof(chat_compress_dict)-1);
+
+	memset(out,0,sizeof(*out));
+	zs.next_in = (Bytef*)text;
+	zs.avail_in = len;
+	zs.next_out = (Bytef*)(out->msg_data.buffer + sizeof(compressed_hdr_t));
+	zs.avail_out = COMPRESSED_DATA_MAX_LEN;
+
+	int ret = deflate(&zs, Z_FINISH);
+	size_t comp_len = zs.total_out;
+	deflateEnd(&zs);
+	if(Z_STREAM_END != ret)
+	{
+		LOGD("%lu bytes do not compress into one frame.",(unsigned long)len);
+		return false;
+	}
+
+	compressed_hdr_t hdr = { .raw_len = len, .comp_len = comp_len, .codec = CODEC_DEFLATE_DICT };
+	memcpy(out->msg_data.buffer, &hdr, sizeof(hdr));
+	out->msg_type = MSG_CLIENT_TX_COMPRESSED;
+	return true;
+}
+
+int client_inflate_text(const msg_t* msg, char* out, size_t out_len)
+{
+	compressed_hdr_t hdr;
+	memcpy(&hdr, msg->msg_data.buffer, sizeof(hdr));
+	if( (CODEC_DEFLATE_DICT != hdr.codec) || (hdr.comp_len > COMPRESSED_DATA_MAX_LEN) || (hdr.raw_len > out_len) )
+	{
+		LOGE("Invalid compressed frame.");
+		return -1;
+	}
+
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	if(Z_OK != inflateInit(&zs))
+		return -1;
+	zs.next_in = (Bytef*)(msg->msg_data.buffer + sizeof(hdr));
+	zs.avail_in = hdr.comp_len;
+	zs.next_out = (Bytef*)out;
+	zs.avail_out = hdr.raw_len;
+
+	int ret = inflate(&zs, Z_FINISH);
+	if(Z_NEED_DICT == ret)
+	{
+		inflateSetDictionary(&zs, (const Bytef*)chat_compress_dict, sizeof(chat_compress_dict)-1);
+		ret = inflate(&zs, Z_FINISH);
+	}
+	size_t produced = zs.total_out;
+	inflateEnd(&zs);
+
+	if( (Z_STREAM_END != ret) || (produced != hdr.raw_len) )
+	{
+		LOGE("Inflate failed, ret : %d.",ret);
+		return -1;
+	}
+	return (int)produced;
+}
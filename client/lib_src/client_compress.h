@@ -0,0 +1,16 @@
+#ifndef CLIENT_COMPRESS_H
+#define CLIENT_COMPRESS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "chat_app_common.h"
+
+/* Codecs offered in MSG_CONN_ESTABLISH_ACK. */
+#define CLIENT_SUPPORTED_CODECS  CODEC_DEFLATE_DICT
+
+/* Fill out as MSG_CLIENT_TX_COMPRESSED, false when the result would not fit one frame. */
+bool client_deflate_text(const char* text, size_t len, msg_t* out);
+/* Inflate a MSG_CLIENT_RX_COMPRESSED payload into out, returns raw length or -1. */
+int client_inflate_text(const msg_t* msg, char* out, size_t out_len);
+
+#endif
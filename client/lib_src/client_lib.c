@@ -5,24 +5,23 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <arpa/inet.h>
-#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/select.h>
 #include <poll.h>
-#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
 #include "logger.h"
 #include "client_lib.h"
 #include "chat_app_common.h"
-
-#define RETVAL(x) ((void*)(intptr_t)(x))
-#define GETVAL(ptr)   ((client_err_type_t)(intptr_t)(ptr))
+#include "client_compress.h"
+#include "client_session.h"
+#include "client_shm.h"
 
 client_err_type_t recv_with_timeout(int sock, void *buf, size_t len, int timeout_sec);
-pthread_t io_thread_id;
-
-int sock = INVALID_FD;
-lib_params_t *cb_parameters=NULL;
-bool conn_request_rx       = false;
 
 const char *errStr[] = {
     "UNDEFINED_CLIENT_ERR",
@@ -30,10 +29,16 @@ const char *errStr[] = {
     "CONNECTION_FAILED",
     "CLIENT_NOT_CONNECTED",
     "CLIENT_MSG_SEND_ERR",
-    "CLIENT_ERR_THREAD_CREATE",	
+    "CLIENT_ERR_THREAD_CREATE",
     "CLIENT_READ_ERROR",
     "CLIENT_READ_TIMEOUT",
     "CLIENT_CB_PARAMS_NOT_SET",
+    "CLIENT_ERR_NULL_PTR",
+    "CLIENT_NOT_IN_CHAT",
+    "CLIENT_FILE_ERR",
+    "CLIENT_FILE_BUSY",
+    "CLIENT_REQ_LIMIT",
+    "CLIENT_WOULD_BLOCK",
     "CLIENT_MAX_ERR"
 };
 
@@ -68,10 +73,45 @@ const char *msgTypeStr[] = {
 	"MSG_CLIENT_DISCONNECTED",
 	"MSG_CLIENT_CHAT_READY",
 	"MSG_CLIENT_CHANGE_CONN_FD_REQ",
-	"MSG_MAX_CLIENT_REACHED"
+	"MSG_MAX_CLIENT_REACHED",
+	"MSG_HEARTBEAT_REQ",
+	"MSG_HEARTBEAT_ACK",
+	"MSG_CONNECTION_REQ_EXPIRED",
+	"MSG_CLIENT_IDLE_TIMEOUT",
+	"MSG_FILE_OFFER",
+	"MSG_FILE_DATA",
+	"MSG_FILE_CANCEL",
+	"MSG_CLIENT_TX_COMPRESSED",
+	"MSG_CLIENT_RX_COMPRESSED",
+	"MSG_CHANNEL_LIMIT",
+	"MSG_SHM_UPGRADE_REQ",
+	"MSG_SHM_UPGRADE_ACK",
+	"MSG_SHM_UPGRADE_NACK",
+	"MSG_RATE_LIMITED",
+	"MSG_SERVER_BUSY",
+	"MSG_SERVER_SHUTDOWN"
 };
 
-void handle_rx_msg_lib(int sock,msg_t rx_msg);
+void handle_rx_msg_lib(client_session_t* s, const msg_t* rx_msg);
+client_err_type_t flush_tx(client_session_t* s);
+void start_file_chunk(client_session_t* s);
+void file_xfer_close(file_xfer_t* xfer, bool remove_file);
+void deliver_compressed_msg(client_session_t* s, const msg_t* rx_msg);
+void complete_request(client_session_t* s, const msg_t* rx_msg);
+int expire_requests(client_session_t* s);
+void fail_all_requests(client_session_t* s, client_err_type_t status);
+void handle_file_offer(client_session_t* s, const msg_t* rx_msg);
+void handle_file_data(client_session_t* s, const msg_t* rx_msg);
+static void cancel_xfer(client_session_t* s, file_xfer_t* xfer);
+static void report_file_progress(client_session_t* s, bool sending, file_xfer_t* xfer);
+static void release_channel(client_session_t* s, uint8_t ch);
+
+static uint64_t lib_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
 
 void print_bin_info(void)
 {
@@ -82,83 +122,201 @@ void print_bin_info(void)
     printf("*********************************************\n\n");
 }
 
-void sig_int_handler(int sig)
+client_session_t* client_session_new(const lib_params_t* params)
 {
-	LOGI("Client termination signal received.");
-	if(sig==SIGINT)
+	LOGD("");
+	if( (!params) || (!params->msg_handle_cb) )
 	{
-		if(NULL==cb_parameters)
-		{
-			LOGI("cb_params are null.");
-			return;
-		}
-		else
-		{
-			*(cb_parameters->client_shut_down_flag) = true;
-			LOGI("Set client_shut_down_flag.");
-		}
+		LOGE("Null callback params found.");
+		return NULL;
 	}
+
+	client_session_t* s = calloc(1,sizeof(*s));
+	if(!s)
+	{
+		LOGE("calloc failed for session.");
+		return NULL;
+	}
+	s->sock = INVALID_FD;
+	s->params = *params;
+	s->tx_file.file_fd = INVALID_FD;
+	s->rx_file.file_fd = INVALID_FD;
+	s->shm_wake_fd = INVALID_FD;
+	s->shm_server_fd = INVALID_FD;
+	s->shm_poll_fd = INVALID_FD;
+	for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
+		release_channel(s,ch);
+	LOGI("Session created.");
+	return s;
 }
 
-client_err_type_t check_lib_params(void)
+void client_session_free(client_session_t* s)
 {
-	LOGD("");
-	if(!cb_parameters)
+	if(!s) return;
+	client_close(s);
+	free(s);
+}
+
+void* client_user_data(client_session_t* s)
+{
+	return s->params.user_data;
+}
+
+static client_channel_t* get_channel(client_session_t* s, uint8_t ch)
+{
+	if( (NO_CHANNEL == ch) || (ch > MAX_CHANNELS) ) return NULL;
+	return &s->channels[ch-1];
+}
+
+client_channel_state_t client_channel_state(client_session_t* s, uint8_t ch)
+{
+	client_channel_t* chan = get_channel(s,ch);
+	return chan ? chan->state : CHANNEL_FREE;
+}
+
+const char* client_peer_name(client_session_t* s, uint8_t ch)
+{
+	client_channel_t* chan = get_channel(s,ch);
+	return chan ? chan->peer : UNDEF_NAME;
+}
+
+uint8_t client_find_channel(client_session_t* s, const char* name)
+{
+	if(!name) return NO_CHANNEL;
+	for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
 	{
-		LOGE("Null callback params found.");
-		return CLIENT_ERR_NULL_PTR;
+		client_channel_t* chan = get_channel(s,ch);
+		if( (CHANNEL_FREE != chan->state) && (0 == strcmp(chan->peer,name)) )
+			return ch;
 	}
-	else if( (!cb_parameters->client_shut_down_flag) || 
-	         (!cb_parameters->server_shut_down_flag) || 
-			 (!cb_parameters->msg_handle_cb) ||
-			 (!cb_parameters->busy_in_chat)  ||
-			 (!cb_parameters->connected_client_name)
-			)
+	return NO_CHANNEL;
+}
+
+uint8_t client_active_channel(client_session_t* s)
+{
+	return s->active_channel;
+}
+
+client_err_type_t client_switch_channel(client_session_t* s, uint8_t ch)
+{
+	if(CHANNEL_CHAT != client_channel_state(s,ch))
+		return CLIENT_NOT_IN_CHAT;
+	s->active_channel = ch;
+	return CLIENT_SUCCESS;
+}
+
+/* Returns the chat channel meant by ch, NO_CHANNEL standing for the active one. */
+static uint8_t resolve_chat_channel(client_session_t* s, uint8_t ch)
+{
+	if(NO_CHANNEL == ch)
+		ch = s->active_channel;
+	return (CHANNEL_CHAT == client_channel_state(s,ch)) ? ch : NO_CHANNEL;
+}
+
+static void set_channel(client_session_t* s, uint8_t ch, client_channel_state_t state, const char* peer)
+{
+	client_channel_t* chan = get_channel(s,ch);
+	if(!chan)
 	{
-		LOGE("Any of cb_param is null.");
-		return CLIENT_ERR_NULL_PTR;
+		LOGE("Server used invalid channel %u.",ch);
+		return;
 	}
-	LOGI("cb_params set successfully.");
-	return CLIENT_SUCCESS;
+	LOGI("Channel %u : %s, state %d.",ch,peer,state);
+	chan->state = state;
+	// A state change alone passes the channel's own name.
+	if(peer != chan->peer)
+	{
+		strncpy(chan->peer,peer,MAX_CLIENT_NAME_LEN-1);
+		chan->peer[MAX_CLIENT_NAME_LEN-1] = '\0';
+	}
+	if(CHANNEL_CHAT == state)
+		s->active_channel = ch;
 }
 
-client_err_type_t connect_to_server(void)
+/* Drops the conversation and its file transfers, another chat becomes active. */
+static void release_channel(client_session_t* s, uint8_t ch)
 {
-	LOGD("");
-	print_bin_info();
-    struct sockaddr_in serv_addr;
+	client_channel_t* chan = get_channel(s,ch);
+	if(!chan) return;
+	chan->state = CHANNEL_FREE;
+	strcpy(chan->peer,UNDEF_NAME);
+	if( (s->tx_file.active) && (ch == s->tx_file.channel) )
+		file_xfer_close(&s->tx_file,false);
+	if( (s->rx_file.active) && (ch == s->rx_file.channel) )
+		file_xfer_close(&s->rx_file,true);
 
-	if(CLIENT_SUCCESS!=check_lib_params())
+	if(ch != s->active_channel) return;
+	s->active_channel = NO_CHANNEL;
+	for(uint8_t i=1; i<=MAX_CHANNELS; i++)
 	{
-		return CLIENT_CB_PARAMS_NOT_SET;
+		if(CHANNEL_CHAT == get_channel(s,i)->state)
+		{
+			s->active_channel = i;
+			break;
+		}
 	}
+}
 
-    struct sigaction sa = {0};
-    sa.sa_handler = sig_int_handler;   
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;          
-    sigaction(SIGINT, &sa, NULL);
+/* The UNIX socket when a path is given, TCP otherwise. */
+static bool open_server_socket(client_session_t* s)
+{
+	if(s->params.server_path)
+	{
+		struct sockaddr_un serv_addr;
+		memset(&serv_addr,0,sizeof(serv_addr));
+		serv_addr.sun_family = AF_UNIX;
+		if(strlen(s->params.server_path) >= sizeof(serv_addr.sun_path))
+		{
+			LOGE("Server socket path too long.");
+			return false;
+		}
+		strcpy(serv_addr.sun_path,s->params.server_path);
+		s->sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		LOGI("Got UNIX socket.");
+		return (INVALID_FD != s->sock) && (0 == connect(s->sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)));
+	}
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(s->params.server_port ? s->params.server_port : SERVER_PORT);
+    if(1 != inet_pton(AF_INET, s->params.server_ip ? s->params.server_ip : SERVER_IP, &serv_addr.sin_addr))
+	{
+		LOGE("Invalid server address.");
+		return false;
+	}
+    s->sock = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
 	LOGI("Got socket.");
+	return (INVALID_FD != s->sock) && (0 == connect(s->sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)));
+}
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr);
+client_err_type_t connect_to_server(client_session_t* s)
+{
+	LOGD("");
+	if(!s)
+	{
+		return CLIENT_CB_PARAMS_NOT_SET;
+	}
+	if(INVALID_FD != s->sock)
+	{
+		LOGE("Session is already connected.");
+		return CONNECTION_FAILED;
+	}
 
-    if(connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)))
+    if(!open_server_socket(s))
 	{
 		LOGE("[ connect ] failed.");
+		client_close(s);
 		return CONNECTION_FAILED;
 	}
     LOGI("Connected to server.");
 
 	msg_t temp_msg={0};
-	client_err_type_t err = recv_with_timeout(sock,&temp_msg,sizeof(temp_msg),5);
+	client_err_type_t err = recv_with_timeout(s->sock,&temp_msg,sizeof(temp_msg),5);
 
 	if(CLIENT_SUCCESS != err )
 	{
 		LOGE("Connection verification failed.");
+		client_close(s);
 		return CONNECTION_FAILED;
 	}
 	else
@@ -166,170 +324,414 @@ client_err_type_t connect_to_server(void)
 		if( (MSG_CONN_ESTABLISH_REQ==temp_msg.msg_type) && (0==strcmp(temp_msg.msg_data.buffer,SERVER_UNIQUEUE_ID) ))
 		{
 			LOGI("Connection verified successfully.");
+			conn_caps_t caps;
+			memcpy(&caps,temp_msg.msg_data.buffer+HANDSHAKE_CAPS_OFFSET,sizeof(caps));
+			s->conn_codecs = caps.codecs & CLIENT_SUPPORTED_CODECS;
+			LOGI("Negotiated codecs : 0x%x.",s->conn_codecs);
+
 			msg_t send_node={0};
 			send_node.msg_type=MSG_CONN_ESTABLISH_ACK;
-			client_err_type_t err = send_msg_to_server(send_node);
-			if(err!=CLIENT_SUCCESS) return CONNECTION_FAILED;
+			caps.codecs = CLIENT_SUPPORTED_CODECS;
+			memcpy(send_node.msg_data.buffer+HANDSHAKE_CAPS_OFFSET,&caps,sizeof(caps));
+			if(sizeof(send_node)!=send(s->sock,&send_node,sizeof(send_node),MSG_NOSIGNAL))
+			{
+				client_close(s);
+				return CONNECTION_FAILED;
+			}
+			if( (s->params.use_shm) && (s->params.server_path) && (CLIENT_SUCCESS != client_shm_upgrade(s)) )
+			{
+				client_close(s);
+				return CONNECTION_FAILED;
+			}
 		}
 		else if(MSG_MAX_CLIENT_REACHED==temp_msg.msg_type)
 		{
 			printf("Server is on its limit, no more client connection allowed.\n");
+			client_close(s);
+			return CONNECTION_FAILED;
+		}
+		else if(MSG_SERVER_BUSY==temp_msg.msg_type)
+		{
+			rate_limit_info_t info;
+			memcpy(&info,temp_msg.msg_data.buffer,sizeof(info));
+			printf("Server is overloaded, retry in %u ms.\n",info.retry_after_ms);
+			client_close(s);
+			return CONNECTION_FAILED;
+		}
+		else if(MSG_SERVER_SHUTDOWN==temp_msg.msg_type)
+		{
+			printf("Server is shutting down.\n");
+			client_close(s);
 			return CONNECTION_FAILED;
 		}
 		else
 		{
 			LOGE("Server key mismatched.");
+			client_close(s);
 			return CONNECTION_FAILED;
 		}
 	}
+
+	// From here on the socket is driven by client_process_io().
+	fcntl(s->sock,F_SETFL,fcntl(s->sock,F_GETFL)|O_NONBLOCK);
 	return CLIENT_SUCCESS;
 }
 
-void set_my_name(char *name_to_set)
+void set_my_name(client_session_t* s, char *name_to_set)
 {
 	LOGD("");
-	if(NULL==name_to_set)
-	{
-		LOGE("Null ptr found");
-		return;
-	}
-
-	msg_t send_msg={0};
-	send_msg.to_client_id=MSG_SERVER;
-	strcpy(send_msg.msg_data.buffer,name_to_set);
-	send_msg.msg_type = MSG_SET_NAME_REQ_TYPE;
-	client_err_type_t ret = send_msg_to_server(send_msg);
+	client_err_type_t ret = set_my_name_async(s,name_to_set,NULL,NULL,0,NULL);
 	if(CLIENT_SUCCESS!=ret)
 		LOGE("set-name msg send : failed.");
-	else
-		LOGD("set-name msg send : success,name : %s.",name_to_set);
 }
 
-client_err_type_t send_msg_to_server(msg_t msg_to_send)
+static client_err_type_t tx_queue(client_session_t* s, const void* data, size_t len)
+{
+	if(s->tx_len + len > s->tx_cap)
+	{
+		size_t cap = s->tx_cap ? s->tx_cap : 2*sizeof(msg_t);
+		while(cap < s->tx_len + len)
+			cap *= 2;
+		uint8_t* buf = realloc(s->tx_buf,cap);
+		if(!buf)
+		{
+			LOGE("realloc failed for %lu bytes.",(unsigned long)cap);
+			return CLIENT_MSG_SEND_ERR;
+		}
+		s->tx_buf = buf;
+		s->tx_cap = cap;
+	}
+	memcpy(s->tx_buf + s->tx_len, data, len);
+	s->tx_len += len;
+	return CLIENT_SUCCESS;
+}
+
+/* Queues the frame and writes as much as the socket takes without blocking. */
+client_err_type_t send_msg_to_server(client_session_t* s, const msg_t* msg_to_send)
 {
 	LOGD("");
-	if(sock==INVALID_FD)
+	if(s->sock==INVALID_FD)
 	{
 		LOGE("cliet is not connected to server.");
 		return CLIENT_NOT_CONNECTED;
 	}
+	if( (s->shm) && (!shm_frame_on_socket(msg_to_send->msg_type)) )
+		return client_shm_send(s,msg_to_send);
 
-	int ret = send(sock,&msg_to_send,sizeof(msg_to_send),0);
-	if( (sizeof(msg_to_send)!=ret) || (-1==ret))
+	client_err_type_t err = tx_queue(s,msg_to_send,sizeof(*msg_to_send));
+	if(CLIENT_SUCCESS != err)
+		return err;
+	err = flush_tx(s);
+	if( (CLIENT_SUCCESS != err) && (CLIENT_WOULD_BLOCK != err) )
 	{
 		LOGE("Error in sending msg to server.");
-		return CLIENT_MSG_SEND_ERR;
+		return err;
 	}
-	LOGI("msg send to server successfuly.");
+	LOGI("msg queued to server successfuly.");
 	return CLIENT_SUCCESS;
 }
 
-void* io_thread(void* arg)
+/* The peer's receiver counts raw bytes, a chunk whose file was closed is padded with zeroes. */
+static ssize_t send_chunk_bytes(client_session_t* s)
 {
-	LOGD("");
-    struct pollfd fds[2];
-    fds[0].fd = sock;
-    fds[0].events = POLLIN;
-
-    fds[1].fd = STDIN_FILENO;
-    fds[1].events = POLLIN;
-
-	msg_t rx_msg;
+	if(INVALID_FD != s->tx_file.file_fd)
+	{
+		off_t off = s->tx_file.done;
+		return sendfile(s->sock, s->tx_file.file_fd, &off, s->tx_chunk_left);
+	}
+	static const uint8_t zeroes[FILE_RX_BUF_LEN];
+	size_t len = (s->tx_chunk_left < sizeof(zeroes)) ? s->tx_chunk_left : sizeof(zeroes);
+	return send(s->sock, zeroes, len, MSG_DONTWAIT|MSG_NOSIGNAL);
+}
 
-    while ( (!(*cb_parameters->client_shut_down_flag)) && (!(*cb_parameters->server_shut_down_flag)) ) 
-    {
-        int ret = poll(fds, 2, 2000);
-
-        if (ret < 0)
-        {
-			if (EINTR == errno ) {
-                LOGD("Poll interrupted by signal.");
-                break;
-            }
-            LOGD("Error in poll.");
-            break;
-        }
-		else if(ret==0)
+client_err_type_t flush_tx(client_session_t* s)
+{
+	while(true)
+	{
+		if( (s->tx_chunk_left > 0) && (s->tx_off == s->tx_chunk_at) )
 		{
-			// LOGD("Poll timeout.");
-			continue;
-		}
-
-        if (fds[0].revents & POLLIN)
-        {
-            int bytes = recv(sock, &rx_msg, sizeof(rx_msg), 0);
-            if (bytes > 0)
-            {
-				LOGD("%d bytes received from server.",bytes);
-				if( (NULL!=cb_parameters) && (NULL!=cb_parameters->msg_handle_cb)) 
+			ssize_t sent = send_chunk_bytes(s);
+			if(sent > 0)
+			{
+				s->tx_chunk_left -= sent;
+				if(s->tx_file.active)
 				{
-					cb_parameters->msg_handle_cb(rx_msg);
-					handle_rx_msg_lib(sock,rx_msg);
+					s->tx_file.done += sent;
+					if(0 == s->tx_chunk_left)
+					{
+						report_file_progress(s,true,&s->tx_file);
+						if(s->tx_file.done >= s->tx_file.size)
+						{
+							LOGI("File sent : %s.",s->tx_file.name);
+							file_xfer_close(&s->tx_file,false);
+						}
+					}
 				}
+				continue;
 			}
-            else if (bytes == 0)
-            {
-                printf("Server shut-down detected.\n");
-                LOGI("Setting client/server shutdow flag.");
-				*cb_parameters->server_shut_down_flag = true;
-				*cb_parameters->client_shut_down_flag = true;
-                break;
-            }
-            else
-            {
-                LOGE("error in receive from server.");;
-                break;
-            }
-        }
-		if(fds[1].revents & POLLIN)
+			if( (0 == sent) && (INVALID_FD != s->tx_file.file_fd) )
+			{
+				// The file shrank under the transfer: the chunk is padded out and the peer told.
+				LOGE("File ended early : %s.",s->tx_file.name);
+				close(s->tx_file.file_fd);
+				s->tx_file.file_fd = INVALID_FD;
+				cancel_xfer(s,&s->tx_file);
+				continue;
+			}
+		}
+		else
 		{
-			char buffer[MAX_MSG_LEN];
-			int bytes = read(STDIN_FILENO, buffer, sizeof(buffer)-1);
-            if (bytes > 0)
-            {
-				// LOGD("%d bytes received from stdin.",bytes);
-				if((1==bytes) && (buffer[0]=='\n'))
+			size_t limit = (s->tx_chunk_left > 0) ? s->tx_chunk_at : s->tx_len;
+			if(s->tx_off == limit)
+			{
+				if(s->tx_off == s->tx_len)
 				{
-					continue;
-				}
-
-				buffer[bytes] = '\0';
-				if(buffer[bytes-1] == '\n')
-					buffer[bytes-1] = '\0';
-
-				char *start = buffer;
-				while (*start == ' ' || *start == '\t')
-					start++;
-				
-				// Move the trimmed string to the beginning of buf
-				if (start != buffer) {
-					memmove(buffer, start, strlen(start) + 1);
+					s->tx_off = 0;
+					s->tx_len = 0;
 				}
-
-				process_send_msg(buffer);
+				return CLIENT_SUCCESS;
 			}
-            else if (bytes == 0)
-            {
-				LOGD("0 bytes received in poll of stdin.");
+			ssize_t sent = send(s->sock, s->tx_buf + s->tx_off, limit - s->tx_off, MSG_DONTWAIT|MSG_NOSIGNAL);
+			if(sent > 0)
+			{
+				s->tx_off += sent;
 				continue;
-            }
-            else
-            {
-                LOGE("error in receive from STDIN.");
-                break;
-            }
+			}
 		}
-    }
-	LOGI("Client io_thread is terminating.");
-    return RETVAL(CLIENT_SUCCESS);
+
+		if(EINTR == errno)
+			continue;
+		if( (EAGAIN == errno) || (EWOULDBLOCK == errno) )
+			return CLIENT_WOULD_BLOCK;
+		LOGE("Error in sending to server, errno : %d.",errno);
+		return CLIENT_MSG_SEND_ERR;
+	}
+}
+
+int client_get_fd(client_session_t* s)
+{
+	return s->shm ? s->shm_poll_fd : s->sock;
 }
 
-void get_client_list(void)
+/* An active outgoing file wants POLLOUT even with an empty queue, to start its next chunk. */
+short client_poll_events(client_session_t* s)
+{
+	if(INVALID_FD == s->sock) return 0;
+	bool want_out = (s->tx_off < s->tx_len) || (s->tx_chunk_left > 0) || (s->tx_file.active);
+	if(s->shm)
+		return client_shm_poll_events(s,want_out);
+	return POLLIN | (want_out ? POLLOUT : 0);
+}
+
+static void dispatch_rx_frame(client_session_t* s, const msg_t* rx_msg)
+{
+	LOGD("msg received from server, msg_type : %s.",msgTypeToStr(rx_msg->msg_type));
+	if(MSG_CLIENT_RX_COMPRESSED==rx_msg->msg_type)
+	{
+		deliver_compressed_msg(s,rx_msg);
+		return;
+	}
+	s->params.msg_handle_cb(s,rx_msg);
+	handle_rx_msg_lib(s,rx_msg);
+	complete_request(s,rx_msg);
+}
+
+/* A whole frame is read where it was received, unless msg_t cannot be read from that address. */
+static void dispatch_rx_bytes(client_session_t* s, const uint8_t* data)
+{
+	msg_t aligned;
+	const msg_t* rx_msg = (const msg_t*)data;
+	if(0 != ((uintptr_t)data % _Alignof(msg_t)))
+	{
+		memcpy(&aligned,data,sizeof(aligned));
+		rx_msg = &aligned;
+	}
+	dispatch_rx_frame(s,rx_msg);
+}
+
+static void consume_chunk_bytes(client_session_t* s, const uint8_t* data, size_t len)
+{
+	file_xfer_t* xfer = &s->rx_file;
+	s->rx_chunk_left -= len;
+	if( (!s->rx_chunk_keep) || (!xfer->active) ) return;
+
+	if(len != (size_t)write(xfer->file_fd, data, len))
+	{
+		LOGE("Write to %s failed, cancelling.",xfer->path);
+		cancel_xfer(s,xfer);
+		return;
+	}
+	xfer->done += len;
+	if(s->rx_chunk_left > 0) return;
+
+	report_file_progress(s,false,xfer);
+	if(xfer->done >= xfer->size)
+	{
+		LOGI("File received : %s.",xfer->path);
+		file_xfer_close(xfer,false);
+	}
+}
+
+/* Splits the stream into frames and the raw chunks following MSG_FILE_DATA frames. */
+static void consume_rx(client_session_t* s, const uint8_t* data, size_t len)
+{
+	while( (len > 0) && (!s->rx_broken) )
+	{
+		if(s->rx_chunk_left > 0)
+		{
+			size_t n = (len < s->rx_chunk_left) ? len : s->rx_chunk_left;
+			consume_chunk_bytes(s,data,n);
+			data += n;
+			len -= n;
+			continue;
+		}
+
+		if( (0 == s->rx_len) && (len >= sizeof(msg_t)) )
+		{
+			dispatch_rx_bytes(s,data);
+			data += sizeof(msg_t);
+			len -= sizeof(msg_t);
+			continue;
+		}
+
+		size_t n = sizeof(s->rx_frame) - s->rx_len;
+		if(n > len)
+			n = len;
+		memcpy(s->rx_frame + s->rx_len, data, n);
+		s->rx_len += n;
+		data += n;
+		len -= n;
+		if(s->rx_len == sizeof(s->rx_frame))
+		{
+			s->rx_len = 0;
+			dispatch_rx_bytes(s,s->rx_frame);
+		}
+	}
+}
+
+static client_err_type_t read_from_server(client_session_t* s)
+{
+	uint8_t buf[FILE_RX_BUF_LEN];
+	size_t budget = CLIENT_READ_BUDGET;
+	while(budget > 0)
+	{
+		ssize_t bytes = recv(s->sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if(bytes > 0)
+		{
+			consume_rx(s,buf,bytes);
+			if(s->rx_broken)
+				return CLIENT_READ_ERROR;
+			if((size_t)bytes < sizeof(buf))
+				return CLIENT_SUCCESS;
+			budget = (budget > (size_t)bytes) ? budget - bytes : 0;
+			continue;
+		}
+		if(0 == bytes)
+			return CLIENT_NOT_CONNECTED;
+		if(EINTR == errno)
+			continue;
+		if( (EAGAIN == errno) || (EWOULDBLOCK == errno) )
+			return CLIENT_SUCCESS;
+		LOGE("error in receive from server, errno : %d.",errno);
+		return CLIENT_READ_ERROR;
+	}
+	return CLIENT_SUCCESS;
+}
+
+int client_next_timeout_ms(client_session_t* s)
+{
+	int64_t next = -1;
+	uint64_t now = lib_now_ms();
+	for(int i=0; i<MAX_PENDING_REQS; i++)
+	{
+		pending_req_t* slot = &s->pending_reqs[i];
+		if(0 == slot->req_id) continue;
+		int64_t left = (slot->deadline_ms > now) ? (int64_t)(slot->deadline_ms - now) : 0;
+		if( (next < 0) || (left < next) )
+			next = left;
+	}
+	return (int)next;
+}
+
+/* Frames already in the ring go before a hang-up seen on the socket. */
+static void read_from_shm(client_session_t* s)
+{
+	msg_t rx_msg;
+	int budget = CLIENT_SHM_READ_BUDGET;
+	while( (budget > 0) && (s->shm) && (client_shm_recv(s,&rx_msg)) )
+	{
+		budget--;
+		dispatch_rx_frame(s,&rx_msg);
+	}
+	// Come back through the caller's poll for the rest.
+	if( (0 == budget) && (s->shm) )
+		shm_wake(s->shm_wake_fd);
+}
+
+client_err_type_t client_process_io(client_session_t* s, short revents)
+{
+	if(INVALID_FD == s->sock)
+		return CLIENT_NOT_CONNECTED;
+
+	if(s->shm)
+	{
+		revents = client_shm_ready(s);
+		read_from_shm(s);
+		if(INVALID_FD == s->sock)
+			return CLIENT_NOT_CONNECTED;
+	}
+
+	client_err_type_t err = CLIENT_SUCCESS;
+	if(revents & (POLLIN|POLLHUP|POLLERR))
+		err = read_from_server(s);
+
+	if(CLIENT_SUCCESS == err)
+	{
+		err = flush_tx(s);
+		// One chunk per step, so incoming frames are not starved by a large file.
+		if( (CLIENT_SUCCESS == err) && (s->tx_file.active) && (0 == s->tx_chunk_left) )
+		{
+			start_file_chunk(s);
+			err = flush_tx(s);
+		}
+		if(CLIENT_WOULD_BLOCK == err)
+			err = CLIENT_SUCCESS;
+	}
+	expire_requests(s);
+
+	if(CLIENT_SUCCESS != err)
+	{
+		printf("Server shut-down detected.\n");
+		LOGI("Closing the session, err : %s.",errTostr(err));
+		client_close(s);
+	}
+	return err;
+}
+
+void client_close(client_session_t* s)
+{
+	if(INVALID_FD == s->sock) return;
+	close(s->sock);
+	s->sock = INVALID_FD;
+	client_shm_close(s);
+	abort_file_transfers(s);
+	fail_all_requests(s,CLIENT_NOT_CONNECTED);
+	free(s->tx_buf);
+	s->tx_buf = NULL;
+	s->tx_len = s->tx_off = s->tx_cap = 0;
+	s->tx_chunk_left = 0;
+	s->rx_len = 0;
+	s->rx_chunk_left = 0;
+	s->rx_broken = false;
+	for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
+		release_channel(s,ch);
+	LOGI("Connection to server closed.");
+}
+
+void get_client_list(client_session_t* s)
 {
 	LOGD("");
-	msg_t client_list_req_struct={0};
-	client_list_req_struct.msg_type = MSG_GET_CLIENT_LIST_TYPE;
-	send_msg_to_server(client_list_req_struct);
+	get_client_list_async(s,NULL,NULL,0,NULL);
 }
 
 const char *errTostr(client_err_type_t err)
@@ -358,110 +760,504 @@ client_err_type_t recv_with_timeout(int sock, void *buf, size_t len, int timeout
 
     int retval = select(sock + 1, &readfds, NULL, NULL, &tv);
 
-    if (retval == -1) 
+    if (retval == -1)
 	{
         LOGE("Error in select.");
         return CLIENT_READ_ERROR;
     }
-    else if (retval == 0) 
+    else if (retval == 0)
 	{
         LOGI("Timeout waiting for data.");
         return CLIENT_READ_TIMEOUT;
     }
-    else 
+    else
 	{
-        int ret = recv(sock, buf, len, 0);
+        ssize_t ret = recv(sock, buf, len, 0);
+		if(ret <= 0)
+		{
+			LOGE("recv failed, ret : %zd, errno : %d.",ret,errno);
+			return CLIENT_READ_ERROR;
+		}
 		return CLIENT_SUCCESS;
     }
 }
 
-void set_lib_params(lib_params_t* params)
+void connect_with_client(client_session_t* s, char *name)
 {
-	if(!params)
-		LOGE("NUll lib params found.");
-	else
+	if(!name)
 	{
-		cb_parameters=params;
-		LOGI("Lib params set successfully.");
+		LOGE("Null ptr found.");
+		return;
 	}
+	if(CLIENT_SUCCESS==connect_with_client_async(s,name,NULL,NULL,0,NULL))
+		printf("Connection request to %s send.\n",name);
 }
 
-client_err_type_t chat_on(void)
+/* Without a callback the id is still sent, nothing waits for the response. */
+static client_err_type_t send_request(client_session_t* s, msg_t* req, req_done_cb_t cb, void* user_data, int timeout_ms, uint16_t* req_id)
 {
-	if(pthread_create(&io_thread_id,NULL,io_thread,NULL))
+	pending_req_t* slot = NULL;
+
+	uint16_t id = 0;
+	for(int i=0; i<=MAX_PENDING_REQS; i++)
 	{
-		LOGE("Error in creating rx thread.");
-		return CLIENT_ERR_THREAD_CREATE;
+		id = ++s->last_req_id;
+		if(0 == id)
+			id = ++s->last_req_id;
+		if( (!cb) || (0 == s->pending_reqs[id % MAX_PENDING_REQS].req_id) )
+			break;
+		id = 0;
 	}
-	void* io_thread_ret_val ;
-	LOGI("joiing io_thread to main thread.");
-	
-	pthread_join(io_thread_id,&io_thread_ret_val);
-	LOGD("io_thread joined to main thread. [ %s ].",errTostr(GETVAL(io_thread_ret_val)) );
-	return GETVAL(io_thread_ret_val);
+	if(0 == id)
+	{
+		LOGE("Too many requests in flight.");
+		return CLIENT_REQ_LIMIT;
+	}
+	if(cb)
+	{
+		slot = &s->pending_reqs[id % MAX_PENDING_REQS];
+		slot->req_id = id;
+		slot->cb = cb;
+		slot->user_data = user_data;
+		slot->deadline_ms = lib_now_ms() + ((timeout_ms > 0) ? timeout_ms : REQ_DEFAULT_TIMEOUT_MS);
+	}
+
+	req->req_id = id;
+	if(req_id)
+		*req_id = id;
+	client_err_type_t err = send_msg_to_server(s,req);
+	if(CLIENT_SUCCESS != err)
+	{
+		if(slot)
+			slot->req_id = 0;
+		return err;
+	}
+	return CLIENT_SUCCESS;
 }
 
-void connect_with_client(char *name)
+client_err_type_t set_my_name_async(client_session_t* s, const char* name, req_done_cb_t cb, void* user_data, int timeout_ms, uint16_t* req_id)
 {
-	if(!name) 
+	if(!name) return CLIENT_ERR_NULL_PTR;
+	msg_t req={0};
+	req.msg_type = MSG_SET_NAME_REQ_TYPE;
+	strncpy(req.msg_data.buffer,name,MAX_MSG_LEN-1);
+	return send_request(s,&req,cb,user_data,timeout_ms,req_id);
+}
+
+client_err_type_t get_client_list_async(client_session_t* s, req_done_cb_t cb, void* user_data, int timeout_ms, uint16_t* req_id)
+{
+	msg_t req={0};
+	req.msg_type = MSG_GET_CLIENT_LIST_TYPE;
+	return send_request(s,&req,cb,user_data,timeout_ms,req_id);
+}
+
+client_err_type_t connect_with_client_async(client_session_t* s, const char* name, req_done_cb_t cb, void* user_data, int timeout_ms, uint16_t* req_id)
+{
+	if(!name) return CLIENT_ERR_NULL_PTR;
+	msg_t req={0};
+	req.msg_type = MSG_CONNECT_TO_CLIENT;
+	strncpy(req.msg_data.buffer,name,MAX_MSG_LEN-1);
+	return send_request(s,&req,cb,user_data,timeout_ms,req_id);
+}
+
+void complete_request(client_session_t* s, const msg_t* rx_msg)
+{
+	if(0 == rx_msg->req_id) return;
+
+	pending_req_t* slot = &s->pending_reqs[rx_msg->req_id % MAX_PENDING_REQS];
+	if(slot->req_id != rx_msg->req_id)
 	{
-		LOGE("Null ptr found.");
+		// Fire-and-forget request, or a later frame for one already completed.
 		return;
 	}
-	msg_t conn_req_msg={
-		.msg_type = MSG_CONNECT_TO_CLIENT,
-	};
-	memcpy(&conn_req_msg.msg_data.buffer,name,MAX_MSG_LEN);
+	pending_req_t done = *slot;
+	slot->req_id = 0;
+
+	done.cb(done.req_id,CLIENT_SUCCESS,rx_msg,done.user_data);
+}
 
-	send_msg_to_server(conn_req_msg);
-	printf("Connection request to %s send.\n",name);
+int expire_requests(client_session_t* s)
+{
+	pending_req_t expired[MAX_PENDING_REQS];
+	int count = 0;
+	uint64_t now = lib_now_ms();
+
+	for(int i=0; i<MAX_PENDING_REQS; i++)
+	{
+		pending_req_t* slot = &s->pending_reqs[i];
+		if(0 == slot->req_id) continue;
+		if(slot->deadline_ms <= now)
+		{
+			expired[count++] = *slot;
+			slot->req_id = 0;
+		}
+	}
+
+	for(int i=0; i<count; i++)
+	{
+		LOGI("Request %u timed out.",expired[i].req_id);
+		expired[i].cb(expired[i].req_id,CLIENT_READ_TIMEOUT,NULL,expired[i].user_data);
+	}
+	return count;
+}
+
+void fail_all_requests(client_session_t* s, client_err_type_t status)
+{
+	for(int i=0; i<MAX_PENDING_REQS; i++)
+	{
+		pending_req_t done = s->pending_reqs[i];
+		s->pending_reqs[i].req_id = 0;
+		if(done.req_id)
+			done.cb(done.req_id,status,NULL,done.user_data);
+	}
 }
 
-void handle_rx_msg_lib(int sock,msg_t rx_msg)
+/*
+ * Text that does not fit one frame is compressed when the server negotiated a
+ * codec, and split into several frames when it still does not fit.
+ */
+client_err_type_t send_chat_text(client_session_t* s, uint8_t ch, const char* text)
 {
-	switch(rx_msg.msg_type)
+	if(!text) return CLIENT_ERR_NULL_PTR;
+	ch = resolve_chat_channel(s,ch);
+	if(NO_CHANNEL == ch)
+		return CLIENT_NOT_IN_CHAT;
+	if(0 == strcmp(text,DISCONNECT_CMD))
+		return disconnect_channel(s,ch);
+
+	size_t len = strlen(text);
+	msg_t send_msg={0};
+	if( (len >= COMPRESS_MIN_LEN) && (s->conn_codecs & CODEC_DEFLATE_DICT) && client_deflate_text(text,len,&send_msg) )
+	{
+		LOGI("Sending %lu bytes compressed to %u.",(unsigned long)len,((compressed_hdr_t*)send_msg.msg_data.buffer)->comp_len);
+		send_msg.channel_id = ch;
+		return send_msg_to_server(s,&send_msg);
+	}
+
+	size_t off = 0;
+	do
 	{
+		size_t piece = ((len-off) < (MAX_MSG_LEN-1)) ? (len-off) : (MAX_MSG_LEN-1);
+		memset(&send_msg,0,sizeof(send_msg));
+		send_msg.msg_type = MSG_CLIENT_TX_TYPE;
+		send_msg.channel_id = ch;
+		memcpy(send_msg.msg_data.buffer,text+off,piece);
+		client_err_type_t err = send_msg_to_server(s,&send_msg);
+		if(CLIENT_SUCCESS != err) return err;
+		off += piece;
+	}while(off < len);
+	return CLIENT_SUCCESS;
+}
+
+/* The server frees its side of the channel when it relays DISCONNECT_CMD. */
+client_err_type_t disconnect_channel(client_session_t* s, uint8_t ch)
+{
+	ch = resolve_chat_channel(s,ch);
+	if(NO_CHANNEL == ch)
+		return CLIENT_NOT_IN_CHAT;
+
+	msg_t send_msg={0};
+	send_msg.msg_type = MSG_CLIENT_TX_TYPE;
+	send_msg.channel_id = ch;
+	strcpy(send_msg.msg_data.buffer,DISCONNECT_CMD);
+	client_err_type_t err = send_msg_to_server(s,&send_msg);
+	LOGI("Leaving chat with %s on channel %u.",client_peer_name(s,ch),ch);
+	release_channel(s,ch);
+	return err;
+}
+
+/* The server handles the answer before any later frame, so the chat starts right away. */
+client_err_type_t accept_connection(client_session_t* s, uint8_t ch)
+{
+	client_channel_t* chan = get_channel(s,ch);
+	if( (!chan) || (CHANNEL_REQ_RX != chan->state) )
+		return CLIENT_NOT_IN_CHAT;
+
+	msg_t send_msg={0};
+	send_msg.msg_type = MSG_CLIENT_ACCEPT_CONNECTION;
+	send_msg.channel_id = ch;
+	LOGI("sending : Connection request accept response on channel %u.",ch);
+	set_channel(s,ch,CHANNEL_CHAT,chan->peer);
+	return send_msg_to_server(s,&send_msg);
+}
+
+client_err_type_t decline_connection(client_session_t* s, uint8_t ch)
+{
+	if(CHANNEL_REQ_RX != client_channel_state(s,ch))
+		return CLIENT_NOT_IN_CHAT;
+
+	msg_t send_msg={0};
+	send_msg.msg_type = MSG_CLIENT_DECLINE_CONNECTION;
+	send_msg.channel_id = ch;
+	LOGI("sending : Connection request decline response on channel %u.",ch);
+	release_channel(s,ch);
+	return send_msg_to_server(s,&send_msg);
+}
+
+/* The application sees the same plain frames a peer without the codec gets from the server. */
+void deliver_compressed_msg(client_session_t* s, const msg_t* rx_msg)
+{
+	char text[CHAT_TEXT_MAX_LEN];
+	int len = client_inflate_text(rx_msg,text,sizeof(text));
+	if(len < 0) return;
+
+	for(int off=0; off<len; off+=MAX_MSG_LEN-1)
+	{
+		msg_t plain_msg={0};
+		int piece = ((len-off) < (MAX_MSG_LEN-1)) ? (len-off) : (MAX_MSG_LEN-1);
+		plain_msg.msg_type = MSG_CLIENT_RX_TYPE;
+		plain_msg.channel_id = rx_msg->channel_id;
+		memcpy(plain_msg.msg_data.buffer,text+off,piece);
+		s->params.msg_handle_cb(s,&plain_msg);
+		handle_rx_msg_lib(s,&plain_msg);
+	}
+}
+
+void file_xfer_close(file_xfer_t* xfer, bool remove_file)
+{
+	if(!xfer->active) return;
+	if(INVALID_FD != xfer->file_fd)
+		close(xfer->file_fd);
+	if( (remove_file) && (xfer->done < xfer->size) && ('\0' != xfer->path[0]) )
+		unlink(xfer->path);
+	xfer->file_fd = INVALID_FD;
+	xfer->active = false;
+}
+
+static void report_file_progress(client_session_t* s, bool sending, file_xfer_t* xfer)
+{
+	if(s->params.file_progress_cb)
+		s->params.file_progress_cb(s, sending, xfer->name, xfer->done, xfer->size);
+}
+
+static void fill_file_hdr(msg_t* msg, msg_type_t type, file_xfer_t* xfer, uint32_t chunk_len)
+{
+	file_xfer_hdr_t hdr = {0};
+	hdr.file_size = xfer->size;
+	hdr.offset = xfer->done;
+	hdr.chunk_len = chunk_len;
+	strncpy(hdr.file_name, xfer->name, sizeof(hdr.file_name)-1);
+	hdr.file_name[sizeof(hdr.file_name)-1] = '\0';
+	memset(msg,0,sizeof(*msg));
+	msg->msg_type = type;
+	msg->channel_id = xfer->channel;
+	memcpy(msg->msg_data.buffer, &hdr, sizeof(hdr));
+}
+
+client_err_type_t send_file(client_session_t* s, uint8_t ch, const char* path)
+{
+	if(!path) return CLIENT_ERR_NULL_PTR;
+	ch = resolve_chat_channel(s,ch);
+	if(NO_CHANNEL == ch)
+	{
+		return CLIENT_NOT_IN_CHAT;
+	}
+	if(s->tx_file.active)
+	{
+		return CLIENT_FILE_BUSY;
+	}
+
+	int file_fd = open(path, O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if( (INVALID_FD == file_fd) || (fstat(file_fd,&st)) || (!S_ISREG(st.st_mode)) )
+	{
+		LOGE("Cannot open regular file : %s.",path);
+		if(INVALID_FD != file_fd) close(file_fd);
+		return CLIENT_FILE_ERR;
+	}
+
+	char path_copy[FILE_NAME_MAX_LEN];
+	strncpy(path_copy, path, sizeof(path_copy)-1);
+	path_copy[sizeof(path_copy)-1] = '\0';
+
+	file_xfer_t* xfer = &s->tx_file;
+	memset(xfer,0,sizeof(*xfer));
+	xfer->channel = ch;
+	xfer->file_fd = file_fd;
+	xfer->size = st.st_size;
+	strncpy(xfer->name, basename(path_copy), sizeof(xfer->name)-1);
+
+	msg_t offer;
+	fill_file_hdr(&offer, MSG_FILE_OFFER, xfer, 0);
+	client_err_type_t err = send_msg_to_server(s,&offer);
+	if(CLIENT_SUCCESS != err)
+	{
+		close(file_fd);
+		xfer->file_fd = INVALID_FD;
+		return err;
+	}
+	LOGI("Sending file : %s, size : %lu.",xfer->name,(unsigned long)xfer->size);
+
+	xfer->active = true;
+	if(0 == xfer->size)
+	{
+		report_file_progress(s,true,xfer);
+		file_xfer_close(xfer,false);
+	}
+	return CLIENT_SUCCESS;
+}
+
+/* Queues the header frame, flush_tx() follows it with the chunk straight from the page cache. */
+void start_file_chunk(client_session_t* s)
+{
+	uint64_t left = s->tx_file.size - s->tx_file.done;
+	uint32_t chunk_len = (left < FILE_CHUNK_MAX_LEN) ? left : FILE_CHUNK_MAX_LEN;
+
+	msg_t data_msg;
+	fill_file_hdr(&data_msg, MSG_FILE_DATA, &s->tx_file, chunk_len);
+	if(CLIENT_SUCCESS != tx_queue(s,&data_msg,sizeof(data_msg)))
+	{
+		file_xfer_close(&s->tx_file,false);
+		return;
+	}
+	s->tx_chunk_at = s->tx_len;
+	s->tx_chunk_left = chunk_len;
+}
+
+static void cancel_xfer(client_session_t* s, file_xfer_t* xfer)
+{
+	msg_t cancel_msg;
+	fill_file_hdr(&cancel_msg, MSG_FILE_CANCEL, xfer, 0);
+	send_msg_to_server(s,&cancel_msg);
+	// Chunk bytes already on the way are read and dropped by consume_rx().
+	file_xfer_close(xfer, xfer == &s->rx_file);
+	LOGI("File transfer cancelled.");
+}
+
+void cancel_file_transfer(client_session_t* s)
+{
+	file_xfer_t* xfer = s->tx_file.active ? &s->tx_file : &s->rx_file;
+	if(!xfer->active)
+	{
+		LOGI("No file transfer in progress.");
+		return;
+	}
+	cancel_xfer(s,xfer);
+}
+
+void abort_file_transfers(client_session_t* s)
+{
+	file_xfer_close(&s->tx_file,false);
+	file_xfer_close(&s->rx_file,true);
+}
+
+void handle_file_offer(client_session_t* s, const msg_t* rx_msg)
+{
+	file_xfer_hdr_t hdr;
+	memcpy(&hdr, rx_msg->msg_data.buffer, sizeof(hdr));
+	hdr.file_name[sizeof(hdr.file_name)-1] = '\0';
+
+	file_xfer_t* xfer = &s->rx_file;
+	if( (xfer->active) && (xfer->channel != rx_msg->channel_id) )
+	{
+		LOGI("Already receiving on channel %u, refusing file from channel %u.",xfer->channel,rx_msg->channel_id);
+		msg_t cancel_msg = *rx_msg;
+		cancel_msg.msg_type = MSG_FILE_CANCEL;
+		send_msg_to_server(s,&cancel_msg);
+		return;
+	}
+	file_xfer_close(xfer,true);
+	memset(xfer,0,sizeof(*xfer));
+	xfer->channel = rx_msg->channel_id;
+	xfer->size = hdr.file_size;
+	strncpy(xfer->name, basename(hdr.file_name), sizeof(xfer->name)-1);
+	snprintf(xfer->path, sizeof(xfer->path), "%s%s", FILE_RECV_PREFIX, xfer->name);
+
+	xfer->file_fd = open(xfer->path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if(INVALID_FD == xfer->file_fd)
+	{
+		LOGE("Cannot create %s, declining file.",xfer->path);
+		msg_t cancel_msg;
+		fill_file_hdr(&cancel_msg, MSG_FILE_CANCEL, xfer, 0);
+		send_msg_to_server(s,&cancel_msg);
+		return;
+	}
+	xfer->active = true;
+	if(0 == xfer->size)
+	{
+		report_file_progress(s,false,xfer);
+		file_xfer_close(xfer,false);
+	}
+}
+
+/* The chunk follows the frame on the socket and must be consumed even when cancelled. */
+void handle_file_data(client_session_t* s, const msg_t* rx_msg)
+{
+	file_xfer_hdr_t hdr;
+	memcpy(&hdr, rx_msg->msg_data.buffer, sizeof(hdr));
+	if(hdr.chunk_len > FILE_CHUNK_MAX_LEN)
+	{
+		LOGE("File chunk of %u bytes exceeds limit.",hdr.chunk_len);
+		s->rx_broken = true;
+		return;
+	}
+	s->rx_chunk_left = hdr.chunk_len;
+	s->rx_chunk_keep = (s->rx_file.channel == rx_msg->channel_id);
+}
+
+void handle_rx_msg_lib(client_session_t* s, const msg_t* rx_msg)
+{
+	uint8_t ch = rx_msg->channel_id;
+	switch(rx_msg->msg_type)
+	{
+		case MSG_CLIENT_FREE:
+			set_channel(s,ch,CHANNEL_REQ_SENT,rx_msg->msg_data.buffer);
+			break;
+
 		case MSG_CONNECTION_REQ_RX:
-			LOGI("Setting conn_request_rx to true.");
-			conn_request_rx = true;
+			set_channel(s,ch,CHANNEL_REQ_RX,rx_msg->msg_data.buffer);
 			break;
-		
+
 		case MSG_CLIENT_ACCEPT_CONNECTION_ACK:
-			if(conn_request_rx)
-			{
-				LOGI("We have connn-request and some-one has accepted our conn-request.");
-			}
-			LOGI("Setting conn_request_rx to false.");
-			conn_request_rx = false;
-			LOGI("Setting busy_in_chat to true.");
-			*(cb_parameters->busy_in_chat)=true;
-			LOGI("Setting connected client name to : %s.",rx_msg.msg_data.buffer);
-			strcpy(cb_parameters->connected_client_name,rx_msg.msg_data.buffer);
+			// Also sent, with a placeholder name, for an accept the server had no request for.
+			if(CHANNEL_REQ_SENT == client_channel_state(s,ch))
+				set_channel(s,ch,CHANNEL_CHAT,rx_msg->msg_data.buffer);
 			break;
 
 		case MSG_CLIENT_CHAT_READY:
-			LOGI("Setting busy_in_chat to true.");
-			LOGI("Setting connected client name to : %s.",rx_msg.msg_data.buffer);
-			strcpy(cb_parameters->connected_client_name,rx_msg.msg_data.buffer);
-			*(cb_parameters->busy_in_chat)=true;
+			set_channel(s,ch,CHANNEL_CHAT,rx_msg->msg_data.buffer);
 			break;
-		
-		case MSG_CLIENT_NO_MORE_FREE:
+
+		case MSG_HEARTBEAT_REQ:
+		{
+			msg_t heartbeat_ack={0};
+			heartbeat_ack.msg_type = MSG_HEARTBEAT_ACK;
+			send_msg_to_server(s,&heartbeat_ack);
+		}
+			break;
+
+		case MSG_FILE_OFFER:
+			handle_file_offer(s,rx_msg);
+			break;
+
+		case MSG_FILE_DATA:
+			handle_file_data(s,rx_msg);
+			break;
+
+		case MSG_FILE_CANCEL:
+			LOGI("File transfer on channel %u cancelled by peer or server.",ch);
+			if( (s->tx_file.active) && (ch == s->tx_file.channel) )
+				file_xfer_close(&s->tx_file,false);
+			if( (s->rx_file.active) && (ch == s->rx_file.channel) )
+				file_xfer_close(&s->rx_file,true);
+			break;
+
+		case MSG_CONNECTION_REQ_EXPIRED:
+		case MSG_CLIENT_DECLINE_CONNECTION_ACK:
 		case MSG_CLIENT_TERMINATION:
 		case MSG_CLIENT_DISCONNECTED:
-			LOGI("Setting conn_request_rx to false.");
-			conn_request_rx = false;
-			LOGI("Setting busy_in_chat to false.");
-			*(cb_parameters->busy_in_chat)=false;
-			LOGI("Setting connected client name to default.");
-			strcpy(cb_parameters->connected_client_name,UNDEF_NAME);
+		case MSG_CLIENT_NO_MORE_FREE:
+		case MSG_CLIENT_NO_MORE_EXIST:
+			LOGI("Channel %u with %s closed.",ch,client_peer_name(s,ch));
+			release_channel(s,ch);
 			break;
 	}
 }
 
+/* Per thread, sessions may be driven from several threads that all log. */
 char* get_current_time(void) {
-    static char buf[20];
+    static __thread char buf[20];
     time_t now = time(NULL);
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &(struct tm){0}));
     return buf;
 }
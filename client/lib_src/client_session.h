@@ -0,0 +1,96 @@
+#ifndef CLIENT_SESSION_H
+#define CLIENT_SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "chat_app_common.h"
+#include "chat_shm.h"
+#include "client_lib.h"
+
+typedef struct
+{
+	bool active;
+	uint8_t channel;
+	int file_fd;
+	uint64_t size;
+	uint64_t done;
+	char name[FILE_NAME_MAX_LEN];
+	char path[FILE_NAME_MAX_LEN+sizeof(FILE_RECV_PREFIX)];
+}file_xfer_t;
+
+typedef struct
+{
+	uint16_t req_id;
+	req_done_cb_t cb;
+	void* user_data;
+	uint64_t deadline_ms;
+}pending_req_t;
+
+typedef struct
+{
+	client_channel_state_t state;
+	char peer[MAX_CLIENT_NAME_LEN];
+}client_channel_t;
+
+/*
+ * Everything one connection to the server needs. Nothing is shared between
+ * sessions, so different threads may drive different sessions.
+ */
+struct client_session
+{
+	int sock;
+	lib_params_t params;
+	/* Set when the stream can no longer be parsed, the next step closes the session. */
+	bool rx_broken;
+	uint32_t conn_codecs;
+
+	/* Index is channel id - 1, the server hands out the ids. */
+	client_channel_t channels[MAX_CHANNELS];
+	/* Chat channel that NO_CHANNEL stands for in the send calls. */
+	uint8_t active_channel;
+
+	file_xfer_t tx_file;
+	file_xfer_t rx_file;
+
+	/*
+	 * Bytes queued for the server but not yet taken by the socket. While
+	 * tx_chunk_left is set, the raw file chunk goes out at offset tx_chunk_at,
+	 * between the MSG_FILE_DATA frame and whatever was queued after it.
+	 */
+	uint8_t* tx_buf;
+	size_t tx_len;
+	size_t tx_off;
+	size_t tx_cap;
+	size_t tx_chunk_at;
+	uint32_t tx_chunk_left;
+
+	/* Partial frame from the server, or raw chunk bytes owed after a MSG_FILE_DATA frame. */
+	uint8_t rx_frame[sizeof(msg_t)];
+	size_t rx_len;
+	uint32_t rx_chunk_left;
+	/* The pending chunk belongs to rx_file, otherwise it is read and dropped. */
+	bool rx_chunk_keep;
+
+	/*
+	 * Rings granted by MSG_SHM_UPGRADE_ACK, NULL while everything goes over the
+	 * socket. shm_poll_fd watches the socket and shm_wake_fd together.
+	 */
+	shm_region_t* shm;
+	int shm_wake_fd;
+	int shm_server_fd;
+	int shm_poll_fd;
+	uint32_t shm_sock_events;
+	uint32_t shm_rx_head;
+	uint32_t shm_tx_tail;
+	/* Frames that found the ring full, sent in order once the server makes room. */
+	msg_t* shm_backlog;
+	size_t shm_backlog_len;
+	size_t shm_backlog_cap;
+
+	/* Slot is req_id % MAX_PENDING_REQS, ids are handed out so that slot is free. */
+	pending_req_t pending_reqs[MAX_PENDING_REQS];
+	uint16_t last_req_id;
+};
+
+#endif
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "logger.h"
+#include "client_shm.h"
+
+/* data.u32 of the two members of the poll set. */
+#define SHM_POLL_SOCK  0
+#define SHM_POLL_WAKE  1
+
+#define SHM_UPGRADE_TIMEOUT_MS 5000
+
+static void close_fds(int* fds, int count)
+{
+	for(int i=0; i<count; i++)
+		close(fds[i]);
+}
+
+/* One frame with the descriptors the server attached to it. */
+static client_err_type_t recv_frame_with_fds(int sock, msg_t* msg, int* fds, int* count)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	int ret = poll(&pfd,1,SHM_UPGRADE_TIMEOUT_MS);
+	if(0 == ret)
+		return CLIENT_READ_TIMEOUT;
+	if(ret < 0)
+		return CLIENT_READ_ERROR;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int)*SHM_FD_COUNT)];
+		struct cmsghdr align;
+	}ctrl;
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf) };
+	ssize_t bytes = recvmsg(sock,&mh,MSG_WAITALL|MSG_CMSG_CLOEXEC);
+
+	*count = 0;
+	for(struct cmsghdr* cmsg=CMSG_FIRSTHDR(&mh); cmsg; cmsg=CMSG_NXTHDR(&mh,cmsg))
+	{
+		if( (SOL_SOCKET != cmsg->cmsg_level) || (SCM_RIGHTS != cmsg->cmsg_type) ) continue;
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds,CMSG_DATA(cmsg),n*sizeof(int));
+		*count = n;
+	}
+	if(sizeof(*msg) != (size_t)bytes)
+	{
+		close_fds(fds,*count);
+		*count = 0;
+		return (0 == bytes) ? CLIENT_NOT_CONNECTED : CLIENT_READ_ERROR;
+	}
+	return CLIENT_SUCCESS;
+}
+
+static bool shm_map(client_session_t* s, int* fds)
+{
+	// The session owns the descriptors from here, client_shm_close() releases them.
+	s->shm_wake_fd = fds[SHM_FD_CLIENT_WAKE];
+	s->shm_server_fd = fds[SHM_FD_SERVER_WAKE];
+	struct stat st;
+	void* region = MAP_FAILED;
+	if( (0 == fstat(fds[SHM_FD_REGION],&st)) && ((size_t)st.st_size >= sizeof(shm_region_t)) )
+		region = mmap(NULL,sizeof(shm_region_t),PROT_READ|PROT_WRITE,MAP_SHARED,fds[SHM_FD_REGION],0);
+	close(fds[SHM_FD_REGION]);
+	if(MAP_FAILED == region)
+	{
+		LOGE("Cannot map the shared memory region, errno : %d.",errno);
+		return false;
+	}
+	s->shm = region;
+	if( (SHM_REGION_MAGIC != s->shm->magic) || (SHM_RING_SLOTS != s->shm->slots) )
+	{
+		LOGE("Shared memory layout mismatch, slots : %u.",s->shm->slots);
+		return false;
+	}
+	// The indexes of a fresh region are zero, whatever the server wrote since is still to be read.
+	s->shm_rx_head = 0;
+	s->shm_tx_tail = 0;
+
+	s->shm_poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN|EPOLLRDHUP, .data.u32 = SHM_POLL_SOCK };
+	s->shm_sock_events = ev.events;
+	if( (INVALID_FD == s->shm_poll_fd) || (epoll_ctl(s->shm_poll_fd,EPOLL_CTL_ADD,s->sock,&ev)) )
+	{
+		LOGE("Poll set for shared memory failed, errno : %d.",errno);
+		return false;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = SHM_POLL_WAKE;
+	if(epoll_ctl(s->shm_poll_fd,EPOLL_CTL_ADD,s->shm_wake_fd,&ev))
+	{
+		LOGE("Poll set for shared memory failed, errno : %d.",errno);
+		return false;
+	}
+	return true;
+}
+
+client_err_type_t client_shm_upgrade(client_session_t* s)
+{
+	msg_t req={0};
+	req.msg_type = MSG_SHM_UPGRADE_REQ;
+	if(sizeof(req) != send(s->sock,&req,sizeof(req),MSG_NOSIGNAL))
+		return CLIENT_MSG_SEND_ERR;
+
+	msg_t reply={0};
+	int fds[SHM_FD_COUNT];
+	int count = 0;
+	client_err_type_t err = recv_frame_with_fds(s->sock,&reply,fds,&count);
+	if(CLIENT_SUCCESS != err)
+	{
+		LOGE("No answer to the shared memory request : %s.",errTostr(err));
+		return err;
+	}
+	if( (MSG_SHM_UPGRADE_ACK != reply.msg_type) || (SHM_FD_COUNT != count) )
+	{
+		LOGI("Server declined shared memory, staying on the socket.");
+		close_fds(fds,count);
+		return CLIENT_SUCCESS;
+	}
+	if(!shm_map(s,fds))
+	{
+		// The server already moved us, the session cannot go back to the socket.
+		client_shm_close(s);
+		return CONNECTION_FAILED;
+	}
+	LOGI("Moved onto shared memory.");
+	return CLIENT_SUCCESS;
+}
+
+void client_shm_close(client_session_t* s)
+{
+	if(s->shm)
+		munmap(s->shm,sizeof(shm_region_t));
+	s->shm = NULL;
+	if(INVALID_FD != s->shm_wake_fd)
+		close(s->shm_wake_fd);
+	if(INVALID_FD != s->shm_server_fd)
+		close(s->shm_server_fd);
+	if(INVALID_FD != s->shm_poll_fd)
+		close(s->shm_poll_fd);
+	s->shm_wake_fd = INVALID_FD;
+	s->shm_server_fd = INVALID_FD;
+	s->shm_poll_fd = INVALID_FD;
+	free(s->shm_backlog);
+	s->shm_backlog = NULL;
+	s->shm_backlog_len = s->shm_backlog_cap = 0;
+}
+
+static void shm_flush_backlog(client_session_t* s)
+{
+	size_t sent = 0;
+	bool wake = false;
+	while(sent < s->shm_backlog_len)
+	{
+		shm_push_t ret = shm_ring_push(&s->shm->to_server,&s->shm_tx_tail,&s->shm_backlog[sent]);
+		if(SHM_PUSH_FULL == ret)
+			break;
+		wake |= (SHM_PUSH_WAKE == ret);
+		sent++;
+	}
+	if(wake)
+		shm_wake(s->shm_server_fd);
+	memmove(s->shm_backlog,s->shm_backlog+sent,(s->shm_backlog_len-sent)*sizeof(msg_t));
+	s->shm_backlog_len -= sent;
+}
+
+client_err_type_t client_shm_send(client_session_t* s, const msg_t* msg)
+{
+	if(0 == s->shm_backlog_len)
+	{
+		shm_push_t ret = shm_ring_push(&s->shm->to_server,&s->shm_tx_tail,msg);
+		if(SHM_PUSH_WAKE == ret)
+			shm_wake(s->shm_server_fd);
+		if(SHM_PUSH_FULL != ret)
+			return CLIENT_SUCCESS;
+	}
+
+	// The server rings shm_wake_fd once it makes room.
+	if(s->shm_backlog_len == s->shm_backlog_cap)
+	{
+		size_t cap = s->shm_backlog_cap ? 2*s->shm_backlog_cap : SHM_RING_SLOTS;
+		msg_t* backlog = realloc(s->shm_backlog,cap*sizeof(msg_t));
+		if(!backlog)
+		{
+			LOGE("realloc failed for %lu frames.",(unsigned long)cap);
+			return CLIENT_MSG_SEND_ERR;
+		}
+		s->shm_backlog = backlog;
+		s->shm_backlog_cap = cap;
+	}
+	s->shm_backlog[s->shm_backlog_len++] = *msg;
+	return CLIENT_SUCCESS;
+}
+
+bool client_shm_recv(client_session_t* s, msg_t* msg)
+{
+	bool wake = false;
+	bool got = shm_ring_pop(&s->shm->to_client,&s->shm_rx_head,msg,&wake);
+	if(wake)
+		shm_wake(s->shm_server_fd);
+	return got;
+}
+
+short client_shm_poll_events(client_session_t* s, bool want_out)
+{
+	uint32_t events = EPOLLIN|EPOLLRDHUP|(want_out ? EPOLLOUT : 0);
+	if(events != s->shm_sock_events)
+	{
+		struct epoll_event ev = { .events = events, .data.u32 = SHM_POLL_SOCK };
+		if(0 == epoll_ctl(s->shm_poll_fd,EPOLL_CTL_MOD,s->sock,&ev))
+			s->shm_sock_events = events;
+	}
+	return POLLIN;
+}
+
+short client_shm_ready(client_session_t* s)
+{
+	struct epoll_event events[2];
+	short revents = 0;
+	int n = epoll_wait(s->shm_poll_fd,events,2,0);
+	for(int i=0; i<n; i++)
+	{
+		if(SHM_POLL_WAKE == events[i].data.u32)
+		{
+			shm_wake_clear(s->shm_wake_fd);
+			continue;
+		}
+		if(events[i].events & EPOLLIN) revents |= POLLIN;
+		if(events[i].events & EPOLLOUT) revents |= POLLOUT;
+		if(events[i].events & (EPOLLHUP|EPOLLRDHUP)) revents |= POLLHUP;
+		if(events[i].events & EPOLLERR) revents |= POLLERR;
+	}
+	if(s->shm_backlog_len > 0)
+		shm_flush_backlog(s);
+	return revents;
+}
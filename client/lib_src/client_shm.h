@@ -0,0 +1,26 @@
+#ifndef CLIENT_SHM_H
+#define CLIENT_SHM_H
+
+#include <stdbool.h>
+#include "chat_app_common.h"
+#include "client_session.h"
+
+/* Frames taken from the ring per client_process_io() call before yielding to the caller. */
+#define CLIENT_SHM_READ_BUDGET  SHM_RING_SLOTS
+
+/*
+ * Asks for the rings right after the handshake, while the socket still
+ * blocks. A server that declines leaves the session on the socket; only a
+ * broken connection is an error.
+ */
+client_err_type_t client_shm_upgrade(client_session_t* s);
+void client_shm_close(client_session_t* s);
+
+client_err_type_t client_shm_send(client_session_t* s, const msg_t* msg);
+bool client_shm_recv(client_session_t* s, msg_t* msg);
+/* Events of the socket for client_poll_events(), the poll set itself only wants POLLIN. */
+short client_shm_poll_events(client_session_t* s, bool want_out);
+/* Socket revents out of the poll set, also resends what waited for room in the ring. */
+short client_shm_ready(client_session_t* s);
+
+#endif
@@ -11,6 +11,9 @@ typedef enum{
     CMD_TYPE_SET_NAME,
     CMD_TYPE_PRINT_HELP,
     CMD_TYPE_CLEAR_SCREEN,
+    CMD_TYPE_SEND_FILE,
+    CMD_TYPE_CANCEL_FILE,
+    CMD_TYPE_SWITCH,
     CMD_TYPE_MAX_CMD
 }cmd_type_t;
 
@@ -19,6 +22,9 @@ typedef enum{
 #define SET_NAME_CMD      "set_name"
 #define PRINT_HELP_CMD    "help"
 #define CLEAR_SCREEN_CMD  "clear"
+#define SEND_FILE_CMD     "send_file"
+#define CANCEL_FILE_CMD   "cancel_file"
+#define SWITCH_CMD        "switch"
 
 #define REQ_ACCEPT_STR   "yes"
 #define REQ_DECLINE_STR  "no"
@@ -29,25 +35,44 @@ const char* cmd_list[]={
     DISCONNECT_CMD,
     SET_NAME_CMD,
     PRINT_HELP_CMD,
-    CLEAR_SCREEN_CMD
+    CLEAR_SCREEN_CMD,
+    SEND_FILE_CMD,
+    CANCEL_FILE_CMD,
+    SWITCH_CMD
 };
 
-extern bool conn_request_rx;
-extern lib_params_t* cb_parameters;
 cmd_type_t get_cmd_id_by_name(char *cmd_name);
-void  handle_send_msg_to_client(char *send_msg_str);
+
+static bool is_cmd_with_arg(const char *input, const char *cmd)
+{
+    size_t len = strlen(cmd);
+    return (0 == strncmp(input,cmd,len)) && (' ' == input[len]);
+}
+void  handle_send_msg_to_client(client_session_t* s, char *send_msg_str);
+void  handle_switch_cmd(client_session_t* s, char *name);
+void  handle_connect_cmd(client_session_t* s, char *name);
+
+/* Responses are printed by msg_handle_cb, only a missing one is reported here. */
+static void report_request_failure(uint16_t req_id, client_err_type_t status, const msg_t* resp, void* user_data)
+{
+    if(CLIENT_SUCCESS != status)
+        printf("[ %s ] got no response from server : %s.\n",(const char*)user_data,errTostr(status));
+}
 
 void show_help(void)
 {
     printf("cmd : [ %s] : To get list off all connected client to the server (including you).\n",GET_LIST_CMD);
     printf("cmd : [ %s] : To set your name as you wish.\n",SET_NAME_CMD);
     printf("cmd : [ %s client_name ]: will connect you to the client named \"client_name\".\n",CONNECT_CMD);
-    printf("cmd : [ %s ] : To disconnect from the client you previously connected.\n",DISCONNECT_CMD);
+    printf("cmd : [ %s ] : To disconnect from the client you are currently chatting with.\n",DISCONNECT_CMD);
+    printf("cmd : [ %s client_name ] : To send your messages to another client you are chatting with, lists the chats without a name.\n",SWITCH_CMD);
     printf("cmd : [ %s ] : To print the help and usage of all commands.\n",PRINT_HELP_CMD);
     printf("cmd : [ %s ] : To clear the screen.\n",CLEAR_SCREEN_CMD);
+    printf("cmd : [ %s file_path ] : To send a file to the client you are currently chatting with.\n",SEND_FILE_CMD);
+    printf("cmd : [ %s ] : To cancel the file transfer in progress.\n",CANCEL_FILE_CMD);
 }
 
-void process_send_msg(char *send_msg_buffer)
+void process_send_msg(client_session_t* s, char *send_msg_buffer)
 {
     if(!send_msg_buffer) 
     {
@@ -55,31 +80,60 @@ void process_send_msg(char *send_msg_buffer)
         return;
     }
 
-    if(*(cb_parameters->busy_in_chat))
+    // File commands work inside a chat, so check them before treating input as chat text.
+    cmd_type_t file_cmd = get_cmd_id_by_name(send_msg_buffer);
+    if(CMD_TYPE_SEND_FILE == file_cmd)
+    {
+        char *cmd_str = strtok(send_msg_buffer," ");
+        char *path    = strtok(NULL,"");
+
+        if(!path)
+        {
+            printf("No file path provided.\n");
+            return;
+        }
+        client_err_type_t err = send_file(s,NO_CHANNEL,path);
+        if(CLIENT_SUCCESS != err)
+            printf("Cannot send file : %s.\n",errTostr(err));
+        return;
+    }
+    else if(CMD_TYPE_CANCEL_FILE == file_cmd)
     {
-        handle_send_msg_to_client(send_msg_buffer);
+        cancel_file_transfer(s);
         return;
     }
 
-    msg_t conn_response_msg={0};
-
-    if(conn_request_rx && (0==strcmp(send_msg_buffer,REQ_ACCEPT_STR)))
+    // "yes" and "no" answer the oldest request still waiting, even while chatting.
+    uint8_t req_ch = NO_CHANNEL;
+    for(uint8_t ch=1; (ch<=MAX_CHANNELS) && (NO_CHANNEL==req_ch); ch++)
     {
-        conn_request_rx = false;
-        conn_response_msg.msg_type=MSG_CLIENT_ACCEPT_CONNECTION;
-        LOGI("sending : Connection request accept response.");
-        send_msg_to_server(conn_response_msg);
+        if(CHANNEL_REQ_RX == client_channel_state(s,ch))
+            req_ch = ch;
+    }
+    if( (NO_CHANNEL != req_ch) && (0==strcmp(send_msg_buffer,REQ_ACCEPT_STR)) )
+    {
+        accept_connection(s,req_ch);
         return;
     }
-    else if(conn_request_rx && (0==strcmp(send_msg_buffer,REQ_DECLINE_STR)))
+    else if( (NO_CHANNEL != req_ch) && (0==strcmp(send_msg_buffer,REQ_DECLINE_STR)) )
     {
-        conn_request_rx = false;
-        conn_response_msg.msg_type=MSG_CLIENT_DECLINE_CONNECTION;
-        LOGI("sending : Connection request decline response.");
-        send_msg_to_server(conn_response_msg);
+        decline_connection(s,req_ch);
         return;
     }
-    else if( conn_request_rx )
+
+    if(NO_CHANNEL != client_active_channel(s))
+    {
+        // Only commands with their argument are taken out of the chat text.
+        if(is_cmd_with_arg(send_msg_buffer,CONNECT_CMD))
+            handle_connect_cmd(s,send_msg_buffer+strlen(CONNECT_CMD)+1);
+        else if( (is_cmd_with_arg(send_msg_buffer,SWITCH_CMD)) || (0==strcmp(send_msg_buffer,SWITCH_CMD)) )
+            handle_switch_cmd(s,send_msg_buffer+strlen(SWITCH_CMD));
+        else
+            handle_send_msg_to_client(s,send_msg_buffer);
+        return;
+    }
+
+    if(NO_CHANNEL != req_ch)
     {
         printf("Please enter \"yes\" or \"no\" to accept or decline connection request.\n");
         return;
@@ -94,24 +148,16 @@ void process_send_msg(char *send_msg_buffer)
     switch(cmd)
     {
         case CMD_TYPE_GET_LIST:
-            get_client_list();
+            get_client_list_async(s,report_request_failure,GET_LIST_CMD,0,NULL);
             break;  
 
         case  CMD_TYPE_CONNECT:
-        {
-            char *cmd_str = strtok(send_msg_buffer," ");
-            char *name    = strtok(NULL," ");
+            handle_connect_cmd(s,send_msg_buffer+strlen(CONNECT_CMD));
+            break;
 
-            if(name) 
-            {
-                connect_with_client(name);
-            }
-            else 
-            {
-                printf("No client name provided to connect.\n");
-            }
-        }
-        break;
+        case CMD_TYPE_SWITCH:
+            handle_switch_cmd(s,send_msg_buffer+strlen(SWITCH_CMD));
+            break;
 
         case CMD_TYPE_DISCONNECT:
             printf("You are not connected to anyone.\n");
@@ -125,7 +171,7 @@ void process_send_msg(char *send_msg_buffer)
             if(name) 
             {
                 LOGI("Setting name to : %s .",name);
-                set_my_name(name);
+                set_my_name_async(s,name,report_request_failure,SET_NAME_CMD,0,NULL);
             }
             else 
             {
@@ -145,6 +191,9 @@ void process_send_msg(char *send_msg_buffer)
             show_help();
         }
         break;
+
+        default:
+            break;
     }
 }
 
@@ -161,7 +210,7 @@ cmd_type_t get_cmd_id_by_name(char *cmd_name)
             cmd=i;
             break;
         }
-        if( CMD_TYPE_SET_NAME==i || CMD_TYPE_CONNECT==i )
+        if( CMD_TYPE_SET_NAME==i || CMD_TYPE_CONNECT==i || CMD_TYPE_SEND_FILE==i || CMD_TYPE_SWITCH==i )
         {
             if( 0 == strncmp(cmd_name,cmd_list[i],strlen(cmd_list[i])) )
             {
@@ -173,7 +222,7 @@ cmd_type_t get_cmd_id_by_name(char *cmd_name)
     return cmd;
 }
 
-void  handle_send_msg_to_client(char *send_msg_str)
+void  handle_send_msg_to_client(client_session_t* s, char *send_msg_str)
 {
     if(!send_msg_str)
     {
@@ -181,19 +230,42 @@ void  handle_send_msg_to_client(char *send_msg_str)
         return;
     }
 
-    msg_t send_msg={0};
-    send_msg.msg_type=MSG_CLIENT_TX_TYPE;
-    strcpy(send_msg.msg_data.buffer,send_msg_str);
-    send_msg_to_server(send_msg);
-
     if(0==strcmp(send_msg_str,DISCONNECT_CMD))
+        printf("You are quittig the chat with [ %s ].\n",client_peer_name(s,client_active_channel(s)));
+
+    send_chat_text(s,NO_CHANNEL,send_msg_str);
+
+    LOGI("msg send to another client in chat communication.");
+}
+
+void  handle_connect_cmd(client_session_t* s, char *name)
+{
+    name = strtok(name," ");
+    if(!name)
     {
-        printf("You are quittig the chat.\n");
-        LOGI("Settig busy_in_chat flag false.");
-        *(cb_parameters->busy_in_chat) = false;
-        LOGI("Setting connected client name to default.");
-        strcpy(cb_parameters->connected_client_name,UNDEF_NAME);
+        printf("No client name provided to connect.\n");
+        return;
     }
+    if(CLIENT_SUCCESS==connect_with_client_async(s,name,report_request_failure,CONNECT_CMD,0,NULL))
+        printf("Connection request to %s send.\n",name);
+}
 
-    LOGI("msg send to another client in chat communication.");
+void  handle_switch_cmd(client_session_t* s, char *name)
+{
+    name = strtok(name," ");
+    if(!name)
+    {
+        for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
+        {
+            if(CHANNEL_CHAT == client_channel_state(s,ch))
+                printf("%s [ %s ]\n",(ch==client_active_channel(s)) ? "*" : " ",client_peer_name(s,ch));
+        }
+        return;
+    }
+    if(CLIENT_SUCCESS != client_switch_channel(s,client_find_channel(s,name)))
+    {
+        printf("You are not chatting with [ %s ].\n",name);
+        return;
+    }
+    printf("Messages now go to [ %s ].\n",name);
 }
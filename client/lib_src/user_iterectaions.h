@@ -5,6 +5,6 @@
 #include "client_lib.h"
 
 void show_help(void);
-void process_send_msg(char *send_msg_buffer);
+void process_send_msg(client_session_t* session, char *send_msg_buffer);
 
 #endif
@@ -1,51 +1,155 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 #include "logger.h"
 #include "client_lib.h"
 
-client_err_type_t msg_handle_cb(msg_t rx_msg);
-
-bool server_shut_down_flag = false;
-bool client_shut_down_flag = false;
-bool busy_in_chat          = false;
-char connected_client_name[MAX_CLIENT_NAME_LEN]=UNDEF_NAME;
+client_err_type_t msg_handle_cb(client_session_t* session, const msg_t* rx_msg);
+void file_progress_cb(client_session_t* session, bool sending, const char* file_name, uint64_t done, uint64_t total);
+void chat_loop(client_session_t* session);
 
 lib_params_t params_send_to_lib={
-	.client_shut_down_flag = &client_shut_down_flag,
-	.server_shut_down_flag = &server_shut_down_flag,
-	.busy_in_chat          = &busy_in_chat,
 	.msg_handle_cb         = msg_handle_cb,
-	.connected_client_name = connected_client_name
+	.file_progress_cb      = file_progress_cb
 };
 
 int main(int argc,char** argv)
 {
 	LOGD("main started.");
-	set_lib_params(&params_send_to_lib);
+	print_bin_info();
+	if(argc > 3)
+	{
+		printf("Usage : %s [name] [server_port|unix_socket_path]\n",argv[0]);
+		return -1;
+	}
+	// A path means the server runs on this host, chat then goes through shared memory.
+	if( (argc == 3) && (strchr(argv[2],'/')) )
+	{
+		params_send_to_lib.server_path = argv[2];
+		params_send_to_lib.use_shm = true;
+	}
+	else if(argc == 3)
+		params_send_to_lib.server_port = (uint16_t)atoi(argv[2]);
+	client_session_t* session = client_session_new(&params_send_to_lib);
+	if(!session)
+	{
+		printf("Cannot create client session.\n");
+		return -1;
+	}
 
-	client_err_type_t ret = connect_to_server();
+	client_err_type_t ret = connect_to_server(session);
 	if(ret!= CLIENT_SUCCESS)
 	{
 		printf("Connect to server failed.\n");
 		LOGE("Error : %s .",errTostr(ret));
+		client_session_free(session);
 		return -1;
 	}
 
-	if(argc==2)
+	if(argc>=2)
 	{
-		set_my_name(argv[1]);
+		set_my_name(session,argv[1]);
 	}
 
 	show_help();
 
-	ret = chat_on();
+	chat_loop(session);
+	client_session_free(session);
 	printf("Closing the client.\n");
 }
 
-client_err_type_t msg_handle_cb(msg_t rx_msg)
+bool read_user_input(client_session_t* session)
+{
+	char buffer[CHAT_TEXT_MAX_LEN+1];
+	int bytes = read(STDIN_FILENO, buffer, sizeof(buffer)-1);
+	if (bytes < 0)
+	{
+		LOGE("error in receive from STDIN.");
+		return (EINTR == errno);
+	}
+	if (bytes == 0)
+	{
+		LOGD("stdin closed.");
+		return false;
+	}
+	if((1==bytes) && (buffer[0]=='\n'))
+		return true;
+
+	buffer[bytes] = '\0';
+	if(buffer[bytes-1] == '\n')
+		buffer[bytes-1] = '\0';
+
+	char *start = buffer;
+	while (*start == ' ' || *start == '\t')
+		start++;
+
+	// Move the trimmed string to the beginning of buf
+	if (start != buffer) {
+		memmove(buffer, start, strlen(start) + 1);
+	}
+
+	process_send_msg(session,buffer);
+	return true;
+}
+
+/* SIGINT is blocked and read from a signalfd, so it is just one more fd in the poll set. */
+void chat_loop(client_session_t* session)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if(INVALID_FD == sig_fd)
+	{
+		LOGE("[ signalfd ] failed, errno : %d.",errno);
+		return;
+	}
+
+	struct pollfd fds[3];
+	fds[1].fd = STDIN_FILENO;
+	fds[1].events = POLLIN;
+	fds[2].fd = sig_fd;
+	fds[2].events = POLLIN;
+
+	while (INVALID_FD != client_get_fd(session))
+	{
+		fds[0].fd = client_get_fd(session);
+		fds[0].events = client_poll_events(session);
+		for(int i=0; i<3; i++)
+			fds[i].revents = 0;
+
+		if( (poll(fds, 3, client_next_timeout_ms(session)) < 0) && (EINTR != errno) )
+		{
+			LOGE("Error in poll, errno : %d.",errno);
+			break;
+		}
+		if(fds[2].revents & POLLIN)
+		{
+			LOGI("Client termination signal received.");
+			break;
+		}
+
+		if(CLIENT_SUCCESS != client_process_io(session,fds[0].revents))
+			break;
+
+		// A closed stdin is dropped from the set, incoming chat still shows up.
+		if( (fds[1].revents & (POLLIN|POLLHUP)) && (!read_user_input(session)) )
+			fds[1].fd = -1;
+	}
+	close(sig_fd);
+	LOGI("Client chat loop is terminating.");
+}
+
+client_err_type_t msg_handle_cb(client_session_t* session, const msg_t* rx_msg)
 {
-	switch (rx_msg.msg_type)
+	switch (rx_msg->msg_type)
 	{
 		case MSG_SET_NAME_ACK_TYPE:
 			printf("Name set successfully\n");
@@ -56,41 +160,41 @@ client_err_type_t msg_handle_cb(msg_t rx_msg)
 			break;
 
 		case MSG_GET_CLIENT_LIST_TYPE:
-			printf("Available clients on server : %s\n",rx_msg.msg_data.buffer);
+			printf("Available clients on server : %s\n",rx_msg->msg_data.buffer);
 			break;
 
 		case MSG_CONNECTION_REQ_RX:
-			printf("[ %s ] Wants to connect with you.\n",rx_msg.msg_data.buffer);
+			printf("[ %s ] Wants to connect with you.\n",rx_msg->msg_data.buffer);
 			printf("Enter \"yes\" or \"no\" to accept or decline connection request.\n");
 			break;
 
 		case MSG_CLIENT_STATUS_REQ_PENDING:
-			printf("Cannot connect with [ %s ], processing other connection request.\n",rx_msg.msg_data.buffer);
+			printf("Connection request with [ %s ] is already pending.\n",rx_msg->msg_data.buffer);
 			break;
 
 		case MSG_CLIENT_ACCEPT_CONNECTION_ACK:
-			printf("[ %s ] accepted your connection request.\n",rx_msg.msg_data.buffer);
+			printf("[ %s ] accepted your connection request.\n",rx_msg->msg_data.buffer);
 			printf("You can chat now.\n");
 			break;
 
 		case MSG_CLIENT_NO_MORE_FREE:
-			printf("Cannot connect to [ %s ], no more available to chat.\n",rx_msg.msg_data.buffer);
+			printf("Cannot connect to [ %s ], no more available to chat.\n",rx_msg->msg_data.buffer);
 			break;
 
 		case MSG_CLIENT_TERMINATION:
-			printf("Client terminated : %s.\n",rx_msg.msg_data.buffer);
+			printf("Client terminated : %s.\n",rx_msg->msg_data.buffer);
 			break;
 
 		case MSG_CLIENT_DISCONNECTED:
-			printf("Client disconnected : [ %s ].\n",rx_msg.msg_data.buffer);
+			printf("Client disconnected : [ %s ].\n",rx_msg->msg_data.buffer);
 			break;
 		
 		case MSG_CLIENT_CHAT_READY:
-			printf("Ready to chat with : [ %s ].\n",rx_msg.msg_data.buffer);
+			printf("Ready to chat with : [ %s ].\n",rx_msg->msg_data.buffer);
 			break;
 
 		case MSG_CLIENT_DECLINE_CONNECTION_ACK:
-			printf("[ %s ] Declined your connection request.\n",rx_msg.msg_data.buffer);
+			printf("[ %s ] Declined your connection request.\n",rx_msg->msg_data.buffer);
 			break;
 		
 		case MSG_CLIENT_FREE:
@@ -98,7 +202,11 @@ client_err_type_t msg_handle_cb(msg_t rx_msg)
 			break;
 
 		case MSG_CLIENT_BUSY:
-			printf("[ %s ] is now busy in chat with someone else, cannot connect to you.\n",rx_msg.msg_data.buffer);
+			printf("[ %s ] is now busy in chat with someone else, cannot connect to you.\n",rx_msg->msg_data.buffer);
+			break;
+
+		case MSG_CHANNEL_LIMIT:
+			printf("Cannot connect to [ %s ], already %d chats open.\n",rx_msg->msg_data.buffer,MAX_CHANNELS);
 			break;
 
 		case MSG_ATTEMPT_TO_CONNECT_TO_SELF:
@@ -106,16 +214,69 @@ client_err_type_t msg_handle_cb(msg_t rx_msg)
 			break;
 
 		case MSG_CLIENT_NOT_EXIST:
-			printf("No client with name : %s.\n",rx_msg.msg_data.buffer);
+			printf("No client with name : %s.\n",rx_msg->msg_data.buffer);
+			break;
+
+		case MSG_HEARTBEAT_REQ:
+			break;
+
+		case MSG_CONNECTION_REQ_EXPIRED:
+			printf("Connection request with [ %s ] expired.\n",rx_msg->msg_data.buffer);
+			break;
+
+		case MSG_CLIENT_IDLE_TIMEOUT:
+			printf("Disconnected by server after being idle too long.\n");
+			break;
+
+		case MSG_RATE_LIMITED:
+		{
+			rate_limit_info_t info;
+			memcpy(&info,rx_msg->msg_data.buffer,sizeof(info));
+			printf("Too many requests, %s dropped by server. Retry in %u ms.\n",msgTypeToStr((msg_type_t)info.msg_type),info.retry_after_ms);
+		}
+		break;
+
+		case MSG_SERVER_BUSY:
+		{
+			rate_limit_info_t info;
+			memcpy(&info,rx_msg->msg_data.buffer,sizeof(info));
+			printf("Server is overloaded, %s dropped. Retry in %u ms.\n",msgTypeToStr((msg_type_t)info.msg_type),info.retry_after_ms);
+		}
+		break;
+
+		case MSG_SERVER_SHUTDOWN:
+			printf("Server is shutting down, the connection closes.\n");
+			break;
+
+		case MSG_FILE_OFFER:
+		{
+			file_xfer_hdr_t hdr;
+			memcpy(&hdr,rx_msg->msg_data.buffer,sizeof(hdr));
+			hdr.file_name[sizeof(hdr.file_name)-1] = '\0';
+			printf("[ %s ] is sending file : %s (%lu bytes).\n",client_peer_name(session,rx_msg->channel_id),hdr.file_name,(unsigned long)hdr.file_size);
+		}
+		break;
+
+		case MSG_FILE_DATA:
+			break;
+
+		case MSG_FILE_CANCEL:
+			printf("File transfer cancelled.\n");
 			break;
 
 		case MSG_CLIENT_RX_TYPE:
-			printf("[ %s ] : [ %s ]\n",connected_client_name, rx_msg.msg_data.buffer);
+			printf("[ %s ] : [ %s ]\n",client_peer_name(session,rx_msg->channel_id), rx_msg->msg_data.buffer);
 			break;
 
 		default:
-			printf("msg rx , msg_type : %s, msg_data : %s\n",msgTypeToStr(rx_msg.msg_type),rx_msg.msg_data.buffer);
+			printf("msg rx , msg_type : %s, msg_data : %s\n",msgTypeToStr(rx_msg->msg_type),rx_msg->msg_data.buffer);
 			break;
 	}
 	return CLIENT_SUCCESS;
 }
+
+void file_progress_cb(client_session_t* session, bool sending, const char* file_name, uint64_t done, uint64_t total)
+{
+	unsigned percent = total ? (unsigned)((done*100)/total) : 100;
+	printf("%s %s : %u%% (%lu/%lu bytes).\n",sending ? "Sending" : "Receiving",file_name,percent,(unsigned long)done,(unsigned long)total);
+}
@@ -2,6 +2,7 @@
 #define CHAT_APP_COMMON_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define BUILD_DATE __DATE__
 #define BUILD_TIME __TIME__
@@ -16,6 +17,21 @@
 #define UNDEF_NAME          "NAME_NOT_DEFINED"
 #define DISCONNECT_CMD       "disconnect"
 #define MAX_CLIENT_NAME_LEN  64
+#define FILE_NAME_MAX_LEN    256
+#define FILE_CHUNK_MAX_LEN   (256*1024)
+#define CHAT_TEXT_MAX_LEN    4096
+/* Concurrent conversations per connection, channel ids run from 1 to MAX_CHANNELS. */
+#define MAX_CHANNELS         8
+#define NO_CHANNEL           0
+/* Besides TCP the server listens on this UNIX socket path, filled with its port. */
+#define SERVER_UNIX_PATH_FMT "/tmp/chat_server.%u.sock"
+
+/* Codec bits exchanged at offset HANDSHAKE_CAPS_OFFSET of the handshake frames. */
+#define CODEC_NONE           0x00
+#define CODEC_DEFLATE_DICT   0x01
+#define HANDSHAKE_CAPS_OFFSET 128
+/* Frames are fixed size, text that already fits one gains nothing from compression. */
+#define COMPRESS_MIN_LEN     MAX_MSG_LEN
 
 typedef enum{
     MSG_CLIENT_RX_TYPE=0,
@@ -48,6 +64,22 @@ typedef enum{
     MSG_CLIENT_CHAT_READY,
     MSG_CLIENT_CHANGE_CONN_FD_REQ,
     MSG_MAX_CLIENT_REACHED,
+    MSG_HEARTBEAT_REQ,
+    MSG_HEARTBEAT_ACK,
+    MSG_CONNECTION_REQ_EXPIRED,
+    MSG_CLIENT_IDLE_TIMEOUT,
+    MSG_FILE_OFFER,
+    MSG_FILE_DATA,
+    MSG_FILE_CANCEL,
+    MSG_CLIENT_TX_COMPRESSED,
+    MSG_CLIENT_RX_COMPRESSED,
+    MSG_CHANNEL_LIMIT,
+    MSG_SHM_UPGRADE_REQ,
+    MSG_SHM_UPGRADE_ACK,
+    MSG_SHM_UPGRADE_NACK,
+    MSG_RATE_LIMITED,
+    MSG_SERVER_BUSY,
+    MSG_SERVER_SHUTDOWN,
     MSG_TYPE_MAX
 }msg_type_t;
 
@@ -55,11 +87,69 @@ typedef struct {
     char buffer[MAX_MSG_LEN];
 }msg_data_t;
 
+/*
+ * req_id is chosen by the client for a request, 0 means none. The server
+ * echoes it on every frame it sends back to that client while handling the
+ * request and clears it on everything else. It sits in what used to be
+ * padding, so the frame layout is unchanged.
+ *
+ * channel_id names one conversation of the connection. Ids are local to each
+ * connection: the server rewrites it when relaying to the peer. Chat and file
+ * frames sent with NO_CHANNEL go to the lowest channel in the fitting state,
+ * which keeps single-chat clients working.
+ */
 typedef struct 
 {
-    uint8_t to_client_id;
+    uint8_t channel_id;
+    uint16_t req_id;
     msg_type_t msg_type;
     msg_data_t msg_data;
 }msg_t;
 
-#endif
\ No newline at end of file
+/* Bytes ahead of msg_data, the part a relay rewrites. */
+#define MSG_HDR_LEN          offsetof(msg_t,msg_data)
+
+/*
+ * Carried in msg_data.buffer of MSG_FILE_OFFER, MSG_FILE_DATA and
+ * MSG_FILE_CANCEL. A MSG_FILE_DATA frame is followed on the stream by
+ * chunk_len raw bytes of the file, outside of any msg_t.
+ */
+typedef struct
+{
+    uint64_t file_size;
+    uint64_t offset;
+    uint32_t chunk_len;
+    char file_name[FILE_NAME_MAX_LEN];
+}file_xfer_hdr_t;
+
+typedef struct
+{
+    uint32_t codecs;
+}conn_caps_t;
+
+/*
+ * Leads msg_data.buffer of MSG_CLIENT_TX_COMPRESSED and MSG_CLIENT_RX_COMPRESSED,
+ * followed by comp_len bytes that inflate to raw_len bytes of chat text.
+ */
+typedef struct
+{
+    uint16_t raw_len;
+    uint16_t comp_len;
+    uint32_t codec;
+}compressed_hdr_t;
+
+#define COMPRESSED_DATA_MAX_LEN (MAX_MSG_LEN - sizeof(compressed_hdr_t))
+
+/*
+ * Carried in msg_data.buffer of MSG_RATE_LIMITED: the type of the request the
+ * server dropped and when its bucket has a token again. MSG_SERVER_BUSY
+ * carries it too, for a request or, as MSG_CONN_ESTABLISH_REQ, a whole
+ * connection refused while the server is overloaded.
+ */
+typedef struct
+{
+    uint32_t msg_type;
+    uint32_t retry_after_ms;
+}rate_limit_info_t;
+
+#endif
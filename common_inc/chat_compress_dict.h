@@ -0,0 +1,31 @@
+#ifndef CHAT_COMPRESS_DICT_H
+#define CHAT_COMPRESS_DICT_H
+
+/*
+ * Preset dictionary for CODEC_DEFLATE_DICT, shared by client and server.
+ * Built from common chat phrases and log/stack trace tokens. Deflate matches
+ * the tail best, so the most frequent strings come last. Changing a single
+ * byte breaks decoding between old and new builds: add a new codec bit instead.
+ */
+static const char chat_compress_dict[] =
+    "Traceback (most recent call last):\n  File \"\", line , in \n"
+    "Exception in thread \"main\" java.lang.NullPointerException\n\tat "
+    "Segmentation fault (core dumped)\nerror: undefined reference to "
+    "warning: unused variable \nmake: *** [Makefile: ] Error 1\n"
+    "[ INFO ] [ DEBUG ] [ ERROR ] [ WARN ] failed, errno : connection refused "
+    "timeout expired\n#include <stdio.h>\nint main(int argc, char **argv)\n{\n"
+    "    return 0;\n}\nfunction () { const let var = null; undefined true false "
+    "if (err) { return err; }\nfor (int i = 0; i < ; i++) {\n"
+    "SELECT * FROM WHERE id = ORDER BY LIMIT ;\n"
+    "http://https://www..com/github.com/localhost:8080/api/v1/"
+    "2024-01-01 00:00:00 Mon Tue Wed Thu Fri Sat Sun "
+    "Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec "
+    "please could you can you check this out, let me know what you think. "
+    "I think that we should the same issue again, it is not working. "
+    "sounds good, thank you so much! thanks, no problem, see you tomorrow. "
+    "what do you mean? I don't know, maybe later. I'm not sure about that. "
+    "yes, of course. okay, that makes sense. have a look at the logs below:\n"
+    "hello, how are you? I am fine, thanks. what are you doing today? "
+    "the and to of a in is that for it you with on this be are have was ";
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef CHAT_SHM_H
+#define CHAT_SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include "chat_app_common.h"
+
+/*
+ * Shared-memory transport for clients on the server's host. A client
+ * connected over the UNIX socket sends MSG_SHM_UPGRADE_REQ after the
+ * handshake and gets MSG_SHM_UPGRADE_ACK with SHM_FD_COUNT descriptors
+ * attached (SCM_RIGHTS). From then on frames travel through the two rings of
+ * the region, except those for which shm_frame_on_socket() holds: file frames
+ * stay on the socket, next to the raw chunks that follow MSG_FILE_DATA. The
+ * socket also tells either side that the other one went away.
+ *
+ * Each side sleeps on its own eventfd. A producer signals the consumer's
+ * eventfd only when the ring was drained up to the frame it just added; a
+ * consumer signals the producer's eventfd only when the producer found the
+ * ring full. The server has one eventfd, the doorbell, shared by all clients.
+ */
+#define SHM_RING_SLOTS       256
+#define SHM_REGION_MAGIC     0x43485348u
+#define SHM_REGION_NAME      "chat_shm"
+
+/* Order of the descriptors attached to MSG_SHM_UPGRADE_ACK. */
+#define SHM_FD_REGION        0
+#define SHM_FD_CLIENT_WAKE   1
+#define SHM_FD_SERVER_WAKE   2
+#define SHM_FD_COUNT         3
+
+/*
+ * Single producer, single consumer. head and tail only grow, the slot is the
+ * index modulo SHM_RING_SLOTS. Both ends keep their own index privately and
+ * only publish it here, so a misbehaving peer cannot push them out of the slots.
+ */
+typedef struct
+{
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+    _Atomic uint32_t producer_waiting;
+    _Alignas(64) msg_t slots[SHM_RING_SLOTS];
+}shm_ring_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t slots;
+    shm_ring_t to_server;
+    shm_ring_t to_client;
+}shm_region_t;
+
+typedef enum{
+    SHM_PUSH_OK=0,
+    /* The consumer may be asleep, signal its eventfd. */
+    SHM_PUSH_WAKE,
+    SHM_PUSH_FULL
+}shm_push_t;
+
+/* The raw chunk after MSG_FILE_DATA cannot go through a ring, so neither do its control frames. */
+static inline bool shm_frame_on_socket(msg_type_t type)
+{
+    return (MSG_FILE_OFFER == type) || (MSG_FILE_DATA == type) || (MSG_FILE_CANCEL == type)
+        || (MSG_SHM_UPGRADE_REQ == type) || (MSG_SHM_UPGRADE_ACK == type) || (MSG_SHM_UPGRADE_NACK == type);
+}
+
+/*
+ * Publishing tail and then reading head pairs with the consumer publishing
+ * head and then reading tail (all sequentially consistent): either the
+ * consumer sees the new frame, or the producer sees it caught up and wakes it.
+ */
+static inline shm_push_t shm_ring_push_frame(shm_ring_t* ring, uint32_t* tail, const msg_t* hdr, const msg_data_t* data)
+{
+    if(*tail - atomic_load(&ring->head) >= SHM_RING_SLOTS)
+    {
+        atomic_store(&ring->producer_waiting,1);
+        if(*tail - atomic_load(&ring->head) >= SHM_RING_SLOTS)
+            return SHM_PUSH_FULL;
+        atomic_store(&ring->producer_waiting,0);
+    }
+    msg_t* slot = &ring->slots[*tail % SHM_RING_SLOTS];
+    memcpy(slot,hdr,MSG_HDR_LEN);
+    slot->msg_data = *data;
+    (*tail)++;
+    atomic_store(&ring->tail,*tail);
+    return (atomic_load(&ring->head) == *tail - 1) ? SHM_PUSH_WAKE : SHM_PUSH_OK;
+}
+
+static inline shm_push_t shm_ring_push(shm_ring_t* ring, uint32_t* tail, const msg_t* msg)
+{
+    return shm_ring_push_frame(ring,tail,msg,&msg->msg_data);
+}
+
+/* wake_producer is set when the producer found the ring full and waits for room. */
+static inline bool shm_ring_pop(shm_ring_t* ring, uint32_t* head, msg_t* msg, bool* wake_producer)
+{
+    if(atomic_load(&ring->tail) == *head)
+        return false;
+    *msg = ring->slots[*head % SHM_RING_SLOTS];
+    (*head)++;
+    atomic_store(&ring->head,*head);
+    if( (atomic_load(&ring->producer_waiting)) && (atomic_exchange(&ring->producer_waiting,0)) )
+        *wake_producer = true;
+    return true;
+}
+
+/* A saturated counter fails with EAGAIN, the sleeper is awake then anyway. */
+static inline void shm_wake(int efd)
+{
+    uint64_t one = 1;
+    ssize_t ret = write(efd,&one,sizeof(one));
+    (void)ret;
+}
+
+/* Called before draining, so a signal sent meanwhile is not lost. */
+static inline void shm_wake_clear(int efd)
+{
+    uint64_t count;
+    ssize_t ret = read(efd,&count,sizeof(count));
+    (void)ret;
+}
+
+#endif
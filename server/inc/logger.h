@@ -18,24 +18,29 @@
 #define COLOR_RESET        "\033[0m"
 
 char* get_current_time(void);
+/* Runtime level, LOG_LEVEL only caps what is compiled in. */
+extern int srv_log_level;
 
 #if LOG_LEVEL>=LOG_LEVEL_ERROR
-    #define LOGE(fmt, ...) fprintf(stderr, COLOR_BOLD_RED "[ %s ] [ ERROR ] " COLOR_RESET "%s:%d: "  fmt "\n",\
-                            get_current_time(),__func__, __LINE__, ##__VA_ARGS__)
+    #define LOGE(fmt, ...) do { if(srv_log_level>=LOG_LEVEL_ERROR) \
+                            fprintf(stderr, COLOR_BOLD_RED "[ %s ] [ ERROR ] " COLOR_RESET "%s:%d: "  fmt "\n",\
+                            get_current_time(),__func__, __LINE__, ##__VA_ARGS__); } while(0)
 #else
     #define LOGE(fmt,...)
 #endif
 
 #if LOG_LEVEL>=LOG_LEVEL_INFO
-    #define LOGI(fmt, ...) fprintf(stderr, COLOR_BOLD_GREEN "[ %s ] [ INFO ]  " COLOR_RESET "%s:%d: " fmt "\n",\
-                            get_current_time(),__func__, __LINE__, ##__VA_ARGS__)
+    #define LOGI(fmt, ...) do { if(srv_log_level>=LOG_LEVEL_INFO) \
+                            fprintf(stderr, COLOR_BOLD_GREEN "[ %s ] [ INFO ]  " COLOR_RESET "%s:%d: " fmt "\n",\
+                            get_current_time(),__func__, __LINE__, ##__VA_ARGS__); } while(0)
 #else
     #define LOGI(fmt,...)
 #endif
 
 #if LOG_LEVEL>=LOG_LEVEL_DEBUG
-    #define LOGD(fmt, ...) fprintf(stderr, COLOR_BOLD_YELLOW "[ %s ] [ DEBUG ] "COLOR_RESET "%s:%d: " fmt "\n",\
-                            get_current_time(),__func__, __LINE__, ##__VA_ARGS__)
+    #define LOGD(fmt, ...) do { if(srv_log_level>=LOG_LEVEL_DEBUG) \
+                            fprintf(stderr, COLOR_BOLD_YELLOW "[ %s ] [ DEBUG ] "COLOR_RESET "%s:%d: " fmt "\n",\
+                            get_current_time(),__func__, __LINE__, ##__VA_ARGS__); } while(0)
 #else
     #define LOGD(fmt,...)
 #endif
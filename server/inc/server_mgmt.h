@@ -3,13 +3,39 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <netinet/in.h>
 #include "server_queue.h"
+#include "server_timer.h"
+#include "server_io.h"
+#include "server_cluster.h"
+#include "server_shm.h"
+#include "server_ratelimit.h"
+#include "server_overload.h"
+#include "server_handover.h"
+#include "server_shutdown.h"
+#include "server_config.h"
+#include "server_workpool.h"
+#include "server_mailbox.h"
+#include "server_arena.h"
 
-#define MAX_LISTEN           20
+#ifndef MAX_LISTEN
+#define MAX_LISTEN           4096
+#endif
 #define SERVER_PORT          12345
 #define MAX_CLIENT           20
+#define SOMAXCONN_PATH       "/proc/sys/net/core/somaxconn"
+/* Size of sun_path in struct sockaddr_un. */
+#define UNIX_PATH_LEN        108
 
-#define MAX_RECV_BUFFER_LEN  2048
+/* Defaults of the tunables below, see srv_tuning_t. */
+#define ACCEPT_BATCH_MAX                64
+#define ACCEPT_FD_EXHAUSTED_BACKOFF_US  10000
+#define HANDSHAKE_TIMEOUT_MS            5000
+
+#define HEARTBEAT_INTERVAL_MS           30000
+#define DEAD_PEER_HEARTBEATS            3
+#define IDLE_EVICT_TIMEOUT_MS           (30*60*1000)
+#define CONN_REQ_TIMEOUT_MS             30000
 
 #define LOCK_CLIENT_DATA_MUTEX() do {       \
     LOGD("Locking client_data_mutex");      \
@@ -33,16 +59,53 @@ typedef enum
     ERR_CLIENT_CLOSED_CONN,
     ERR_RECV,
     ERR_ADD_NODE_FAILED,
-    ERR_READ_TIMEOUT
+    ERR_READ_TIMEOUT,
+    SERVER_HANDED_OVER
 }srv_err_type;
 
+/*
+ * One conversation of a connection. The peer keeps the other end under its
+ * own id, peer_channel. REQ_SENT is the requester's end of a pending
+ * request, REQ_PENDING the end that has to accept or decline it.
+ * A peer on another node is addressed by its fd there, peer_node is
+ * NODE_NONE while the request is still looking for the node.
+ */
+typedef struct
+{
+    /* Only moved by channel_transition(), alloc_channel() and release_channel(). */
+    client_chat_status_t status;
+    uint8_t peer_node;
+    int peer_fd;
+    /* Generation of the local client on peer_fd, a later client on the same fd does not match. */
+    uint32_t peer_gen;
+    uint8_t peer_channel;
+    /* Routed connect request, answered once the peer's node replies. */
+    uint16_t req_id;
+    /* Only kept for peers on other nodes. */
+    char peer_name[MAX_CLIENT_NAME_LEN];
+    srv_timer_t conn_req_timer;
+}chat_channel_t;
+
 typedef struct 
 {
-    client_chat_status_t chat_status;
     int fd;
-    int to_fd;
-    pthread_t thread_id;
+    /* Tells this client from earlier ones on the same fd, never 0. */
+    uint32_t gen;
+    /* Indexed by channel id - 1. */
+    chat_channel_t channels[MAX_CHANNELS];
     char name[MAX_CLIENT_NAME_LEN];
+    /* Cluster mode: name is held at its owner node, claim_name waits for the owner's answer. */
+    bool name_registered;
+    char claim_name[MAX_CLIENT_NAME_LEN];
+    uint16_t claim_req_id;
+    bool handshake_done;
+    uint32_t codecs;
+    uint64_t last_rx_ms;
+    uint64_t last_activity_ms;
+    srv_timer_t handshake_timer;
+    srv_timer_t idle_timer;
+    /* Token buckets per request class, filled once the handshake is done. */
+    rate_state_t rate;
 }client_data_t;
 
 typedef struct client_node_t {
@@ -50,7 +113,69 @@ typedef struct client_node_t {
     struct client_node_t* next;
 } client_node_t;
 
-srv_err_type init_srv(void);
+typedef void (*client_iter_cb_t)(client_data_t* data, void* arg);
+
+typedef struct srv_config_t
+{
+    io_backend_type_t io_backend;
+    uint16_t port;
+    /* UNIX socket for clients on this host, which may move onto shared memory. Empty disables it. */
+    char unix_path[UNIX_PATH_LEN];
+    /* Knobs a SIGHUP reloads from config_path, empty when started without -f. */
+    srv_tuning_t tuning;
+    char config_path[CONFIG_PATH_LEN];
+    /* Threads running heavy handlers off the loop, 0 keeps them inline. */
+    uint32_t workers;
+    /* Take the sockets and clients over from the server running on port. */
+    bool takeover;
+    /* Cluster mode: the address other nodes reach this one at, and nodes to join through. */
+    bool cluster;
+    char advertise_ip[INET_ADDRSTRLEN];
+    int seed_count;
+    char seeds[CLUSTER_MAX_NODES][CLUSTER_ADDR_LEN];
+}srv_config_t;
+
+client_data_t* get_client_data_by_fd(int fd);
+/* NULL unless fd still holds the client of generation gen. */
+client_data_t* get_client_data_by_handle(int fd, uint32_t gen);
+chat_channel_t* get_channel(client_data_t* data, uint8_t channel);
+uint8_t find_channel(client_data_t* data, uint8_t channel, client_chat_status_t status);
+uint8_t find_channel_by_peer(client_data_t* data, const client_data_t* peer);
+uint8_t find_channel_by_remote_name(client_data_t* data, const char* name);
+uint8_t alloc_channel(client_data_t* data, client_chat_status_t status, int peer_fd);
+void release_channel(client_data_t* data, uint8_t channel);
+bool channel_transition(chat_channel_t* chan, client_chat_status_t from, client_chat_status_t to);
+chat_channel_t* get_linked_channel(client_data_t* data, uint8_t channel, client_data_t** peer_out);
+void for_each_client(client_iter_cb_t cb, void* arg);
+
+/* Entry points used by the I/O backends. */
+void handle_new_connection(int socket_fd);
+int accept_pending_connections(int listen_fd);
+/* msg may point into the receive buffer, it is only valid during the call. */
+bool handle_rx_frame(int fd, const msg_t* msg);
+void handle_client_disconnect(int fd);
+
+/* Entry points used by the cluster layer. */
+io_prio_t msg_tx_prio(msg_type_t type);
+bool handle_node_relay(uint8_t node, int link_fd, msg_t* msg);
+bool handle_node_connect_req(uint8_t origin, node_connect_t* req);
+void handle_node_connect_result(uint8_t node, node_connect_t* res);
+void handle_name_claim_result(node_name_claim_t* claim);
+void handle_node_down(uint8_t node);
+void handle_ring_change(void);
+
+/*
+ * Entry points used by the hot upgrade. export_clients() snapshots every
+ * client under client_data_mutex. Clients are adopted under their new
+ * fd while their channels still point at the old ones, remap_adopted_peers()
+ * translates those once every client arrived.
+ */
+typedef void (*client_export_cb_t)(handover_client_t* rec, void* arg);
+void export_clients(client_export_cb_t cb, void* arg);
+bool adopt_client(int fd, const handover_client_t* rec, const uint8_t* rx, const uint8_t* tx);
+void remap_adopted_peers(const int* fd_map);
+
+srv_err_type init_srv(const srv_config_t* config);
 srv_err_type wait_for_client_conn_and_accept(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "server_arena.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+#define ARENA_ALIGN  16
+
+typedef struct arena_chunk_t
+{
+    struct arena_chunk_t* next;
+    struct arena_chunk_t* prev;
+    size_t used;
+    uint32_t live;
+    _Alignas(ARENA_ALIGN) uint8_t data[];
+}arena_chunk_t;
+
+/* In front of every block, chunk is NULL for one taken from the heap. */
+typedef struct
+{
+    _Alignas(ARENA_ALIGN) arena_chunk_t* chunk;
+}arena_hdr_t;
+
+static arena_chunk_t* cur = NULL;
+static arena_chunk_t* spare = NULL;
+/* Left behind with blocks still in use, e.g. frames deferred behind a job. */
+static arena_chunk_t* pinned = NULL;
+static uint64_t pinned_count = 0;
+static int spare_count = 0;
+static uint64_t chunk_count = 0;
+
+static void* heap_block(size_t len)
+{
+    arena_hdr_t* hdr = malloc(sizeof(*hdr) + len);
+    if(!hdr)
+    {
+        LOGE("malloc failed for %zu bytes.",len);
+        return NULL;
+    }
+    metrics_inc(METRIC_ARENA_HEAP_ALLOCS);
+    hdr->chunk = NULL;
+    return hdr + 1;
+}
+
+static void pin(arena_chunk_t* chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = pinned;
+    if(pinned)
+        pinned->prev = chunk;
+    pinned = chunk;
+    metrics_set(METRIC_ARENA_CHUNKS_PINNED,++pinned_count);
+}
+
+static void unpin(arena_chunk_t* chunk)
+{
+    if(chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        pinned = chunk->next;
+    if(chunk->next)
+        chunk->next->prev = chunk->prev;
+    metrics_set(METRIC_ARENA_CHUNKS_PINNED,--pinned_count);
+}
+
+/* The current chunk is full: rewind it if it is empty, else move on to another one. */
+static arena_chunk_t* next_chunk(void)
+{
+    if( (cur) && (0 == cur->live) )
+    {
+        cur->used = 0;
+        return cur;
+    }
+    arena_chunk_t* chunk = spare;
+    if(chunk)
+    {
+        spare = chunk->next;
+        spare_count--;
+    }
+    else
+    {
+        chunk = malloc(sizeof(*chunk) + ARENA_CHUNK_SIZE);
+        if(!chunk)
+        {
+            LOGE("malloc failed for an arena chunk.");
+            return NULL;
+        }
+        metrics_inc(METRIC_ARENA_HEAP_ALLOCS);
+        metrics_set_max(METRIC_ARENA_CHUNKS_MAX,++chunk_count);
+    }
+    chunk->next = NULL;
+    chunk->prev = NULL;
+    chunk->used = 0;
+    chunk->live = 0;
+    // The one left behind is picked up by arena_free() once its blocks are gone.
+    if(cur)
+        pin(cur);
+    cur = chunk;
+    return chunk;
+}
+
+void* arena_alloc(size_t len)
+{
+    if(len > ARENA_MAX_BLOCK)
+        return heap_block(len);
+
+    size_t need = sizeof(arena_hdr_t) + ((len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+    if( ((!cur) || (cur->used + need > ARENA_CHUNK_SIZE)) && (!next_chunk()) )
+        return heap_block(len);
+
+    arena_hdr_t* hdr = (arena_hdr_t*)(cur->data + cur->used);
+    cur->used += need;
+    cur->live++;
+    hdr->chunk = cur;
+    metrics_add(METRIC_ARENA_BYTES,len);
+    return hdr + 1;
+}
+
+void arena_free(void* ptr)
+{
+    if(!ptr)
+        return;
+    arena_hdr_t* hdr = (arena_hdr_t*)ptr - 1;
+    arena_chunk_t* chunk = hdr->chunk;
+    if(!chunk)
+    {
+        free(hdr);
+        return;
+    }
+    if( (0 != --chunk->live) || (chunk == cur) )
+        return;
+    unpin(chunk);
+    if(spare_count < ARENA_SPARE_CHUNKS)
+    {
+        chunk->next = spare;
+        spare = chunk;
+        spare_count++;
+    }
+    else
+    {
+        free(chunk);
+        chunk_count--;
+    }
+}
+
+void arena_reset(void)
+{
+    if( (cur) && (0 == cur->live) )
+        cur->used = 0;
+}
+
+void arena_fini(void)
+{
+    if( (cur) && (cur->live) )
+        LOGE("arena chunk freed with %u blocks in use.",cur->live);
+    free(cur);
+    cur = NULL;
+    while(pinned)
+    {
+        arena_chunk_t* next = pinned->next;
+        LOGE("arena chunk freed with %u blocks in use.",pinned->live);
+        free(pinned);
+        pinned = next;
+    }
+    pinned_count = 0;
+    while(spare)
+    {
+        arena_chunk_t* next = spare->next;
+        free(spare);
+        spare = next;
+    }
+    spare_count = 0;
+    chunk_count = 0;
+}
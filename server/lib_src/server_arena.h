@@ -0,0 +1,28 @@
+#ifndef SERVER_ARENA_H
+#define SERVER_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE     (64*1024)
+/* Bigger blocks, e.g. relayed file bytes, come from the heap. */
+#define ARENA_MAX_BLOCK      (ARENA_CHUNK_SIZE/8)
+/* Emptied chunks kept for reuse, the rest are given back. */
+#define ARENA_SPARE_CHUNKS   8
+
+/*
+ * Bump allocator for the short-lived records of the loop: frames deferred
+ * behind a job, the jobs and their keys. Queued frames take tx slots from
+ * server_iopool.h instead, they can stay queued for as long as a peer does
+ * not read. Blocks are carved from 64 KiB chunks. The current chunk is
+ * rewound at the end of a loop iteration only if every block carved from it
+ * was freed; a chunk left behind with blocks still in use is pinned until
+ * its last block is freed, then it becomes spare. arena_fini() frees them
+ * all. Loop thread only, workers may use the memory but not allocate or free.
+ */
+void* arena_alloc(size_t len);
+void arena_free(void* ptr);
+/* End of a loop iteration. */
+void arena_reset(void);
+void arena_fini(void);
+
+#endif
@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "server_cluster.h"
+#include "server_mgmt.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+/*
+ * Servers started with the same seeds form one namespace of client names.
+ * Membership is gossiped: every node bumps its own heartbeat and sends its
+ * table to a few peers, a node whose heartbeat stops growing is declared
+ * down. Each name is owned by one node, picked on a consistent hash ring,
+ * and the owner keeps a directory of which node the name is connected to.
+ * Every node dials every other node and only sends on the link it dialed,
+ * so a pair of nodes is joined by two one-way links.
+ */
+
+#define CLUSTER_MAX_LINKS   (4*CLUSTER_MAX_NODES)
+
+typedef struct
+{
+    bool used;
+    bool alive;
+    bool seed;
+    char addr[CLUSTER_ADDR_LEN];
+    uint64_t heartbeat;
+    uint64_t updated_ms;
+    uint64_t next_dial_ms;
+    /* Dialed by this server, everything for the node is sent here. */
+    int out_fd;
+    /* Dialed by the node, only read from. */
+    int in_fd;
+}cluster_node_t;
+
+/* Every link fd, including replaced ones the I/O layer has not reaped yet. */
+typedef struct
+{
+    int fd;
+    uint8_t node;
+    bool outgoing;
+}cluster_link_t;
+
+typedef struct
+{
+    uint32_t hash;
+    uint8_t node;
+}ring_point_t;
+
+typedef struct dir_entry_t
+{
+    char name[MAX_CLIENT_NAME_LEN];
+    uint8_t node;
+    struct dir_entry_t* next;
+}dir_entry_t;
+
+static bool enabled = false;
+static cluster_node_t nodes[CLUSTER_MAX_NODES];
+static cluster_link_t links[CLUSTER_MAX_LINKS];
+static int link_count = 0;
+static ring_point_t ring[CLUSTER_MAX_NODES*CLUSTER_VNODES];
+static int ring_len = 0;
+/* Names this node owns, and the node each one is connected to. */
+static dir_entry_t* directory = NULL;
+static srv_timer_t gossip_timer;
+
+static bool parse_addr(const char* addr, struct sockaddr_in* sa)
+{
+    char ip[CLUSTER_ADDR_LEN];
+    const char* colon = strrchr(addr,':');
+    if( (!colon) || ((size_t)(colon-addr) >= sizeof(ip)) ) return false;
+    memcpy(ip,addr,colon-addr);
+    ip[colon-addr] = '\0';
+
+    char* end = NULL;
+    long port = strtol(colon+1,&end,10);
+    if( (colon[1] == '\0') || (*end != '\0') || (port <= 0) || (port > 65535) ) return false;
+
+    memset(sa,0,sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons((uint16_t)port);
+    return 1==inet_pton(AF_INET,ip,&sa->sin_addr);
+}
+
+/* FNV-1a finished with the murmur3 mixer, vnode keys only differ in their last bytes. */
+static uint32_t ring_hash(const char* key)
+{
+    uint32_t h = 2166136261u;
+    for(; *key; key++)
+    {
+        h ^= (uint8_t)*key;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int ring_cmp(const void* a, const void* b)
+{
+    const ring_point_t* x = a;
+    const ring_point_t* y = b;
+    if(x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+    return strcmp(nodes[x->node].addr,nodes[y->node].addr);
+}
+
+static void ring_rebuild(void)
+{
+    char key[CLUSTER_ADDR_LEN+8];
+    ring_len = 0;
+    for(uint8_t i=0; i<CLUSTER_MAX_NODES; i++)
+    {
+        if( (!nodes[i].used) || (!nodes[i].alive) ) continue;
+        for(int v=0; v<CLUSTER_VNODES; v++)
+        {
+            snprintf(key,sizeof(key),"%s#%d",nodes[i].addr,v);
+            ring[ring_len].hash = ring_hash(key);
+            ring[ring_len].node = i;
+            ring_len++;
+        }
+    }
+    qsort(ring,ring_len,sizeof(ring[0]),ring_cmp);
+}
+
+/* First ring point at or after the name's hash, wrapping around. */
+static uint8_t name_owner(const char* name)
+{
+    if(0==ring_len) return NODE_LOCAL;
+    uint32_t h = ring_hash(name);
+    int lo = 0;
+    int hi = ring_len;
+    while(lo < hi)
+    {
+        int mid = (lo+hi)/2;
+        if(ring[mid].hash < h)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return ring[(lo==ring_len) ? 0 : lo].node;
+}
+
+static dir_entry_t* dir_find(const char* name)
+{
+    dir_entry_t* entry = directory;
+    while( (entry) && (strcmp(entry->name,name)) )
+        entry = entry->next;
+    return entry;
+}
+
+/* A name already connected to another node stays with it. */
+static bool dir_claim(const char* name, uint8_t node)
+{
+    dir_entry_t* entry = dir_find(name);
+    if(entry) return (node == entry->node);
+
+    entry = calloc(1,sizeof(dir_entry_t));
+    if(!entry)
+    {
+        LOGE("cluster : calloc failed for name %s.",name);
+        return false;
+    }
+    strncpy(entry->name,name,MAX_CLIENT_NAME_LEN-1);
+    entry->node = node;
+    entry->next = directory;
+    directory = entry;
+    LOGI("cluster : name %s registered at node %s.",name,nodes[node].addr);
+    return true;
+}
+
+/* NULL name or NODE_NONE match every entry, unowned ones went to another node. */
+static void dir_drop(const char* name, uint8_t node, bool unowned)
+{
+    dir_entry_t** link = &directory;
+    while(*link)
+    {
+        dir_entry_t* entry = *link;
+        bool match = unowned ? (NODE_LOCAL != name_owner(entry->name))
+                             : ( ((!name) || (0==strcmp(entry->name,name))) && ((NODE_NONE==node) || (node==entry->node)) );
+        if(match)
+        {
+            LOGD("cluster : name %s dropped from directory.",entry->name);
+            *link = entry->next;
+            free(entry);
+        }
+        else
+        {
+            link = &entry->next;
+        }
+    }
+}
+
+static uint8_t node_find(const char* addr)
+{
+    for(uint8_t i=0; i<CLUSTER_MAX_NODES; i++)
+    {
+        if( (nodes[i].used) && (0==strcmp(nodes[i].addr,addr)) )
+            return i;
+    }
+    return NODE_NONE;
+}
+
+static uint8_t node_add(const char* addr)
+{
+    uint8_t idx = node_find(addr);
+    if(NODE_NONE != idx) return idx;
+
+    for(uint8_t i=1; i<CLUSTER_MAX_NODES; i++)
+    {
+        if(nodes[i].used) continue;
+        memset(&nodes[i],0,sizeof(nodes[i]));
+        nodes[i].used = true;
+        strncpy(nodes[i].addr,addr,CLUSTER_ADDR_LEN-1);
+        nodes[i].updated_ms = srv_now_ms();
+        nodes[i].out_fd = INVALID_FD;
+        nodes[i].in_fd = INVALID_FD;
+        LOGI("cluster : node %s added.",addr);
+        return i;
+    }
+    LOGE("cluster : node table full, ignoring %s.",addr);
+    return NODE_NONE;
+}
+
+/* Gossip and hello entries come off the wire, only well formed addresses make it in. */
+static uint8_t digest_node(node_digest_t* digest)
+{
+    struct sockaddr_in sa;
+    digest->addr[CLUSTER_ADDR_LEN-1] = '\0';
+    if(!parse_addr(digest->addr,&sa))
+    {
+        LOGE("cluster : malformed node address.");
+        return NODE_NONE;
+    }
+    return node_add(digest->addr);
+}
+
+static bool node_has_links(uint8_t idx)
+{
+    for(int i=0; i<link_count; i++)
+    {
+        if(idx == links[i].node) return true;
+    }
+    return false;
+}
+
+static void membership_changed(void)
+{
+    ring_rebuild();
+    dir_drop(NULL,NODE_NONE,true);
+    handle_ring_change();
+}
+
+static void dial_node(uint8_t idx);
+
+static void node_heard(uint8_t idx, uint64_t heartbeat)
+{
+    cluster_node_t* node = &nodes[idx];
+    if( (NODE_LOCAL==idx) || (heartbeat <= node->heartbeat) ) return;
+    node->heartbeat = heartbeat;
+    node->updated_ms = srv_now_ms();
+    if(node->alive) return;
+
+    node->alive = true;
+    LOGI("cluster : node %s is up.",node->addr);
+    // Re-claims for names it now owns go out right away, queued behind the connect.
+    if(INVALID_FD == node->out_fd)
+        dial_node(idx);
+    membership_changed();
+}
+
+static void node_down(uint8_t idx)
+{
+    cluster_node_t* node = &nodes[idx];
+    node->alive = false;
+    LOGI("cluster : node %s is down.",node->addr);
+    metrics_inc(METRIC_NODES_DOWN);
+    if(INVALID_FD != node->out_fd)
+        srv_io_close_fd(node->out_fd);
+    if(INVALID_FD != node->in_fd)
+        srv_io_close_fd(node->in_fd);
+    dir_drop(NULL,idx,false);
+    handle_node_down(idx);
+    membership_changed();
+}
+
+static bool link_add(int fd, uint8_t node, bool outgoing)
+{
+    if(link_count >= CLUSTER_MAX_LINKS)
+    {
+        LOGE("cluster : link table full, fd : %d.",fd);
+        return false;
+    }
+    links[link_count].fd = fd;
+    links[link_count].node = node;
+    links[link_count].outgoing = outgoing;
+    link_count++;
+    return true;
+}
+
+static void fill_digest(msg_t* msg, uint8_t idx, int slot)
+{
+    node_digest_t digest = {0};
+    strcpy(digest.addr,nodes[idx].addr);
+    digest.heartbeat = nodes[idx].heartbeat;
+    memcpy(msg->msg_data.buffer + slot*sizeof(digest),&digest,sizeof(digest));
+}
+
+/* Non-blocking, the hello waits in the send queue until the connect completes. */
+static void dial_node(uint8_t idx)
+{
+    cluster_node_t* node = &nodes[idx];
+    node->next_dial_ms = srv_now_ms() + CLUSTER_REDIAL_MS;
+
+    struct sockaddr_in sa;
+    if(!parse_addr(node->addr,&sa)) return;
+    int fd = socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+    if(INVALID_FD==fd)
+    {
+        LOGE("cluster : [ socket ] failed, errno : %d.",errno);
+        return;
+    }
+    if( (connect(fd,(struct sockaddr*)&sa,sizeof(sa)) < 0) && (EINPROGRESS != errno) )
+    {
+        LOGE("cluster : connect to %s failed, errno : %d.",node->addr,errno);
+        close(fd);
+        return;
+    }
+    if(!link_add(fd,idx,true))
+    {
+        close(fd);
+        return;
+    }
+    if(IO_SUCC != srv_io_add_fd(fd))
+    {
+        link_count--;
+        close(fd);
+        return;
+    }
+    node->out_fd = fd;
+    LOGI("cluster : dialing node %s, fd : %d.",node->addr,fd);
+
+    msg_t hello = {0};
+    hello.msg_type = (msg_type_t)NODE_MSG_HELLO;
+    fill_digest(&hello,NODE_LOCAL,0);
+    srv_io_send(fd,&hello,sizeof(hello),IO_PRIO_CONTROL,IO_STREAM_NONE);
+}
+
+static void send_gossip(void)
+{
+    msg_t msg = {0};
+    msg.msg_type = (msg_type_t)NODE_MSG_GOSSIP;
+    uint8_t targets[CLUSTER_MAX_NODES];
+    int target_count = 0;
+    int entries = 0;
+    for(uint8_t i=0; i<CLUSTER_MAX_NODES; i++)
+    {
+        if( (!nodes[i].used) || (!nodes[i].alive) ) continue;
+        fill_digest(&msg,i,entries++);
+        if( (NODE_LOCAL != i) && (INVALID_FD != nodes[i].out_fd) )
+            targets[target_count++] = i;
+    }
+
+    // Partial shuffle, the first CLUSTER_GOSSIP_FANOUT targets get this round.
+    for(int k=0; (k<CLUSTER_GOSSIP_FANOUT) && (k<target_count); k++)
+    {
+        int j = k + rand()%(target_count-k);
+        uint8_t tmp = targets[k];
+        targets[k] = targets[j];
+        targets[j] = tmp;
+        cluster_send(targets[k],&msg);
+    }
+}
+
+static void gossip_tick(void* arg)
+{
+    (void)arg;
+    uint64_t now = srv_now_ms();
+    nodes[NODE_LOCAL].heartbeat++;
+
+    for(uint8_t i=1; i<CLUSTER_MAX_NODES; i++)
+    {
+        cluster_node_t* node = &nodes[i];
+        if(!node->used) continue;
+        if( (node->alive) && (now - node->updated_ms > CLUSTER_NODE_TIMEOUT_MS) )
+        {
+            node_down(i);
+        }
+        else if( (!node->alive) && (!node->seed) && (now - node->updated_ms > CLUSTER_NODE_FORGET_MS) && (!node_has_links(i)) )
+        {
+            LOGI("cluster : forgetting node %s.",node->addr);
+            node->used = false;
+            continue;
+        }
+        if( ((node->alive) || (node->seed)) && (INVALID_FD == node->out_fd) && (now >= node->next_dial_ms) )
+            dial_node(i);
+    }
+    send_gossip();
+    srv_timer_arm(&gossip_timer,CLUSTER_GOSSIP_INTERVAL_MS);
+}
+
+int cluster_init(const char* self_addr, const char seeds[][CLUSTER_ADDR_LEN], int seed_count)
+{
+    struct sockaddr_in sa;
+    if(!parse_addr(self_addr,&sa))
+    {
+        LOGE("cluster : invalid node address %s.",self_addr);
+        return -1;
+    }
+
+    memset(nodes,0,sizeof(nodes));
+    nodes[NODE_LOCAL].used = true;
+    nodes[NODE_LOCAL].alive = true;
+    strncpy(nodes[NODE_LOCAL].addr,self_addr,CLUSTER_ADDR_LEN-1);
+    nodes[NODE_LOCAL].out_fd = INVALID_FD;
+    nodes[NODE_LOCAL].in_fd = INVALID_FD;
+    // Wall clock start, so a restarted node outruns what the others remember of it.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    nodes[NODE_LOCAL].heartbeat = (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+    srand((unsigned)(ts.tv_nsec ^ getpid()));
+
+    for(int i=0; i<seed_count; i++)
+    {
+        if(!parse_addr(seeds[i],&sa))
+        {
+            LOGE("cluster : invalid seed address %s.",seeds[i]);
+            return -1;
+        }
+        if(0==strcmp(seeds[i],self_addr)) continue;
+        uint8_t idx = node_add(seeds[i]);
+        if(NODE_NONE != idx)
+            nodes[idx].seed = true;
+    }
+
+    link_count = 0;
+    ring_rebuild();
+    enabled = true;
+    srv_timer_init(&gossip_timer,gossip_tick,NULL);
+    srv_timer_arm(&gossip_timer,CLUSTER_GOSSIP_INTERVAL_MS);
+    LOGI("cluster : node %s, %d seeds.",self_addr,seed_count);
+    return 0;
+}
+
+void cluster_fini(void)
+{
+    if(!enabled) return;
+    srv_timer_cancel(&gossip_timer);
+    while(directory)
+    {
+        dir_entry_t* next = directory->next;
+        free(directory);
+        directory = next;
+    }
+    link_count = 0;
+    enabled = false;
+}
+
+bool cluster_enabled(void)
+{
+    return enabled;
+}
+
+const char* cluster_node_addr(uint8_t node)
+{
+    if( (node >= CLUSTER_MAX_NODES) || (!nodes[node].used) ) return UNDEF_NAME;
+    return nodes[node].addr;
+}
+
+uint8_t cluster_node_of_fd(int fd)
+{
+    for(int i=0; (enabled) && (i<link_count); i++)
+    {
+        if(fd == links[i].fd) return links[i].node;
+    }
+    return NODE_NONE;
+}
+
+bool cluster_accept_link(int fd, const msg_t* hello)
+{
+    node_digest_t digest;
+    memcpy(&digest,hello->msg_data.buffer,sizeof(digest));
+    uint8_t idx = digest_node(&digest);
+    if( (NODE_NONE==idx) || (NODE_LOCAL==idx) || (!link_add(fd,idx,false)) )
+    {
+        LOGE("fd : %d, rejecting node link.",fd);
+        return false;
+    }
+
+    cluster_node_t* node = &nodes[idx];
+    if(INVALID_FD != node->in_fd)
+    {
+        LOGI("cluster : node %s reconnected, closing old link fd : %d.",node->addr,node->in_fd);
+        srv_io_close_fd(node->in_fd);
+    }
+    node->in_fd = fd;
+    LOGI("cluster : link from node %s, fd : %d.",node->addr,fd);
+    node_heard(idx,digest.heartbeat);
+    // Answer right away instead of at the next gossip round.
+    if(INVALID_FD == node->out_fd)
+        dial_node(idx);
+    return true;
+}
+
+bool cluster_link_closed(int fd)
+{
+    for(int i=0; i<link_count; i++)
+    {
+        if(fd != links[i].fd) continue;
+        cluster_node_t* node = &nodes[links[i].node];
+        if(fd == node->out_fd)
+            node->out_fd = INVALID_FD;
+        if(fd == node->in_fd)
+            node->in_fd = INVALID_FD;
+        LOGI("cluster : link fd : %d to node %s closed.",fd,node->addr);
+        links[i] = links[--link_count];
+        return true;
+    }
+    return false;
+}
+
+bool cluster_send(uint8_t node, const msg_t* msg)
+{
+    if( (node >= CLUSTER_MAX_NODES) || (NODE_LOCAL==node) || (INVALID_FD==nodes[node].out_fd) )
+        return false;
+    if(msg->msg_type >= (msg_type_t)NODE_MSG_HELLO)
+        return IO_SUCC == srv_io_send(nodes[node].out_fd,msg,sizeof(*msg),IO_PRIO_CONTROL,IO_STREAM_NONE);
+    // Relayed frames carry the receiver's fd and channel. Chats that hash to one stream just keep their mutual order.
+    uint8_t stream = 1 + ((unsigned)msg->req_id * MAX_CHANNELS + msg->channel_id) % UINT8_MAX;
+    return IO_SUCC == srv_io_send(nodes[node].out_fd,msg,sizeof(*msg),msg_tx_prio(msg->msg_type),stream);
+}
+
+int cluster_link_fd(uint8_t node)
+{
+    if( (node >= CLUSTER_MAX_NODES) || (NODE_LOCAL==node) ) return INVALID_FD;
+    return nodes[node].out_fd;
+}
+
+cluster_claim_t cluster_claim_name(const char* name, int fd, uint16_t req_id)
+{
+    uint8_t owner = name_owner(name);
+    if(NODE_LOCAL == owner)
+        return dir_claim(name,NODE_LOCAL) ? CLAIM_GRANTED : CLAIM_DENIED;
+
+    node_name_claim_t claim = {0};
+    strncpy(claim.name,name,MAX_CLIENT_NAME_LEN-1);
+    claim.fd = fd;
+    claim.req_id = req_id;
+    msg_t msg = {0};
+    msg.msg_type = (msg_type_t)NODE_MSG_NAME_CLAIM;
+    memcpy(msg.msg_data.buffer,&claim,sizeof(claim));
+    if(!cluster_send(owner,&msg))
+    {
+        LOGE("cluster : owner %s of name %s unreachable.",nodes[owner].addr,name);
+        return CLAIM_DENIED;
+    }
+    return CLAIM_PENDING;
+}
+
+void cluster_release_name(const char* name)
+{
+    uint8_t owner = name_owner(name);
+    if(NODE_LOCAL == owner)
+    {
+        dir_drop(name,NODE_LOCAL,false);
+        return;
+    }
+    node_name_claim_t claim = {0};
+    strncpy(claim.name,name,MAX_CLIENT_NAME_LEN-1);
+    msg_t msg = {0};
+    msg.msg_type = (msg_type_t)NODE_MSG_NAME_RELEASE;
+    memcpy(msg.msg_data.buffer,&claim,sizeof(claim));
+    cluster_send(owner,&msg);
+}
+
+void cluster_connect_result(node_connect_t* res)
+{
+    uint8_t origin = node_find(res->from_node);
+    if(NODE_LOCAL == origin)
+    {
+        handle_node_connect_result(NODE_LOCAL,res);
+        return;
+    }
+    msg_t msg = {0};
+    msg.msg_type = (msg_type_t)NODE_MSG_CONNECT_RESULT;
+    memcpy(msg.msg_data.buffer,res,sizeof(*res));
+    if( (NODE_NONE == origin) || (!cluster_send(origin,&msg)) )
+        LOGE("cluster : cannot return connect result to %s.",res->from_node);
+}
+
+/* Called where the name is not connected locally: the origin, or its owner. */
+void cluster_route_connect(node_connect_t* req)
+{
+    uint8_t target = name_owner(req->to_name);
+    if(NODE_LOCAL == target)
+    {
+        dir_entry_t* entry = dir_find(req->to_name);
+        target = entry ? entry->node : NODE_LOCAL;
+    }
+
+    msg_t msg = {0};
+    msg.msg_type = (msg_type_t)NODE_MSG_CONNECT_REQ;
+    if( (NODE_LOCAL != target) && (req->hops < CLUSTER_MAX_HOPS) )
+    {
+        req->hops++;
+        memcpy(msg.msg_data.buffer,req,sizeof(*req));
+        if(cluster_send(target,&msg)) return;
+    }
+    LOGI("cluster : no route for name %s.",req->to_name);
+    req->result = MSG_CLIENT_NOT_EXIST;
+    cluster_connect_result(req);
+}
+
+static void handle_gossip(const msg_t* msg)
+{
+    for(size_t i=0; i<GOSSIP_MAX_ENTRIES; i++)
+    {
+        node_digest_t digest;
+        memcpy(&digest,msg->msg_data.buffer + i*sizeof(digest),sizeof(digest));
+        if('\0' == digest.addr[0]) break;
+        uint8_t idx = digest_node(&digest);
+        if(NODE_NONE != idx)
+            node_heard(idx,digest.heartbeat);
+    }
+}
+
+bool cluster_handle_frame(int fd, msg_t* msg)
+{
+    int i = 0;
+    while( (i<link_count) && (fd != links[i].fd) )
+        i++;
+    if(i == link_count) return false;
+    // The dialed side only ever gets the client greeting of the accepting server.
+    if(links[i].outgoing) return true;
+
+    uint8_t node = links[i].node;
+    node_name_claim_t claim;
+    node_connect_t req;
+    switch((int)msg->msg_type)
+    {
+        case NODE_MSG_HELLO:
+            break;
+
+        case NODE_MSG_GOSSIP:
+            handle_gossip(msg);
+            break;
+
+        case NODE_MSG_NAME_CLAIM:
+            memcpy(&claim,msg->msg_data.buffer,sizeof(claim));
+            claim.name[MAX_CLIENT_NAME_LEN-1] = '\0';
+            claim.granted = dir_claim(claim.name,node);
+            msg->msg_type = (msg_type_t)NODE_MSG_NAME_RESULT;
+            memcpy(msg->msg_data.buffer,&claim,sizeof(claim));
+            cluster_send(node,msg);
+            break;
+
+        case NODE_MSG_NAME_RESULT:
+            memcpy(&claim,msg->msg_data.buffer,sizeof(claim));
+            claim.name[MAX_CLIENT_NAME_LEN-1] = '\0';
+            handle_name_claim_result(&claim);
+            break;
+
+        case NODE_MSG_NAME_RELEASE:
+            memcpy(&claim,msg->msg_data.buffer,sizeof(claim));
+            claim.name[MAX_CLIENT_NAME_LEN-1] = '\0';
+            dir_drop(claim.name,node,false);
+            break;
+
+        case NODE_MSG_CONNECT_REQ:
+        case NODE_MSG_CONNECT_RESULT:
+            memcpy(&req,msg->msg_data.buffer,sizeof(req));
+            req.from_node[CLUSTER_ADDR_LEN-1] = '\0';
+            req.from_name[MAX_CLIENT_NAME_LEN-1] = '\0';
+            req.to_name[MAX_CLIENT_NAME_LEN-1] = '\0';
+            if(NODE_MSG_CONNECT_RESULT == (int)msg->msg_type)
+            {
+                handle_node_connect_result(node,&req);
+                break;
+            }
+            uint8_t origin = node_find(req.from_node);
+            if( (NODE_NONE == origin) || (NODE_LOCAL == origin) )
+            {
+                LOGE("cluster : connect request from unknown node %s.",req.from_node);
+                break;
+            }
+            if(!handle_node_connect_req(origin,&req))
+                cluster_route_connect(&req);
+            break;
+
+        default:
+            if( ((int)msg->msg_type < 0) || (msg->msg_type >= MSG_TYPE_MAX) )
+            {
+                LOGE("cluster : unknown frame type %d from node %s.",(int)msg->msg_type,nodes[node].addr);
+                break;
+            }
+            return handle_node_relay(node,fd,msg);
+    }
+    return true;
+}
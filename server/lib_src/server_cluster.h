@@ -0,0 +1,104 @@
+#ifndef SERVER_CLUSTER_H
+#define SERVER_CLUSTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chat_app_common.h"
+
+#define CLUSTER_MAX_NODES            16
+#define CLUSTER_ADDR_LEN             24
+#define CLUSTER_DEFAULT_IP           "127.0.0.1"
+#define CLUSTER_VNODES               32
+#define CLUSTER_GOSSIP_INTERVAL_MS   500
+#define CLUSTER_GOSSIP_FANOUT        2
+#define CLUSTER_NODE_TIMEOUT_MS      3000
+#define CLUSTER_NODE_FORGET_MS       30000
+#define CLUSTER_REDIAL_MS            1000
+#define CLUSTER_ROUTE_TIMEOUT_MS     5000
+#define CLUSTER_MAX_HOPS             3
+
+/* Node index of this server, a channel with this peer_node talks to a local client. */
+#define NODE_LOCAL                   0
+#define NODE_NONE                    0xff
+
+/*
+ * Frames only exchanged between servers, numbered above every msg_type_t.
+ * Any other type on a node link is a relayed client frame: req_id carries
+ * the receiving client's fd and channel_id its channel.
+ */
+typedef enum{
+    NODE_MSG_HELLO=0x100,
+    NODE_MSG_GOSSIP,
+    NODE_MSG_NAME_CLAIM,
+    NODE_MSG_NAME_RESULT,
+    NODE_MSG_NAME_RELEASE,
+    NODE_MSG_CONNECT_REQ,
+    NODE_MSG_CONNECT_RESULT,
+    NODE_MSG_MAX
+}node_msg_type_t;
+
+/* Gossip entry, a node is identified by the address its clients connect to. */
+typedef struct
+{
+    char addr[CLUSTER_ADDR_LEN];
+    uint64_t heartbeat;
+}node_digest_t;
+
+#define GOSSIP_MAX_ENTRIES  (MAX_MSG_LEN/sizeof(node_digest_t))
+
+typedef struct
+{
+    char name[MAX_CLIENT_NAME_LEN];
+    int32_t fd;
+    uint16_t req_id;
+    uint8_t granted;
+}node_name_claim_t;
+
+/*
+ * Connect request travelling origin -> name owner -> node holding the name,
+ * the result goes straight back to from_node.
+ */
+typedef struct
+{
+    char from_node[CLUSTER_ADDR_LEN];
+    char from_name[MAX_CLIENT_NAME_LEN];
+    char to_name[MAX_CLIENT_NAME_LEN];
+    int32_t from_fd;
+    int32_t to_fd;
+    int32_t result;
+    uint16_t req_id;
+    uint8_t from_ch;
+    uint8_t to_ch;
+    uint8_t hops;
+}node_connect_t;
+
+typedef enum{
+    CLAIM_GRANTED=0,
+    CLAIM_DENIED,
+    CLAIM_PENDING
+}cluster_claim_t;
+
+int cluster_init(const char* self_addr, const char seeds[][CLUSTER_ADDR_LEN], int seed_count);
+void cluster_fini(void);
+bool cluster_enabled(void);
+const char* cluster_node_addr(uint8_t node);
+
+/* Node a link fd belongs to, NODE_NONE for client connections. */
+uint8_t cluster_node_of_fd(int fd);
+/* The first frame of an accepted connection was NODE_MSG_HELLO. */
+bool cluster_accept_link(int fd, const msg_t* hello);
+/* Frame read from a link, false closes it. */
+bool cluster_handle_frame(int fd, msg_t* msg);
+/* True when fd was a link, the client layer then has nothing to clean up. */
+bool cluster_link_closed(int fd);
+
+/* Frames for a node go out on the link this server dialed. */
+bool cluster_send(uint8_t node, const msg_t* msg);
+int cluster_link_fd(uint8_t node);
+
+cluster_claim_t cluster_claim_name(const char* name, int fd, uint16_t req_id);
+void cluster_release_name(const char* name);
+void cluster_route_connect(node_connect_t* req);
+void cluster_connect_result(node_connect_t* res);
+
+#endif
@@ -0,0 +1,41 @@
+#include <string.h>
+#include <zlib.h>
+#include "server_compress.h"
+#include "chat_compress_dict.h"
+#include "logger.h"
+
+int srv_inflate_text(const msg_t* msg, char* out, size_t out_len)
+{
+    compressed_hdr_t hdr;
+    memcpy(&hdr, msg->msg_data.buffer, sizeof(hdr));
+    if( (CODEC_DEFLATE_DICT != hdr.codec) || (hdr.comp_len > COMPRESSED_DATA_MAX_LEN) || (hdr.raw_len > out_len) )
+    {
+        LOGE("Invalid compressed frame, codec : %u, comp_len : %u, raw_len : %u.",hdr.codec,hdr.comp_len,hdr.raw_len);
+        return -1;
+    }
+
+    z_stream zs;
+    memset(&zs,0,sizeof(zs));
+    if(Z_OK != inflateInit(&zs))
+        return -1;
+    zs.next_in = (Bytef*)(msg->msg_data.buffer + sizeof(hdr));
+    zs.avail_in = hdr.comp_len;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = hdr.raw_len;
+
+    int ret = inflate(&zs, Z_FINISH);
+    if(Z_NEED_DICT == ret)
+    {
+        inflateSetDictionary(&zs, (const Bytef*)chat_compress_dict, sizeof(chat_compress_dict)-1);
+        ret = inflate(&zs, Z_FINISH);
+    }
+    size_t produced = zs.total_out;
+    inflateEnd(&zs);
+
+    if( (Z_STREAM_END != ret) || (produced != hdr.raw_len) )
+    {
+        LOGE("Inflate failed, ret : %d.",ret);
+        return -1;
+    }
+    return (int)produced;
+}
@@ -0,0 +1,14 @@
+#ifndef SERVER_COMPRESS_H
+#define SERVER_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chat_app_common.h"
+
+/* Codecs offered in MSG_CONN_ESTABLISH_REQ. */
+#define SRV_SUPPORTED_CODECS  CODEC_DEFLATE_DICT
+
+/* Inflate a MSG_CLIENT_TX_COMPRESSED payload into out, returns raw length or -1. */
+int srv_inflate_text(const msg_t* msg, char* out, size_t out_len);
+
+#endif
@@ -0,0 +1,547 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "server_config.h"
+#include "server_mgmt.h"
+#include "logger.h"
+
+typedef enum{
+    KEY_BACKEND=0,
+    KEY_PORT,
+    KEY_UNIX_PATH,
+    KEY_U32,
+    KEY_LOG_LEVEL,
+    KEY_RATE
+}config_kind_t;
+
+/* KEY_U32 and KEY_RATE values live at offset in srv_config_t. */
+typedef struct
+{
+    const char* name;
+    config_kind_t kind;
+    bool reloadable;
+    size_t offset;
+    uint32_t min;
+    uint32_t max;
+}config_key_t;
+
+#define TUNING_AT(field)   offsetof(srv_config_t,tuning.field)
+
+static const config_key_t configKeys[] = {
+    { "backend",               KEY_BACKEND,   false, 0, 0, 0 },
+    { "port",                  KEY_PORT,      false, 0, 1, UINT16_MAX },
+    { "unix_path",             KEY_UNIX_PATH, false, 0, 0, 0 },
+    { "workers",               KEY_U32,       false, offsetof(srv_config_t,workers), 0, WORKPOOL_MAX_THREADS },
+    { "max_clients",           KEY_U32,       true,  TUNING_AT(max_clients), 1, IO_MAX_FDS },
+    { "log_level",             KEY_LOG_LEVEL, true,  0, 0, 0 },
+    { "handshake_timeout_ms",  KEY_U32,       true,  TUNING_AT(handshake_timeout_ms), 100, 600000 },
+    { "heartbeat_interval_ms", KEY_U32,       true,  TUNING_AT(heartbeat_interval_ms), 1000, 3600000 },
+    { "idle_timeout_ms",       KEY_U32,       true,  TUNING_AT(idle_timeout_ms), 1000, 7*24*3600*1000 },
+    { "conn_req_timeout_ms",   KEY_U32,       true,  TUNING_AT(conn_req_timeout_ms), 1000, 3600000 },
+    { "accept_batch",          KEY_U32,       true,  TUNING_AT(accept_batch), 1, 4096 },
+    { "read_budget_kb",        KEY_U32,       true,  TUNING_AT(read_budget_kb), IO_READ_CHUNK/1024, 16*1024 },
+    { "rate.list",             KEY_RATE,      true,  TUNING_AT(rate.limits[RATE_CLASS_LIST]), 0, 0 },
+    { "rate.connect",          KEY_RATE,      true,  TUNING_AT(rate.limits[RATE_CLASS_CONNECT]), 0, 0 },
+    { "rate.name",             KEY_RATE,      true,  TUNING_AT(rate.limits[RATE_CLASS_NAME]), 0, 0 },
+    { "rate.chat",             KEY_RATE,      true,  TUNING_AT(rate.limits[RATE_CLASS_CHAT]), 0, 0 },
+    { "rate.other",            KEY_RATE,      true,  TUNING_AT(rate.limits[RATE_CLASS_OTHER]), 0, 0 },
+    { "rate.strikes",          KEY_U32,       true,  TUNING_AT(rate.max_strikes), 0, UINT32_MAX },
+    { "overload.lag",          KEY_U32,       true,  TUNING_AT(overload.lag_ms), 0, 60000 },
+    { "overload.queue",        KEY_U32,       true,  TUNING_AT(overload.queue_mb), 0, UINT32_MAX },
+    { "overload.mem",          KEY_U32,       true,  TUNING_AT(overload.mem_mb), 0, UINT32_MAX },
+};
+#define CONFIG_KEY_COUNT   (sizeof(configKeys)/sizeof(configKeys[0]))
+
+static const char *logLevelStr[] = {
+    "none",
+    "error",
+    "info",
+    "debug"
+};
+
+int srv_log_level = LOG_LEVEL;
+
+static srv_tuning_t tuning;
+static srv_config_t effective;
+static volatile sig_atomic_t reload_requested = 0;
+static int reload_fd = INVALID_FD;
+static int admin_fd = INVALID_FD;
+static char admin_path[UNIX_PATH_LEN];
+static uint64_t next_poll_ms = 0;
+
+void config_tuning_defaults(srv_tuning_t* t)
+{
+    memset(t,0,sizeof(*t));
+    t->max_clients = MAX_CLIENT;
+    t->log_level = LOG_LEVEL;
+    t->handshake_timeout_ms = HANDSHAKE_TIMEOUT_MS;
+    t->heartbeat_interval_ms = HEARTBEAT_INTERVAL_MS;
+    t->idle_timeout_ms = IDLE_EVICT_TIMEOUT_MS;
+    t->conn_req_timeout_ms = CONN_REQ_TIMEOUT_MS;
+    t->accept_batch = ACCEPT_BATCH_MAX;
+    t->read_budget_kb = IO_READ_BUDGET/1024;
+    rate_config_defaults(&t->rate);
+    overload_config_defaults(&t->overload);
+}
+
+const srv_tuning_t* config_tuning(void)
+{
+    return &tuning;
+}
+
+static const config_key_t* find_key(const char* name)
+{
+    for(size_t i=0; i<CONFIG_KEY_COUNT; i++)
+    {
+        if(0 == strcmp(configKeys[i].name,name))
+            return &configKeys[i];
+    }
+    return NULL;
+}
+
+static char* trim(char* str)
+{
+    while(isspace((unsigned char)*str)) str++;
+    char* end = str + strlen(str);
+    while( (end > str) && (isspace((unsigned char)end[-1])) ) end--;
+    *end = '\0';
+    return str;
+}
+
+static bool parse_u32(const char* str, uint32_t min, uint32_t max, uint32_t* out)
+{
+    if(!isdigit((unsigned char)*str)) return false;
+    char* end = NULL;
+    errno = 0;
+    unsigned long val = strtoul(str,&end,10);
+    if( (errno) || ('\0' != *end) || (val < min) || (val > max) ) return false;
+    *out = (uint32_t)val;
+    return true;
+}
+
+/* NULL when value is fine, otherwise what is wrong with it. */
+static const char* parse_value(const config_key_t* key, const char* value, srv_config_t* cfg)
+{
+    uint8_t* base = (uint8_t*)cfg;
+    uint32_t val = 0;
+    switch(key->kind)
+    {
+        case KEY_BACKEND:
+            cfg->io_backend = io_backend_from_str(value);
+            return (IO_BACKEND_MAX == cfg->io_backend) ? "expected epoll or uring" : NULL;
+        case KEY_PORT:
+            if(!parse_u32(value,key->min,key->max,&val)) return "expected a port number";
+            cfg->port = (uint16_t)val;
+            return NULL;
+        case KEY_UNIX_PATH:
+            if(strlen(value) >= sizeof(cfg->unix_path)) return "path too long";
+            strcpy(cfg->unix_path,value);
+            return NULL;
+        case KEY_U32:
+        {
+            static char range[CONFIG_LINE_LEN];
+            snprintf(range,sizeof(range),"expected %u to %u",key->min,key->max);
+            if(!parse_u32(value,key->min,key->max,&val)) return range;
+            memcpy(base+key->offset,&val,sizeof(val));
+            return NULL;
+        }
+        case KEY_LOG_LEVEL:
+            for(uint32_t i=0; i<sizeof(logLevelStr)/sizeof(logLevelStr[0]); i++)
+            {
+                if(0 != strcmp(value,logLevelStr[i])) continue;
+                cfg->tuning.log_level = i;
+                return NULL;
+            }
+            return "expected none, error, info or debug";
+        case KEY_RATE:
+        {
+            // Same spelling as -r, the class name follows the "rate." prefix.
+            char spec[CONFIG_LINE_LEN];
+            snprintf(spec,sizeof(spec),"%s=%s",key->name+strlen("rate."),value);
+            return rate_config_parse(&cfg->tuning.rate,spec) ? NULL : "expected per_sec[/burst]";
+        }
+    }
+    return "unsupported key";
+}
+
+static void format_value(const config_key_t* key, const srv_config_t* cfg, char* buf, size_t len)
+{
+    const uint8_t* base = (const uint8_t*)cfg;
+    uint32_t val = 0;
+    rate_limit_t limit;
+    switch(key->kind)
+    {
+        case KEY_BACKEND:
+            snprintf(buf,len,"%s",io_backend_to_str(cfg->io_backend));
+            break;
+        case KEY_PORT:
+            snprintf(buf,len,"%u",cfg->port);
+            break;
+        case KEY_UNIX_PATH:
+            snprintf(buf,len,"%s",cfg->unix_path);
+            break;
+        case KEY_U32:
+            memcpy(&val,base+key->offset,sizeof(val));
+            snprintf(buf,len,"%u",val);
+            break;
+        case KEY_LOG_LEVEL:
+            val = cfg->tuning.log_level;
+            snprintf(buf,len,"%s",(val < sizeof(logLevelStr)/sizeof(logLevelStr[0])) ? logLevelStr[val] : "none");
+            break;
+        case KEY_RATE:
+            memcpy(&limit,base+key->offset,sizeof(limit));
+            snprintf(buf,len,"%u/%u",limit.per_sec,limit.burst);
+            break;
+    }
+}
+
+bool config_file_load(const char* path, srv_config_t* cfg, bool* unix_path_set)
+{
+    FILE* fp = fopen(path,"r");
+    if(!fp)
+    {
+        LOGE("Cannot open %s, errno : %d.",path,errno);
+        return false;
+    }
+    srv_config_t next = *cfg;
+    bool path_seen = false;
+    int errors = 0;
+    int line_no = 0;
+    char line[CONFIG_LINE_LEN];
+    while(fgets(line,sizeof(line),fp))
+    {
+        line_no++;
+        size_t len = strlen(line);
+        if( (len == sizeof(line)-1) && ('\n' != line[len-1]) && (!feof(fp)) )
+        {
+            LOGE("%s:%d: line longer than %d characters.",path,line_no,CONFIG_LINE_LEN-2);
+            errors++;
+            int c;
+            while( ((c = fgetc(fp)) != EOF) && ('\n' != c) );
+            continue;
+        }
+        char* comment = strchr(line,'#');
+        if(comment) *comment = '\0';
+        char* entry = trim(line);
+        if('\0' == *entry) continue;
+
+        char* eq = strchr(entry,'=');
+        if(!eq)
+        {
+            LOGE("%s:%d: expected key = value.",path,line_no);
+            errors++;
+            continue;
+        }
+        *eq = '\0';
+        char* name = trim(entry);
+        char* value = trim(eq+1);
+        const config_key_t* key = find_key(name);
+        if(!key)
+        {
+            LOGE("%s:%d: unknown key %s.",path,line_no,name);
+            errors++;
+            continue;
+        }
+        const char* err = parse_value(key,value,&next);
+        if(err)
+        {
+            LOGE("%s:%d: %s = %s, %s.",path,line_no,name,value,err);
+            errors++;
+            continue;
+        }
+        if(KEY_UNIX_PATH == key->kind)
+            path_seen = true;
+    }
+    fclose(fp);
+    if(errors)
+    {
+        LOGE("%s : %d error(s), configuration left as it was.",path,errors);
+        return false;
+    }
+
+    // Kept absolute, a reload must find the same file.
+    char full[PATH_MAX];
+    snprintf(next.config_path,sizeof(next.config_path),"%s",realpath(path,full) ? full : path);
+    *cfg = next;
+    if(path_seen)
+        *unix_path_set = true;
+    return true;
+}
+
+static void apply_tuning(const srv_tuning_t* t)
+{
+    tuning = *t;
+    srv_log_level = (int)t->log_level;
+}
+
+void config_init(const srv_config_t* cfg)
+{
+    effective = *cfg;
+    apply_tuning(&cfg->tuning);
+}
+
+/*
+ * The file is read on top of the running configuration, so a key left out
+ * keeps its value. Nothing changes unless the whole file is valid.
+ */
+static bool config_reload(void)
+{
+    if('\0' == effective.config_path[0])
+    {
+        LOGE("Reload requested, but the server was started without a configuration file.");
+        return false;
+    }
+    srv_config_t next = effective;
+    bool unix_path_set = false;
+    if(!config_file_load(effective.config_path,&next,&unix_path_set))
+    {
+        LOGE("Reload of %s failed, the running configuration is kept.",effective.config_path);
+        return false;
+    }
+
+    int changes = 0;
+    for(size_t i=0; i<CONFIG_KEY_COUNT; i++)
+    {
+        char before[CONFIG_LINE_LEN], after[CONFIG_LINE_LEN];
+        format_value(&configKeys[i],&effective,before,sizeof(before));
+        format_value(&configKeys[i],&next,after,sizeof(after));
+        if(0 == strcmp(before,after)) continue;
+        if(!configKeys[i].reloadable)
+        {
+            LOGI("%s : %s -> %s needs a restart, %s stays in effect.",configKeys[i].name,before,after,before);
+            continue;
+        }
+        LOGI("%s : %s -> %s.",configKeys[i].name,before,after);
+        changes++;
+    }
+    next.io_backend = effective.io_backend;
+    next.port = effective.port;
+    strcpy(next.unix_path,effective.unix_path);
+    next.workers = effective.workers;
+
+    effective = next;
+    apply_tuning(&next.tuning);
+    rate_init(&tuning.rate);
+    overload_set_config(&tuning.overload);
+    LOGI("Configuration reloaded from %s, %d change(s).",effective.config_path,changes);
+    return true;
+}
+
+static size_t config_dump(char* buf, size_t len)
+{
+    size_t used = 0;
+    if('\0' != effective.config_path[0])
+        used += snprintf(buf+used,len-used,"# configuration file : %s\n",effective.config_path);
+    else
+        used += snprintf(buf+used,len-used,"# no configuration file, defaults and command line\n");
+    for(size_t i=0; (i<CONFIG_KEY_COUNT) && (used < len); i++)
+    {
+        char value[CONFIG_LINE_LEN];
+        format_value(&configKeys[i],&effective,value,sizeof(value));
+        used += snprintf(buf+used,len-used,"%s = %s%s\n",configKeys[i].name,value,
+                         configKeys[i].reloadable ? "" : "    # needs a restart");
+    }
+    return (used < len) ? used : len-1;
+}
+
+static void config_signal_handler(int sig)
+{
+    (void)sig;
+    config_request_reload();
+}
+
+void config_request_reload(void)
+{
+    int saved_errno = errno;
+    reload_requested = 1;
+    if(INVALID_FD != reload_fd)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(reload_fd,&one,sizeof(one));
+        (void)ret;
+    }
+    errno = saved_errno;
+}
+
+/* Only wakes the loop, config_poll() does the reload. */
+static void config_reload_wake(void)
+{
+    uint64_t val;
+    while( (read(reload_fd,&val,sizeof(val)) < 0) && (EINTR == errno) );
+}
+
+static void set_timeouts(int fd, int timeout_ms)
+{
+    struct timeval tv = { timeout_ms/1000, (timeout_ms%1000)*1000 };
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+}
+
+static void send_text(int fd, const char* text, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t sent = send(fd,text,len,MSG_NOSIGNAL);
+        if(sent <= 0) return;
+        text += sent;
+        len -= sent;
+    }
+}
+
+int config_service_init(void)
+{
+    reload_fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if( (INVALID_FD == reload_fd) || (IO_SUCC != srv_io_add_doorbell(reload_fd,config_reload_wake)) )
+    {
+        LOGE("Reload eventfd setup failed, errno : %d.",errno);
+        config_fini();
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = config_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+
+    // A file left behind by an earlier server is replaced.
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(admin_path,sizeof(admin_path),SERVER_ADMIN_PATH_FMT,effective.port);
+    strcpy(addr.sun_path,admin_path);
+    unlink(admin_path);
+    admin_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if( (INVALID_FD == admin_fd) || (bind(admin_fd,(struct sockaddr*)&addr,sizeof(addr))) || (listen(admin_fd,4)) )
+    {
+        LOGE("Cannot listen on %s, errno : %d, admin queries disabled.",admin_path,errno);
+        if(INVALID_FD != admin_fd)
+            close(admin_fd);
+        admin_fd = INVALID_FD;
+        return 0;
+    }
+    next_poll_ms = srv_now_ms() + CONFIG_ADMIN_POLL_MS;
+    LOGI("Admin queries on %s, SIGHUP reloads %s.",admin_path,
+         ('\0' != effective.config_path[0]) ? effective.config_path : "nothing, no configuration file");
+    return 0;
+}
+
+/* One command line in, the answer out, then the connection is closed. */
+static void serve_admin(int fd)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if( (getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&cred_len)) || ((0 != cred.uid) && (geteuid() != cred.uid)) )
+    {
+        LOGE("Admin query from uid %u refused.",cred.uid);
+        return;
+    }
+    set_timeouts(fd,CONFIG_ADMIN_TIMEOUT_MS);
+
+    char cmd[CONFIG_ADMIN_CMD_LEN];
+    size_t got = 0;
+    while( (got < sizeof(cmd)-1) && (!memchr(cmd,'\n',got)) )
+    {
+        ssize_t bytes = recv(fd,cmd+got,sizeof(cmd)-1-got,0);
+        if(bytes <= 0) break;
+        got += bytes;
+    }
+    cmd[got] = '\0';
+    char* command = trim(cmd);
+
+    char reply[CONFIG_ADMIN_REPLY_LEN];
+    size_t used = 0;
+    if(0 == strcmp(command,"reload"))
+    {
+        bool ok = config_reload();
+        used = snprintf(reply,sizeof(reply),"%s\n",ok ? "# reloaded" : "# reload failed, see the server log");
+    }
+    else if(0 != strcmp(command,"config"))
+    {
+        used = snprintf(reply,sizeof(reply),"# unknown command %s, expected config or reload\n",command);
+        send_text(fd,reply,used);
+        return;
+    }
+    used += config_dump(reply+used,sizeof(reply)-used);
+    send_text(fd,reply,used);
+}
+
+void config_poll(void)
+{
+    if(reload_requested)
+    {
+        reload_requested = 0;
+        config_reload();
+    }
+    if(INVALID_FD == admin_fd) return;
+    uint64_t now = srv_now_ms();
+    if(now < next_poll_ms) return;
+    next_poll_ms = now + CONFIG_ADMIN_POLL_MS;
+
+    int fd = accept4(admin_fd,NULL,NULL,SOCK_CLOEXEC);
+    if(INVALID_FD == fd) return;
+    serve_admin(fd);
+    close(fd);
+}
+
+void config_fini(void)
+{
+    if(INVALID_FD != admin_fd)
+    {
+        close(admin_fd);
+        unlink(admin_path);
+        admin_fd = INVALID_FD;
+    }
+    if(INVALID_FD != reload_fd)
+        close(reload_fd);
+    reload_fd = INVALID_FD;
+}
+
+int config_admin_query(uint16_t port, const char* cmd)
+{
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path,sizeof(addr.sun_path),SERVER_ADMIN_PATH_FMT,port);
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if( (INVALID_FD == fd) || (connect(fd,(struct sockaddr*)&addr,sizeof(addr))) )
+    {
+        printf("No server answers on %s, errno : %d.\n",addr.sun_path,errno);
+        if(INVALID_FD != fd)
+            close(fd);
+        return -1;
+    }
+    // The server polls its admin socket, give it a few rounds to pick this up.
+    set_timeouts(fd,CONFIG_ADMIN_TIMEOUT_MS + 10*CONFIG_ADMIN_POLL_MS);
+    char line[CONFIG_ADMIN_CMD_LEN];
+    int len = snprintf(line,sizeof(line),"%s\n",cmd);
+    send_text(fd,line,(size_t)len);
+    shutdown(fd,SHUT_WR);
+
+    char buf[CONFIG_ADMIN_REPLY_LEN];
+    ssize_t bytes;
+    bool answered = false;
+    while( (bytes = recv(fd,buf,sizeof(buf),0)) > 0 )
+    {
+        fwrite(buf,1,bytes,stdout);
+        answered = true;
+    }
+    close(fd);
+    if(!answered)
+    {
+        printf("No answer from %s.\n",addr.sun_path);
+        return -1;
+    }
+    return 0;
+}
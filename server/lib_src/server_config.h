@@ -0,0 +1,72 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "server_ratelimit.h"
+#include "server_overload.h"
+
+/* The running server answers admin queries here, one path per port. */
+#define SERVER_ADMIN_PATH_FMT      "/tmp/chat_server.%u.admin"
+/* How often the loop looks for an admin query. */
+#define CONFIG_ADMIN_POLL_MS       100
+/* A query has this long to send its command and take the answer. */
+#define CONFIG_ADMIN_TIMEOUT_MS    200
+#define CONFIG_ADMIN_CMD_LEN       64
+#define CONFIG_ADMIN_REPLY_LEN     4096
+#define CONFIG_LINE_LEN            256
+#define CONFIG_PATH_LEN            4096
+
+/*
+ * Knobs that can change while the server runs. A new value applies the next
+ * time it is looked at: timers already armed keep their deadline, clients over
+ * a lowered max_clients stay connected.
+ */
+typedef struct
+{
+    uint32_t max_clients;
+    uint32_t log_level;
+    uint32_t handshake_timeout_ms;
+    /* A peer silent for DEAD_PEER_HEARTBEATS intervals is dropped. */
+    uint32_t heartbeat_interval_ms;
+    uint32_t idle_timeout_ms;
+    uint32_t conn_req_timeout_ms;
+    /* Connections taken per accept round, and bytes read per connection per wakeup (epoll). */
+    uint32_t accept_batch;
+    uint32_t read_budget_kb;
+    /* Per client token buckets, see rate_config_parse(). */
+    rate_config_t rate;
+    /* Load at which requests are shed and connections refused, see overload_config_parse(). */
+    overload_config_t overload;
+}srv_tuning_t;
+
+struct srv_config_t;
+
+void config_tuning_defaults(srv_tuning_t* tuning);
+/* The tuning in effect, read by the loop on every use. */
+const srv_tuning_t* config_tuning(void);
+
+/*
+ * Reads "key = value" lines from path into cfg, '#' starts a comment.
+ * Every error is logged with its line and nothing is changed unless the whole
+ * file is valid. unix_path_set reports whether the file named a UNIX socket.
+ */
+bool config_file_load(const char* path, struct srv_config_t* cfg, bool* unix_path_set);
+
+/*
+ * Takes cfg as the effective configuration, before anything reads the
+ * tuning. config_service_init() then installs the SIGHUP handler and opens
+ * the admin socket, config_poll() is called by the main loop outside of any
+ * I/O callback: it reloads the file after a SIGHUP and answers admin queries.
+ */
+void config_init(const struct srv_config_t* cfg);
+int config_service_init(void);
+void config_poll(void);
+/* Async-signal-safe. */
+void config_request_reload(void);
+void config_fini(void);
+
+/* Sends cmd ("config" or "reload") to the server on port and prints its answer. */
+int config_admin_query(uint16_t port, const char* cmd);
+
+#endif
@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server_handover.h"
+#include "server_mgmt.h"
+#include "server_io.h"
+#include "server_timer.h"
+#include "server_cluster.h"
+#include "logger.h"
+
+/*
+ * Hot upgrade. The running server listens on a UNIX socket; a new binary
+ * started with -t connects, the old one stops reading and waits until the
+ * kernel holds none of its requests, then passes every listening socket,
+ * client socket and shared-memory link with SCM_RIGHTS, each with the state
+ * that goes with it. Clients never notice: their sockets stay open, bytes
+ * that arrive meanwhile wait in the socket, and the new server picks up
+ * half-read frames and unsent replies where the old one left them. The old
+ * server only lets go once the new one acknowledged everything; until then
+ * a failure on either side leaves it running as before.
+ */
+
+static const char *handoverKindStr[] = {
+    "hello",
+    "busy",
+    "refused",
+    "listener",
+    "doorbell",
+    "clients",
+    "client",
+    "shm",
+    "end",
+    "ack"
+};
+
+static int listen_fd = INVALID_FD;
+static char listen_path[HANDOVER_PATH_LEN];
+static handover_listeners_t owned;
+static uint64_t next_poll_ms = 0;
+/* Closed last, the successor takes that as the sign we let go. */
+static int successor_fd = INVALID_FD;
+
+typedef struct
+{
+    int fd;
+    bool ok;
+}send_ctx_t;
+
+const char* handover_kind_to_str(handover_kind_t kind)
+{
+    if(kind >= HANDOVER_KIND_MAX) return "none";
+    return handoverKindStr[kind];
+}
+
+static void set_timeouts(int fd)
+{
+    struct timeval tv = { .tv_sec = HANDOVER_TIMEOUT_MS/1000, .tv_usec = (HANDOVER_TIMEOUT_MS%1000)*1000 };
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+}
+
+static int handover_path(uint16_t port, char* path, size_t len)
+{
+    return snprintf(path,len,SERVER_HANDOVER_PATH_FMT,port);
+}
+
+static bool send_all(int fd, const uint8_t* data, size_t len)
+{
+    while(len)
+    {
+        ssize_t sent = send(fd,data,len,MSG_NOSIGNAL);
+        if( (sent < 0) && (EINTR == errno) )
+            continue;
+        if(sent <= 0)
+            return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, uint8_t* data, size_t len)
+{
+    while(len)
+    {
+        ssize_t got = recv(fd,data,len,0);
+        if( (got < 0) && (EINTR == errno) )
+            continue;
+        if(got <= 0)
+            return false;
+        data += got;
+        len -= got;
+    }
+    return true;
+}
+
+/* The descriptors go with the header, the payload follows as plain bytes. */
+static bool send_rec(int fd, handover_kind_t kind, const void* payload, size_t len, const int* fds, int fd_count)
+{
+    handover_rec_t rec = { HANDOVER_MAGIC, HANDOVER_VERSION, (uint16_t)kind, (uint32_t)len, (uint32_t)fd_count };
+    union {
+        char buf[CMSG_SPACE(sizeof(int)*HANDOVER_MAX_FDS)];
+        struct cmsghdr align;
+    }ctrl;
+    memset(&ctrl,0,sizeof(ctrl));
+    struct iovec iov = { .iov_base = &rec, .iov_len = sizeof(rec) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if(fd_count)
+    {
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int)*fd_count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int)*fd_count);
+        memcpy(CMSG_DATA(cmsg),fds,sizeof(int)*fd_count);
+    }
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(fd,&mh,MSG_NOSIGNAL);
+    }while( (sent < 0) && (EINTR == errno) );
+    if(sent < 0)
+    {
+        LOGE("Sending handover %s failed, errno : %d.",handover_kind_to_str(kind),errno);
+        return false;
+    }
+    if( (!send_all(fd,(const uint8_t*)&rec+sent,sizeof(rec)-sent)) || (!send_all(fd,payload,len)) )
+    {
+        LOGE("Sending handover %s failed, errno : %d.",handover_kind_to_str(kind),errno);
+        return false;
+    }
+    return true;
+}
+
+/* The payload is malloc'ed and the caller's to free, fds gets HANDOVER_MAX_FDS slots. */
+static bool recv_rec(int fd, handover_rec_t* rec, uint8_t** payload, int* fds)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int)*HANDOVER_MAX_FDS)];
+        struct cmsghdr align;
+    }ctrl;
+    memset(&ctrl,0,sizeof(ctrl));
+    struct iovec iov = { .iov_base = rec, .iov_len = sizeof(*rec) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl.buf, .msg_controllen = sizeof(ctrl.buf) };
+    ssize_t got;
+    do
+    {
+        got = recvmsg(fd,&mh,MSG_CMSG_CLOEXEC);
+    }while( (got < 0) && (EINTR == errno) );
+    if(got <= 0)
+    {
+        LOGE("Handover peer went away, errno : %d.",got ? errno : 0);
+        return false;
+    }
+
+    int fd_count = 0;
+    for(struct cmsghdr* cmsg=CMSG_FIRSTHDR(&mh); cmsg; cmsg=CMSG_NXTHDR(&mh,cmsg))
+    {
+        if( (SOL_SOCKET != cmsg->cmsg_level) || (SCM_RIGHTS != cmsg->cmsg_type) ) continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i=0; i<n; i++)
+        {
+            int recv_fd;
+            memcpy(&recv_fd,CMSG_DATA(cmsg)+i*sizeof(int),sizeof(int));
+            if( (fds) && (fd_count < HANDOVER_MAX_FDS) )
+                fds[fd_count++] = recv_fd;
+            else
+                close(recv_fd);
+        }
+    }
+
+    *payload = NULL;
+    bool ok = recv_all(fd,(uint8_t*)rec+got,sizeof(*rec)-got);
+    if( (ok) && ( (HANDOVER_MAGIC != rec->magic) || (HANDOVER_VERSION != rec->version) || ((int)rec->fd_count != fd_count) ) )
+    {
+        LOGE("Malformed handover record, magic : %x, version : %u.",rec->magic,rec->version);
+        ok = false;
+    }
+    if( (ok) && (rec->payload_len) )
+    {
+        *payload = malloc(rec->payload_len);
+        ok = (*payload) && (recv_all(fd,*payload,rec->payload_len));
+    }
+    if(!ok)
+    {
+        free(*payload);
+        *payload = NULL;
+        for(int i=0; i<fd_count; i++)
+            close(fds[i]);
+    }
+    return ok;
+}
+
+/* Binds path, a file left behind by an earlier server is replaced. */
+static int bind_path(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(INVALID_FD==fd)
+        return INVALID_FD;
+    if( (bind(fd,(struct sockaddr*)&addr,sizeof(addr))) || (listen(fd,1)) )
+    {
+        close(fd);
+        return INVALID_FD;
+    }
+    return fd;
+}
+
+int handover_listen(uint16_t port, const handover_listeners_t* listeners)
+{
+    handover_path(port,listen_path,sizeof(listen_path));
+    listen_fd = bind_path(listen_path);
+    if(INVALID_FD==listen_fd)
+    {
+        LOGE("Cannot listen on %s, errno : %d, hot upgrade disabled.",listen_path,errno);
+        return INVALID_FD;
+    }
+    owned = *listeners;
+    next_poll_ms = srv_now_ms() + HANDOVER_POLL_MS;
+    LOGI("Successor may take over through %s.",listen_path);
+    return listen_fd;
+}
+
+void handover_close(void)
+{
+    if(INVALID_FD!=listen_fd)
+    {
+        close(listen_fd);
+        unlink(listen_path);
+        listen_fd = INVALID_FD;
+    }
+    if(INVALID_FD!=successor_fd)
+    {
+        close(successor_fd);
+        successor_fd = INVALID_FD;
+    }
+}
+
+static void send_client_cb(handover_client_t* client, void* arg)
+{
+    send_ctx_t* ctx = (send_ctx_t*)arg;
+    if(!ctx->ok) return;
+
+    int fd = client->fd;
+    const uint8_t* rx = NULL;
+    uint8_t* tx = NULL;
+    size_t rx_len = 0, tx_len = 0;
+    srv_io_err_t err = srv_io_export(fd,&rx,&rx_len,&tx,&tx_len);
+    if(IO_SUCC != err)
+    {
+        // Already on its way out, the successor never learns of it.
+        LOGE("fd : %d, not handed over, err : %s.",fd,ioErrToStr(err));
+        return;
+    }
+    client->rx_len = (uint32_t)rx_len;
+    client->tx_len = (uint32_t)tx_len;
+    size_t len = sizeof(*client) + rx_len + tx_len;
+    uint8_t* payload = malloc(len);
+    if(!payload)
+    {
+        LOGE("fd : %d, malloc failed for handover record.",fd);
+        free(tx);
+        ctx->ok = false;
+        return;
+    }
+    memcpy(payload,client,sizeof(*client));
+    // An idle connection has neither a receive buffer nor queued bytes.
+    if(rx_len > 0)
+        memcpy(payload+sizeof(*client),rx,rx_len);
+    if(tx_len > 0)
+        memcpy(payload+sizeof(*client)+rx_len,tx,tx_len);
+    free(tx);
+    ctx->ok = send_rec(ctx->fd,HANDOVER_CLIENT,payload,len,&fd,1);
+    free(payload);
+    if(!ctx->ok) return;
+
+    int shm_fds[HANDOVER_MAX_FDS];
+    handover_shm_t shm = { .fd = fd };
+    int fd_count = shm_export(fd,&shm.state,shm_fds);
+    if(!fd_count) return;
+    len = sizeof(shm) + shm.state.backlog*sizeof(msg_t);
+    payload = malloc(len);
+    if(!payload)
+    {
+        LOGE("fd : %d, malloc failed for handover record.",fd);
+        ctx->ok = false;
+        return;
+    }
+    memcpy(payload,&shm,sizeof(shm));
+    shm_export_backlog(fd,(msg_t*)(payload+sizeof(shm)));
+    ctx->ok = send_rec(ctx->fd,HANDOVER_SHM,payload,len,shm_fds,fd_count);
+    free(payload);
+}
+
+static bool send_state(int fd)
+{
+    handover_listener_t tcp = { .is_unix = 0 };
+    if(!send_rec(fd,HANDOVER_LISTENER,&tcp,sizeof(tcp),&owned.tcp_fd,1))
+        return false;
+    if(INVALID_FD != owned.unix_fd)
+    {
+        handover_listener_t local = { .is_unix = 1 };
+        strcpy(local.path,owned.unix_path);
+        if(!send_rec(fd,HANDOVER_LISTENER,&local,sizeof(local),&owned.unix_fd,1))
+            return false;
+    }
+    int doorbell = shm_doorbell_fd();
+    if( (INVALID_FD != doorbell) && (!send_rec(fd,HANDOVER_DOORBELL,NULL,0,&doorbell,1)) )
+        return false;
+    if(!send_rec(fd,HANDOVER_CLIENTS,NULL,0,NULL,0))
+        return false;
+
+    send_ctx_t ctx = { fd, true };
+    export_clients(send_client_cb,&ctx);
+    return (ctx.ok) && (send_rec(fd,HANDOVER_END,NULL,0,NULL,0));
+}
+
+/* True once the successor holds everything, fd is then kept open until we let go. */
+static bool serve(int fd)
+{
+    set_timeouts(fd);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if( (getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&cred_len)) || (cred.uid != getuid()) )
+    {
+        LOGE("Handover asked for by another user, ignored.");
+        return false;
+    }
+    handover_rec_t rec;
+    uint8_t* payload = NULL;
+    if(!recv_rec(fd,&rec,&payload,NULL))
+        return false;
+    free(payload);
+    // The ACK below may fail before recv_rec() sets it again.
+    payload = NULL;
+    if(HANDOVER_HELLO != rec.kind)
+    {
+        LOGE("Handover expected hello, got %s.",handover_kind_to_str(rec.kind));
+        return false;
+    }
+    if(cluster_enabled())
+    {
+        // Node links and routed requests are not carried over.
+        LOGE("Handover refused, cluster nodes cannot be upgraded in place.");
+        send_rec(fd,HANDOVER_REFUSED,NULL,0,NULL,0);
+        return false;
+    }
+
+    if( (workpool_pending()) || (mailbox_pending()) )
+    {
+        // Results of offloaded work have nowhere to go in the successor.
+        LOGI("Work in flight, successor has to retry.");
+        send_rec(fd,HANDOVER_BUSY,NULL,0,NULL,0);
+        return false;
+    }
+    LOGI("Successor pid %d asks to take over, quiescing.",(int)cred.pid);
+    srv_io_err_t err = srv_io_quiesce(HANDOVER_QUIESCE_MS);
+    if(IO_SUCC != err)
+    {
+        LOGI("Cannot quiesce yet, err : %s, successor has to retry.",ioErrToStr(err));
+        srv_io_resume();
+        send_rec(fd,HANDOVER_BUSY,NULL,0,NULL,0);
+        return false;
+    }
+    bool ok = send_state(fd) && recv_rec(fd,&rec,&payload,NULL);
+    free(payload);
+    if( (!ok) || (HANDOVER_ACK != rec.kind) )
+    {
+        LOGE("Handover failed, serving on.");
+        srv_io_resume();
+        return false;
+    }
+    return true;
+}
+
+bool handover_poll(void)
+{
+    if(INVALID_FD==listen_fd) return false;
+    uint64_t now = srv_now_ms();
+    if(now < next_poll_ms) return false;
+    next_poll_ms = now + HANDOVER_POLL_MS;
+
+    // Blocking from here on, the clients wait in their sockets meanwhile.
+    int fd = accept4(listen_fd,NULL,NULL,SOCK_CLOEXEC);
+    if(INVALID_FD==fd) return false;
+    if(!serve(fd))
+    {
+        close(fd);
+        return false;
+    }
+    successor_fd = fd;
+    LOGI("Successor took over every socket.");
+    return true;
+}
+
+int handover_connect(uint16_t port, handover_listeners_t* listeners)
+{
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    handover_path(port,addr.sun_path,sizeof(addr.sun_path));
+    listeners->tcp_fd = INVALID_FD;
+    listeners->unix_fd = INVALID_FD;
+    listeners->unix_path[0] = '\0';
+    listeners->doorbell_fd = INVALID_FD;
+
+    for(int attempt=0; attempt<HANDOVER_RETRIES; attempt++)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if( (INVALID_FD==fd) || (connect(fd,(struct sockaddr*)&addr,sizeof(addr))) )
+        {
+            LOGE("No server to take over at %s, errno : %d.",addr.sun_path,errno);
+            if(INVALID_FD!=fd)
+                close(fd);
+            return INVALID_FD;
+        }
+        set_timeouts(fd);
+        if(!send_rec(fd,HANDOVER_HELLO,NULL,0,NULL,0))
+        {
+            close(fd);
+            return INVALID_FD;
+        }
+
+        handover_rec_t rec;
+        uint8_t* payload = NULL;
+        int fds[HANDOVER_MAX_FDS];
+        bool ok;
+        while( (ok = recv_rec(fd,&rec,&payload,fds)) )
+        {
+            if( (HANDOVER_LISTENER == rec.kind) && (1 == rec.fd_count) && (sizeof(handover_listener_t) == rec.payload_len) )
+            {
+                handover_listener_t* l = (handover_listener_t*)payload;
+                if(l->is_unix)
+                {
+                    listeners->unix_fd = fds[0];
+                    snprintf(listeners->unix_path,sizeof(listeners->unix_path),"%s",l->path);
+                }
+                else
+                {
+                    listeners->tcp_fd = fds[0];
+                }
+            }
+            else if( (HANDOVER_DOORBELL == rec.kind) && (1 == rec.fd_count) )
+            {
+                listeners->doorbell_fd = fds[0];
+            }
+            else
+            {
+                for(uint32_t i=0; i<rec.fd_count; i++)
+                    close(fds[i]);
+                break;
+            }
+            free(payload);
+            payload = NULL;
+        }
+        free(payload);
+        if( (ok) && (HANDOVER_CLIENTS == rec.kind) && (INVALID_FD != listeners->tcp_fd) )
+        {
+            LOGI("Taking over from the server on port %u.",port);
+            return fd;
+        }
+        close(fd);
+        if( (ok) && (HANDOVER_BUSY == rec.kind) )
+        {
+            LOGI("Server busy, asking again in %d ms.",HANDOVER_RETRY_MS);
+            usleep(HANDOVER_RETRY_MS*1000);
+            continue;
+        }
+        LOGE("Handover %s.",(ok) && (HANDOVER_REFUSED == rec.kind) ? "refused" : "failed");
+        return INVALID_FD;
+    }
+    LOGE("Server stayed busy, giving up.");
+    return INVALID_FD;
+}
+
+static bool take_client(const uint8_t* payload, uint32_t len, int fd, int* fd_map)
+{
+    const handover_client_t* rec = (const handover_client_t*)payload;
+    if( (len < sizeof(*rec)) || (len != sizeof(*rec) + rec->rx_len + rec->tx_len) ||
+        (rec->rx_len > MAX_RECV_BUFFER_LEN) || (rec->fd < 0) || (rec->fd >= IO_MAX_FDS) )
+    {
+        LOGE("Malformed client record.");
+        close(fd);
+        return false;
+    }
+    const uint8_t* rx = payload + sizeof(*rec);
+    if(!adopt_client(fd,rec,rx,rx+rec->rx_len))
+    {
+        close(fd);
+        return true;
+    }
+    fd_map[rec->fd] = fd;
+    return true;
+}
+
+static bool take_shm(const uint8_t* payload, uint32_t len, const int* fds, int fd_count, const int* fd_map)
+{
+    const handover_shm_t* rec = (const handover_shm_t*)payload;
+    if( (len < sizeof(*rec)) || (len != sizeof(*rec) + rec->state.backlog*sizeof(msg_t)) ||
+        (rec->fd < 0) || (rec->fd >= IO_MAX_FDS) || (HANDOVER_MAX_FDS != fd_count) )
+    {
+        LOGE("Malformed shared memory record.");
+        for(int i=0; i<fd_count; i++)
+            close(fds[i]);
+        return false;
+    }
+    int fd = fd_map[rec->fd];
+    if( (INVALID_FD != fd) && (shm_adopt(fd,&rec->state,fds,(const msg_t*)(payload+sizeof(*rec)))) )
+        return true;
+    // Without its rings the client cannot be served, it reconnects.
+    LOGE("fd : %d, shared memory link not taken over.",fd);
+    close(fds[0]);
+    close(fds[1]);
+    if(INVALID_FD != fd)
+        srv_io_close_fd(fd);
+    return true;
+}
+
+bool handover_receive(int conn_fd)
+{
+    int* fd_map = malloc(sizeof(int)*IO_MAX_FDS);
+    if(!fd_map)
+    {
+        LOGE("malloc failed for handover fd map.");
+        close(conn_fd);
+        return false;
+    }
+    for(int i=0; i<IO_MAX_FDS; i++)
+        fd_map[i] = INVALID_FD;
+
+    int clients = 0;
+    bool ok;
+    handover_rec_t rec;
+    uint8_t* payload = NULL;
+    int fds[HANDOVER_MAX_FDS];
+    while( (ok = recv_rec(conn_fd,&rec,&payload,fds)) )
+    {
+        if( (HANDOVER_CLIENT == rec.kind) && (1 == rec.fd_count) )
+        {
+            ok = take_client(payload,rec.payload_len,fds[0],fd_map);
+            clients++;
+        }
+        else if(HANDOVER_SHM == rec.kind)
+        {
+            ok = take_shm(payload,rec.payload_len,fds,rec.fd_count,fd_map);
+        }
+        else
+        {
+            for(uint32_t i=0; i<rec.fd_count; i++)
+                close(fds[i]);
+            ok = (HANDOVER_END == rec.kind);
+            break;
+        }
+        free(payload);
+        payload = NULL;
+        if(!ok) break;
+    }
+    free(payload);
+
+    if(ok)
+    {
+        remap_adopted_peers(fd_map);
+        ok = send_rec(conn_fd,HANDOVER_ACK,NULL,0,NULL,0);
+    }
+    free(fd_map);
+    if(!ok)
+    {
+        LOGE("Handover aborted, the old server serves on.");
+        close(conn_fd);
+        return false;
+    }
+    // Nothing is read from the sockets before the old server let go of them.
+    uint8_t byte;
+    while( (recv(conn_fd,&byte,1,0) < 0) && (EINTR == errno) );
+    close(conn_fd);
+    LOGI("Took over %d clients.",clients);
+    return true;
+}
@@ -0,0 +1,122 @@
+#ifndef SERVER_HANDOVER_H
+#define SERVER_HANDOVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chat_app_common.h"
+#include "server_ratelimit.h"
+#include "server_shm.h"
+
+/* A running server listens here for its successor, one path per port. */
+#define SERVER_HANDOVER_PATH_FMT   "/tmp/chat_server.%u.handover"
+#define HANDOVER_MAGIC             0x4f564448
+#define HANDOVER_VERSION           1
+/* Size of sun_path in struct sockaddr_un. */
+#define HANDOVER_PATH_LEN          108
+/* Every record has to arrive within this, a stalled peer aborts the handover. */
+#define HANDOVER_TIMEOUT_MS        5000
+#define HANDOVER_QUIESCE_MS        2000
+/* How often the loop looks for a successor. */
+#define HANDOVER_POLL_MS           100
+/* A busy server (file relays in flight) is asked again this often. */
+#define HANDOVER_RETRY_MS          500
+#define HANDOVER_RETRIES           20
+#define HANDOVER_MAX_FDS           2
+
+typedef enum{
+    HANDOVER_HELLO=0,
+    HANDOVER_BUSY,
+    HANDOVER_REFUSED,
+    HANDOVER_LISTENER,
+    HANDOVER_DOORBELL,
+    /* Ends the listeners, the clients follow. */
+    HANDOVER_CLIENTS,
+    HANDOVER_CLIENT,
+    HANDOVER_SHM,
+    HANDOVER_END,
+    HANDOVER_ACK,
+    HANDOVER_KIND_MAX
+}handover_kind_t;
+
+/* Every record starts with this, fd_count descriptors ride on its first byte. */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t kind;
+    uint32_t payload_len;
+    uint32_t fd_count;
+}handover_rec_t;
+
+typedef struct
+{
+    uint8_t is_unix;
+    char path[HANDOVER_PATH_LEN];
+}handover_listener_t;
+
+typedef struct
+{
+    uint8_t status;
+    uint8_t peer_channel;
+    uint16_t req_id;
+    /* The peer's fd in the old process, remapped once every client arrived. */
+    int32_t peer_fd;
+    uint32_t conn_req_left_ms;
+}handover_channel_t;
+
+/* Followed by rx_len bytes of a partial frame and tx_len bytes not yet sent. */
+typedef struct
+{
+    int32_t fd;
+    char name[MAX_CLIENT_NAME_LEN];
+    uint8_t handshake_done;
+    uint32_t codecs;
+    uint32_t handshake_left_ms;
+    uint32_t idle_left_ms;
+    /* CLOCK_MONOTONIC is shared by both processes, timestamps carry over as they are. */
+    uint64_t last_rx_ms;
+    uint64_t last_activity_ms;
+    rate_state_t rate;
+    handover_channel_t channels[MAX_CHANNELS];
+    uint32_t rx_len;
+    uint32_t tx_len;
+}handover_client_t;
+
+/* Follows a client on shared memory, then state.backlog frames. */
+typedef struct
+{
+    int32_t fd;
+    shm_link_state_t state;
+}handover_shm_t;
+
+/* What a successor inherits before any client, INVALID_FD where absent. */
+typedef struct
+{
+    int tcp_fd;
+    int unix_fd;
+    char unix_path[HANDOVER_PATH_LEN];
+    int doorbell_fd;
+}handover_listeners_t;
+
+/*
+ * Old side. handover_listen() opens the socket a successor connects to,
+ * handover_poll() is called by the main loop outside of any I/O callback and
+ * returns true once a successor took every socket over; this process then
+ * only has to let go of them. handover_close() removes the socket.
+ */
+int handover_listen(uint16_t port, const handover_listeners_t* listeners);
+bool handover_poll(void);
+void handover_close(void);
+
+/*
+ * New side. handover_connect() asks the server on port to hand over and
+ * receives its listeners, retrying while it is busy. Once the caller set up
+ * with them, handover_receive() adopts every client and shared-memory link,
+ * acknowledges and waits for the old server to let go.
+ */
+int handover_connect(uint16_t port, handover_listeners_t* listeners);
+bool handover_receive(int conn_fd);
+
+const char* handover_kind_to_str(handover_kind_t kind);
+
+#endif
@@ -0,0 +1,1274 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "server_io.h"
+#include "server_mgmt.h"
+#include "server_metrics.h"
+#include "server_arena.h"
+#include "server_iopool.h"
+#include "logger.h"
+
+const char *ioErrStr[] = {
+    "UNDEFINED_IO_ERR",
+    "IO_SUCC",
+    "ERR_IO_INIT",
+    "ERR_IO_NOT_SUPPORTED",
+    "ERR_IO_MALLOC_FAILED",
+    "ERR_IO_CONN_NOT_FOUND",
+    "ERR_IO_CONN_CLOSING",
+    "ERR_IO_RELAY_BUSY",
+    "ERR_IO_TX_BUSY",
+    "ERR_IO_WRONG_THREAD"
+};
+
+const char *ioBackendStr[] = {
+    "epoll",
+    "uring"
+};
+
+static const srv_io_backend_t* backend = NULL;
+
+/* fd -> connection, sized by RLIMIT_NOFILE so lookups are a plain index. */
+static srv_conn_t** conn_table = NULL;
+static int conn_table_size = 0;
+/* Last generation handed out per fd. */
+static uint32_t* fd_gens = NULL;
+
+/* The thread running the loop, the one owning every connection. */
+static pthread_t loop_thread;
+
+/* Closes are deferred to the top of the loop, handlers may hold client_data_mutex. */
+static srv_conn_t** close_pending = NULL;
+static int close_pending_count = 0;
+
+/*
+ * Connections that got frames during this loop iteration. They are flushed
+ * once per iteration, so a burst to one peer leaves as one batch.
+ */
+static srv_conn_t* flush_list = NULL;
+
+/* Connections whose last hold was released, what they kept is parsed by rx_replay_all(). */
+static srv_conn_t* replay_list = NULL;
+
+/* Sink for relayed payload whose receiver went away. */
+static int devnull_fd = INVALID_FD;
+
+typedef struct
+{
+    int efd;
+    void (*cb)(void);
+}srv_doorbell_t;
+
+static srv_doorbell_t doorbells[IO_MAX_DOORBELLS];
+static int doorbell_count = 0;
+
+/* Bytes of every frame allocated and not sent yet, watched for overload. */
+static size_t tx_queued_bytes = 0;
+
+const char* ioErrToStr(srv_io_err_t err)
+{
+    if(err >= ERR_IO_MAX) return ioErrStr[0];
+    return ioErrStr[err+1];
+}
+
+io_backend_type_t io_backend_from_str(const char* name)
+{
+    if(!name) return IO_BACKEND_MAX;
+    for(int i=0;i<IO_BACKEND_MAX;i++)
+    {
+        if(0==strcmp(name,ioBackendStr[i]))
+            return i;
+    }
+    return IO_BACKEND_MAX;
+}
+
+const char* io_backend_to_str(io_backend_type_t type)
+{
+    if(type >= IO_BACKEND_MAX) return "none";
+    return ioBackendStr[type];
+}
+
+const char* srv_io_backend_name(void)
+{
+    return backend ? backend->name : "none";
+}
+
+srv_io_err_t srv_io_init(io_backend_type_t type, int listen_fd)
+{
+    struct rlimit rl;
+    if( (0!=getrlimit(RLIMIT_NOFILE,&rl)) || (RLIM_INFINITY==rl.rlim_cur) || (rl.rlim_cur > IO_MAX_FDS) )
+        conn_table_size = IO_MAX_FDS;
+    else
+        conn_table_size = rl.rlim_cur;
+
+    devnull_fd = open(DEV_NULL_PATH,O_WRONLY|O_CLOEXEC);
+    conn_table = calloc(conn_table_size,sizeof(srv_conn_t*));
+    close_pending = calloc(conn_table_size,sizeof(srv_conn_t*));
+    fd_gens = calloc(conn_table_size,sizeof(uint32_t));
+    if( (!conn_table) || (!close_pending) || (!fd_gens) )
+    {
+        LOGE("calloc failed for connection table of %d entries.",conn_table_size);
+        return ERR_IO_MALLOC_FAILED;
+    }
+    loop_thread = pthread_self();
+
+    if(IO_BACKEND_URING==type)
+    {
+        srv_io_err_t err = uring_backend.init(listen_fd);
+        if(IO_SUCC==err)
+            backend = &uring_backend;
+        else
+            LOGE("io_uring backend unavailable [ %s ], falling back to epoll.",ioErrToStr(err));
+    }
+
+    if(!backend)
+    {
+        srv_io_err_t err = epoll_backend.init(listen_fd);
+        if(IO_SUCC!=err)
+        {
+            LOGE("epoll backend init failed [ %s ].",ioErrToStr(err));
+            return err;
+        }
+        backend = &epoll_backend;
+    }
+    LOGI("I/O backend : %s, connection table : %d.",backend->name,conn_table_size);
+    return IO_SUCC;
+}
+
+srv_io_err_t srv_io_add_fd(int fd)
+{
+    if( (fd < 0) || (fd >= conn_table_size) )
+    {
+        LOGE("fd : %d, outside connection table.",fd);
+        return ERR_IO_INIT;
+    }
+
+    srv_conn_t* conn = calloc(1,sizeof(srv_conn_t));
+    if(!conn)
+    {
+        LOGE("fd : %d, calloc failed.",fd);
+        return ERR_IO_MALLOC_FAILED;
+    }
+    conn->fd = fd;
+    if(0 == ++fd_gens[fd])
+        ++fd_gens[fd];
+    conn->gen = fd_gens[fd];
+    conn->relay_dst = INVALID_FD;
+    conn->relay_pipe[0] = INVALID_FD;
+    conn->relay_pipe[1] = INVALID_FD;
+
+    // Frames are batched per loop iteration already, Nagle would only delay the last one.
+    int one = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+    srv_io_err_t err = backend->add_conn(conn);
+    if(IO_SUCC!=err)
+    {
+        free(conn);
+        return err;
+    }
+    conn_table[fd] = conn;
+    return IO_SUCC;
+}
+
+srv_io_err_t srv_io_add_listener(int listen_fd)
+{
+    return backend->add_listener(listen_fd);
+}
+
+srv_io_err_t srv_io_add_doorbell(int efd, void (*cb)(void))
+{
+    if(doorbell_count >= IO_MAX_DOORBELLS)
+        return ERR_IO_INIT;
+    srv_io_err_t err = backend->add_doorbell(efd);
+    if(IO_SUCC == err)
+        doorbells[doorbell_count++] = (srv_doorbell_t){ efd, cb };
+    return err;
+}
+
+void srv_io_doorbell(int efd)
+{
+    for(int i=0; i<doorbell_count; i++)
+    {
+        if(doorbells[i].efd == efd)
+        {
+            doorbells[i].cb();
+            return;
+        }
+    }
+}
+
+static srv_conn_t* conn_by_fd(int fd)
+{
+    if( (fd < 0) || (fd >= conn_table_size) ) return NULL;
+    return conn_table[fd];
+}
+
+uint32_t srv_io_conn_gen(int fd)
+{
+    srv_conn_t* conn = conn_by_fd(fd);
+    return ( (conn) && (!conn->closing) ) ? conn->gen : 0;
+}
+
+static void tx_schedule(srv_conn_t* conn)
+{
+    if(conn->in_flush) return;
+    conn->in_flush = true;
+    conn->next_flush = flush_list;
+    flush_list = conn;
+}
+
+static void flush_pending_sends(void)
+{
+    while(flush_list)
+    {
+        srv_conn_t* conn = flush_list;
+        flush_list = conn->next_flush;
+        conn->next_flush = NULL;
+        conn->in_flush = false;
+
+        // A closing connection still gets what was queued before the close.
+        uint64_t frames = conn->prio_queued;
+        for(srv_tx_buf_t* buf=conn->tx_unsent; buf; buf=buf->next)
+            frames++;
+        if(0 == frames) continue;
+        metrics_inc(METRIC_TX_FLUSHES);
+        metrics_set_max(METRIC_TX_BATCH_MAX,frames);
+
+        backend->start_send(conn);
+        // A relay into this socket waits for the queue to drain.
+        if( (!conn->tx_head) && (!conn->closing) )
+            srv_io_relay_writable(conn);
+    }
+}
+
+/* Nested: a relay and a multi-call flush may both hold the cork. */
+void srv_io_cork(srv_conn_t* conn, bool on)
+{
+    int prev = conn->cork_depth;
+    conn->cork_depth += on ? 1 : -1;
+    if( (conn->cork_depth < 0) || ((prev > 0) == (conn->cork_depth > 0)) )
+    {
+        if(conn->cork_depth < 0)
+            conn->cork_depth = 0;
+        return;
+    }
+    int val = on ? 1 : 0;
+    setsockopt(conn->fd,IPPROTO_TCP,TCP_CORK,&val,sizeof(val));
+    metrics_inc(METRIC_IO_SYSCALLS);
+}
+
+/* Frames take a slot of the pool's tx slab, a relayed chat line costs no malloc once it is warm. */
+static srv_tx_buf_t* tx_buf_alloc(srv_conn_t* conn, size_t len)
+{
+    srv_tx_buf_t* buf = iopool_tx_get(len);
+    if(!buf)
+    {
+        LOGE("fd : %d, malloc failed for %zu bytes.",conn->fd,len);
+        return NULL;
+    }
+    buf->next = NULL;
+    buf->conn = conn;
+    buf->len = len;
+    buf->off = 0;
+    buf->seq = 0;
+    buf->prio = IO_PRIO_BULK;
+    buf->stream = IO_STREAM_NONE;
+    tx_queued_bytes += len;
+    return buf;
+}
+
+static srv_tx_buf_t* tx_buf_new(srv_conn_t* conn, const void* data, size_t len)
+{
+    srv_tx_buf_t* buf = tx_buf_alloc(conn,len);
+    if(!buf)
+        return NULL;
+    if(data)
+        memcpy(buf->data,data,len);
+    else
+        memset(buf->data,0,len);
+    return buf;
+}
+
+/* One copy of every part straight into the frame's queue entry. */
+static srv_tx_buf_t* tx_buf_gather(srv_conn_t* conn, const struct iovec* iov, int iovcnt)
+{
+    size_t len = 0;
+    for(int i=0; i<iovcnt; i++)
+        len += iov[i].iov_len;
+    srv_tx_buf_t* buf = tx_buf_alloc(conn,len);
+    if(!buf)
+        return NULL;
+    size_t off = 0;
+    for(int i=0; i<iovcnt; i++)
+    {
+        memcpy(buf->data + off,iov[i].iov_base,iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    return buf;
+}
+
+static void tx_buf_free(srv_tx_buf_t* buf)
+{
+    tx_queued_bytes -= buf->len;
+    iopool_tx_put(buf,buf->len);
+}
+
+size_t srv_io_tx_queued_bytes(void)
+{
+    return tx_queued_bytes;
+}
+
+static void tx_link_tail(srv_conn_t* conn, srv_tx_buf_t* buf)
+{
+    if(conn->tx_tail)
+        conn->tx_tail->next = buf;
+    else
+        conn->tx_head = buf;
+    conn->tx_tail = buf;
+    if(!conn->tx_unsent)
+        conn->tx_unsent = buf;
+}
+
+/* held is set for regular frames, which must not overtake a running relay. */
+static srv_io_err_t tx_queue(srv_conn_t* conn, srv_tx_buf_t* buf, bool held)
+{
+    if(!buf)
+        return ERR_IO_MALLOC_FAILED;
+
+    if( (held) && (conn->relay_from) )
+    {
+        if(conn->held_tail)
+            conn->held_tail->next = buf;
+        else
+            conn->held_head = buf;
+        conn->held_tail = buf;
+        return IO_SUCC;
+    }
+
+    tx_link_tail(conn,buf);
+    tx_schedule(conn);
+    return IO_SUCC;
+}
+
+static srv_io_err_t tx_append(srv_conn_t* conn, const void* data, size_t len, bool held)
+{
+    return tx_queue(conn,tx_buf_new(conn,data,len),held);
+}
+
+/*
+ * Frames wait in their class queue until the backend pulls them. A frame
+ * whose stream still has frames waiting in a lower class joins them there,
+ * so a stream never gets reordered.
+ */
+static srv_io_err_t prio_enqueue(srv_conn_t* conn, srv_tx_buf_t* buf, io_prio_t prio, uint8_t stream)
+{
+    if(!buf)
+        return ERR_IO_MALLOC_FAILED;
+
+    if(IO_STREAM_NONE != stream)
+    {
+        int bucket = stream % IO_PRIO_STREAMS;
+        for(int c=prio+1; c<IO_PRIO_MAX; c++)
+        {
+            if(conn->prio_stream_queued[c][bucket])
+                prio = c;
+        }
+        conn->prio_stream_queued[prio][bucket]++;
+    }
+    buf->prio = prio;
+    buf->stream = stream;
+    buf->seq = conn->prio_seq++;
+    if(conn->prio_tail[prio])
+        conn->prio_tail[prio]->next = buf;
+    else
+        conn->prio_head[prio] = buf;
+    conn->prio_tail[prio] = buf;
+    conn->prio_queued++;
+    tx_schedule(conn);
+    return IO_SUCC;
+}
+
+static bool seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+/*
+ * Head of the highest class. Once IO_PRIO_STARVE_LIMIT frames in a row went
+ * ahead of the oldest queued frame, that one goes next.
+ */
+static srv_tx_buf_t* prio_pick(srv_conn_t* conn)
+{
+    int top = IO_PRIO_MAX;
+    int oldest = IO_PRIO_MAX;
+    for(int c=0; c<IO_PRIO_MAX; c++)
+    {
+        if(!conn->prio_head[c]) continue;
+        if(IO_PRIO_MAX == top)
+            top = c;
+        if( (IO_PRIO_MAX == oldest) || (seq_before(conn->prio_head[c]->seq,conn->prio_head[oldest]->seq)) )
+            oldest = c;
+    }
+    if(IO_PRIO_MAX == top)
+        return NULL;
+
+    int pick = top;
+    if(oldest == top)
+    {
+        conn->prio_skips = 0;
+    }
+    else if(conn->prio_skips >= IO_PRIO_STARVE_LIMIT)
+    {
+        pick = oldest;
+        conn->prio_skips = 0;
+        metrics_inc(METRIC_TX_PRIO_AGED);
+    }
+    else
+    {
+        conn->prio_skips++;
+        metrics_inc(METRIC_TX_PRIO_JUMPS);
+    }
+
+    srv_tx_buf_t* buf = conn->prio_head[pick];
+    conn->prio_head[pick] = buf->next;
+    if(!conn->prio_head[pick])
+        conn->prio_tail[pick] = NULL;
+    buf->next = NULL;
+    conn->prio_queued--;
+    if(IO_STREAM_NONE != buf->stream)
+        conn->prio_stream_queued[pick][buf->stream % IO_PRIO_STREAMS]--;
+    return buf;
+}
+
+/*
+ * Moves up to max frames from the class queues onto the send queue. Backends
+ * pull only once the kernel took what was queued before, so frames keep
+ * competing by class while the socket is full.
+ */
+int srv_io_tx_pull(srv_conn_t* conn, int max)
+{
+    int count = 0;
+    srv_tx_buf_t* buf;
+    while( (count < max) && ((buf = prio_pick(conn))) )
+    {
+        tx_link_tail(conn,buf);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Queues one frame in class prio. Frames of the same stream, e.g. one chat,
+ * are never reordered among themselves.
+ */
+srv_io_err_t srv_io_send(int fd, const void* data, size_t len, io_prio_t prio, uint8_t stream)
+{
+    struct iovec iov = { (void*)data, len };
+    return srv_io_sendv(fd,&iov,1,prio,stream);
+}
+
+srv_io_err_t srv_io_sendv(int fd, const struct iovec* iov, int iovcnt, io_prio_t prio, uint8_t stream)
+{
+    if(!pthread_equal(pthread_self(),loop_thread))
+    {
+        LOGE("fd : %d, send off the loop thread.",fd);
+        return ERR_IO_WRONG_THREAD;
+    }
+    srv_conn_t* conn = conn_by_fd(fd);
+    if(!conn)
+        return ERR_IO_CONN_NOT_FOUND;
+    if(conn->closing)
+        return ERR_IO_CONN_CLOSING;
+    if(prio >= IO_PRIO_MAX)
+        prio = IO_PRIO_BULK;
+
+    srv_tx_buf_t* buf = tx_buf_gather(conn,iov,iovcnt);
+    srv_io_err_t err = (conn->relay_from) ? tx_queue(conn,buf,true) : prio_enqueue(conn,buf,prio,stream);
+    if(IO_SUCC==err)
+        metrics_inc(METRIC_TX_MSGS);
+    return err;
+}
+
+/*
+ * One frame with descriptors attached (SCM_RIGHTS). It cannot wait in the
+ * queue, so fd must have nothing queued or held; the descriptors go with the
+ * first byte and whatever the socket does not take at once is queued.
+ */
+srv_io_err_t srv_io_send_fds(int fd, const void* data, size_t len, const int* fds, int count)
+{
+    srv_conn_t* conn = conn_by_fd(fd);
+    if(!conn)
+        return ERR_IO_CONN_NOT_FOUND;
+    if(conn->closing)
+        return ERR_IO_CONN_CLOSING;
+    if( (conn->tx_head) || (conn->prio_queued) || (conn->relay_from) || (count > IO_MAX_SEND_FDS) )
+        return ERR_IO_TX_BUSY;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int)*IO_MAX_SEND_FDS)];
+        struct cmsghdr align;
+    }ctrl;
+    memset(&ctrl,0,sizeof(ctrl));
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl.buf, .msg_controllen = CMSG_SPACE(sizeof(int)*count) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int)*count);
+    memcpy(CMSG_DATA(cmsg),fds,sizeof(int)*count);
+
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(fd,&mh,MSG_NOSIGNAL|MSG_DONTWAIT);
+        metrics_inc(METRIC_IO_SYSCALLS);
+    }while( (sent < 0) && (EINTR == errno) );
+    if(sent < 0)
+    {
+        LOGE("fd : %d, [ sendmsg ] with descriptors failed, errno : %d.",fd,errno);
+        return ERR_IO_TX_BUSY;
+    }
+    metrics_inc(METRIC_TX_MSGS);
+    if((size_t)sent < len)
+        return tx_append(conn,(const uint8_t*)data + sent,len - sent,true);
+    return IO_SUCC;
+}
+
+void srv_io_tx_pop(srv_conn_t* conn)
+{
+    srv_tx_buf_t* buf = conn->tx_head;
+    if(!buf) return;
+    conn->tx_head = buf->next;
+    if(!conn->tx_head)
+        conn->tx_tail = NULL;
+    if(conn->tx_unsent == buf)
+        conn->tx_unsent = buf->next;
+    tx_buf_free(buf);
+}
+
+/* Drops len bytes written from the head of the queue, possibly spanning frames. */
+void srv_io_tx_consume(srv_conn_t* conn, size_t len)
+{
+    while( (len > 0) && (conn->tx_head) )
+    {
+        srv_tx_buf_t* buf = conn->tx_head;
+        size_t left = buf->len - buf->off;
+        if(len < left)
+        {
+            buf->off += len;
+            return;
+        }
+        len -= left;
+        srv_io_tx_pop(conn);
+    }
+}
+
+/* Queues payload of a parked relay in its place among the held frames, NULL data pads with zeroes. */
+static void held_insert(srv_conn_t* dst, srv_conn_t* src, const void* data, size_t len)
+{
+    srv_tx_buf_t* buf = tx_buf_new(dst,data,len);
+    if(!buf)
+    {
+        srv_io_conn_close(dst);
+        return;
+    }
+
+    srv_tx_buf_t* after = src->relay_mark;
+    buf->next = after ? after->next : dst->held_head;
+    if(after)
+        after->next = buf;
+    else
+        dst->held_head = buf;
+    if(dst->held_tail == after)
+        dst->held_tail = buf;
+    src->relay_mark = buf;
+}
+
+static void relay_unpark(srv_conn_t* dst, srv_conn_t* src)
+{
+    srv_conn_t* prev = NULL;
+    for(srv_conn_t* p=dst->parked_head; p; prev=p, p=p->relay_next_parked)
+    {
+        if(p != src) continue;
+        if(prev)
+            prev->relay_next_parked = p->relay_next_parked;
+        else
+            dst->parked_head = p->relay_next_parked;
+        if(dst->parked_tail == p)
+            dst->parked_tail = prev;
+        break;
+    }
+    src->relay_next_parked = NULL;
+    src->relay_parked = false;
+    src->relay_mark = NULL;
+}
+
+/* Payload bytes that were already read into user space before the relay took over. */
+static size_t relay_copy(srv_conn_t* src, const uint8_t* data, size_t len)
+{
+    size_t n = (len < src->relay_remaining) ? len : src->relay_remaining;
+    srv_conn_t* dst = conn_by_fd(src->relay_dst);
+    if( (dst) && (src->relay_parked) && (!dst->closing) )
+        held_insert(dst,src,data,n);
+    else if( (dst) && (dst->relay_from == src) && (!dst->closing) )
+        tx_append(dst,data,n,false);
+    src->relay_remaining -= n;
+    metrics_add(METRIC_RELAY_BYTES_COPIED,n);
+    return n;
+}
+
+static void relay_finish(srv_conn_t* src);
+
+/* Received while the connection is held, kept in arrival order. */
+static void rx_keep(srv_conn_t* conn, const uint8_t* data, size_t len)
+{
+    if(0 == len) return;
+    uint8_t* held = realloc(conn->rx_held, conn->rx_held_len + len);
+    if(!held)
+    {
+        LOGE("fd : %d, realloc failed for %zu held bytes.",conn->fd,conn->rx_held_len + len);
+        srv_io_conn_close(conn);
+        return;
+    }
+    memcpy(held + conn->rx_held_len, data, len);
+    conn->rx_held = held;
+    conn->rx_held_len += len;
+}
+
+/* Until kept bytes are parsed again, later ones queue up behind them. */
+static bool rx_is_held(const srv_conn_t* conn)
+{
+    return (conn->rx_holds > 0) || (conn->rx_held);
+}
+
+/*
+ * Whole frames are handed to the handler where they were received. Only a
+ * frame split across reads is put together in rx_buf, and one at an address
+ * msg_t cannot be read from is copied out first.
+ */
+static void conn_rx_frame(srv_conn_t* conn, const uint8_t* data)
+{
+    msg_t aligned;
+    const msg_t* msg = (const msg_t*)data;
+    if(0 != ((uintptr_t)data % _Alignof(msg_t)))
+    {
+        memcpy(&aligned,data,sizeof(aligned));
+        msg = &aligned;
+    }
+    metrics_inc(METRIC_RX_MSGS);
+    if(!handle_rx_frame(conn->fd,msg))
+        srv_io_conn_close(conn);
+}
+
+/* Reassembles fixed size frames from the byte stream and dispatches them. */
+bool srv_io_conn_rx(srv_conn_t* conn, const uint8_t* data, size_t len)
+{
+    while( (len > 0) && (!conn->closing) )
+    {
+        if(rx_is_held(conn))
+        {
+            rx_keep(conn,data,len);
+            break;
+        }
+
+        if(conn->relay_remaining > 0)
+        {
+            size_t n = relay_copy(conn,data,len);
+            data += n;
+            len -= n;
+            if(0 == conn->relay_remaining)
+                relay_finish(conn);
+            continue;
+        }
+
+        if( (0 == conn->rx_len) && (len >= sizeof(msg_t)) )
+        {
+            // A relay the handler starts takes over what follows at the top of the loop.
+            conn_rx_frame(conn,data);
+            data += sizeof(msg_t);
+            len -= sizeof(msg_t);
+            continue;
+        }
+
+        // Only the rest of a split frame is copied, the frames after it are read in place.
+        if( (!conn->rx_buf) && (!(conn->rx_buf = iopool_rx_get())) )
+        {
+            srv_io_conn_close(conn);
+            break;
+        }
+        size_t room = MAX_RECV_BUFFER_LEN - conn->rx_len;
+        if(conn->rx_len < sizeof(msg_t))
+            room = sizeof(msg_t) - conn->rx_len;
+        size_t chunk = (len < room) ? len : room;
+        memcpy(conn->rx_buf + conn->rx_len, data, chunk);
+        conn->rx_len += chunk;
+        data += chunk;
+        len -= chunk;
+
+        size_t off = 0;
+        while( (conn->rx_len - off >= sizeof(msg_t)) && (!conn->closing) && (!rx_is_held(conn)) )
+        {
+            conn_rx_frame(conn,conn->rx_buf + off);
+            off += sizeof(msg_t);
+
+            // The handler started a relay, what follows the frame is payload.
+            if(conn->relay_remaining > 0)
+            {
+                off += relay_copy(conn, conn->rx_buf + off, conn->rx_len - off);
+                if(0 == conn->relay_remaining)
+                    relay_finish(conn);
+                else
+                    break;
+            }
+        }
+        // A handler held the connection: the rest of rx_buf goes ahead of what was not copied in.
+        if( (rx_is_held(conn)) && (!conn->closing) )
+        {
+            rx_keep(conn, conn->rx_buf + off, conn->rx_len - off);
+            off = conn->rx_len;
+        }
+        memmove(conn->rx_buf, conn->rx_buf + off, conn->rx_len - off);
+        conn->rx_len -= off;
+        if(0 == conn->rx_len)
+        {
+            iopool_rx_put(conn->rx_buf);
+            conn->rx_buf = NULL;
+        }
+    }
+    return !conn->closing;
+}
+
+void srv_io_rx_hold(int fd)
+{
+    srv_conn_t* conn = conn_by_fd(fd);
+    if( (!conn) || (conn->closing) ) return;
+    if(0 == conn->rx_holds++)
+    {
+        metrics_inc(METRIC_RX_HOLDS);
+        backend->rx_pause(conn,true);
+    }
+}
+
+void srv_io_rx_release(int fd)
+{
+    srv_conn_t* conn = conn_by_fd(fd);
+    if( (!conn) || (conn->rx_holds <= 0) ) return;
+    if( (0 != --conn->rx_holds) || (conn->closing) || (conn->rx_replay) ) return;
+    conn->rx_replay = true;
+    conn->next_replay = replay_list;
+    replay_list = conn;
+}
+
+/* Parses what released connections kept, then lets the backend read them again. */
+static void rx_replay_all(void)
+{
+    while(replay_list)
+    {
+        srv_conn_t* conn = replay_list;
+        replay_list = conn->next_replay;
+        conn->next_replay = NULL;
+        conn->rx_replay = false;
+        if( (conn->closing) || (conn->rx_holds > 0) ) continue;
+
+        uint8_t* held = conn->rx_held;
+        size_t len = conn->rx_held_len;
+        conn->rx_held = NULL;
+        conn->rx_held_len = 0;
+        if(held)
+            srv_io_conn_rx(conn,held,len);
+        free(held);
+        // Held again by a frame it kept, the next release comes back here.
+        if( (conn->closing) || (rx_is_held(conn)) ) continue;
+        if(conn->relay_remaining > 0)
+            srv_io_relay_run(conn);
+        else
+            backend->rx_pause(conn,false);
+    }
+}
+
+static void replay_unlink(srv_conn_t* conn)
+{
+    srv_conn_t** link = &replay_list;
+    while( (*link) && (*link != conn) ) link = &(*link)->next_replay;
+    if(*link) *link = conn->next_replay;
+    conn->next_replay = NULL;
+    conn->rx_replay = false;
+}
+
+srv_io_err_t srv_io_relay_start(int src_fd, int dst_fd, size_t len)
+{
+    srv_conn_t* src = conn_by_fd(src_fd);
+    if( (!src) || (src->closing) )
+        return ERR_IO_CONN_NOT_FOUND;
+    if(src->relay_remaining > 0)
+        return ERR_IO_RELAY_BUSY;
+
+    if( (INVALID_FD == src->relay_pipe[0]) && (!iopool_pipe_get(src->relay_pipe)) )
+        return ERR_IO_INIT;
+
+    srv_conn_t* dst = conn_by_fd(dst_fd);
+    if( (dst) && (dst->closing) )
+        dst = NULL;
+    src->relay_remaining = len;
+    src->relay_in_pipe = 0;
+    src->relay_dst = dst ? dst_fd : INVALID_FD;
+    if( (dst) && (dst->relay_from) )
+    {
+        // The frame announcing this payload is the one just held back on dst.
+        src->relay_parked = true;
+        src->relay_mark = dst->held_tail;
+        src->relay_next_parked = NULL;
+        if(dst->parked_tail)
+            dst->parked_tail->relay_next_parked = src;
+        else
+            dst->parked_head = src;
+        dst->parked_tail = src;
+    }
+    else if(dst)
+    {
+        // The frame announcing the chunk was queued last, so the payload goes right behind it.
+        // Both leave in full segments.
+        srv_io_tx_pull(dst,INT_MAX);
+        dst->relay_from = src;
+        srv_io_cork(dst,true);
+    }
+    return IO_SUCC;
+}
+
+/*
+ * Releases the frames held back on the receiver and hands src back to
+ * framing. A parked relay takes the receiver over once the frames before
+ * its payload are out.
+ */
+static void relay_finish(srv_conn_t* src)
+{
+    srv_conn_t* dst = conn_by_fd(src->relay_dst);
+    srv_conn_t* next = NULL;
+    src->relay_dst = INVALID_FD;
+    src->relay_wait_out = false;
+    // The payload is through, the next chunk borrows a pipe again.
+    if( (!src->closing) && (0 == src->relay_in_pipe) )
+        iopool_pipe_put(src->relay_pipe);
+    if( (dst) && (src->relay_parked) )
+    {
+        // All of it was copied into the held frames already.
+        relay_unpark(dst,src);
+    }
+    else if( (dst) && (dst->relay_from == src) )
+    {
+        dst->relay_from = NULL;
+        next = dst->closing ? NULL : dst->parked_head;
+        while( (dst->held_head) && ((!next) || (next->relay_mark)) )
+        {
+            srv_tx_buf_t* buf = dst->held_head;
+            dst->held_head = buf->next;
+            buf->next = NULL;
+            if(dst->tx_tail)
+                dst->tx_tail->next = buf;
+            else
+                dst->tx_head = buf;
+            dst->tx_tail = buf;
+            if(!dst->tx_unsent)
+                dst->tx_unsent = buf;
+            if( (next) && (buf == next->relay_mark) )
+                break;
+        }
+        if(!dst->held_head)
+            dst->held_tail = NULL;
+        if(next)
+        {
+            relay_unpark(dst,next);
+            dst->relay_from = next;
+        }
+        if(!dst->closing)
+        {
+            // The cork stays on for a relay that follows right away.
+            if(!next)
+                srv_io_cork(dst,false);
+            if(dst->tx_unsent)
+                tx_schedule(dst);
+        }
+    }
+    if(!src->closing)
+        backend->relay_done(src);
+    if(next)
+        srv_io_relay_run(next);
+}
+
+/* Moves payload socket -> pipe -> socket until done or a side would block. */
+static io_relay_state_t relay_pump(srv_conn_t* src)
+{
+    while(!src->closing)
+    {
+        if(src->relay_in_pipe > 0)
+        {
+            srv_conn_t* dst = conn_by_fd(src->relay_dst);
+            int out_fd = devnull_fd;
+            if( (dst) && (dst->relay_from == src) && (!dst->closing) )
+            {
+                // Bytes copied earlier are queued on dst and must go out first.
+                if(dst->tx_head)
+                    return IO_RELAY_WAIT_OUT;
+                out_fd = dst->fd;
+            }
+
+            ssize_t n = splice(src->relay_pipe[0], NULL, out_fd, NULL, src->relay_in_pipe, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            metrics_inc(METRIC_IO_SYSCALLS);
+            if(n > 0)
+            {
+                src->relay_in_pipe -= n;
+                if(out_fd != devnull_fd)
+                    metrics_add(METRIC_RELAY_BYTES_SPLICED,n);
+                continue;
+            }
+            if( (n < 0) && ((EAGAIN == errno) || (EINTR == errno)) )
+                return IO_RELAY_WAIT_OUT;
+
+            LOGE("fd : %d, relay splice to fd : %d failed, errno : %d.",src->fd,out_fd,errno);
+            if(out_fd == devnull_fd)
+            {
+                srv_io_conn_close(src);
+                break;
+            }
+            srv_io_conn_close(dst);
+            src->relay_dst = INVALID_FD;
+            continue;
+        }
+
+        if(0 == src->relay_remaining)
+            return IO_RELAY_DONE;
+
+        // A receive still armed on the socket would race with splice for the same bytes.
+        if(src->recv_armed)
+            return IO_RELAY_WAIT_IN;
+
+        size_t want = (src->relay_remaining < IO_RELAY_PIPE_SZ) ? src->relay_remaining : IO_RELAY_PIPE_SZ;
+        ssize_t n = splice(src->fd, NULL, src->relay_pipe[1], NULL, want, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        metrics_inc(METRIC_IO_SYSCALLS);
+        if(n > 0)
+        {
+            src->relay_remaining -= n;
+            src->relay_in_pipe += n;
+            continue;
+        }
+        if( (n < 0) && ((EAGAIN == errno) || (EINTR == errno)) )
+            return IO_RELAY_WAIT_IN;
+
+        if(0 == n)
+            LOGI("Client termination detected fd : [ %d ].",src->fd);
+        else
+            LOGE("fd : %d, relay splice from socket failed, errno : %d.",src->fd,errno);
+        srv_io_conn_close(src);
+    }
+    return IO_RELAY_DONE;
+}
+
+void srv_io_relay_run(srv_conn_t* src)
+{
+    if(src->relay_parked)
+    {
+        backend->relay_park(src);
+        return;
+    }
+    src->relay_wait_out = false;
+    io_relay_state_t state = relay_pump(src);
+    if(src->closing)
+        return;
+
+    if(IO_RELAY_DONE == state)
+    {
+        relay_finish(src);
+    }
+    else if(IO_RELAY_WAIT_IN == state)
+    {
+        backend->relay_wait(src,NULL);
+    }
+    else
+    {
+        src->relay_wait_out = true;
+        backend->relay_wait(src,conn_by_fd(src->relay_dst));
+    }
+}
+
+/* Backends call this once dst has drained its queue or became writable. */
+void srv_io_relay_writable(srv_conn_t* dst)
+{
+    srv_conn_t* src = dst->relay_from;
+    if( (!src) || (!src->relay_wait_out) || (dst->tx_head) || (src->closing) ) return;
+    srv_io_relay_run(src);
+}
+
+void srv_io_conn_close(srv_conn_t* conn)
+{
+    if(conn->closing) return;
+    conn->closing = true;
+    close_pending[close_pending_count++] = conn;
+}
+
+void srv_io_close_fd(int fd)
+{
+    if( (fd < 0) || (fd >= conn_table_size) || (!conn_table[fd]) ) return;
+    srv_io_conn_close(conn_table[fd]);
+}
+
+void srv_io_conn_free(srv_conn_t* conn)
+{
+    while(conn->tx_head)
+        srv_io_tx_pop(conn);
+    for(int c=0; c<IO_PRIO_MAX; c++)
+    {
+        while(conn->prio_head[c])
+        {
+            srv_tx_buf_t* buf = conn->prio_head[c];
+            conn->prio_head[c] = buf->next;
+            tx_buf_free(buf);
+        }
+    }
+    while(conn->held_head)
+    {
+        srv_tx_buf_t* buf = conn->held_head;
+        conn->held_head = buf->next;
+        tx_buf_free(buf);
+    }
+    iopool_rx_put(conn->rx_buf);
+    iopool_pipe_drop(conn->relay_pipe);
+    if(conn->rx_replay)
+        replay_unlink(conn);
+    free(conn->rx_held);
+    free(conn);
+}
+
+/* Unlinks a closing connection from any relay it takes part in. */
+static void relay_detach(srv_conn_t* conn)
+{
+    srv_conn_t* dst = conn_by_fd(conn->relay_dst);
+    if( (dst) && (conn->relay_parked) )
+    {
+        size_t missing = conn->relay_remaining;
+        if( (missing > 0) && (!dst->closing) )
+            held_insert(dst,conn,NULL,missing);
+        conn->relay_remaining = 0;
+        relay_finish(conn);
+    }
+    else if( (dst) && (dst->relay_from == conn) )
+    {
+        // The receiver expects the announced length, pad the bytes that will never come.
+        size_t missing = conn->relay_remaining + conn->relay_in_pipe;
+        while( (missing > 0) && (!dst->closing) )
+        {
+            size_t n = (missing < IO_RELAY_PIPE_SZ) ? missing : IO_RELAY_PIPE_SZ;
+            if(IO_SUCC != tx_append(dst,NULL,n,false))
+                break;
+            missing -= n;
+        }
+        conn->relay_remaining = 0;
+        conn->relay_in_pipe = 0;
+        relay_finish(conn);
+    }
+
+    srv_conn_t* src = conn->relay_from;
+    if(src)
+    {
+        conn->relay_from = NULL;
+        src->relay_dst = INVALID_FD;
+        if(src->relay_wait_out)
+            srv_io_relay_run(src);
+    }
+
+    // Relays queued for this receiver drain their payload into /dev/null.
+    while(conn->parked_head)
+    {
+        src = conn->parked_head;
+        relay_unpark(conn,src);
+        src->relay_dst = INVALID_FD;
+        if(!src->closing)
+            srv_io_relay_run(src);
+    }
+}
+
+static void reap_closed_conns(void)
+{
+    for(int i=0;i<close_pending_count;i++)
+    {
+        srv_conn_t* conn = close_pending[i];
+        LOGD("fd : %d, closing connection.",conn->fd);
+        handle_client_disconnect(conn->fd);
+        relay_detach(conn);
+        conn_table[conn->fd] = NULL;
+        backend->close_conn(conn);
+    }
+    close_pending_count = 0;
+}
+
+int srv_io_run_once(int timeout_ms)
+{
+    rx_replay_all();
+    // Closes requested outside the loop, e.g. by timers, must not wait for I/O.
+    if(close_pending_count > 0)
+        timeout_ms = 0;
+    // Frames queued since the last iteration, e.g. by timers or disconnect handling.
+    flush_pending_sends();
+    int ret = backend->run_once(timeout_ms);
+    metrics_inc(METRIC_IO_LOOP_WAKEUPS);
+    rx_replay_all();
+    flush_pending_sends();
+    reap_closed_conns();
+    arena_reset();
+    return ret;
+}
+
+static bool relay_active(void)
+{
+    for(int fd=0;fd<conn_table_size;fd++)
+    {
+        srv_conn_t* conn = conn_table[fd];
+        // Bytes kept for a held connection are no more exportable than relayed ones.
+        if( (conn) && ((conn->relay_remaining) || (conn->relay_in_pipe) || (conn->relay_from) || (conn->parked_head) || (conn->held_head) ||
+            (rx_is_held(conn))) )
+            return true;
+    }
+    return false;
+}
+
+srv_io_err_t srv_io_quiesce(int timeout_ms)
+{
+    reap_closed_conns();
+    if(relay_active())
+        return ERR_IO_RELAY_BUSY;
+    for(int fd=0; (backend->pause_conn) && (fd<conn_table_size); fd++)
+    {
+        if(conn_table[fd])
+            backend->pause_conn(conn_table[fd]);
+    }
+    srv_io_err_t err = backend->quiesce ? backend->quiesce(timeout_ms) : IO_SUCC;
+    // Frames handled while draining may have closed a connection or started a relay.
+    reap_closed_conns();
+    if( (IO_SUCC == err) && (relay_active()) )
+        err = ERR_IO_RELAY_BUSY;
+    return err;
+}
+
+void srv_io_resume(void)
+{
+    if(backend->resume)
+        backend->resume();
+    for(int fd=0;fd<conn_table_size;fd++)
+    {
+        srv_conn_t* conn = conn_table[fd];
+        if( (!conn) || (conn->closing) ) continue;
+        if(backend->resume_conn)
+            backend->resume_conn(conn);
+        if( ((conn->relay_remaining) || (conn->relay_in_pipe)) && (!conn->relay_parked) )
+            srv_io_relay_run(conn);
+        if( (conn->tx_unsent) || (conn->prio_queued) )
+            tx_schedule(conn);
+    }
+}
+
+srv_io_err_t srv_io_export(int fd, const uint8_t** rx, size_t* rx_len, uint8_t** tx, size_t* tx_len)
+{
+    srv_conn_t* conn = conn_by_fd(fd);
+    if(!conn)
+        return ERR_IO_CONN_NOT_FOUND;
+    if(conn->closing)
+        return ERR_IO_CONN_CLOSING;
+
+    // In pick order, the new process sends these bytes before anything else.
+    srv_io_tx_pull(conn,INT_MAX);
+    size_t len = 0;
+    for(srv_tx_buf_t* buf=conn->tx_head; buf; buf=buf->next)
+        len += buf->len - buf->off;
+    *tx = NULL;
+    if( (len > 0) && (!(*tx = malloc(len))) )
+    {
+        LOGE("fd : %d, malloc failed for %zu bytes.",fd,len);
+        return ERR_IO_MALLOC_FAILED;
+    }
+    size_t off = 0;
+    for(srv_tx_buf_t* buf=conn->tx_head; buf; buf=buf->next)
+    {
+        memcpy(*tx + off,buf->data + buf->off,buf->len - buf->off);
+        off += buf->len - buf->off;
+    }
+    *tx_len = len;
+    *rx = conn->rx_buf;
+    *rx_len = conn->rx_len;
+    return IO_SUCC;
+}
+
+srv_io_err_t srv_io_adopt_fd(int fd, const uint8_t* rx, size_t rx_len, const uint8_t* tx, size_t tx_len)
+{
+    if(rx_len > MAX_RECV_BUFFER_LEN)
+        return ERR_IO_INIT;
+    srv_io_err_t err = srv_io_add_fd(fd);
+    if(IO_SUCC != err)
+        return err;
+    srv_conn_t* conn = conn_table[fd];
+    if(rx_len > 0)
+    {
+        if(!(conn->rx_buf = iopool_rx_get()))
+            return ERR_IO_MALLOC_FAILED;
+        memcpy(conn->rx_buf,rx,rx_len);
+        conn->rx_len = rx_len;
+    }
+    if(tx_len > 0)
+        err = tx_append(conn,tx,tx_len,false);
+    return err;
+}
+
+void srv_io_release_all(void)
+{
+    for(int fd=0;fd<conn_table_size;fd++)
+    {
+        srv_conn_t* conn = conn_table[fd];
+        if(!conn) continue;
+        conn_table[fd] = NULL;
+        close(fd);
+        srv_io_conn_free(conn);
+    }
+    close_pending_count = 0;
+    flush_list = NULL;
+    replay_list = NULL;
+}
+
+void srv_io_close_all(void)
+{
+    for(int fd=0;fd<conn_table_size;fd++)
+    {
+        if(conn_table[fd])
+            srv_io_conn_close(conn_table[fd]);
+    }
+    reap_closed_conns();
+    flush_list = NULL;
+    replay_list = NULL;
+}
+
+void srv_io_fini(void)
+{
+    if(backend)
+        backend->fini();
+    backend = NULL;
+    arena_fini();
+    iopool_fini();
+    doorbell_count = 0;
+    free(conn_table);
+    free(close_pending);
+    free(fd_gens);
+    if(INVALID_FD != devnull_fd)
+        close(devnull_fd);
+    devnull_fd = INVALID_FD;
+    conn_table = NULL;
+    close_pending = NULL;
+    fd_gens = NULL;
+}
@@ -0,0 +1,240 @@
+#ifndef SERVER_IO_H
+#define SERVER_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "chat_app_common.h"
+
+#define IO_MAX_FDS           65536
+#define IO_MAX_EVENTS        256
+#define IO_READ_CHUNK        16384
+/* Default of read_budget_kb, see srv_tuning_t. */
+#define IO_READ_BUDGET       (64*1024)
+#define IO_URING_ENTRIES     1024
+#define IO_URING_BUF_COUNT   256
+#define IO_URING_BUF_SIZE    4096
+#define IO_URING_BUF_GROUP   0
+
+#define MAX_RECV_BUFFER_LEN  2048
+
+#define IO_MAX_IOV           64
+
+#define IO_MAX_SEND_FDS      4
+/* Eventfds the loop wakes up on: shared memory, shutdown, reload and finished work. */
+#define IO_MAX_DOORBELLS     8
+
+/* Frames moved from the class queues per send call, the rest can still be overtaken. */
+#define IO_PRIO_BATCH        IO_MAX_IOV
+/* Frames picked ahead of the oldest queued one before it goes out regardless. */
+#define IO_PRIO_STARVE_LIMIT 16
+/* Buckets tracking which class the frames of a stream wait in. */
+#define IO_PRIO_STREAMS      16
+
+#define IO_RELAY_PIPE_SZ     (256*1024)
+#define DEV_NULL_PATH        "/dev/null"
+
+typedef enum{
+    IO_BACKEND_EPOLL=0,
+    IO_BACKEND_URING,
+    IO_BACKEND_MAX
+}io_backend_type_t;
+
+typedef enum{
+    IO_SUCC=0,
+    ERR_IO_INIT,
+    ERR_IO_NOT_SUPPORTED,
+    ERR_IO_MALLOC_FAILED,
+    ERR_IO_CONN_NOT_FOUND,
+    ERR_IO_CONN_CLOSING,
+    ERR_IO_RELAY_BUSY,
+    ERR_IO_TX_BUSY,
+    ERR_IO_WRONG_THREAD,
+    ERR_IO_MAX
+}srv_io_err_t;
+
+/* Outbound classes, a frame goes out ahead of queued frames of a lower class. */
+typedef enum{
+    IO_PRIO_CONTROL=0,
+    IO_PRIO_CHAT,
+    IO_PRIO_BULK,
+    IO_PRIO_MAX
+}io_prio_t;
+
+/* Frames of one stream keep their order whatever their class, none ties a frame to nothing. */
+#define IO_STREAM_NONE       0
+
+struct srv_conn_t;
+
+typedef struct srv_tx_buf_t {
+    struct srv_tx_buf_t* next;
+    struct srv_conn_t* conn;
+    size_t len;
+    size_t off;
+    uint32_t seq;
+    uint8_t prio;
+    uint8_t stream;
+    uint8_t data[];
+} srv_tx_buf_t;
+
+typedef enum{
+    IO_RELAY_DONE=0,
+    IO_RELAY_WAIT_IN,
+    IO_RELAY_WAIT_OUT
+}io_relay_state_t;
+
+typedef struct srv_conn_t {
+    int fd;
+    /* Tells this connection from earlier ones on the same fd, never 0. */
+    uint32_t gen;
+    bool closing;
+    int inflight;
+    bool recv_armed;
+    bool recv_cancel_sent;
+    bool recv_oneshot;
+    bool rx_paused;
+    bool want_out;
+    bool in_flush;
+    bool detached;
+    int cork_depth;
+    int tx_inflight;
+    srv_tx_buf_t* tx_head;
+    srv_tx_buf_t* tx_tail;
+    srv_tx_buf_t* tx_unsent;
+    /* Frames not handed to the backend yet, one FIFO per class, see srv_io_tx_pull(). */
+    srv_tx_buf_t* prio_head[IO_PRIO_MAX];
+    srv_tx_buf_t* prio_tail[IO_PRIO_MAX];
+    uint16_t prio_stream_queued[IO_PRIO_MAX][IO_PRIO_STREAMS];
+    uint32_t prio_queued;
+    uint32_t prio_seq;
+    int prio_skips;
+    struct srv_conn_t* next_flush;
+    struct srv_conn_t* next_zombie;
+    struct srv_conn_t* prev_zombie;
+
+    /* Raw payload streamed from this connection, see srv_io_relay_start(). */
+    size_t relay_remaining;
+    size_t relay_in_pipe;
+    int relay_dst;
+    int relay_pipe[2];
+    bool relay_wait_out;
+    /* Queued behind the relay already writing into relay_dst, src is not read meanwhile. */
+    bool relay_parked;
+    struct srv_conn_t* relay_next_parked;
+    /* Last frame held on relay_dst that goes out before this payload. */
+    srv_tx_buf_t* relay_mark;
+    /* On the receiving side: the relay writing into this socket and the frames held back meanwhile. */
+    struct srv_conn_t* relay_from;
+    srv_tx_buf_t* held_head;
+    srv_tx_buf_t* held_tail;
+    struct srv_conn_t* parked_head;
+    struct srv_conn_t* parked_tail;
+    /* Borrowed from the pool only while a frame split across reads is put together. */
+    size_t rx_len;
+    uint8_t* rx_buf;
+    /* Reading stops while holds are taken, see srv_io_rx_hold(). What arrived meanwhile waits in rx_held. */
+    int rx_holds;
+    uint8_t* rx_held;
+    size_t rx_held_len;
+    bool rx_replay;
+    struct srv_conn_t* next_replay;
+} srv_conn_t;
+
+/* One implementation per kernel interface, picked once at startup. */
+typedef struct {
+    const char* name;
+    srv_io_err_t (*init)(int listen_fd);
+    /* Further listening sockets and doorbells, kept until fini. */
+    srv_io_err_t (*add_listener)(int listen_fd);
+    srv_io_err_t (*add_doorbell)(int efd);
+    srv_io_err_t (*add_conn)(srv_conn_t* conn);
+    void (*start_send)(srv_conn_t* conn);
+    void (*close_conn)(srv_conn_t* conn);
+    void (*relay_wait)(srv_conn_t* src, srv_conn_t* dst);
+    void (*relay_done)(srv_conn_t* src);
+    void (*relay_park)(srv_conn_t* src);
+    /* Stops or restarts reading a connection that is not relaying. */
+    void (*rx_pause)(srv_conn_t* conn, bool on);
+    int  (*run_once)(int timeout_ms);
+    void (*fini)(void);
+    /* Hot upgrade, NULL where the backend keeps no request in the kernel. */
+    void (*pause_conn)(srv_conn_t* conn);
+    srv_io_err_t (*quiesce)(int timeout_ms);
+    void (*resume_conn)(srv_conn_t* conn);
+    void (*resume)(void);
+} srv_io_backend_t;
+
+extern const srv_io_backend_t epoll_backend;
+extern const srv_io_backend_t uring_backend;
+
+srv_io_err_t srv_io_init(io_backend_type_t type, int listen_fd);
+int srv_io_run_once(int timeout_ms);
+srv_io_err_t srv_io_add_fd(int fd);
+srv_io_err_t srv_io_add_listener(int listen_fd);
+/* cb runs on the loop whenever efd turns readable, it has to read efd itself. */
+srv_io_err_t srv_io_add_doorbell(int efd, void (*cb)(void));
+/* Loop thread only, other threads go through server_mailbox.h. */
+srv_io_err_t srv_io_send(int fd, const void* data, size_t len, io_prio_t prio, uint8_t stream);
+/* One frame gathered from iovcnt parts, copied once into the connection's queue. */
+srv_io_err_t srv_io_sendv(int fd, const struct iovec* iov, int iovcnt, io_prio_t prio, uint8_t stream);
+srv_io_err_t srv_io_send_fds(int fd, const void* data, size_t len, const int* fds, int count);
+void srv_io_close_fd(int fd);
+void srv_io_close_all(void);
+void srv_io_fini(void);
+const char* srv_io_backend_name(void);
+/* Generation of the connection on fd, 0 when there is none or it is closing. */
+uint32_t srv_io_conn_gen(int fd);
+io_backend_type_t io_backend_from_str(const char* name);
+const char* io_backend_to_str(io_backend_type_t type);
+const char* ioErrToStr(srv_io_err_t err);
+/* Frames queued on all connections and not written yet, in bytes. */
+size_t srv_io_tx_queued_bytes(void);
+
+/*
+ * Streams the next len raw bytes received on src_fd to dst_fd with splice(),
+ * bypassing framing. INVALID_FD as dst_fd discards them. Frames queued to
+ * dst_fd meanwhile are held back until the relay completes. A relay into a
+ * dst_fd that is already receiving one waits for it, right behind the frame
+ * last queued to dst_fd.
+ */
+srv_io_err_t srv_io_relay_start(int src_fd, int dst_fd, size_t len);
+
+/*
+ * Back-pressure for a connection whose frames wait behind work in flight.
+ * While it holds any, nothing more received on fd is parsed and the backend
+ * stops reading it; bytes already received are kept. Once the last hold is
+ * released they are parsed within the same loop iteration, then reading
+ * starts again.
+ */
+void srv_io_rx_hold(int fd);
+void srv_io_rx_release(int fd);
+
+/*
+ * Hot upgrade. srv_io_quiesce() stops reading and accepting and waits until
+ * the kernel holds no request, so every byte is either still in a socket or
+ * in our queues; it fails while a file is relayed and srv_io_resume() undoes
+ * it. srv_io_export() hands out a connection's partial frame and unsent
+ * bytes, the tx copy is the caller's to free. srv_io_adopt_fd() registers an
+ * inherited socket with both. srv_io_release_all() drops every connection
+ * without shutting its socket down or telling anyone.
+ */
+srv_io_err_t srv_io_quiesce(int timeout_ms);
+void srv_io_resume(void);
+srv_io_err_t srv_io_export(int fd, const uint8_t** rx, size_t* rx_len, uint8_t** tx, size_t* tx_len);
+srv_io_err_t srv_io_adopt_fd(int fd, const uint8_t* rx, size_t rx_len, const uint8_t* tx, size_t tx_len);
+void srv_io_release_all(void);
+
+/* Helpers shared by the backends. */
+void srv_io_doorbell(int efd);
+bool srv_io_conn_rx(srv_conn_t* conn, const uint8_t* data, size_t len);
+void srv_io_conn_close(srv_conn_t* conn);
+void srv_io_conn_free(srv_conn_t* conn);
+int srv_io_tx_pull(srv_conn_t* conn, int max);
+void srv_io_tx_pop(srv_conn_t* conn);
+void srv_io_tx_consume(srv_conn_t* conn, size_t len);
+void srv_io_cork(srv_conn_t* conn, bool on);
+void srv_io_relay_run(srv_conn_t* src);
+void srv_io_relay_writable(srv_conn_t* dst);
+
+#endif
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "server_io.h"
+#include "server_mgmt.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+/*
+ * Connections are registered with their pointer. Listeners and doorbells
+ * store their fd shifted up with a tag in the low bits, which a pointer to a
+ * connection never has set.
+ */
+#define EP_TAG_LISTEN     1ULL
+#define EP_TAG_DOORBELL   2ULL
+#define EP_TAG_MASK       3ULL
+#define EP_TAGGED(fd,tag) (((uint64_t)(fd) << 2) | (tag))
+#define EP_TAGGED_FD(u64) ((int)((u64) >> 2))
+
+static int epoll_fd = INVALID_FD;
+static int ep_listen_fd = INVALID_FD;
+
+static void epoll_update(srv_conn_t* conn, bool rx_paused, bool want_out)
+{
+    if( (conn->want_out == want_out) && (conn->rx_paused == rx_paused) ) return;
+
+    struct epoll_event ev;
+    // A paused reader would otherwise spin on a pending hang-up.
+    ev.events = (rx_paused ? 0 : (EPOLLIN|EPOLLRDHUP)) | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if(epoll_ctl(epoll_fd,EPOLL_CTL_MOD,conn->fd,&ev))
+    {
+        LOGE("fd : %d, [ epoll_ctl ] MOD failed, errno : %d.",conn->fd,errno);
+        srv_io_conn_close(conn);
+        return;
+    }
+    metrics_inc(METRIC_IO_SYSCALLS);
+    conn->want_out = want_out;
+    conn->rx_paused = rx_paused;
+}
+
+static void epoll_set_out(srv_conn_t* conn, bool want_out)
+{
+    epoll_update(conn,conn->rx_paused,want_out);
+}
+
+static srv_io_err_t epoll_add_tagged(int fd, uint64_t tag)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EP_TAGGED(fd,tag);
+    if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&ev))
+    {
+        LOGE("fd : %d, [ epoll_ctl ] ADD failed, errno : %d.",fd,errno);
+        return ERR_IO_INIT;
+    }
+    return IO_SUCC;
+}
+
+static srv_io_err_t epoll_init(int listen_fd)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(INVALID_FD==epoll_fd)
+    {
+        LOGE("[ epoll_create1 ] failed, errno : %d.",errno);
+        return ERR_IO_INIT;
+    }
+
+    if(IO_SUCC != epoll_add_tagged(listen_fd,EP_TAG_LISTEN))
+    {
+        close(epoll_fd);
+        epoll_fd = INVALID_FD;
+        return ERR_IO_INIT;
+    }
+    ep_listen_fd = listen_fd;
+    return IO_SUCC;
+}
+
+static srv_io_err_t epoll_add_listener(int listen_fd)
+{
+    return epoll_add_tagged(listen_fd,EP_TAG_LISTEN);
+}
+
+static srv_io_err_t epoll_add_doorbell(int efd)
+{
+    return epoll_add_tagged(efd,EP_TAG_DOORBELL);
+}
+
+static srv_io_err_t epoll_add_conn(srv_conn_t* conn)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,conn->fd,&ev))
+    {
+        LOGE("fd : %d, [ epoll_ctl ] ADD failed, errno : %d.",conn->fd,errno);
+        return ERR_IO_INIT;
+    }
+    metrics_inc(METRIC_IO_SYSCALLS);
+    return IO_SUCC;
+}
+
+/*
+ * Everything queued in this loop iteration goes out in one sendmsg() per
+ * batch pulled from the class queues. A single frame is sent as is; when the
+ * queue needs more than one call, the socket is corked so the calls still
+ * fill whole segments.
+ */
+static void epoll_flush(srv_conn_t* conn)
+{
+    bool corked = false;
+    while( (conn->tx_head) || (srv_io_tx_pull(conn,IO_PRIO_BATCH) > 0) )
+    {
+        struct iovec iov[IO_MAX_IOV];
+        int count = 0;
+        srv_tx_buf_t* buf = conn->tx_head;
+        for(; (buf) && (count < IO_MAX_IOV); buf=buf->next, count++)
+        {
+            iov[count].iov_base = buf->data + buf->off;
+            iov[count].iov_len = buf->len - buf->off;
+        }
+        if( ((buf) || (conn->prio_queued)) && (!corked) )
+        {
+            srv_io_cork(conn,true);
+            corked = true;
+        }
+
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t size = sendmsg(conn->fd, &mh, MSG_NOSIGNAL|MSG_DONTWAIT);
+        metrics_inc(METRIC_IO_SYSCALLS);
+        if(size > 0)
+        {
+            srv_io_tx_consume(conn,size);
+            continue;
+        }
+        if( (-1==size) && (EINTR==errno) )
+            continue;
+        if( (-1==size) && ((EAGAIN==errno) || (EWOULDBLOCK==errno)) )
+        {
+            // A closing connection gets one best effort attempt only.
+            if(!conn->closing)
+                epoll_set_out(conn,true);
+            break;
+        }
+        if(!conn->closing)
+            LOGE("fd : %d, error in sending, errno : %d.",conn->fd,errno);
+        srv_io_conn_close(conn);
+        break;
+    }
+    if( (corked) && (!conn->closing) )
+        srv_io_cork(conn,false);
+    if( (conn->tx_head) || (conn->closing) )
+        return;
+    conn->tx_unsent = NULL;
+    epoll_set_out(conn,false);
+}
+
+static void epoll_start_send(srv_conn_t* conn)
+{
+    // Once EPOLLOUT is armed the socket is full, wait for it instead of retrying.
+    if(conn->want_out) return;
+    epoll_flush(conn);
+}
+
+static void epoll_close_conn(srv_conn_t* conn)
+{
+    epoll_ctl(epoll_fd,EPOLL_CTL_DEL,conn->fd,NULL);
+    close(conn->fd);
+    srv_io_conn_free(conn);
+}
+
+/* While the receiver is full, stop reading the source so level triggering does not spin. */
+static void epoll_relay_wait(srv_conn_t* src, srv_conn_t* dst)
+{
+    if(!dst)
+    {
+        epoll_update(src,src->rx_holds > 0,src->want_out);
+        return;
+    }
+    epoll_update(src,true,src->want_out);
+    if(!dst->tx_head)
+        epoll_set_out(dst,true);
+}
+
+static void epoll_relay_done(srv_conn_t* src)
+{
+    epoll_update(src,src->rx_holds > 0,src->want_out);
+}
+
+static void epoll_relay_park(srv_conn_t* src)
+{
+    epoll_update(src,true,src->want_out);
+}
+
+static void epoll_rx_pause(srv_conn_t* conn, bool on)
+{
+    epoll_update(conn,on,conn->want_out);
+}
+
+static void epoll_read(srv_conn_t* conn)
+{
+    uint8_t buf[IO_READ_CHUNK];
+    size_t budget = (size_t)config_tuning()->read_budget_kb*1024;
+
+    // Held by a frame parsed in this call or by an event reported before the pause.
+    while( (budget > 0) && (!conn->closing) && (0 == conn->rx_holds) )
+    {
+        if(conn->relay_remaining > 0)
+        {
+            srv_io_relay_run(conn);
+            return;
+        }
+        ssize_t bytes = recv(conn->fd, buf, sizeof(buf), 0);
+        metrics_inc(METRIC_IO_SYSCALLS);
+        if(bytes > 0)
+        {
+            srv_io_conn_rx(conn,buf,bytes);
+            // A short read drained the socket, level triggering covers the rest.
+            if((size_t)bytes < sizeof(buf))
+                return;
+            budget = (budget > (size_t)bytes) ? budget - bytes : 0;
+            continue;
+        }
+        if(0 == bytes)
+        {
+            LOGI("Client termination detected fd : [ %d ].",conn->fd);
+            srv_io_conn_close(conn);
+            return;
+        }
+        if(EINTR == errno)
+            continue;
+        if( (EAGAIN != errno) && (EWOULDBLOCK != errno) )
+        {
+            LOGE("error in receive from client fd : %d .",conn->fd);
+            srv_io_conn_close(conn);
+        }
+        return;
+    }
+}
+
+static int epoll_run_once(int timeout_ms)
+{
+    struct epoll_event events[IO_MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, IO_MAX_EVENTS, timeout_ms);
+    metrics_inc(METRIC_IO_SYSCALLS);
+    if(n < 0)
+    {
+        if(EINTR != errno)
+            LOGE("[ epoll_wait ] failed, errno : %d.",errno);
+        return 0;
+    }
+
+    for(int i=0;i<n;i++)
+    {
+        uint64_t tag = events[i].data.u64 & EP_TAG_MASK;
+        if(EP_TAG_LISTEN == tag)
+        {
+            int listen_fd = EP_TAGGED_FD(events[i].data.u64);
+            if(ep_listen_fd == listen_fd)
+                metrics_sample_listen_queue(listen_fd);
+            int accepted = accept_pending_connections(listen_fd);
+            if(accepted>0)
+            {
+                metrics_inc(METRIC_ACCEPT_BATCHES);
+                metrics_set_max(METRIC_ACCEPT_BATCH_MAX,accepted);
+            }
+            continue;
+        }
+        if(EP_TAG_DOORBELL == tag)
+        {
+            srv_io_doorbell(EP_TAGGED_FD(events[i].data.u64));
+            continue;
+        }
+        srv_conn_t* conn = events[i].data.ptr;
+        if(conn->closing)
+            continue;
+        if(events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+            epoll_read(conn);
+        if( (events[i].events & EPOLLOUT) && (!conn->closing) )
+        {
+            epoll_flush(conn);
+            srv_io_relay_writable(conn);
+        }
+    }
+    return n;
+}
+
+static void epoll_fini(void)
+{
+    if(INVALID_FD!=epoll_fd)
+        close(epoll_fd);
+    epoll_fd = INVALID_FD;
+}
+
+const srv_io_backend_t epoll_backend = {
+    .name         = "epoll",
+    .init         = epoll_init,
+    .add_listener = epoll_add_listener,
+    .add_doorbell = epoll_add_doorbell,
+    .add_conn     = epoll_add_conn,
+    .start_send   = epoll_start_send,
+    .close_conn   = epoll_close_conn,
+    .relay_wait   = epoll_relay_wait,
+    .relay_done   = epoll_relay_done,
+    .relay_park   = epoll_relay_park,
+    .rx_pause     = epoll_rx_pause,
+    .run_once     = epoll_run_once,
+    .fini         = epoll_fini
+};
@@ -0,0 +1,958 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include "server_io.h"
+#include "server_mgmt.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+/* user_data carries a pointer with the operation in its low bits. */
+#define URING_OP_ACCEPT   1
+#define URING_OP_RECV     2
+#define URING_OP_SEND     3
+#define URING_OP_CANCEL   4
+#define URING_OP_POLL     5
+#define URING_OP_DOORBELL 6
+/* Start-up probe requests, tagged with their fd. */
+#define URING_OP_PROBE    7
+#define URING_OP_MASK     7ULL
+#define URING_PROBE_WAIT_MS 100
+#define URING_PROBE_ROUNDS  10
+
+#define URING_UD(ptr,op)  ((uint64_t)(uintptr_t)(ptr) | (op))
+#define URING_UD_PTR(ud)  ((void*)(uintptr_t)((ud) & ~URING_OP_MASK))
+#define URING_UD_OP(ud)   ((int)((ud) & URING_OP_MASK))
+/* Accepts and the doorbell carry their fd instead of a pointer. */
+#define URING_UD_FD(fd,op) (((uint64_t)(fd) << 3) | (op))
+#define URING_UD_GET_FD(ud) ((int)((ud) >> 3))
+
+static int ring_fd = INVALID_FD;
+static struct io_uring_params params;
+
+static void* ring_ptr = NULL;
+static size_t ring_sz = 0;
+static struct io_uring_sqe* sqes = NULL;
+static size_t sqes_sz = 0;
+
+static unsigned* sq_head;
+static unsigned* sq_tail;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+static unsigned sq_local_tail = 0;
+
+static struct io_uring_buf_ring* buf_ring = NULL;
+static size_t buf_ring_sz = 0;
+static uint8_t* buf_base = NULL;
+static uint16_t buf_ring_tail = 0;
+
+static int ur_listen_fd = INVALID_FD;
+static int accepts_this_round = 0;
+
+static srv_conn_t* zombie_list = NULL;
+
+/* Listeners and doorbells with the multishot request the kernel holds for them. */
+#define URING_MAX_WATCHED 8
+typedef struct{
+    int fd;
+    int op;
+    bool armed;
+}uring_watch_t;
+static uring_watch_t watched[URING_MAX_WATCHED];
+static int watched_count = 0;
+
+/* Requests held for connections, and no new ones while a hot upgrade drains them. */
+static int conn_inflight = 0;
+static bool quiescing = false;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg,0,sizeof(arg));
+    if(timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms/1000;
+        ts.tv_nsec = (timeout_ms%1000)*1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    unsigned flags = IORING_ENTER_EXT_ARG | (min_complete ? IORING_ENTER_GETEVENTS : 0);
+    metrics_inc(METRIC_IO_SYSCALLS);
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+}
+
+static unsigned uring_sq_unsubmitted(void)
+{
+    return sq_local_tail - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE);
+}
+
+static void uring_submit(void)
+{
+    unsigned to_submit = uring_sq_unsubmitted();
+    if(0==to_submit) return;
+    __atomic_store_n(sq_tail,sq_local_tail,__ATOMIC_RELEASE);
+    if(uring_enter(to_submit,0,-1) < 0)
+        LOGE("[ io_uring_enter ] submit failed, errno : %d.",errno);
+}
+
+static unsigned uring_sq_space(void)
+{
+    return params.sq_entries - uring_sq_unsubmitted();
+}
+
+static struct io_uring_sqe* uring_get_sqe(void)
+{
+    if(0==uring_sq_space())
+        uring_submit();
+    if(0==uring_sq_space())
+    {
+        LOGE("io_uring submission queue is full.");
+        return NULL;
+    }
+    struct io_uring_sqe* sqe = &sqes[sq_local_tail & *sq_mask];
+    sq_local_tail++;
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_recycle_buffer(uint16_t bid)
+{
+    struct io_uring_buf* buf = &buf_ring->bufs[buf_ring_tail & (IO_URING_BUF_COUNT-1)];
+    buf->addr = (uint64_t)(uintptr_t)(buf_base + (size_t)bid*IO_URING_BUF_SIZE);
+    buf->len = IO_URING_BUF_SIZE;
+    buf->bid = bid;
+    buf_ring_tail++;
+    __atomic_store_n(&buf_ring->tail,buf_ring_tail,__ATOMIC_RELEASE);
+}
+
+static uring_watch_t* uring_watch(int fd, int op)
+{
+    for(int i=0; i<watched_count; i++)
+    {
+        if( (fd == watched[i].fd) && (op == watched[i].op) )
+            return &watched[i];
+    }
+    if(watched_count >= URING_MAX_WATCHED)
+        return NULL;
+    watched[watched_count] = (uring_watch_t){ fd, op, false };
+    return &watched[watched_count++];
+}
+
+/* The multishot request of fd ended, false while it must stay down. */
+static bool uring_watch_ended(int fd, int op)
+{
+    uring_watch_t* w = uring_watch(fd,op);
+    if(w)
+        w->armed = false;
+    return !quiescing;
+}
+
+static void uring_arm_accept(int listen_fd)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe) return;
+    uring_watch_t* w = uring_watch(listen_fd,URING_OP_ACCEPT);
+    if(w)
+        w->armed = true;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+    sqe->user_data = URING_UD_FD(listen_fd,URING_OP_ACCEPT);
+}
+
+static void uring_arm_doorbell(int efd)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe) return;
+    uring_watch_t* w = uring_watch(efd,URING_OP_DOORBELL);
+    if(w)
+        w->armed = true;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = efd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_UD_FD(efd,URING_OP_DOORBELL);
+}
+
+static void uring_arm_recv(srv_conn_t* conn)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe)
+    {
+        srv_io_conn_close(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IO_URING_BUF_GROUP;
+    sqe->ioprio = conn->recv_oneshot ? 0 : IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_UD(conn,URING_OP_RECV);
+    conn->recv_armed = true;
+    conn->recv_cancel_sent = false;
+    conn->inflight++;
+    conn_inflight++;
+}
+
+static void uring_cancel_recv(srv_conn_t* conn)
+{
+    if( (!conn->recv_armed) || (conn->recv_cancel_sent) ) return;
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_UD(conn,URING_OP_RECV);
+    sqe->user_data = URING_UD(NULL,URING_OP_CANCEL);
+    conn->recv_cancel_sent = true;
+}
+
+/* One-shot readiness for the relay pump, which then splices with plain syscalls. */
+static void uring_poll_for_relay(srv_conn_t* src, int fd, short events)
+{
+    // Resuming runs the relay again, which asks for the poll anew.
+    if(quiescing) return;
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe)
+    {
+        srv_io_conn_close(src);
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = URING_UD(src,URING_OP_POLL);
+    src->inflight++;
+    conn_inflight++;
+}
+
+static void uring_zombie_unlink(srv_conn_t* conn)
+{
+    if(conn->prev_zombie)
+        conn->prev_zombie->next_zombie = conn->next_zombie;
+    else
+        zombie_list = conn->next_zombie;
+    if(conn->next_zombie)
+        conn->next_zombie->prev_zombie = conn->prev_zombie;
+}
+
+/* A detached connection is released once the kernel holds no more of its requests. */
+static void uring_maybe_free(srv_conn_t* conn)
+{
+    if( (!conn->detached) || (conn->inflight > 0) ) return;
+    uring_zombie_unlink(conn);
+    close(conn->fd);
+    srv_io_conn_free(conn);
+}
+
+/*
+ * The frames pulled from the class queues go out as one IOSQE_IO_LINK chain
+ * so they stay ordered; the next batch is pulled only after this one completes.
+ */
+static void uring_flush_conn(srv_conn_t* conn)
+{
+    // A closing connection still flushes what was queued before the close.
+    if( (conn->detached) || (conn->tx_inflight > 0) || (quiescing) ) return;
+    if(!conn->tx_unsent)
+        srv_io_tx_pull(conn,IO_PRIO_BATCH);
+    if(!conn->tx_unsent) return;
+
+    unsigned chain_len = 0;
+    for(srv_tx_buf_t* buf=conn->tx_unsent; buf; buf=buf->next)
+        chain_len++;
+    if(uring_sq_space() < chain_len)
+        uring_submit();
+    if(chain_len > uring_sq_space())
+        chain_len = uring_sq_space();
+
+    srv_tx_buf_t* buf = conn->tx_unsent;
+    for(unsigned i=0; i<chain_len; i++, buf=buf->next)
+    {
+        struct io_uring_sqe* sqe = uring_get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(buf->data + buf->off);
+        sqe->len = buf->len - buf->off;
+        sqe->msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+        // MSG_MORE corks every send of a burst but the last, a lone frame goes out at once.
+        if(i+1 < chain_len)
+        {
+            sqe->msg_flags |= MSG_MORE;
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        sqe->user_data = URING_UD(buf,URING_OP_SEND);
+        conn->inflight++;
+        conn->tx_inflight++;
+        conn_inflight++;
+    }
+    conn->tx_unsent = buf;
+}
+
+static void uring_handle_accept(int listen_fd, int res, unsigned flags)
+{
+    if(res >= 0)
+    {
+        accepts_this_round++;
+        handle_new_connection(res);
+    }
+    else if( (-EAGAIN != res) && (-ECONNABORTED != res) && (-EINTR != res) )
+    {
+        metrics_inc(METRIC_ACCEPT_ERRORS);
+        LOGE("multishot accept failed, err : %d.",-res);
+        if( (-EMFILE == res) || (-ENFILE == res) )
+            usleep(ACCEPT_FD_EXHAUSTED_BACKOFF_US);
+    }
+
+    if( (!(flags & IORING_CQE_F_MORE)) && (uring_watch_ended(listen_fd,URING_OP_ACCEPT)) )
+        uring_arm_accept(listen_fd);
+}
+
+static void uring_handle_doorbell(int efd, int res, unsigned flags)
+{
+    if(res > 0)
+        srv_io_doorbell(efd);
+    else if(-ECANCELED != res)
+        LOGE("doorbell poll failed, err : %d.",-res);
+    if( (!(flags & IORING_CQE_F_MORE)) && (uring_watch_ended(efd,URING_OP_DOORBELL)) )
+        uring_arm_doorbell(efd);
+}
+
+static void uring_handle_recv(srv_conn_t* conn, int res, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE))
+    {
+        conn->recv_armed = false;
+        conn->inflight--;
+        conn_inflight--;
+    }
+
+    if(res > 0)
+    {
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(!conn->closing)
+            srv_io_conn_rx(conn, buf_base + (size_t)bid*IO_URING_BUF_SIZE, res);
+        uring_recycle_buffer(bid);
+    }
+    else if(0 == res)
+    {
+        if(!conn->closing)
+        {
+            LOGI("Client termination detected fd : [ %d ].",conn->fd);
+            srv_io_conn_close(conn);
+        }
+    }
+    else if( (-ENOBUFS != res) && (-ECANCELED != res) && (!conn->closing) )
+    {
+        LOGE("error in receive from client fd : %d, err : %d.",conn->fd,-res);
+        srv_io_conn_close(conn);
+    }
+
+    if(!conn->closing)
+    {
+        // Held: what the multishot receive still delivers is kept, nothing is armed again.
+        if(conn->rx_holds > 0)
+        {
+            if(conn->recv_armed)
+                uring_cancel_recv(conn);
+        }
+        // A relay takes the socket over only once the multishot receive is gone.
+        else if(conn->relay_remaining > 0)
+        {
+            // Multishot would keep pulling payload into user space, file senders read one buffer at a time.
+            conn->recv_oneshot = true;
+            if(conn->recv_armed)
+                uring_cancel_recv(conn);
+            else
+                srv_io_relay_run(conn);
+        }
+        else if( (!conn->recv_armed) && (!quiescing) )
+        {
+            uring_arm_recv(conn);
+        }
+    }
+    uring_maybe_free(conn);
+}
+
+static void uring_handle_send(srv_tx_buf_t* buf, int res)
+{
+    srv_conn_t* conn = buf->conn;
+    conn->inflight--;
+    conn->tx_inflight--;
+    conn_inflight--;
+
+    if( (res < 0) || ((size_t)res != buf->len - buf->off) )
+    {
+        if( (!conn->closing) && (-ECANCELED != res) )
+            LOGE("fd : %d, error in sending, err : %d.",conn->fd,(res < 0) ? -res : 0);
+        srv_io_conn_close(conn);
+    }
+
+    // Linked sends complete in submission order, so this is the queue head.
+    if(conn->tx_head == buf)
+        srv_io_tx_pop(conn);
+    else
+        LOGE("fd : %d, send completion out of order.",conn->fd);
+
+    if( (0 == conn->tx_inflight) && ((conn->tx_unsent) || (conn->prio_queued)) )
+        uring_flush_conn(conn);
+    if( (!conn->tx_head) && (!conn->closing) )
+        srv_io_relay_writable(conn);
+    uring_maybe_free(conn);
+}
+
+static void uring_handle_poll(srv_conn_t* conn)
+{
+    conn->inflight--;
+    conn_inflight--;
+    if( (!conn->closing) && ((conn->relay_remaining > 0) || (conn->relay_in_pipe > 0)) )
+        srv_io_relay_run(conn);
+    uring_maybe_free(conn);
+}
+
+static int uring_reap(void)
+{
+    int count = 0;
+    unsigned head = *cq_head;
+    while(head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        head++;
+        __atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+        count++;
+
+        switch(URING_UD_OP(user_data))
+        {
+            case URING_OP_ACCEPT:
+                uring_handle_accept(URING_UD_GET_FD(user_data),res,flags);
+                break;
+
+            case URING_OP_RECV:
+                uring_handle_recv(URING_UD_PTR(user_data),res,flags);
+                break;
+
+            case URING_OP_SEND:
+                uring_handle_send(URING_UD_PTR(user_data),res);
+                break;
+
+            case URING_OP_POLL:
+                uring_handle_poll(URING_UD_PTR(user_data));
+                break;
+
+            case URING_OP_DOORBELL:
+                uring_handle_doorbell(URING_UD_GET_FD(user_data),res,flags);
+                break;
+
+            case URING_OP_CANCEL:
+            case URING_OP_PROBE:
+                break;
+        }
+    }
+    return count;
+}
+
+static void uring_teardown(void)
+{
+    if(buf_base) free(buf_base);
+    if(buf_ring) munmap(buf_ring,buf_ring_sz);
+    if(sqes) munmap(sqes,sqes_sz);
+    if(ring_ptr) munmap(ring_ptr,ring_sz);
+    if(INVALID_FD!=ring_fd) close(ring_fd);
+    buf_base = NULL;
+    buf_ring = NULL;
+    sqes = NULL;
+    ring_ptr = NULL;
+    ring_fd = INVALID_FD;
+}
+
+/* The opcodes the backend submits, checked with IORING_REGISTER_PROBE. */
+static bool uring_probe_opcodes(void)
+{
+    static const uint8_t needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+    struct io_uring_probe* probe = calloc(1,sizeof(*probe) + IORING_OP_LAST*sizeof(struct io_uring_probe_op));
+    if(!probe)
+    {
+        LOGE("calloc failed for io_uring probe.");
+        return false;
+    }
+    bool ok = (0 == syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST));
+    if(!ok)
+        LOGE("[ io_uring_register ] PROBE failed, errno : %d.",errno);
+    for(size_t i=0; (ok) && (i<sizeof(needed)); i++)
+    {
+        if( (needed[i] > probe->last_op) || (!(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) )
+        {
+            LOGE("io_uring opcode %u not supported.",needed[i]);
+            ok = false;
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+static bool uring_probe_arm(uint8_t opcode, int fd)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe) return false;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = URING_UD_FD(fd,URING_OP_PROBE);
+    if(IORING_OP_ACCEPT == opcode)
+    {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+    else
+    {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = IO_URING_BUF_GROUP;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    uring_submit();
+    return true;
+}
+
+/* Next completion of the probe request on fd, other probe completions are dropped. */
+static bool uring_probe_wait(int fd, int* res, unsigned* flags)
+{
+    uint64_t tag = URING_UD_FD(fd,URING_OP_PROBE);
+    for(int round=0; round<URING_PROBE_ROUNDS; round++)
+    {
+        unsigned head = *cq_head;
+        while(head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            bool match = (tag == cqe->user_data);
+            if(match)
+            {
+                *res = cqe->res;
+                *flags = cqe->flags;
+            }
+            if(cqe->flags & IORING_CQE_F_BUFFER)
+                uring_recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            head++;
+            __atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+            if(match)
+                return true;
+        }
+        uring_enter(0,1,URING_PROBE_WAIT_MS);
+    }
+    return false;
+}
+
+static void uring_probe_stop(int fd)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_UD_FD(fd,URING_OP_PROBE);
+    sqe->user_data = URING_UD_FD(INVALID_FD,URING_OP_PROBE);
+    uring_submit();
+
+    int res = 0;
+    unsigned flags = IORING_CQE_F_MORE;
+    while( (flags & IORING_CQE_F_MORE) && (uring_probe_wait(fd,&res,&flags)) )
+        ;
+}
+
+/* One multishot request on fd whose input is already waiting, true if it completed and stayed armed. */
+static bool uring_probe_one(uint8_t opcode, int fd, int* res)
+{
+    unsigned flags = 0;
+    *res = -ETIME;
+    if(!uring_probe_arm(opcode,fd))
+        return false;
+    bool done = uring_probe_wait(fd,res,&flags);
+    if( (!done) || (flags & IORING_CQE_F_MORE) )
+        uring_probe_stop(fd);
+    return (done) && (*res >= 0) && (flags & IORING_CQE_F_MORE);
+}
+
+/* A listener with one connection queued, binding only the family picks a free abstract name. */
+static bool uring_probe_sockets(int* lfd, int* cfd)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    *lfd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+    *cfd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+    if( (*lfd < 0) || (*cfd < 0)
+        || (bind(*lfd,(struct sockaddr*)&addr,sizeof(sa_family_t)))
+        || (listen(*lfd,1))
+        || (getsockname(*lfd,(struct sockaddr*)&addr,&addr_len))
+        || (connect(*cfd,(struct sockaddr*)&addr,addr_len))
+        || (1 != send(*cfd,"",1,MSG_NOSIGNAL)) )
+    {
+        LOGE("io_uring probe sockets failed, errno : %d.",errno);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Kernels before 5.19 (accept) and 6.0 (recv) fail every request carrying
+ * the multishot flag with EINVAL, which would leave nothing armed. One of
+ * each is tried here so srv_io_init() falls back to epoll on such kernels.
+ */
+static bool uring_probe_multishot(void)
+{
+    if(!uring_probe_opcodes())
+        return false;
+
+    int lfd = INVALID_FD;
+    int cfd = INVALID_FD;
+    int afd = INVALID_FD;
+    int len = 0;
+    bool ok = uring_probe_sockets(&lfd,&cfd);
+    if(ok)
+    {
+        ok = uring_probe_one(IORING_OP_ACCEPT,lfd,&afd);
+        if(!ok)
+            LOGE("io_uring multishot accept not supported, err : %d.",-afd);
+    }
+    if(ok)
+    {
+        ok = uring_probe_one(IORING_OP_RECV,afd,&len);
+        if(!ok)
+            LOGE("io_uring multishot recv not supported, err : %d.",-len);
+    }
+    if(afd >= 0) close(afd);
+    if(lfd >= 0) close(lfd);
+    if(cfd >= 0) close(cfd);
+    return ok;
+}
+
+static srv_io_err_t uring_init(int listen_fd)
+{
+    memset(&params,0,sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    ring_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    if( (ring_fd < 0) && (EINVAL == errno) )
+    {
+        memset(&params,0,sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    }
+    if(ring_fd < 0)
+    {
+        LOGE("[ io_uring_setup ] failed, errno : %d.",errno);
+        ring_fd = INVALID_FD;
+        return ERR_IO_NOT_SUPPORTED;
+    }
+
+    if( !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) )
+    {
+        LOGE("io_uring lacks SINGLE_MMAP/EXT_ARG, features : 0x%x.",params.features);
+        uring_teardown();
+        return ERR_IO_NOT_SUPPORTED;
+    }
+
+    size_t sq_sz = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    size_t cq_sz = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    ring_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+    ring_ptr = mmap(NULL, ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    sqes_sz = params.sq_entries*sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if( (MAP_FAILED==ring_ptr) || (MAP_FAILED==sqes) )
+    {
+        LOGE("[ mmap ] of io_uring rings failed.");
+        if(MAP_FAILED==ring_ptr) ring_ptr = NULL;
+        if(MAP_FAILED==sqes) sqes = NULL;
+        uring_teardown();
+        return ERR_IO_INIT;
+    }
+
+    uint8_t* ptr = ring_ptr;
+    sq_head  = (unsigned*)(ptr + params.sq_off.head);
+    sq_tail  = (unsigned*)(ptr + params.sq_off.tail);
+    sq_mask  = (unsigned*)(ptr + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(ptr + params.sq_off.array);
+    cq_head  = (unsigned*)(ptr + params.cq_off.head);
+    cq_tail  = (unsigned*)(ptr + params.cq_off.tail);
+    cq_mask  = (unsigned*)(ptr + params.cq_off.ring_mask);
+    cqes     = (struct io_uring_cqe*)(ptr + params.cq_off.cqes);
+    for(unsigned i=0;i<params.sq_entries;i++)
+        sq_array[i] = i;
+    sq_local_tail = *sq_tail;
+
+    // Provided buffer ring, multishot recv picks a buffer per completion.
+    buf_ring_sz = IO_URING_BUF_COUNT*sizeof(struct io_uring_buf);
+    buf_ring = mmap(NULL, buf_ring_sz, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    buf_base = malloc((size_t)IO_URING_BUF_COUNT*IO_URING_BUF_SIZE);
+    if( (MAP_FAILED==buf_ring) || (!buf_base) )
+    {
+        LOGE("Provided buffer allocation failed.");
+        if(MAP_FAILED==buf_ring) buf_ring = NULL;
+        uring_teardown();
+        return ERR_IO_MALLOC_FAILED;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = IO_URING_BUF_COUNT;
+    reg.bgid = IO_URING_BUF_GROUP;
+    if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+        LOGE("[ io_uring_register ] PBUF_RING failed, errno : %d.",errno);
+        uring_teardown();
+        return ERR_IO_NOT_SUPPORTED;
+    }
+    buf_ring_tail = 0;
+    for(uint16_t bid=0;bid<IO_URING_BUF_COUNT;bid++)
+        uring_recycle_buffer(bid);
+
+    if(!uring_probe_multishot())
+    {
+        uring_teardown();
+        return ERR_IO_NOT_SUPPORTED;
+    }
+
+    ur_listen_fd = listen_fd;
+    uring_arm_accept(listen_fd);
+    LOGI("io_uring ready, sq : %u, cq : %u, features : 0x%x.",params.sq_entries,params.cq_entries,params.features);
+    return IO_SUCC;
+}
+
+static srv_io_err_t uring_add_listener(int listen_fd)
+{
+    uring_arm_accept(listen_fd);
+    return IO_SUCC;
+}
+
+static srv_io_err_t uring_add_doorbell(int efd)
+{
+    uring_arm_doorbell(efd);
+    return IO_SUCC;
+}
+
+static srv_io_err_t uring_add_conn(srv_conn_t* conn)
+{
+    // Accepted while an upgrade drains the ring, resuming arms it.
+    if(quiescing) return IO_SUCC;
+    uring_arm_recv(conn);
+    return conn->recv_armed ? IO_SUCC : ERR_IO_INIT;
+}
+
+static void uring_start_send(srv_conn_t* conn)
+{
+    // Called once per loop iteration, the chain is submitted when the loop enters the kernel.
+    uring_flush_conn(conn);
+}
+
+static void uring_relay_wait(srv_conn_t* src, srv_conn_t* dst)
+{
+    if(!dst)
+    {
+        if(src->recv_armed)
+            uring_cancel_recv(src);
+        else
+            uring_poll_for_relay(src,src->fd,POLLIN);
+        return;
+    }
+    // With sends in flight, their completion reports the socket drained.
+    if(!dst->tx_head)
+        uring_poll_for_relay(src,dst->fd,POLLOUT);
+}
+
+static void uring_relay_done(srv_conn_t* src)
+{
+    if( (!src->recv_armed) && (!quiescing) && (0 == src->rx_holds) )
+        uring_arm_recv(src);
+}
+
+static void uring_rx_pause(srv_conn_t* conn, bool on)
+{
+    if(on)
+    {
+        if(conn->recv_armed)
+            uring_cancel_recv(conn);
+    }
+    else if( (!conn->recv_armed) && (!quiescing) && (0 == conn->relay_remaining) && (!conn->relay_parked) )
+    {
+        uring_arm_recv(conn);
+    }
+}
+
+/* Nothing is armed for a parked source, the relay ahead of it restarts it when done. */
+static void uring_relay_park(srv_conn_t* src)
+{
+    if(src->recv_armed)
+        uring_cancel_recv(src);
+}
+
+static void uring_close_conn(srv_conn_t* conn)
+{
+    conn->detached = true;
+    // Sends flushed in this iteration must reach the kernel before the shutdown.
+    if(conn->tx_inflight > 0)
+        uring_submit();
+    shutdown(conn->fd,SHUT_RDWR);
+    if(conn->inflight > 0)
+    {
+        struct io_uring_sqe* sqe = uring_get_sqe();
+        if(sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = URING_UD(NULL,URING_OP_CANCEL);
+        }
+        // A relay poll may sit on the peer's fd.
+        sqe = uring_get_sqe();
+        if(sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_UD(conn,URING_OP_POLL);
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = URING_UD(NULL,URING_OP_CANCEL);
+        }
+    }
+
+    conn->prev_zombie = NULL;
+    conn->next_zombie = zombie_list;
+    if(zombie_list)
+        zombie_list->prev_zombie = conn;
+    zombie_list = conn;
+    uring_maybe_free(conn);
+}
+
+static int uring_run_once(int timeout_ms)
+{
+    __atomic_store_n(sq_tail,sq_local_tail,__ATOMIC_RELEASE);
+
+    bool cq_ready = (*cq_head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE));
+    unsigned to_submit = uring_sq_unsubmitted();
+    if( (to_submit > 0) || (!cq_ready) )
+    {
+        int ret = uring_enter(to_submit, cq_ready ? 0 : 1, timeout_ms);
+        if( (ret < 0) && (EINTR != errno) && (ETIME != errno) )
+            LOGE("[ io_uring_enter ] failed, errno : %d.",errno);
+    }
+
+    accepts_this_round = 0;
+    int count = uring_reap();
+    if(accepts_this_round > 0)
+    {
+        metrics_sample_listen_queue(ur_listen_fd);
+        metrics_inc(METRIC_ACCEPT_BATCHES);
+        metrics_set_max(METRIC_ACCEPT_BATCH_MAX,accepts_this_round);
+    }
+    return count;
+}
+
+static void uring_cancel(uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if(!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = URING_UD(NULL,URING_OP_CANCEL);
+}
+
+/*
+ * The first pause stops all re-arming. Sends are left to finish, cutting one
+ * short would tear a frame.
+ */
+static void uring_pause_conn(srv_conn_t* conn)
+{
+    quiescing = true;
+    uring_cancel_recv(conn);
+    if(conn->inflight - conn->tx_inflight - (conn->recv_armed ? 1 : 0) > 0)
+        uring_cancel(URING_UD(conn,URING_OP_POLL));
+}
+
+static srv_io_err_t uring_quiesce(int timeout_ms)
+{
+    quiescing = true;
+    for(int i=0; i<watched_count; i++)
+    {
+        if(watched[i].armed)
+            uring_cancel(URING_UD_FD(watched[i].fd,watched[i].op));
+    }
+
+    uint64_t deadline = srv_now_ms() + timeout_ms;
+    while(1)
+    {
+        bool armed = false;
+        for(int i=0; i<watched_count; i++)
+            armed |= watched[i].armed;
+        if( (!armed) && (0 == conn_inflight) )
+            return IO_SUCC;
+        uint64_t now = srv_now_ms();
+        if(now >= deadline)
+        {
+            LOGE("io_uring still holds %d requests after %d ms.",conn_inflight,timeout_ms);
+            return ERR_IO_TX_BUSY;
+        }
+        __atomic_store_n(sq_tail,sq_local_tail,__ATOMIC_RELEASE);
+        uring_enter(uring_sq_unsubmitted(),1,(int)(deadline - now));
+        uring_reap();
+    }
+}
+
+static void uring_resume_conn(srv_conn_t* conn)
+{
+    if( (!conn->recv_armed) && (0 == conn->relay_remaining) && (!conn->relay_parked) && (0 == conn->rx_holds) )
+        uring_arm_recv(conn);
+}
+
+static void uring_resume(void)
+{
+    quiescing = false;
+    for(int i=0; i<watched_count; i++)
+    {
+        if(watched[i].armed) continue;
+        if(URING_OP_ACCEPT == watched[i].op)
+            uring_arm_accept(watched[i].fd);
+        else
+            uring_arm_doorbell(watched[i].fd);
+    }
+}
+
+static void uring_fini(void)
+{
+    uring_teardown();
+    while(zombie_list)
+    {
+        srv_conn_t* conn = zombie_list;
+        zombie_list = conn->next_zombie;
+        close(conn->fd);
+        srv_io_conn_free(conn);
+    }
+}
+
+const srv_io_backend_t uring_backend = {
+    .name         = "uring",
+    .init         = uring_init,
+    .add_listener = uring_add_listener,
+    .add_doorbell = uring_add_doorbell,
+    .add_conn     = uring_add_conn,
+    .start_send   = uring_start_send,
+    .close_conn   = uring_close_conn,
+    .relay_wait   = uring_relay_wait,
+    .relay_done   = uring_relay_done,
+    .rx_pause     = uring_rx_pause,
+    .relay_park   = uring_relay_park,
+    .run_once     = uring_run_once,
+    .fini         = uring_fini,
+    .pause_conn   = uring_pause_conn,
+    .quiesce      = uring_quiesce,
+    .resume_conn  = uring_resume_conn,
+    .resume       = uring_resume
+};
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "server_iopool.h"
+#include "server_io.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+/* A spare receive buffer links to the next one through its first bytes. */
+typedef struct rx_spare_t
+{
+    struct rx_spare_t* next;
+}rx_spare_t;
+
+static rx_spare_t* rx_spares = NULL;
+static int rx_spare_count = 0;
+static int rx_total = 0;
+
+/* Fixed size tx slots, recycled frame by frame through their next link. */
+static srv_tx_buf_t* tx_spares = NULL;
+static int tx_spare_count = 0;
+static int tx_total = 0;
+
+static int pipe_spares[IOPOOL_SPARE_PIPES][2];
+static int pipe_spare_count = 0;
+static int pipe_total = 0;
+
+/* iopool_rx_bufs, iopool_tx_bufs and iopool_pipes are the pool's size, the _max ones the most lent at once. */
+static void rx_report(void)
+{
+    metrics_set(METRIC_IOPOOL_RX_BUFS,rx_total);
+    metrics_set_max(METRIC_IOPOOL_RX_BUFS_MAX,rx_total - rx_spare_count);
+}
+
+/* Frames bigger than a slot are not counted, they are the heap's. */
+static void tx_report(void)
+{
+    metrics_set(METRIC_IOPOOL_TX_BUFS,tx_total);
+    metrics_set_max(METRIC_IOPOOL_TX_BUFS_MAX,tx_total - tx_spare_count);
+}
+
+static void pipe_report(void)
+{
+    metrics_set(METRIC_IOPOOL_PIPES,pipe_total);
+    metrics_set_max(METRIC_IOPOOL_PIPES_MAX,pipe_total - pipe_spare_count);
+}
+
+uint8_t* iopool_rx_get(void)
+{
+    uint8_t* buf = (uint8_t*)rx_spares;
+    if(buf)
+    {
+        rx_spares = rx_spares->next;
+        rx_spare_count--;
+    }
+    else if( (buf = malloc(MAX_RECV_BUFFER_LEN)) )
+    {
+        rx_total++;
+    }
+    else
+    {
+        LOGE("malloc failed for a receive buffer.");
+        return NULL;
+    }
+    rx_report();
+    return buf;
+}
+
+void iopool_rx_put(uint8_t* buf)
+{
+    if(!buf)
+        return;
+    if(rx_spare_count < IOPOOL_SPARE_RX_BUFS)
+    {
+        rx_spare_t* spare = (rx_spare_t*)buf;
+        spare->next = rx_spares;
+        rx_spares = spare;
+        rx_spare_count++;
+    }
+    else
+    {
+        free(buf);
+        rx_total--;
+    }
+    rx_report();
+}
+
+srv_tx_buf_t* iopool_tx_get(size_t len)
+{
+    if(len > IOPOOL_TX_BUF_LEN)
+    {
+        srv_tx_buf_t* big = malloc(sizeof(srv_tx_buf_t) + len);
+        if(big)
+            metrics_inc(METRIC_ARENA_HEAP_ALLOCS);
+        else
+            LOGE("malloc failed for a %zu byte frame.",len);
+        return big;
+    }
+    srv_tx_buf_t* buf = tx_spares;
+    if(buf)
+    {
+        tx_spares = buf->next;
+        tx_spare_count--;
+    }
+    else if( (buf = malloc(sizeof(srv_tx_buf_t) + IOPOOL_TX_BUF_LEN)) )
+    {
+        // Counted with the arena's, mallocs_per_msg covers every allocation of a relayed frame.
+        metrics_inc(METRIC_ARENA_HEAP_ALLOCS);
+        tx_total++;
+    }
+    else
+    {
+        LOGE("malloc failed for a tx slot.");
+        return NULL;
+    }
+    tx_report();
+    return buf;
+}
+
+void iopool_tx_put(srv_tx_buf_t* buf, size_t len)
+{
+    if(!buf)
+        return;
+    if(len > IOPOOL_TX_BUF_LEN)
+    {
+        free(buf);
+        return;
+    }
+    if(tx_spare_count < IOPOOL_SPARE_TX_BUFS)
+    {
+        buf->next = tx_spares;
+        tx_spares = buf;
+        tx_spare_count++;
+    }
+    else
+    {
+        free(buf);
+        tx_total--;
+    }
+    tx_report();
+}
+
+bool iopool_pipe_get(int fds[2])
+{
+    if(pipe_spare_count > 0)
+    {
+        pipe_spare_count--;
+        fds[0] = pipe_spares[pipe_spare_count][0];
+        fds[1] = pipe_spares[pipe_spare_count][1];
+    }
+    else if(0 == pipe2(fds,O_NONBLOCK|O_CLOEXEC))
+    {
+        fcntl(fds[1],F_SETPIPE_SZ,IO_RELAY_PIPE_SZ);
+        pipe_total++;
+    }
+    else
+    {
+        LOGE("[ pipe2 ] failed, errno : %d.",errno);
+        fds[0] = INVALID_FD;
+        fds[1] = INVALID_FD;
+        return false;
+    }
+    pipe_report();
+    return true;
+}
+
+void iopool_pipe_put(int fds[2])
+{
+    if(INVALID_FD == fds[0])
+        return;
+    if(pipe_spare_count < IOPOOL_SPARE_PIPES)
+    {
+        pipe_spares[pipe_spare_count][0] = fds[0];
+        pipe_spares[pipe_spare_count][1] = fds[1];
+        pipe_spare_count++;
+    }
+    else
+    {
+        close(fds[0]);
+        close(fds[1]);
+        pipe_total--;
+    }
+    fds[0] = INVALID_FD;
+    fds[1] = INVALID_FD;
+    pipe_report();
+}
+
+void iopool_pipe_drop(int fds[2])
+{
+    if(INVALID_FD == fds[0])
+        return;
+    close(fds[0]);
+    close(fds[1]);
+    fds[0] = INVALID_FD;
+    fds[1] = INVALID_FD;
+    pipe_total--;
+    pipe_report();
+}
+
+void iopool_fini(void)
+{
+    while(rx_spares)
+    {
+        rx_spare_t* next = rx_spares->next;
+        free(rx_spares);
+        rx_spares = next;
+    }
+    rx_spare_count = 0;
+    rx_total = 0;
+    while(tx_spares)
+    {
+        srv_tx_buf_t* next = tx_spares->next;
+        free(tx_spares);
+        tx_spares = next;
+    }
+    tx_spare_count = 0;
+    tx_total = 0;
+    for(int i=0; i<pipe_spare_count; i++)
+    {
+        close(pipe_spares[i][0]);
+        close(pipe_spares[i][1]);
+    }
+    pipe_spare_count = 0;
+    pipe_total = 0;
+}
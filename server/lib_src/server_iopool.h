@@ -0,0 +1,33 @@
+#ifndef SERVER_IOPOOL_H
+#define SERVER_IOPOOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "server_io.h"
+
+/* Spares kept once borrowed ones come back, the rest are given back. */
+#define IOPOOL_SPARE_RX_BUFS  64
+#define IOPOOL_SPARE_TX_BUFS  256
+#define IOPOOL_SPARE_PIPES    4
+/* Payload of one tx slot, a frame; bigger ones come from the heap. */
+#define IOPOOL_TX_BUF_LEN     sizeof(msg_t)
+
+/*
+ * I/O buffers lent to a connection only while it has data in flight, an
+ * idle connection holds none: a receive buffer of MAX_RECV_BUFFER_LEN while
+ * a frame split across reads is put together, a relay pipe while a file
+ * chunk passes through, a tx slot per frame queued to it. Whole frames are
+ * read from the backend's shared buffers. Loop thread only.
+ */
+uint8_t* iopool_rx_get(void);
+void iopool_rx_put(uint8_t* buf);
+/* Room for len bytes of payload, put back by the len it was taken with. */
+srv_tx_buf_t* iopool_tx_get(size_t len);
+void iopool_tx_put(srv_tx_buf_t* buf, size_t len);
+/* Only an empty pipe may be put back, one that may hold bytes is dropped. */
+bool iopool_pipe_get(int fds[2]);
+void iopool_pipe_put(int fds[2]);
+void iopool_pipe_drop(int fds[2]);
+void iopool_fini(void);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "server_mailbox.h"
+#include "server_io.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+typedef struct mail_t
+{
+    struct mail_t* next;
+    uint32_t gen;
+    msg_t msg;
+}mail_t;
+
+/* Newest frame first. scheduled is set while the mailbox sits on the ready stack. */
+typedef struct mailbox_t
+{
+    _Atomic(mail_t*) head;
+    atomic_bool scheduled;
+    struct mailbox_t* next_ready;
+}mailbox_t;
+
+static mailbox_t* boxes = NULL;
+static _Atomic(mailbox_t*) ready = NULL;
+static int bell_fd = INVALID_FD;
+static mailbox_deliver_t deliver_cb = NULL;
+/* A delivery sends to the same fd, which must not start a second round of the same mailbox. */
+static bool delivering = false;
+
+static void drain_box(mailbox_t* mb)
+{
+    int fd = (int)(mb - boxes);
+    mail_t* mail = atomic_exchange(&mb->head,NULL);
+    mail_t* fifo = NULL;
+    while(mail)
+    {
+        mail_t* next = mail->next;
+        mail->next = fifo;
+        fifo = mail;
+        mail = next;
+    }
+    uint32_t gen = srv_io_conn_gen(fd);
+    delivering = true;
+    while(fifo)
+    {
+        mail = fifo;
+        fifo = mail->next;
+        if(gen == mail->gen)
+            deliver_cb(fd,&mail->msg);
+        else
+            metrics_inc(METRIC_MAILBOX_STALE);
+        free(mail);
+    }
+    delivering = false;
+}
+
+/* One wakeup covers every mailbox posted to since the last one. */
+static void mailbox_wake(void)
+{
+    uint64_t val;
+    while( (read(bell_fd,&val,sizeof(val)) < 0) && (EINTR == errno) );
+    metrics_inc(METRIC_MAILBOX_WAKEUPS);
+
+    mailbox_t* mb = atomic_exchange(&ready,NULL);
+    while(mb)
+    {
+        // Read before clearing scheduled, a producer may put it back on the stack right after.
+        mailbox_t* next = mb->next_ready;
+        atomic_store(&mb->scheduled,false);
+        drain_box(mb);
+        mb = next;
+    }
+}
+
+int mailbox_init(mailbox_deliver_t deliver)
+{
+    boxes = calloc(IO_MAX_FDS,sizeof(*boxes));
+    bell_fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if( (!boxes) || (INVALID_FD == bell_fd) || (IO_SUCC != srv_io_add_doorbell(bell_fd,mailbox_wake)) )
+    {
+        LOGE("Mailbox setup failed, errno : %d.",errno);
+        mailbox_fini();
+        return -1;
+    }
+    deliver_cb = deliver;
+    return 0;
+}
+
+bool mailbox_post(int fd, uint32_t gen, const msg_t* msg)
+{
+    if( (!boxes) || (fd < 0) || (fd >= IO_MAX_FDS) )
+        return false;
+    mail_t* mail = malloc(sizeof(*mail));
+    if(!mail)
+        return false;
+    mail->gen = gen;
+    mail->msg = *msg;
+
+    mailbox_t* mb = &boxes[fd];
+    mail_t* head = atomic_load(&mb->head);
+    do
+    {
+        mail->next = head;
+    }while(!atomic_compare_exchange_weak(&mb->head,&head,mail));
+    metrics_inc(METRIC_MAILBOX_POSTS);
+
+    if(atomic_exchange(&mb->scheduled,true))
+        return true;
+    mailbox_t* top = atomic_load(&ready);
+    do
+    {
+        mb->next_ready = top;
+    }while(!atomic_compare_exchange_weak(&ready,&top,mb));
+    if(!top)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(bell_fd,&one,sizeof(one));
+        (void)ret;
+    }
+    return true;
+}
+
+void mailbox_flush(int fd)
+{
+    if( (!boxes) || (delivering) || (fd < 0) || (fd >= IO_MAX_FDS) )
+        return;
+    // The mailbox stays scheduled, the wakeup finds it empty.
+    if(atomic_load_explicit(&boxes[fd].head,memory_order_acquire))
+        drain_box(&boxes[fd]);
+}
+
+bool mailbox_pending(void)
+{
+    return NULL != atomic_load(&ready);
+}
+
+void mailbox_fini(void)
+{
+    for(int fd=0; (boxes) && (fd<IO_MAX_FDS); fd++)
+    {
+        mail_t* mail = atomic_exchange(&boxes[fd].head,NULL);
+        while(mail)
+        {
+            mail_t* next = mail->next;
+            free(mail);
+            mail = next;
+        }
+    }
+    free(boxes);
+    boxes = NULL;
+    atomic_store(&ready,NULL);
+    if(INVALID_FD != bell_fd)
+        close(bell_fd);
+    bell_fd = INVALID_FD;
+}
@@ -0,0 +1,34 @@
+#ifndef SERVER_MAILBOX_H
+#define SERVER_MAILBOX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chat_app_common.h"
+
+/* Sends one posted frame, on the loop. */
+typedef void (*mailbox_deliver_t)(int fd, const msg_t* msg);
+
+/*
+ * Every connection belongs to the loop thread, the only one writing to its
+ * socket. Other threads hand frames to it through the connection's mailbox,
+ * a lock-free multi-producer stack; the first post into an idle set of
+ * mailboxes rings one eventfd, whatever follows before the loop wakes rides
+ * on that wakeup.
+ */
+int mailbox_init(mailbox_deliver_t deliver);
+void mailbox_fini(void);
+
+/*
+ * Any thread. gen is srv_io_conn_gen() of the connection the frame is meant
+ * for, read on the loop; a frame for an earlier connection on the same fd is
+ * dropped.
+ */
+bool mailbox_post(int fd, uint32_t gen, const msg_t* msg);
+/*
+ * Loop side: delivers what was posted to fd so far. Called before the loop
+ * sends anything of its own to fd, so a frame posted first goes out first.
+ */
+void mailbox_flush(int fd);
+bool mailbox_pending(void);
+
+#endif
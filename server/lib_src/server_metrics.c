@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "server_metrics.h"
+#include "logger.h"
+
+#define NETSTAT_PATH "/proc/net/netstat"
+
+const char *metricStr[] = {
+    "UNDEFINED_METRIC",
+    "accepted_total",
+    "accept_batches",
+    "accept_batch_max",
+    "accept_errors",
+    "rejected_max_client",
+    "listen_queue_hwm",
+    "listen_drops",
+    "heartbeats_sent",
+    "handshake_timeouts",
+    "dead_peer_evictions",
+    "idle_evictions",
+    "conn_req_expired",
+    "rx_msgs",
+    "tx_msgs",
+    "io_loop_wakeups",
+    "io_syscalls",
+    "file_chunks",
+    "relay_bytes_spliced",
+    "relay_bytes_copied",
+    "compressed_relayed",
+    "compressed_inflated",
+    "tx_flushes",
+    "tx_batch_max",
+    "node_relays",
+    "nodes_down",
+    "shm_upgrades",
+    "shm_rx_msgs",
+    "shm_tx_msgs",
+    "shm_wakeups",
+    "tx_prio_jumps",
+    "tx_prio_aged",
+    "rate_limited",
+    "rate_limit_evictions",
+    "overload_shed",
+    "overload_rejected",
+    "loop_lag_max_ms",
+    "work_offloaded",
+    "work_stolen",
+    "work_deferred",
+    "rx_holds",
+    "mailbox_posts",
+    "mailbox_wakeups",
+    "mailbox_stale",
+    "arena_bytes",
+    "arena_heap_allocs",
+    "arena_chunks_max",
+    "iopool_rx_bufs",
+    "iopool_rx_bufs_max",
+    "iopool_tx_bufs",
+    "iopool_tx_bufs_max",
+    "arena_chunks_pinned",
+    "iopool_pipes",
+    "iopool_pipes_max"
+};
+
+static atomic_uint_fast64_t metrics[METRIC_MAX];
+
+static uint64_t listen_drops_base = 0;
+static uint64_t last_report_accepted = 0;
+static uint64_t last_report_rx = 0;
+static uint64_t last_report_arena_bytes = 0;
+static uint64_t last_report_heap_allocs = 0;
+static struct timespec last_report_ts;
+
+/* ListenDrops from the TcpExt line, covers every listener in this net namespace. */
+static uint64_t read_listen_drops(void)
+{
+    FILE *fp = fopen(NETSTAT_PATH,"r");
+    if(!fp)
+    {
+        LOGE("Cannot open %s.",NETSTAT_PATH);
+        return 0;
+    }
+
+    char names[4096];
+    char values[4096];
+    uint64_t drops = 0;
+
+    while( fgets(names,sizeof(names),fp) && fgets(values,sizeof(values),fp) )
+    {
+        if(strncmp(names,"TcpExt:",7)) continue;
+
+        char *name_save = NULL;
+        char *val_save  = NULL;
+        char *name = strtok_r(names," \n",&name_save);
+        char *val  = strtok_r(values," \n",&val_save);
+        while(name && val)
+        {
+            if(0==strcmp(name,"ListenDrops"))
+            {
+                drops = strtoull(val,NULL,10);
+                break;
+            }
+            name = strtok_r(NULL," \n",&name_save);
+            val  = strtok_r(NULL," \n",&val_save);
+        }
+        break;
+    }
+    fclose(fp);
+    return drops;
+}
+
+void metrics_init(void)
+{
+    for(int i=0;i<METRIC_MAX;i++)
+        atomic_store(&metrics[i],0);
+
+    listen_drops_base = read_listen_drops();
+    last_report_accepted = 0;
+    last_report_rx = 0;
+    last_report_arena_bytes = 0;
+    last_report_heap_allocs = 0;
+    clock_gettime(CLOCK_MONOTONIC,&last_report_ts);
+    LOGI("Metrics init done, listen drops baseline : %lu.",listen_drops_base);
+}
+
+void metrics_inc(metric_id_t id)
+{
+    if(id >= METRIC_MAX) return;
+    atomic_fetch_add_explicit(&metrics[id],1,memory_order_relaxed);
+}
+
+void metrics_add(metric_id_t id, uint64_t val)
+{
+    if(id >= METRIC_MAX) return;
+    atomic_fetch_add_explicit(&metrics[id],val,memory_order_relaxed);
+}
+
+void metrics_set_max(metric_id_t id, uint64_t val)
+{
+    if(id >= METRIC_MAX) return;
+    uint64_t cur = atomic_load_explicit(&metrics[id],memory_order_relaxed);
+    while( (val > cur) &&
+           !atomic_compare_exchange_weak_explicit(&metrics[id],&cur,val,memory_order_relaxed,memory_order_relaxed) );
+}
+
+void metrics_set(metric_id_t id, uint64_t val)
+{
+    if(id >= METRIC_MAX) return;
+    atomic_store_explicit(&metrics[id],val,memory_order_relaxed);
+}
+
+uint64_t metrics_get(metric_id_t id)
+{
+    if(id >= METRIC_MAX) return 0;
+    return atomic_load_explicit(&metrics[id],memory_order_relaxed);
+}
+
+const char *metric_to_str(metric_id_t id)
+{
+    if(id >= METRIC_MAX) return metricStr[0];
+    return metricStr[id+1];
+}
+
+void metrics_sample_listen_queue(int listen_fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info,0,sizeof(info));
+
+    /* For a listening socket tcpi_unacked is the current accept queue length. */
+    if(0==getsockopt(listen_fd,IPPROTO_TCP,TCP_INFO,&info,&len))
+        metrics_set_max(METRIC_LISTEN_QUEUE_HWM,info.tcpi_unacked);
+}
+
+void metrics_report(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+
+    double elapsed = (now.tv_sec - last_report_ts.tv_sec) +
+                     (now.tv_nsec - last_report_ts.tv_nsec)/1e9;
+    uint64_t accepted = metrics_get(METRIC_ACCEPTED_TOTAL);
+    double accept_rate = (elapsed > 0) ? (accepted - last_report_accepted)/elapsed : 0;
+
+    uint64_t drops = read_listen_drops();
+    if(drops >= listen_drops_base)
+        atomic_store(&metrics[METRIC_LISTEN_DROPS],drops - listen_drops_base);
+
+    LOGI("---------------- server metrics ----------------");
+    for(int i=0;i<METRIC_MAX;i++)
+        LOGI("%-22s : %lu",metric_to_str(i),metrics_get(i));
+    LOGI("%-22s : %.1f/s","accept_rate",accept_rate);
+
+    // What the loop allocated per received frame since the last report.
+    uint64_t rx = metrics_get(METRIC_RX_MSGS) + metrics_get(METRIC_SHM_RX_MSGS);
+    uint64_t arena_bytes = metrics_get(METRIC_ARENA_BYTES);
+    uint64_t heap_allocs = metrics_get(METRIC_ARENA_HEAP_ALLOCS);
+    double frames = (double)(rx - last_report_rx);
+    LOGI("%-22s : %.1f","alloc_bytes_per_msg",(frames > 0) ? (arena_bytes - last_report_arena_bytes)/frames : 0);
+    LOGI("%-22s : %.3f","mallocs_per_msg",(frames > 0) ? (heap_allocs - last_report_heap_allocs)/frames : 0);
+
+    last_report_rx = rx;
+    last_report_arena_bytes = arena_bytes;
+    last_report_heap_allocs = heap_allocs;
+    last_report_accepted = accepted;
+    last_report_ts = now;
+}
@@ -0,0 +1,77 @@
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_REPORT_INTERVAL_SEC  10
+
+typedef enum{
+    METRIC_ACCEPTED_TOTAL=0,
+    METRIC_ACCEPT_BATCHES,
+    METRIC_ACCEPT_BATCH_MAX,
+    METRIC_ACCEPT_ERRORS,
+    METRIC_REJECTED_MAX_CLIENT,
+    METRIC_LISTEN_QUEUE_HWM,
+    METRIC_LISTEN_DROPS,
+    METRIC_HEARTBEATS_SENT,
+    METRIC_HANDSHAKE_TIMEOUTS,
+    METRIC_DEAD_PEER_EVICTIONS,
+    METRIC_IDLE_EVICTIONS,
+    METRIC_CONN_REQ_EXPIRED,
+    METRIC_RX_MSGS,
+    METRIC_TX_MSGS,
+    METRIC_IO_LOOP_WAKEUPS,
+    METRIC_IO_SYSCALLS,
+    METRIC_FILE_CHUNKS,
+    METRIC_RELAY_BYTES_SPLICED,
+    METRIC_RELAY_BYTES_COPIED,
+    METRIC_COMPRESSED_RELAYED,
+    METRIC_COMPRESSED_INFLATED,
+    METRIC_TX_FLUSHES,
+    METRIC_TX_BATCH_MAX,
+    METRIC_NODE_RELAYS,
+    METRIC_NODES_DOWN,
+    METRIC_SHM_UPGRADES,
+    METRIC_SHM_RX_MSGS,
+    METRIC_SHM_TX_MSGS,
+    METRIC_SHM_WAKEUPS,
+    METRIC_TX_PRIO_JUMPS,
+    METRIC_TX_PRIO_AGED,
+    METRIC_RATE_LIMITED,
+    METRIC_RATE_LIMIT_EVICTIONS,
+    METRIC_OVERLOAD_SHED,
+    METRIC_OVERLOAD_REJECTED,
+    METRIC_LOOP_LAG_MAX_MS,
+    METRIC_WORK_OFFLOADED,
+    METRIC_WORK_STOLEN,
+    METRIC_WORK_DEFERRED,
+    METRIC_RX_HOLDS,
+    METRIC_MAILBOX_POSTS,
+    METRIC_MAILBOX_WAKEUPS,
+    METRIC_MAILBOX_STALE,
+    METRIC_ARENA_BYTES,
+    METRIC_ARENA_HEAP_ALLOCS,
+    METRIC_ARENA_CHUNKS_MAX,
+    METRIC_IOPOOL_RX_BUFS,
+    METRIC_IOPOOL_RX_BUFS_MAX,
+    METRIC_IOPOOL_TX_BUFS,
+    METRIC_IOPOOL_TX_BUFS_MAX,
+    METRIC_ARENA_CHUNKS_PINNED,
+    METRIC_IOPOOL_PIPES,
+    METRIC_IOPOOL_PIPES_MAX,
+    METRIC_MAX
+}metric_id_t;
+
+void metrics_init(void);
+void metrics_inc(metric_id_t id);
+void metrics_add(metric_id_t id, uint64_t val);
+void metrics_set_max(metric_id_t id, uint64_t val);
+/* For a gauge, the value currently in effect. */
+void metrics_set(metric_id_t id, uint64_t val);
+uint64_t metrics_get(metric_id_t id);
+const char *metric_to_str(metric_id_t id);
+
+void metrics_sample_listen_queue(int listen_fd);
+void metrics_report(void);
+
+#endif
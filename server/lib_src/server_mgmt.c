@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,12 +7,15 @@
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
-#include <signal.h>
-#include <sys/select.h>
-#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "logger.h"
 #include "server_mgmt.h"
 #include "server_queue.h"
+#include "server_metrics.h"
+#include "server_timer.h"
+#include "server_compress.h"
 
 
 
@@ -48,27 +52,116 @@ const char *msgTypeStr[] = {
 	"MSG_CLIENT_DISCONNECTED",
 	"MSG_CLIENT_CHAT_READY",
 	"MSG_CLIENT_CHANGE_CONN_FD_REQ",
-    "MSG_MAX_CLIENT_REACHED"
+    "MSG_MAX_CLIENT_REACHED",
+    "MSG_HEARTBEAT_REQ",
+    "MSG_HEARTBEAT_ACK",
+    "MSG_CONNECTION_REQ_EXPIRED",
+    "MSG_CLIENT_IDLE_TIMEOUT",
+    "MSG_FILE_OFFER",
+    "MSG_FILE_DATA",
+    "MSG_FILE_CANCEL",
+    "MSG_CLIENT_TX_COMPRESSED",
+    "MSG_CLIENT_RX_COMPRESSED",
+    "MSG_CHANNEL_LIMIT",
+    "MSG_SHM_UPGRADE_REQ",
+    "MSG_SHM_UPGRADE_ACK",
+    "MSG_SHM_UPGRADE_NACK",
+    "MSG_RATE_LIMITED",
+    "MSG_SERVER_BUSY",
+    "MSG_SERVER_SHUTDOWN"
 };
 
 int server_fd = INVALID_FD;
+int unix_server_fd = INVALID_FD;
+char unix_server_path[UNIX_PATH_LEN];
 struct sockaddr_in address;
 int addrlen = sizeof(address);
+/*
+ * Client data only changes on the loop thread, under this mutex so that
+ * workers reading it see whole updates. The loop's own reads skip it, as do
+ * writes to what workers never read: activity stamps and rate state.
+ */
 pthread_mutex_t client_data_mutex;
+/* Set once the loop saw the shutdown request, the teardown then skips peer notices. */
 bool server_terminate = false;
-extern uint8_t total_available_clients;
+/* The request being handled, its id is echoed on replies to the same fd. */
+int reply_fd = INVALID_FD;
+uint16_t reply_req_id = 0;
+/* Per channel request timers carry both the fd and the channel in their argument. */
+#define CHANNEL_TIMER_ARG(fd,ch)   ((void*)(intptr_t)(((fd)<<8)|(ch)))
+#define CHANNEL_TIMER_FD(arg)      ((int)((intptr_t)(arg)>>8))
+#define CHANNEL_TIMER_CH(arg)      ((uint8_t)((intptr_t)(arg)&0xff))
+
+/* Other end of a conversation, a client here or on another node. */
+typedef struct
+{
+    uint8_t node;
+    int fd;
+    uint8_t channel;
+}chat_peer_t;
+
+/* A frame held back while earlier work of its client is with a worker. */
+typedef struct
+{
+    int fd;
+    msg_t msg;
+    bool shed;
+    rate_verdict_t verdict;
+    uint32_t retry_after_ms;
+}deferred_rx_t;
+
+/* gen is srv_io_conn_gen() of the fd the result goes to, taken at submit. */
+typedef struct
+{
+    int fd;
+    uint32_t gen;
+    msg_t msg;
+}roster_job_t;
+
+typedef struct
+{
+    int src_fd;
+    int conn_fd;
+    uint32_t gen;
+    uint8_t peer_ch;
+    msg_t msg;
+    int len;
+    char text[CHAT_TEXT_MAX_LEN];
+}inflate_job_t;
 /**************************/
 
 /* FUNCTIONS DECLARATIONS */
-void* client_thread(void* arg);
-void handle_rx_msg(msg_t msg,int fd);
-srv_err_type wait_to_recv_something(int fd,msg_t* rx_msg);
-srv_err_type send_msg_to_fd(int fd,msg_t send_msg);
+void handle_rx_msg(const msg_t* msg,int fd);
+srv_err_type send_msg_to_fd(int fd,const msg_t* send_msg);
+srv_err_type send_deferred_reply(int fd, uint16_t req_id, const msg_t* msg);
+static void deliver_mail(int fd, const msg_t* msg);
+srv_err_type send_to_peer(const chat_peer_t* peer, const msg_t* msg);
+srv_err_type relay_to_peer(const chat_peer_t* peer, msg_type_t type, const msg_t* msg);
+srv_err_type send_conn_establish_msg(int fd);
 void handle_chat_connection_request(int fd,char* conn_client_name);
-void handle_conn_accept(int fd, msg_t msg);
-void handle_tx_msg(int fd, msg_t msg);
-void handle_decline_conn_request(int fd);
-void handle_change_conn_fd_req(int fd, msg_t msg);
+void handle_remote_connection_request(int fd,char* conn_client_name);
+void handle_conn_accept(int fd, const msg_t* msg);
+void handle_tx_msg(int fd, const msg_t* msg);
+void handle_tx_compressed(int fd, const msg_t* msg);
+void deliver_compressed(int src_fd, int conn_fd, uint8_t peer_ch, const msg_t* msg);
+void handle_decline_conn_request(int fd, const msg_t* msg);
+void handle_change_conn_fd_req(int fd, const msg_t* msg);
+void handle_file_ctrl(int fd, const msg_t* msg);
+void handle_file_data(int fd, const msg_t* msg);
+void handle_shm_upgrade(int fd);
+void send_rate_limited(int fd, const msg_t* msg, uint32_t retry_after_ms);
+void send_server_busy(int fd, const msg_t* msg, uint32_t retry_after_ms);
+void drain_clients(void);
+void dispatch_rx_msg(int fd, const msg_t* msg, bool shed, rate_verdict_t verdict, uint32_t retry_after_ms);
+static void deferred_rx_done(void* arg, bool cancelled);
+void init_client_timers(int fd, client_data_t* data);
+void handshake_timeout_cb(void* arg);
+void idle_timeout_cb(void* arg);
+void conn_req_timeout_cb(void* arg);
+bool get_chat_peer(int fd, uint8_t* channel, chat_peer_t* peer);
+srv_queue_err_type_t rename_client(client_data_t* data, char* name);
+void node_down_cb(client_data_t* data, void* arg);
+void reclaim_name_cb(client_data_t* data, void* arg);
 /**************************/
 
 const char *msgTypeToStr(msg_type_t type)
@@ -77,15 +170,6 @@ const char *msgTypeToStr(msg_type_t type)
 	return msgTypeStr[type+1];
 }
 
-void sig_int_handler(int sig)
-{
-    if(SIGINT==sig)
-    {
-        LOGI("Server termination signal by user.");
-        server_terminate = true;
-    }
-}
-
 void print_bin_info(void)
 {
     printf("*********************************************\n");
@@ -95,230 +179,608 @@ void print_bin_info(void)
     printf("*********************************************\n\n");
 }
 
-srv_err_type init_srv(void)
+/* listen() silently truncates the backlog to net.core.somaxconn. */
+void check_listen_backlog_limit(void)
 {
-    print_bin_info();
-    int ret=-1;
-    struct sigaction sa;
-    sa.sa_handler = sig_int_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0; // <- do NOT set SA_RESTART
-    sigaction(SIGINT, &sa, NULL);
-
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(INVALID_FD==server_fd){
+    FILE *fp = fopen(SOMAXCONN_PATH,"r");
+    if(!fp)
+    {
+        LOGE("Cannot read %s.",SOMAXCONN_PATH);
+        return;
+    }
+    int somaxconn = 0;
+    if( (1==fscanf(fp,"%d",&somaxconn)) && (somaxconn<MAX_LISTEN) )
+    {
+        LOGE("Listen backlog %d is capped to somaxconn %d, raise %s.",MAX_LISTEN,somaxconn,SOMAXCONN_PATH);
+    }
+    else
+    {
+        LOGI("Listen backlog : %d.",MAX_LISTEN);
+    }
+    fclose(fp);
+}
+
+/* A leftover socket file is replaced, unless a server still answers on it. */
+int open_unix_listener(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        LOGE("UNIX socket path too long : %s.",path);
+        return INVALID_FD;
+    }
+    strcpy(addr.sun_path,path);
+
+    int probe_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if( (INVALID_FD!=probe_fd) && (0==connect(probe_fd,(struct sockaddr*)&addr,sizeof(addr))) )
+    {
+        LOGE("Another server listens on %s.",path);
+        close(probe_fd);
+        return INVALID_FD;
+    }
+    if(INVALID_FD!=probe_fd)
+        close(probe_fd);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(INVALID_FD==fd)
+    {
+        LOGE("Failed to get UNIX socket for server.");
+        return INVALID_FD;
+    }
+    if( (bind(fd,(struct sockaddr*)&addr,sizeof(addr))) || (listen(fd,MAX_LISTEN)) )
+    {
+        LOGE("[ bind/listen ] failed for %s, errno : %d.",path,errno);
+        close(fd);
+        return INVALID_FD;
+    }
+    LOGI("Listening on UNIX socket %s.",path);
+    return fd;
+}
+
+int open_tcp_listener(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(INVALID_FD==fd){
         LOGE(" Failed to get socket for server.");
-        return ERR_LIB_INIT;
+        return INVALID_FD;
     }
 
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(SERVER_PORT);
+    address.sin_port = htons(port);
 
     // to remove re-use error
     int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-    ret=bind(server_fd, (struct sockaddr*)&address, sizeof(address));
+    int ret=bind(fd, (struct sockaddr*)&address, sizeof(address));
     if(-1==ret){
         LOGE("[ bind ] failed.");
-        return ERR_LIB_INIT;
+        close(fd);
+        return INVALID_FD;
     }
 
-    ret=listen(server_fd, MAX_LISTEN);
+    ret=listen(fd, MAX_LISTEN);
     if(-1==ret){
         LOGE("[ listen ] failed.");
-        return ERR_LIB_INIT;
+        close(fd);
+        return INVALID_FD;
+    }
+    check_listen_backlog_limit();
+    return fd;
+}
+
+srv_err_type init_srv(const srv_config_t* config)
+{
+    config_init(config);
+    print_bin_info();
+
+    // A successor inherits the listeners, queued connections included.
+    handover_listeners_t listeners = { INVALID_FD, INVALID_FD, "", INVALID_FD };
+    int handover_fd = INVALID_FD;
+    if(config->takeover)
+    {
+        handover_fd = handover_connect(config->port,&listeners);
+        if(INVALID_FD==handover_fd)
+            return ERR_LIB_INIT;
+        server_fd = listeners.tcp_fd;
+    }
+    else
+    {
+        server_fd = open_tcp_listener(config->port);
+        if(INVALID_FD==server_fd)
+            return ERR_LIB_INIT;
     }
+    metrics_init();
+    rate_init(&config->tuning.rate);
 
     if (pthread_mutex_init(&client_data_mutex, NULL) != 0) {
         LOGE("[ server ] client_data_mutex init failed.");
         return ERR_LIB_INIT;
     }
+    srv_timer_service_start();
+    overload_init(&config->tuning.overload);
+    if(IO_SUCC != srv_io_init(config->io_backend,server_fd))
+    {
+        LOGE("[ server ] I/O backend init failed.");
+        return ERR_LIB_INIT;
+    }
+    if( (0 != shutdown_init()) || (0 != mailbox_init(deliver_mail)) || (0 != workpool_init(config->workers)) )
+        return ERR_LIB_INIT;
+    if( (config->takeover) ? (INVALID_FD!=listeners.unix_fd) : (0!=config->unix_path[0]) )
+    {
+        const char* path = (config->takeover) ? listeners.unix_path : config->unix_path;
+        unix_server_fd = (config->takeover) ? listeners.unix_fd : open_unix_listener(path);
+        if( (INVALID_FD==unix_server_fd) || (IO_SUCC!=srv_io_add_listener(unix_server_fd)) || (0!=shm_init(listeners.doorbell_fd)) )
+        {
+            LOGE("[ server ] UNIX socket init failed.");
+            return ERR_LIB_INIT;
+        }
+        snprintf(unix_server_path,sizeof(unix_server_path),"%s",path);
+    }
+    if(config->cluster)
+    {
+        char self_addr[CLUSTER_ADDR_LEN];
+        snprintf(self_addr,sizeof(self_addr),"%s:%u",config->advertise_ip,config->port);
+        if(0 != cluster_init(self_addr,config->seeds,config->seed_count))
+        {
+            LOGE("[ server ] cluster init failed.");
+            return ERR_LIB_INIT;
+        }
+    }
+    if( (INVALID_FD!=handover_fd) && (!handover_receive(handover_fd)) )
+        return ERR_LIB_INIT;
+    listeners.tcp_fd = server_fd;
+    listeners.unix_fd = unix_server_fd;
+    snprintf(listeners.unix_path,sizeof(listeners.unix_path),"%s",unix_server_path);
+    if(0 != config_service_init())
+        return ERR_LIB_INIT;
+    handover_listen(config->port,&listeners);
     LOGI("Server init done.");
     return SERVER_SUCC;
 }
 
-srv_err_type wait_for_client_conn_and_accept(void)
+void handle_new_connection(int socket_fd)
+{
+    LOGD("new client connection , fd : %d.",socket_fd);
+    if(server_terminate)
+    {
+        // Accepted while draining, it would be dropped a moment later anyway.
+        msg_t shutdown_msg={0};
+        shutdown_msg.msg_type=MSG_SERVER_SHUTDOWN;
+        send(socket_fd,&shutdown_msg,sizeof(shutdown_msg),MSG_DONTWAIT|MSG_NOSIGNAL);
+        close(socket_fd);
+        return;
+    }
+    uint32_t retry_after_ms = 0;
+    if(!overload_admit_conn(&retry_after_ms))
+    {
+        // Refused before any state is set up, the hint tells the client when to come back.
+        metrics_inc(METRIC_OVERLOAD_REJECTED);
+        msg_t busy_msg={0};
+        busy_msg.msg_type=MSG_SERVER_BUSY;
+        rate_limit_info_t info = { (uint32_t)MSG_CONN_ESTABLISH_REQ, retry_after_ms };
+        memcpy(busy_msg.msg_data.buffer,&info,sizeof(info));
+        send(socket_fd,&busy_msg,sizeof(busy_msg),MSG_DONTWAIT|MSG_NOSIGNAL);
+        close(socket_fd);
+        return;
+    }
+    if(!reserve_client_slot())
+    {
+        // Not registered with the I/O backend, so a best-effort direct send.
+        metrics_inc(METRIC_REJECTED_MAX_CLIENT);
+        msg_t max_client_msg={0};
+        max_client_msg.msg_type=MSG_MAX_CLIENT_REACHED;
+        send(socket_fd,&max_client_msg,sizeof(max_client_msg),MSG_DONTWAIT|MSG_NOSIGNAL);
+        close(socket_fd);
+        return;
+    }
+
+    LOCK_CLIENT_DATA_MUTEX();
+    srv_queue_err_type_t ret_val = add_client_node_to_queue(&socket_fd);
+    if(ret_val!=SERVER_QUEUE_SUCC)
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGE("Adding client node failed : %s. err : %d.",queueErrToStr(ret_val),ret_val);
+        release_client_slot();
+        close(socket_fd);
+        return;
+    }
+    client_data_t* data = get_client_data_by_fd(socket_fd);
+    init_client_timers(socket_fd,data);
+    srv_timer_arm(&data->handshake_timer,config_tuning()->handshake_timeout_ms);
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    if(IO_SUCC != srv_io_add_fd(socket_fd))
+    {
+        LOGE("fd : %d, cannot register with I/O backend.",socket_fd);
+        LOCK_CLIENT_DATA_MUTEX();
+        remove_client_node_from_queue_by_fd(socket_fd);
+        UNLOCK_CLIENT_DATA_MUTEX();
+        close(socket_fd);
+        return;
+    }
+    metrics_inc(METRIC_ACCEPTED_TOTAL);
+    send_conn_establish_msg(socket_fd);
+}
+
+void init_client_timers(int fd, client_data_t* data)
+{
+    srv_timer_init(&data->handshake_timer,handshake_timeout_cb,(void*)(intptr_t)fd);
+    srv_timer_init(&data->idle_timer,idle_timeout_cb,(void*)(intptr_t)fd);
+    for(int ch=1; ch<=MAX_CHANNELS; ch++)
+        srv_timer_init(&get_channel(data,ch)->conn_req_timer,conn_req_timeout_cb,CHANNEL_TIMER_ARG(fd,ch));
+}
+
+/* Drains the accept queue, bounded so a storm cannot starve the terminate check. */
+int accept_pending_connections(int listen_fd)
 {
-    pthread_t thread_id;
-    fd_set rfds;
-    while(!server_terminate)
+    int accepted = 0;
+    int batch = (int)config_tuning()->accept_batch;
+    while(accepted < batch)
     {
-        LOGI("Waiting for client connection.");
-        int socket_fd = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
-        if(-1==socket_fd)
+        int socket_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if(INVALID_FD==socket_fd)
         {
-            if(errno == EINTR && server_terminate)
-            {
-                LOGI("Server termination signal received, terminating server.");
+            if( (EAGAIN==errno) || (EWOULDBLOCK==errno) )
                 break;
+            if(ECONNABORTED==errno)
+                continue;
+            if(EINTR==errno)
+            {
+                if(shutdown_requested()) break;
+                continue;
             }
-            LOGE("[ accept ] failed.");
+
+            metrics_inc(METRIC_ACCEPT_ERRORS);
+            LOGE("[ accept4 ] failed, errno : %d.",errno);
+            if( (EMFILE==errno) || (ENFILE==errno) )
+                usleep(ACCEPT_FD_EXHAUSTED_BACKOFF_US);
+            break;
         }
-        else
+        accepted++;
+        handle_new_connection(socket_fd);
+    }
+    return accepted;
+}
+
+/*
+ * Single event loop: the backend sleeps until I/O or the nearest timer
+ * deadline, a shutdown request rings an eventfd the backend waits on.
+ * A successor is served between iterations, never from inside a callback.
+ */
+srv_err_type wait_for_client_conn_and_accept(void)
+{
+    bool handed_over = false;
+    uint64_t next_report = srv_now_ms() + METRICS_REPORT_INTERVAL_SEC*1000;
+    LOGI("Waiting for client connection, I/O backend : %s.",srv_io_backend_name());
+    while(!shutdown_requested())
+    {
+        uint64_t now = srv_now_ms();
+        int timeout_ms = (next_report > now) ? (int)(next_report - now) : 0;
+        int timer_ms = srv_timer_next_timeout_ms();
+        if( (timer_ms >= 0) && (timer_ms < timeout_ms) )
+            timeout_ms = timer_ms;
+
+        srv_io_run_once(timeout_ms);
+        // How late the due timers run is how long work waited on the loop.
+        if(timer_ms >= 0)
         {
-            LOCK_CLIENT_DATA_MUTEX();
-            int temp_client_count = total_available_clients;
-            UNLOCK_CLIENT_DATA_MUTEX();
-            if(temp_client_count<MAX_CLIENT)
-            {
-                int* new_socket = malloc(sizeof(int));
-                if (!new_socket)
-                {
-                    LOGE("malloc failed to allocate memory for new_socket.");
-                    sleep(1);
-                    continue;
-                }    
-                *new_socket = socket_fd;
-                LOGI("new client connection , fd : %d.",*new_socket);
-                if(pthread_create(&thread_id,
-                                  NULL,
-                                  client_thread,
-                                  new_socket)
-                )
-                {
-                    free(new_socket);
-                    LOGE("[ pthread_create ] failed.");
-                    return ERR_THREAD_CREATE;
-                }    
-            }
-            else
-            {
-                LOGE("Max client limit reached !!!. client count : %d.",temp_client_count);
-                msg_t max_client_msg={0};
-                max_client_msg.msg_type=MSG_MAX_CLIENT_REACHED;
-                send_msg_to_fd(socket_fd,max_client_msg);        
-            }
+            uint64_t due = now + timer_ms;
+            uint64_t woke = srv_now_ms();
+            overload_note_lag((woke > due) ? (woke - due) : 0);
+        }
+        srv_timer_run_expired();
+
+        if(srv_now_ms() >= next_report)
+        {
+            metrics_report();
+            next_report = srv_now_ms() + METRICS_REPORT_INTERVAL_SEC*1000;
         }
+        config_poll();
+        if(handover_poll())
+        {
+            handed_over = true;
+            break;
+        }
+    }
+    if(handed_over)
+    {
+        // The sockets live on in the successor: nothing is shut down, unlinked or sent.
+        LOGI("Server handed over, exiting.");
+        metrics_report();
+        srv_io_release_all();
+        workpool_fini();
+        mailbox_fini();
+        srv_io_fini();
+        shm_fini();
+        close(server_fd);
+        if(INVALID_FD!=unix_server_fd)
+            close(unix_server_fd);
+        free_all_client_nodes();
+        config_fini();
+        handover_close();
+        shutdown_fini();
+        return SERVER_HANDED_OVER;
+    }
+    LOGI("Server termination signal received, terminating server.");
+    server_terminate = true;
+    drain_clients();
+    metrics_report();
+
+    srv_io_close_all();
+    workpool_fini();
+    mailbox_fini();
+    srv_io_fini();
+    shm_fini();
+    cluster_fini();
+    if(INVALID_FD!=unix_server_fd)
+    {
+        close(unix_server_fd);
+        unlink(unix_server_path);
     }
-    join_all_client_threads();
+    config_fini();
+    handover_close();
+    shutdown_fini();
     free_all_client_nodes();
     return SERVER_TERMINATE_DETECTED;
 }
 
+static void shutdown_notice_cb(client_data_t* data, void* arg)
+{
+    (void)arg;
+    msg_t shutdown_msg={0};
+    shutdown_msg.msg_type = MSG_SERVER_SHUTDOWN;
+    send_msg_to_fd(data->fd,&shutdown_msg);
+}
+
+/*
+ * Tells every client the server goes away, then keeps the loop turning until
+ * everything queued is written or SHUTDOWN_DRAIN_MS passed.
+ */
+void drain_clients(void)
+{
+    uint64_t start = srv_now_ms();
+    uint64_t deadline = start + SHUTDOWN_DRAIN_MS;
+    LOCK_CLIENT_DATA_MUTEX();
+    for_each_client(shutdown_notice_cb,NULL);
+    UNLOCK_CLIENT_DATA_MUTEX();
+    uint64_t now = start;
+    while( ((srv_io_tx_queued_bytes() > 0) || (workpool_pending()) || (mailbox_pending())) && (now < deadline) )
+    {
+        srv_io_run_once((int)(deadline - now));
+        now = srv_now_ms();
+    }
+    LOGI("Shutdown drained in %lu ms, %zu bytes left unsent.",srv_now_ms()-start,srv_io_tx_queued_bytes());
+}
+
 srv_err_type send_conn_establish_msg(int fd)
 {
     msg_t send_msg={0};
-    srv_err_type ret_val = ERR_CONN_EST;
     sprintf(send_msg.msg_data.buffer,SERVER_UNIQUEUE_ID);
     send_msg.msg_type=MSG_CONN_ESTABLISH_REQ;
-    
-    if(SERVER_SUCC!=send_msg_to_fd(fd,send_msg)) 
+    conn_caps_t caps = { .codecs = SRV_SUPPORTED_CODECS };
+    memcpy(send_msg.msg_data.buffer+HANDSHAKE_CAPS_OFFSET,&caps,sizeof(caps));
+
+    // The ack arrives through handle_rx_frame, the handshake timer covers a silent peer.
+    if(SERVER_SUCC!=send_msg_to_fd(fd,&send_msg))
     {
         LOGE("Error in sending conn. establishment msg: %d.",fd);
+        srv_io_close_fd(fd);
+        return ERR_CONN_EST;
     }
-    else
+    LOGI("Connection etablish msg sent successfully to fd : %d.",fd);
+    return SERVER_SUCC;
+}
+
+/* Called by the I/O layer per complete frame, false closes the connection. */
+bool handle_rx_frame(int fd, const msg_t* msg)
+{
+    if(NODE_NONE != cluster_node_of_fd(fd))
+    {
+        // Node frames are answered in place, so they get a copy of their own.
+        msg_t node_msg = *msg;
+        return cluster_handle_frame(fd,&node_msg);
+    }
+
+    LOGI("msg received successfully from, fd : %d, msg_type : %s.",fd,msgTypeToStr(msg->msg_type));
+
+    client_data_t* data = get_client_data_by_fd(fd);
+    if(!data)
     {
-        LOGI("Connection etablish msg sent successfully to fd : %d.",fd);
+        LOGE("fd : %d, no client data found.",fd);
+        return false;
+    }
 
-        memset(&send_msg,0,sizeof(send_msg));
-        int size = recv(fd,&send_msg,sizeof(send_msg),0);
-        if(size!=sizeof(send_msg))
+    if(!data->handshake_done)
+    {
+        LOCK_CLIENT_DATA_MUTEX();
+        if( (NODE_MSG_HELLO == (int)msg->msg_type) && (cluster_enabled()) )
         {
-            LOGE("Connection establish ack recv. error.");
+            // Another server: the connection leaves the client list and becomes a node link.
+            remove_client_node_from_queue_by_fd(fd);
+            UNLOCK_CLIENT_DATA_MUTEX();
+            return cluster_accept_link(fd,msg);
         }
-        else
+        if(MSG_CONN_ESTABLISH_ACK!=msg->msg_type)
         {
-            LOGI("msg received successfully from, fd : %d, msg_type : %s.",fd, msgTypeToStr(send_msg.msg_type));
-            if(MSG_CONN_ESTABLISH_ACK==send_msg.msg_type) 
-            {
-                ret_val = SERVER_SUCC;
-                LOGI("Connection verified with client with fd : %d.",fd);
-            }
+            UNLOCK_CLIENT_DATA_MUTEX();
+            LOGE("Terminating connection as, connection cannot be established :%d.",fd);
+            return false;
         }
+        LOGI("Connection verified with client with fd : %d.",fd);
+        srv_timer_cancel(&data->handshake_timer);
+        data->handshake_done = true;
+        // Clients predating codec negotiation send zeroes here.
+        conn_caps_t caps;
+        memcpy(&caps,msg->msg_data.buffer+HANDSHAKE_CAPS_OFFSET,sizeof(caps));
+        data->codecs = caps.codecs & SRV_SUPPORTED_CODECS;
+        rate_state_init(&data->rate,srv_now_ms());
+        data->last_rx_ms = srv_now_ms();
+        data->last_activity_ms = srv_now_ms();
+        srv_timer_arm(&data->idle_timer,config_tuning()->heartbeat_interval_ms);
+        UNLOCK_CLIENT_DATA_MUTEX();
+        return true;
     }
-    return ret_val;
-}
-
-void* client_thread(void* arg) 
-{
-    int my_socket = *(int*)arg;
-    free(arg);
-    LOGD("Client thread with fd : %d.",my_socket);
 
-    LOCK_CLIENT_DATA_MUTEX();
-    srv_queue_err_type_t ret_val = add_client_node_to_queue(&my_socket);
-    if(ret_val!=SERVER_QUEUE_SUCC)
+    // No wheel operation per message, the idle timer re-reads these when it fires.
+    uint64_t now = srv_now_ms();
+    data->last_rx_ms = now;
+    if(MSG_HEARTBEAT_ACK != msg->msg_type)
+        data->last_activity_ms = now;
+    // Checked before dispatch, a flood of list or connect requests never reaches the scans.
+    // A shed request takes no token, the client is not to blame for the load.
+    uint32_t retry_after_ms = 0;
+    rate_verdict_t verdict = RATE_PASS;
+    bool shed = !overload_admit(msg->msg_type,&retry_after_ms);
+    if(!shed)
+        verdict = rate_check(&data->rate,msg->msg_type,now,&retry_after_ms);
+
+    if( (RATE_EVICT != verdict) && (workpool_busy(fd)) )
     {
-        LOGE("Adding client node failed : %s. err : %d.",queueErrToStr(ret_val),ret_val);
-        msg_t max_client_msg={0};
-        max_client_msg.msg_type=MSG_MAX_CLIENT_REACHED;
-        send_msg_to_fd(my_socket,max_client_msg);
-        UNLOCK_CLIENT_DATA_MUTEX();
-        return NULL;
+        // Earlier work of this client is still with a worker, its replies go out first.
+        deferred_rx_t* rx = arena_alloc(sizeof(*rx));
+        if(rx)
+        {
+            *rx = (deferred_rx_t){ fd, *msg, shed, verdict, retry_after_ms };
+            // Raw chunk bytes follow a file frame, nothing more is read until its handler started the relay.
+            if(MSG_FILE_DATA == msg->msg_type)
+                srv_io_rx_hold(fd);
+            workpool_defer(fd,deferred_rx_done,rx);
+            return true;
+        }
     }
-    UNLOCK_CLIENT_DATA_MUTEX();
-
-    if(SERVER_SUCC != send_conn_establish_msg(my_socket))
+    dispatch_rx_msg(fd,msg,shed,verdict,retry_after_ms);
+    if(RATE_EVICT == verdict)
     {
-        LOGE("Terminating thread as, connection cannot be established :%d.",my_socket);
-        return NULL;
+        LOGE("fd : %d, dropping client after repeated throttling.",fd);
+        metrics_inc(METRIC_RATE_LIMIT_EVICTIONS);
+        return false;
     }
+    return true;
+}
+
+void dispatch_rx_msg(int fd, const msg_t* msg, bool shed, rate_verdict_t verdict, uint32_t retry_after_ms)
+{
+    reply_fd = fd;
+    reply_req_id = msg->req_id;
+    if(shed)
+        send_server_busy(fd,msg,retry_after_ms);
+    else if(RATE_PASS == verdict)
+        handle_rx_msg(msg,fd);
+    else
+        send_rate_limited(fd,msg,retry_after_ms);
+    reply_fd = INVALID_FD;
+    reply_req_id = 0;
+}
+
+static void deferred_rx_done(void* arg, bool cancelled)
+{
+    deferred_rx_t* rx = arg;
+    if(!cancelled)
+        dispatch_rx_msg(rx->fd,&rx->msg,rx->shed,rx->verdict,rx->retry_after_ms);
+    if(MSG_FILE_DATA == rx->msg.msg_type)
+        srv_io_rx_release(rx->fd);
+    arena_free(rx);
+}
+
+/* Called by the I/O layer once per connection, before its fd is closed. */
+void handle_client_disconnect(int fd)
+{
+    workpool_cancel(fd);
+    if(cluster_link_closed(fd))
+        return;
+    shm_link_closed(fd);
 
-    while(!server_terminate)
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(fd);
+    if( (data) && (data->name_registered) && (!server_terminate) )
+        cluster_release_name(data->name);
+    for(uint8_t ch=1; (data) && (!server_terminate) && (ch<=MAX_CHANNELS); ch++)
     {
-        msg_t rx_msg={0};
-        srv_err_type ret = wait_to_recv_something(my_socket,&rx_msg);
-        if(ret == SERVER_SUCC)
-        {
-            handle_rx_msg(rx_msg,my_socket);
-        } 
-        else if(ret == ERR_CLIENT_CLOSED_CONN)
+        client_data_t* peer = NULL;
+        chat_channel_t* chan = get_channel(data,ch);
+        chat_channel_t* peer_chan = get_linked_channel(data,ch,&peer);
+        if( (CHAT_STATUS_FREE != chan->status) && (NODE_LOCAL != chan->peer_node) && (NODE_NONE != chan->peer_node) )
         {
-            LOCK_CLIENT_DATA_MUTEX();
-            int conn_fd = get_conn_fd_by_fd(my_socket);
-            if( INVALID_FD != conn_fd)
-            {
-                if( CHAT_STATUS_FREE != get_client_chatting_status_by_fd(conn_fd) )
-                {
-                    LOGI("chat status of fd : %d, to CHAT_STATUS_FREE. and  to_fd to INVALID_FD.",conn_fd);
-                    set_client_chatting_status_by_fd(conn_fd,CHAT_STATUS_FREE);
-                    set_to_fd_by_fd(my_socket,INVALID_FD);
-                    
-                    msg_t terminate_msg={0};
-                    terminate_msg.msg_type = MSG_CLIENT_TERMINATION;
-                    strcpy(terminate_msg.msg_data.buffer,get_client_name_by_fd(my_socket));
-                    send_msg_to_fd(conn_fd,terminate_msg);
-                }
-            }
-            srv_queue_err_type_t qret = remove_client_node_from_queue_by_fd(my_socket);
-            UNLOCK_CLIENT_DATA_MUTEX();
-
-            if(SERVER_QUEUE_SUCC != qret)
-            {
-                LOGE("Error in removing queue from list. err : %s.",queueErrToStr(qret));
-            }
-            break;
+            // The peer's node releases its end when this arrives.
+            msg_t terminate_msg={0};
+            terminate_msg.msg_type = (CHAT_STATUS_REQ_SENT == chan->status) ? MSG_CONNECTION_REQ_EXPIRED : MSG_CLIENT_TERMINATION;
+            strcpy(terminate_msg.msg_data.buffer,data->name);
+            chat_peer_t remote = { chan->peer_node, chan->peer_fd, chan->peer_channel };
+            send_to_peer(&remote,&terminate_msg);
         }
-        else
+        else if(peer_chan)
         {
-            sleep(1);
+            // The peer only still waits for an answer when it was asked.
+            msg_t terminate_msg={0};
+            terminate_msg.msg_type = (CHAT_STATUS_REQ_PENDING == peer_chan->status) ? MSG_CONNECTION_REQ_EXPIRED : MSG_CLIENT_TERMINATION;
+            terminate_msg.channel_id = chan->peer_channel;
+            strcpy(terminate_msg.msg_data.buffer,data->name);
+            LOGI("fd : %d, releasing channel %u of fd : %d.",fd,chan->peer_channel,peer->fd);
+            int peer_fd = peer->fd;
+            release_channel(peer,chan->peer_channel);
+            send_msg_to_fd(peer_fd,&terminate_msg);
         }
+        release_channel(data,ch);
+    }
+    srv_queue_err_type_t qret = remove_client_node_from_queue_by_fd(fd);
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    if(SERVER_QUEUE_SUCC != qret)
+    {
+        LOGE("Error in removing queue from list. err : %s.",queueErrToStr(qret));
     }
-    LOGD("[ %lu ] Exiting thread.",pthread_self());
-    pthread_exit(NULL);
 }
 
-void set_name_handler(int fd,msg_t msg)
+void set_name_handler(int fd,const msg_t* msg)
 {
-    LOGD("client with fd : %d has Name change request to : %s.",fd,msg.msg_data.buffer);
+    char name[MAX_CLIENT_NAME_LEN];
+    msg_t reply={0};
+    memcpy(name,msg->msg_data.buffer,sizeof(name));
+    name[MAX_CLIENT_NAME_LEN-1] = '\0';
+    LOGD("client with fd : %d has Name change request to : %s.",fd,name);
     LOCK_CLIENT_DATA_MUTEX();
 
-    name_find_type_t ret = check_client_with_same_name_exist_or_not(msg.msg_data.buffer);
+    name_find_type_t ret = check_client_with_same_name_exist_or_not(name);
 
     if(ret!=NAME_NOT_EXIST)
     {
         UNLOCK_CLIENT_DATA_MUTEX();
 
         LOGE("Name already exist, or error while finding. err : %d.",ret);
-        memset(&msg,0,sizeof(msg));
-        msg.msg_type=MSG_SET_NAME_NACK_TYPE;
-        send_msg_to_fd(fd,msg);
+        reply.msg_type=MSG_SET_NAME_NACK_TYPE;
+        send_msg_to_fd(fd,&reply);
         return;
     }
 
-    srv_queue_err_type_t ret_val = set_name_of_client_by_client_fd(fd,msg.msg_data.buffer);
+    client_data_t* data = get_client_data_by_fd(fd);
+    if( (data) && (cluster_enabled()) )
+    {
+        // Names are unique across the cluster, the node owning the name decides.
+        cluster_claim_t claim = cluster_claim_name(name,fd,reply_req_id);
+        if(CLAIM_PENDING == claim)
+        {
+            strcpy(data->claim_name,name);
+            data->claim_req_id = reply_req_id;
+            UNLOCK_CLIENT_DATA_MUTEX();
+            LOGI("fd : %d, name %s claimed at its owner node.",fd,name);
+            return;
+        }
+        if(CLAIM_DENIED == claim)
+        {
+            UNLOCK_CLIENT_DATA_MUTEX();
+            LOGE("fd : %d, name %s is taken on another node.",fd,name);
+            reply.msg_type=MSG_SET_NAME_NACK_TYPE;
+            send_msg_to_fd(fd,&reply);
+            return;
+        }
+    }
+
+    srv_queue_err_type_t ret_val = data ? rename_client(data,name) : ERR_NODE_NOT_FOUND;
     if(ret_val != SERVER_QUEUE_SUCC)
     {
         LOGE("Error in settig name of client with fd : %d, err : %s.",fd,queueErrToStr(ret_val));
@@ -326,22 +788,70 @@ void set_name_handler(int fd,msg_t msg)
         return;
     }
 
-    LOGI("Name changed of client with fd :%d to %s.",fd,msg.msg_data.buffer);
+    LOGI("Name changed of client with fd :%d to %s.",fd,name);
     UNLOCK_CLIENT_DATA_MUTEX();
 
-    memset(&msg,0,sizeof(msg));
-    msg.msg_type=MSG_SET_NAME_ACK_TYPE;
-    send_msg_to_fd(fd,msg);
+    reply.msg_type=MSG_SET_NAME_ACK_TYPE;
+    send_msg_to_fd(fd,&reply);
     return;
 }
 
+/* Caller holds client_data_mutex and checked the name is free on this node. */
+srv_queue_err_type_t rename_client(client_data_t* data, char* name)
+{
+    char old_name[MAX_CLIENT_NAME_LEN];
+    bool was_registered = data->name_registered;
+    strcpy(old_name,data->name);
+
+    srv_queue_err_type_t ret = set_name_of_client_by_client_fd(data->fd,name);
+    if( (SERVER_QUEUE_SUCC == ret) && (cluster_enabled()) )
+    {
+        // The owner granted the new name, the old one goes back to its owner.
+        data->name_registered = true;
+        if(was_registered)
+            cluster_release_name(old_name);
+    }
+    return ret;
+}
+
+/* The worker posts the reply itself, the loop only has to write it. */
+static void client_list_run(void* arg)
+{
+    roster_job_t* job = arg;
+    LOCK_CLIENT_DATA_MUTEX();
+    get_client_list(job->msg.msg_data.buffer);
+    UNLOCK_CLIENT_DATA_MUTEX();
+    LOGI("client list : %s .",job->msg.msg_data.buffer);
+    if(!mailbox_post(job->fd,job->gen,&job->msg))
+        LOGE("fd : %d, client list reply dropped.",job->fd);
+}
+
+static void free_job(void* arg, bool cancelled)
+{
+    (void)cancelled;
+    arena_free(arg);
+}
+
+/* Only lists the clients connected to this node, on a worker when the pool runs. */
 void send_client_list_handler(int fd)
 {
+    roster_job_t* job = (workpool_enabled()) ? arena_alloc(sizeof(*job)) : NULL;
+    if(job)
+    {
+        memset(job,0,sizeof(*job));
+        job->fd = fd;
+        job->gen = srv_io_conn_gen(fd);
+        job->msg.msg_type = MSG_GET_CLIENT_LIST_TYPE;
+        job->msg.req_id = reply_req_id;
+        workpool_submit(fd,client_list_run,free_job,job);
+        return;
+    }
+
     msg_t client_list={0};
     client_list.msg_type = MSG_GET_CLIENT_LIST_TYPE;
     memset(client_list.msg_data.buffer,'\0',sizeof(client_list.msg_data.buffer));
 
-    srv_queue_err_type_t err = get_client_list(client_list.msg_data.buffer);
+    get_client_list(client_list.msg_data.buffer);
 
     LOGI("client list : %s .",client_list.msg_data.buffer);
     if(INVALID_FD==fd)
@@ -350,14 +860,14 @@ void send_client_list_handler(int fd)
     }
     else
     {
-        send_msg_to_fd(fd,client_list);
+        send_msg_to_fd(fd,&client_list);
     }
 }
 
-void handle_rx_msg(msg_t msg,int fd)
+void handle_rx_msg(const msg_t* msg,int fd)
 {
-    srv_err_type ret;
-    switch(msg.msg_type)
+    char conn_client_name[MAX_CLIENT_NAME_LEN];
+    switch(msg->msg_type)
     {
         case MSG_SET_NAME_REQ_TYPE:
             set_name_handler(fd,msg);
@@ -368,7 +878,9 @@ void handle_rx_msg(msg_t msg,int fd)
             break;
 
         case MSG_CONNECT_TO_CLIENT:
-            handle_chat_connection_request(fd,msg.msg_data.buffer);
+            memcpy(conn_client_name,msg->msg_data.buffer,sizeof(conn_client_name));
+            conn_client_name[MAX_CLIENT_NAME_LEN-1] = '\0';
+            handle_chat_connection_request(fd,conn_client_name);
             break;
 
         case MSG_CLIENT_ACCEPT_CONNECTION:
@@ -379,171 +891,372 @@ void handle_rx_msg(msg_t msg,int fd)
             handle_tx_msg(fd,msg);
             break;
 
+        case MSG_CLIENT_TX_COMPRESSED:
+            handle_tx_compressed(fd,msg);
+            break;
+
         case MSG_CLIENT_DECLINE_CONNECTION:
-            handle_decline_conn_request(fd);
+            handle_decline_conn_request(fd,msg);
             break;
 
         case MSG_CLIENT_CHANGE_CONN_FD_REQ:
             handle_change_conn_fd_req(fd,msg);
             break;
+
+        case MSG_HEARTBEAT_ACK:
+            LOGD("fd : %d, heartbeat ack received.",fd);
+            break;
+
+        case MSG_FILE_OFFER:
+        case MSG_FILE_CANCEL:
+            handle_file_ctrl(fd,msg);
+            break;
+
+        case MSG_FILE_DATA:
+            handle_file_data(fd,msg);
+            break;
+
+        case MSG_SHM_UPGRADE_REQ:
+            handle_shm_upgrade(fd);
+            break;
     }
 }
 
-void handle_change_conn_fd_req(int fd, msg_t msg)
+void handshake_timeout_cb(void* arg)
 {
-    if(INVALID_FD==fd)
+    int fd = (int)(intptr_t)arg;
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(fd);
+    if( (data) && (!data->handshake_done) )
     {
-        LOGE("Invalid fd found.");
-        return;
+        LOGE("fd : %d, handshake deadline expired.",fd);
+        metrics_inc(METRIC_HANDSHAKE_TIMEOUTS);
+        srv_io_close_fd(fd);
     }
+    UNLOCK_CLIENT_DATA_MUTEX();
 }
 
-void handle_decline_conn_request(int fd)
+/*
+ * One timer per connection covers heartbeats, dead-peer detection and idle
+ * eviction. Received messages only store timestamps; the timer re-arms itself
+ * for the nearest remaining deadline when it fires.
+ */
+void idle_timeout_cb(void* arg)
 {
-    if(INVALID_FD==fd)
+    int fd = (int)(intptr_t)arg;
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(fd);
+    if(!data)
     {
-        LOGE("fd : %d,Invalid fd found.",fd);
+        UNLOCK_CLIENT_DATA_MUTEX();
         return;
     }
-    LOCK_CLIENT_DATA_MUTEX();
-    if(CHAT_STATUS_REQ_PENDING==get_client_chatting_status_by_fd(fd))
+
+    uint64_t now = srv_now_ms();
+    uint64_t rx_idle  = now - data->last_rx_ms;
+    uint64_t act_idle = now - data->last_activity_ms;
+    // Read once, a reload in between cannot mix old and new limits.
+    const srv_tuning_t* tuning = config_tuning();
+    uint64_t heartbeat_ms = tuning->heartbeat_interval_ms;
+    uint64_t dead_peer_ms = DEAD_PEER_HEARTBEATS * heartbeat_ms;
+    uint64_t idle_evict_ms = tuning->idle_timeout_ms;
+
+    if( (rx_idle >= dead_peer_ms) || (act_idle >= idle_evict_ms) )
     {
-        int conn_fd = get_conn_fd_by_fd(fd);
-        char* my_name = get_client_name_by_fd(fd);
+        bool dead_peer = (rx_idle >= dead_peer_ms);
         UNLOCK_CLIENT_DATA_MUTEX();
 
-        if(INVALID_FD==conn_fd)
+        LOGI("fd : %d, evicting %s connection.",fd,dead_peer ? "dead" : "idle");
+        metrics_inc(dead_peer ? METRIC_DEAD_PEER_EVICTIONS : METRIC_IDLE_EVICTIONS);
+        if(!dead_peer)
         {
-            LOGE("fd : %d,Invalid fd found.",fd);
-            return;
+            msg_t idle_msg={0};
+            idle_msg.msg_type = MSG_CLIENT_IDLE_TIMEOUT;
+            send_msg_to_fd(fd,&idle_msg);
         }
-        msg_t decline_resp_msg ={0};
-        decline_resp_msg.msg_type=MSG_CLIENT_DECLINE_CONNECTION_ACK;
-        strcpy(decline_resp_msg.msg_data.buffer,my_name);
-        send_msg_to_fd(conn_fd,decline_resp_msg);
-
-        LOCK_CLIENT_DATA_MUTEX();
-        set_client_chatting_status_by_fd(fd,CHAT_STATUS_FREE);
-        UNLOCK_CLIENT_DATA_MUTEX();
+        // Queued frames are flushed before the I/O layer closes the fd.
+        srv_io_close_fd(fd);
+        return;
     }
-    else
+
+    uint64_t next_ms = idle_evict_ms - act_idle;
+    if(rx_idle >= heartbeat_ms)
     {
+        if(dead_peer_ms - rx_idle < next_ms)
+            next_ms = dead_peer_ms - rx_idle;
+        if(heartbeat_ms < next_ms)
+            next_ms = heartbeat_ms;
+        srv_timer_arm(&data->idle_timer,next_ms);
         UNLOCK_CLIENT_DATA_MUTEX();
-        LOGI("fd : %d, chat status is not CHAT_STATUS_REQ_PENDING , and got decline msg.",fd);
+
+        msg_t heartbeat_msg={0};
+        heartbeat_msg.msg_type = MSG_HEARTBEAT_REQ;
+        metrics_inc(METRIC_HEARTBEATS_SENT);
+        send_msg_to_fd(fd,&heartbeat_msg);
+        return;
     }
+
+    if(heartbeat_ms - rx_idle < next_ms)
+        next_ms = heartbeat_ms - rx_idle;
+    srv_timer_arm(&data->idle_timer,next_ms);
+    UNLOCK_CLIENT_DATA_MUTEX();
 }
 
-void handle_tx_msg(int fd, msg_t msg)
+void conn_req_timeout_cb(void* arg)
 {
-    LOGD("fd : %d.",fd);
+    int fd = CHANNEL_TIMER_FD(arg);
+    uint8_t ch = CHANNEL_TIMER_CH(arg);
     LOCK_CLIENT_DATA_MUTEX();
-    if(CHAT_STATUS_BUSY==get_client_chatting_status_by_fd(fd))
+    client_data_t* data = get_client_data_by_fd(fd);
+    chat_channel_t* chan = get_channel(data,ch);
+    if( (chan) && (CHAT_STATUS_REQ_SENT == chan->status) && (NODE_NONE == chan->peer_node) )
     {
-        int conn_fd = get_conn_fd_by_fd(fd);
+        // No node answered for the name in time.
+        msg_t not_exist_msg={0};
+        not_exist_msg.msg_type = MSG_CLIENT_NOT_EXIST;
+        strcpy(not_exist_msg.msg_data.buffer,chan->peer_name);
+        uint16_t req_id = chan->req_id;
+        release_channel(data,ch);
         UNLOCK_CLIENT_DATA_MUTEX();
-        if(0==strcmp(msg.msg_data.buffer,DISCONNECT_CMD))
-        {
-            if(INVALID_FD!=conn_fd)
-            {
-                msg_t disconnected_msg={0};
-                disconnected_msg.msg_type = MSG_CLIENT_DISCONNECTED;
-
-                LOCK_CLIENT_DATA_MUTEX();
-                strcpy(disconnected_msg.msg_data.buffer,get_client_name_by_fd(fd));
-                set_client_chatting_status_by_fd(fd,CHAT_STATUS_FREE);
-                set_client_chatting_status_by_fd(conn_fd,CHAT_STATUS_FREE);
-                set_to_fd_by_fd(fd,INVALID_FD);
-                set_to_fd_by_fd(conn_fd,INVALID_FD);
-                UNLOCK_CLIENT_DATA_MUTEX();
-                send_msg_to_fd(conn_fd,disconnected_msg);
-            }
-            else
-            {
-                LOGE("fd : %d,Invalid fd found.",fd);
-            }
-        }
-        else
-        {
-            if(INVALID_FD!=conn_fd)
-            {
-                msg.msg_type=MSG_CLIENT_RX_TYPE;
-                LOGI("sending msg to : %d from %d.",conn_fd,fd);
-                send_msg_to_fd(conn_fd,msg);
-            }
-            else
-            {
-                LOGE("fd : %d,Invalid fd found.",fd);
-            }
-        }
+        LOGI("fd : %d, routed connection request on channel %u got no answer.",fd,ch);
+        send_deferred_reply(fd,req_id,&not_exist_msg);
+        return;
     }
-    else
+    if( (!chan) || (CHAT_STATUS_REQ_PENDING != chan->status) )
     {
         UNLOCK_CLIENT_DATA_MUTEX();
+        return;
+    }
+
+    msg_t target_msg={0};
+    msg_t requester_msg={0};
+    target_msg.msg_type = MSG_CONNECTION_REQ_EXPIRED;
+    target_msg.channel_id = ch;
+    requester_msg.msg_type = MSG_CONNECTION_REQ_EXPIRED;
+    strcpy(requester_msg.msg_data.buffer,data->name);
+
+    chat_peer_t requester = { chan->peer_node, chan->peer_fd, chan->peer_channel };
+    client_data_t* peer = NULL;
+    bool linked = (NODE_LOCAL != requester.node) || (get_linked_channel(data,ch,&peer));
+    if(peer)
+    {
+        strcpy(target_msg.msg_data.buffer,peer->name);
+        release_channel(peer,requester.channel);
+    }
+    else if(linked)
+    {
+        strcpy(target_msg.msg_data.buffer,chan->peer_name);
     }
+    release_channel(data,ch);
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    LOGI("fd : %d, pending connection request on channel %u expired.",fd,ch);
+    metrics_inc(METRIC_CONN_REQ_EXPIRED);
+    send_msg_to_fd(fd,&target_msg);
+    if(linked)
+        send_to_peer(&requester,&requester_msg);
 }
 
-srv_err_type wait_to_recv_something(int fd, msg_t* rx_msg)
+void handle_change_conn_fd_req(int fd, const msg_t* msg)
 {
-    // LOGD("fd :%d.",fd);
-    if(!rx_msg) return ERR_NULL_PTR;
+    if(INVALID_FD==fd)
+    {
+        LOGE("Invalid fd found.");
+        return;
+    }
+}
 
-    struct pollfd fds[2];
-    fds[0].fd = fd;
-    fds[0].events = POLLIN;
+void handle_decline_conn_request(int fd, const msg_t* msg)
+{
+    if(INVALID_FD==fd)
+    {
+        LOGE("fd : %d,Invalid fd found.",fd);
+        return;
+    }
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(fd);
+    uint8_t ch = find_channel(data,msg->channel_id,CHAT_STATUS_REQ_PENDING);
+    if(NO_CHANNEL == ch)
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGI("fd : %d, no pending request on channel %u, and got decline msg.",fd,msg->channel_id);
+        return;
+    }
 
-    int ret = poll(fds, 1, 2000);
+    chat_channel_t* chan = get_channel(data,ch);
+    chat_peer_t requester = { chan->peer_node, chan->peer_fd, chan->peer_channel };
+    client_data_t* peer = NULL;
+    bool linked = (NODE_LOCAL != requester.node) || (get_linked_channel(data,ch,&peer));
+    msg_t decline_resp_msg ={0};
+    decline_resp_msg.msg_type=MSG_CLIENT_DECLINE_CONNECTION_ACK;
+    strcpy(decline_resp_msg.msg_data.buffer,data->name);
+    if(peer)
+        release_channel(peer,requester.channel);
+    release_channel(data,ch);
+    UNLOCK_CLIENT_DATA_MUTEX();
 
-    if (ret < 0)
+    if(!linked)
     {
-        if (EINTR == errno ) 
-        {
-            LOGE("fd : %d,Poll interrupted by signal.",fd);
-            return ERR_CLIENT_CLOSED_CONN;
-        }
-        LOGE("fd : %d,Error in poll.",fd);
-        return ERR_CLIENT_CLOSED_CONN;
+        LOGE("fd : %d, requester of channel %u is gone.",fd,ch);
+        return;
     }
-    else if(ret==0)
+    send_to_peer(&requester,&decline_resp_msg);
+}
+
+/*
+ * Resolves the sender's chatting channel, NO_CHANNEL meaning its lowest one.
+ * On success *channel is the sender's channel and *peer the other end,
+ * with the id the peer knows the conversation by. Every relayed frame comes
+ * through here, a read on the loop thread that takes no lock.
+ */
+bool get_chat_peer(int fd, uint8_t* channel, chat_peer_t* peer)
+{
+    bool found = false;
+    client_data_t* data = get_client_data_by_fd(fd);
+    uint8_t ch = find_channel(data,*channel,CHAT_STATUS_BUSY);
+    chat_channel_t* chan = get_channel(data,ch);
+    // A peer on another node is checked by its own node when the frame arrives.
+    if( (chan) && ((NODE_LOCAL != chan->peer_node) || (get_linked_channel(data,ch,NULL))) )
     {
-        // LOGI("fd : %d, Poll timeout.",fd);
-        return ERR_READ_TIMEOUT;
+        peer->node = chan->peer_node;
+        peer->fd = chan->peer_fd;
+        peer->channel = chan->peer_channel;
+        *channel = ch;
+        found = true;
     }
+    return found;
+}
 
-    if (fds[0].revents & POLLIN)
+void handle_tx_msg(int fd, const msg_t* msg)
+{
+    LOGD("fd : %d.",fd);
+    uint8_t ch = msg->channel_id;
+    chat_peer_t peer;
+    if(!get_chat_peer(fd,&ch,&peer))
     {
-        int bytes = recv(fd, rx_msg, sizeof(*rx_msg), 0);
-        if (bytes > 0)
-        {
-            LOGI("msg received successfully from, fd : %d, msg_type : %s.",fd,msgTypeToStr(rx_msg->msg_type));
-            return SERVER_SUCC;
-        }
-        else if (bytes == 0)
-        {
-            LOGI("Client termination detected fd : [ %d ].",fd);
-            return ERR_CLIENT_CLOSED_CONN;
-        }
-        else
-        {
-            LOGE("error in receive from client fd : %d .",fd);;
-            return ERR_RECV;
-        }
+        LOGE("fd : %d, no chat on channel %u.",fd,msg->channel_id);
+        return;
+    }
+
+    if(0==strcmp(msg->msg_data.buffer,DISCONNECT_CMD))
+    {
+        msg_t disconnected_msg={0};
+        disconnected_msg.msg_type = MSG_CLIENT_DISCONNECTED;
+
+        LOCK_CLIENT_DATA_MUTEX();
+        client_data_t* data = get_client_data_by_fd(fd);
+        strcpy(disconnected_msg.msg_data.buffer,data->name);
+        if(NODE_LOCAL == peer.node)
+            release_channel(get_client_data_by_fd(peer.fd),peer.channel);
+        release_channel(data,ch);
+        UNLOCK_CLIENT_DATA_MUTEX();
+        send_to_peer(&peer,&disconnected_msg);
+    }
+    else
+    {
+        // The text goes out from where it was received, only the header is rewritten.
+        LOGI("sending msg to : %d from %d.",peer.fd,fd);
+        relay_to_peer(&peer,MSG_CLIENT_RX_TYPE,msg);
+    }
+}
+
+/* Pairing and teardown frames go ahead of chat text, which goes ahead of file transfers. */
+io_prio_t msg_tx_prio(msg_type_t type)
+{
+    switch(type)
+    {
+        case MSG_CLIENT_RX_TYPE:
+        case MSG_CLIENT_RX_COMPRESSED:
+            return IO_PRIO_CHAT;
+        case MSG_FILE_OFFER:
+        case MSG_FILE_DATA:
+        case MSG_FILE_CANCEL:
+            return IO_PRIO_BULK;
+        default:
+            return IO_PRIO_CONTROL;
     }
-    return ERR_RECV;
 }
 
-srv_err_type send_msg_to_fd(int fd,msg_t send_msg)
+/*
+ * Queues msg's payload behind a header of its own. The payload is copied
+ * once, into the outbound queue, wherever it lives: a handler's frame or
+ * the receive buffer of the client being relayed.
+ */
+static srv_err_type send_frame(int fd, msg_type_t type, uint8_t channel_id, const msg_t* msg)
 {
     LOGD("");
-    int size = send(fd,&send_msg,sizeof(send_msg),0);
-    if(size!=sizeof(send_msg) || (-1==size)) 
+    // Frames posted from workers were produced first.
+    mailbox_flush(fd);
+    msg_t hdr;
+    memset(&hdr,0,MSG_HDR_LEN);
+    hdr.msg_type = type;
+    hdr.channel_id = channel_id;
+    // Relayed frames carry the sender's id, which means nothing to the peer.
+    hdr.req_id = (fd == reply_fd) ? reply_req_id : 0;
+    if( (!shm_frame_on_socket(type)) && (shm_send(fd,&hdr,&msg->msg_data)) )
     {
-        LOGE("Error in sending msg to fd : %d.",fd);
+        LOGI("msg queued to shared memory of fd : %d msg_type : %s.",fd,msgTypeToStr(type));
+        return SERVER_SUCC;
+    }
+    // A chat keeps its order, only frames of other chats are overtaken.
+    struct iovec iov[2] = { { &hdr, MSG_HDR_LEN }, { (void*)&msg->msg_data, sizeof(msg->msg_data) } };
+    srv_io_err_t err = srv_io_sendv(fd,iov,2,msg_tx_prio(type),channel_id);
+    if(IO_SUCC != err)
+    {
+        LOGE("Error in sending msg to fd : %d, err : %s.",fd,ioErrToStr(err));
         return ERR_MSG_SEND;
     }
-    LOGI("msg sent successfully to fd : %d msg_type : %s.",fd,msgTypeToStr(send_msg.msg_type));
+    LOGI("msg queued successfully to fd : %d msg_type : %s.",fd,msgTypeToStr(type));
 
     return SERVER_SUCC;
+}
+
+srv_err_type send_msg_to_fd(int fd,const msg_t* send_msg)
+{
+    return send_frame(fd,send_msg->msg_type,send_msg->channel_id,send_msg);
+}
 
+/* Answers a request whose outcome arrived later, e.g. from another node. */
+srv_err_type send_deferred_reply(int fd, uint16_t req_id, const msg_t* msg)
+{
+    int saved_fd = reply_fd;
+    uint16_t saved_req_id = reply_req_id;
+    reply_fd = fd;
+    reply_req_id = req_id;
+    srv_err_type ret = send_msg_to_fd(fd,msg);
+    reply_fd = saved_fd;
+    reply_req_id = saved_req_id;
+    return ret;
+}
+
+static void deliver_mail(int fd, const msg_t* msg)
+{
+    send_deferred_reply(fd,msg->req_id,msg);
+}
+
+srv_err_type send_to_peer(const chat_peer_t* peer, const msg_t* msg)
+{
+    return relay_to_peer(peer,msg->msg_type,msg);
+}
+
+/* Frames for a client on another node carry its fd there in req_id. */
+srv_err_type relay_to_peer(const chat_peer_t* peer, msg_type_t type, const msg_t* msg)
+{
+    if(NODE_LOCAL == peer->node)
+        return send_frame(peer->fd,type,peer->channel,msg);
+
+    msg_t node_msg = *msg;
+    node_msg.msg_type = type;
+    node_msg.channel_id = peer->channel;
+    node_msg.req_id = (uint16_t)peer->fd;
+    if(!cluster_send(peer->node,&node_msg))
+    {
+        LOGE("no link to node %s, dropping %s.",cluster_node_addr(peer->node),msgTypeToStr(type));
+        return ERR_MSG_SEND;
+    }
+    metrics_inc(METRIC_NODE_RELAYS);
+    LOGI("msg queued to node %s fd : %d msg_type : %s.",cluster_node_addr(peer->node),peer->fd,msgTypeToStr(type));
+    return SERVER_SUCC;
 }
 
 void handle_chat_connection_request(int fd,char* conn_client_name)
@@ -559,171 +1272,776 @@ void handle_chat_connection_request(int fd,char* conn_client_name)
     msg_t conn_req_send_msg={0};
     memcpy(conn_resp_msg.msg_data.buffer,conn_client_name,MAX_CLIENT_NAME_LEN);
     LOCK_CLIENT_DATA_MUTEX();
-    name_find_type_t ret = check_client_with_same_name_exist_or_not(conn_client_name);
-
-    if(ret==NAME_EXISTS)
+    client_data_t* data = get_client_data_by_fd(fd);
+    client_data_t* peer = get_client_data_by_fd(get_client_fd_by_name(conn_client_name));
+    if( (data) && (!peer) && (cluster_enabled()) )
     {
-        char *my_name = get_client_name_by_fd(fd);
-        if(!strcmp(my_name,conn_client_name))
-        {
-            UNLOCK_CLIENT_DATA_MUTEX();
-            LOGI("[ %s ] tries to connect with itself !!!",conn_client_name);
-            conn_resp_msg.msg_type=MSG_ATTEMPT_TO_CONNECT_TO_SELF;
-        }
-        else
-        {
-            client_chat_status_t chat_status = get_client_chatting_status_by_name(conn_client_name);
-            UNLOCK_CLIENT_DATA_MUTEX();
-    
-            if(chat_status == CHAT_STATUS_CLIENT_NOT_FOUND)
-            {
-                LOGI("fd : %d, client not found with name : %s.",fd,conn_client_name);
-                conn_resp_msg.msg_type=MSG_CLIENT_NOT_EXIST;
-            }
-            else
-            {
-                LOGI("fd : %d, Client with name %s exist. chat_status : %s.",fd,conn_client_name,chat_status_to_str(chat_status));
-                if(CHAT_STATUS_FREE == chat_status)
-                {
-                    conn_resp_msg.msg_type=MSG_CLIENT_FREE;
-                    LOCK_CLIENT_DATA_MUTEX();
-                    int conn_client_fd = get_client_fd_by_name(conn_client_name);
-                    set_client_chatting_status_by_fd(conn_client_fd,CHAT_STATUS_REQ_PENDING);
-                    UNLOCK_CLIENT_DATA_MUTEX();
-                    if(INVALID_FD==conn_client_fd)
-                    {
-                        LOGE("fd : %d, Invalid fd got.",fd);
-                        conn_resp_msg.msg_type=MSG_CLIENT_NOT_EXIST;
-                    }
-                    else
-                    {
-                        //sending conn request to client required.
-                        LOCK_CLIENT_DATA_MUTEX();
-                        set_to_fd_by_fd(fd,conn_client_fd);
-                        set_to_fd_by_fd(conn_client_fd,fd);
-                        UNLOCK_CLIENT_DATA_MUTEX();
-                        LOGI("Sending conn request from [ %s ] : [ %s ] .",my_name,conn_client_name);
-                        conn_req_send_msg.msg_type=MSG_CONNECTION_REQ_RX;
-                        strcpy(conn_req_send_msg.msg_data.buffer,my_name);
-                        send_msg_to_fd(conn_client_fd,conn_req_send_msg);
-                    }
-                }
-                else if (CHAT_STATUS_BUSY == chat_status)
-                {
-                    LOGI("fd : %d, conn_client is busy.",fd);
-                    conn_resp_msg.msg_type=MSG_CLIENT_BUSY;                    
-                }
-                else if(CHAT_STATUS_REQ_PENDING == chat_status)
-                {
-                    LOGI("fd : %d, conn_client has pending connectoin request.",fd);
-                    conn_resp_msg.msg_type=MSG_CLIENT_STATUS_REQ_PENDING;
-                }
-                else
-                {
-                    LOGE("fd : %d,somethig is wrong.",fd);
-                    //if came then mark client not found.
-                    conn_resp_msg.msg_type=MSG_CLIENT_NOT_EXIST;
-                }
-            }        
-        }
+        UNLOCK_CLIENT_DATA_MUTEX();
+        handle_remote_connection_request(fd,conn_client_name);
+        return;
     }
-    else
+    if( (!data) || (!peer) )
     {
         UNLOCK_CLIENT_DATA_MUTEX();
         LOGE("fd : %d,client not found with name : %s.",fd,conn_client_name);
         conn_resp_msg.msg_type=MSG_CLIENT_NOT_EXIST;
+        send_msg_to_fd(fd,&conn_resp_msg);
+        return;
+    }
+    if(peer == data)
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGI("[ %s ] tries to connect with itself !!!",conn_client_name);
+        conn_resp_msg.msg_type=MSG_ATTEMPT_TO_CONNECT_TO_SELF;
+        send_msg_to_fd(fd,&conn_resp_msg);
+        return;
+    }
+
+    // One conversation per pair of clients.
+    uint8_t my_ch = find_channel_by_peer(data,peer);
+    if(NO_CHANNEL != my_ch)
+    {
+        client_chat_status_t status = get_channel(data,my_ch)->status;
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGI("fd : %d, already on channel %u with %s : %s.",fd,my_ch,conn_client_name,chat_status_to_str(status));
+        conn_resp_msg.msg_type = (CHAT_STATUS_BUSY == status) ? MSG_CLIENT_CHAT_READY : MSG_CLIENT_STATUS_REQ_PENDING;
+        conn_resp_msg.channel_id = my_ch;
+        send_msg_to_fd(fd,&conn_resp_msg);
+        return;
+    }
+
+    my_ch = alloc_channel(data,CHAT_STATUS_REQ_SENT,peer->fd);
+    if(NO_CHANNEL == my_ch)
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        conn_resp_msg.msg_type=MSG_CHANNEL_LIMIT;
+        send_msg_to_fd(fd,&conn_resp_msg);
+        return;
+    }
+    uint8_t peer_ch = alloc_channel(peer,CHAT_STATUS_REQ_PENDING,fd);
+    if(NO_CHANNEL == peer_ch)
+    {
+        release_channel(data,my_ch);
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGI("fd : %d, conn_client has no free channel.",fd);
+        conn_resp_msg.msg_type=MSG_CLIENT_BUSY;
+        send_msg_to_fd(fd,&conn_resp_msg);
+        return;
+    }
+    get_channel(data,my_ch)->peer_channel = peer_ch;
+    get_channel(peer,peer_ch)->peer_channel = my_ch;
+    srv_timer_arm(&get_channel(peer,peer_ch)->conn_req_timer,config_tuning()->conn_req_timeout_ms);
+    int conn_client_fd = peer->fd;
+    LOGI("Sending conn request from [ %s ] : [ %s ], channels %u : %u.",data->name,conn_client_name,my_ch,peer_ch);
+    conn_req_send_msg.msg_type=MSG_CONNECTION_REQ_RX;
+    conn_req_send_msg.channel_id=peer_ch;
+    strcpy(conn_req_send_msg.msg_data.buffer,data->name);
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    conn_resp_msg.msg_type=MSG_CLIENT_FREE;
+    conn_resp_msg.channel_id=my_ch;
+    send_msg_to_fd(fd,&conn_resp_msg);
+    send_msg_to_fd(conn_client_fd,&conn_req_send_msg);
+}
+
+/*
+ * A name not connected here may be on another node. The request travels to
+ * the owner of the name and on to the node holding it, the client gets its
+ * answer once the result comes back, see handle_node_connect_result().
+ */
+void handle_remote_connection_request(int fd,char* conn_client_name)
+{
+    msg_t conn_resp_msg={0};
+    memcpy(conn_resp_msg.msg_data.buffer,conn_client_name,MAX_CLIENT_NAME_LEN);
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(fd);
+    uint8_t my_ch = find_channel_by_remote_name(data,conn_client_name);
+    if(NO_CHANNEL != my_ch)
+    {
+        client_chat_status_t status = get_channel(data,my_ch)->status;
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGI("fd : %d, already on channel %u with %s : %s.",fd,my_ch,conn_client_name,chat_status_to_str(status));
+        conn_resp_msg.msg_type = (CHAT_STATUS_BUSY == status) ? MSG_CLIENT_CHAT_READY : MSG_CLIENT_STATUS_REQ_PENDING;
+        conn_resp_msg.channel_id = my_ch;
+        send_msg_to_fd(fd,&conn_resp_msg);
+        return;
+    }
+
+    my_ch = alloc_channel(data,CHAT_STATUS_REQ_SENT,INVALID_FD);
+    if(NO_CHANNEL == my_ch)
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        conn_resp_msg.msg_type=MSG_CHANNEL_LIMIT;
+        send_msg_to_fd(fd,&conn_resp_msg);
+        return;
     }
+    chat_channel_t* chan = get_channel(data,my_ch);
+    chan->peer_node = NODE_NONE;
+    chan->req_id = reply_req_id;
+    strncpy(chan->peer_name,conn_client_name,MAX_CLIENT_NAME_LEN-1);
+    srv_timer_arm(&chan->conn_req_timer,CLUSTER_ROUTE_TIMEOUT_MS);
+
+    node_connect_t req={0};
+    strcpy(req.from_node,cluster_node_addr(NODE_LOCAL));
+    strcpy(req.from_name,data->name);
+    strcpy(req.to_name,chan->peer_name);
+    req.from_fd = fd;
+    req.from_ch = my_ch;
+    req.to_fd = INVALID_FD;
+    req.req_id = reply_req_id;
+    UNLOCK_CLIENT_DATA_MUTEX();
 
-    send_msg_to_fd(fd,conn_resp_msg);
+    LOGI("fd : %d, routing conn request for [ %s ] on channel %u.",fd,conn_client_name,my_ch);
+    cluster_route_connect(&req);
 }
 
-void handle_conn_accept(int fd, msg_t msg)
+void handle_conn_accept(int fd, const msg_t* msg)
 {
     LOGD("fd : %d, Inside this fn.",fd);
     LOCK_CLIENT_DATA_MUTEX();
-    client_chat_status_t my_chat_status = get_client_chatting_status_by_fd(fd);
-    LOGI("chatting status of %d is %s.",fd,chat_status_to_str(my_chat_status));
-    int conn_fd = get_conn_fd_by_fd(fd);
-    if(INVALID_FD==conn_fd)
+    client_data_t* data = get_client_data_by_fd(fd);
+    uint8_t ch = find_channel(data,msg->channel_id,CHAT_STATUS_REQ_PENDING);
+    if(NO_CHANNEL == ch)
     {
-        LOGE("fd : %d,Invalid fd found.",fd);
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGI("fd : %d, There is no current pending request. Ignoring accept request.",fd);
+        msg_t accept_ign_msg={0};
+        strcpy(accept_ign_msg.msg_data.buffer,"SOMETHING_IS_WRONG");
+        accept_ign_msg.msg_type= MSG_CLIENT_ACCEPT_CONNECTION_ACK;
+        accept_ign_msg.channel_id= msg->channel_id;
+        send_msg_to_fd(fd,&accept_ign_msg);
         return;
     }
-    client_chat_status_t conn_client_chat_status = get_client_chatting_status_by_fd(conn_fd);
-    char *conn_client_name = get_client_name_by_fd(conn_fd);
-    if(0==strcmp(conn_client_name,UNDEF_NAME))
+
+    chat_channel_t* chan = get_channel(data,ch);
+    srv_timer_cancel(&chan->conn_req_timer);
+    client_data_t* peer = NULL;
+    chat_channel_t* peer_chan = get_linked_channel(data,ch,&peer);
+    bool remote = (NODE_LOCAL != chan->peer_node);
+    // Both ends go BUSY or neither: a requester that moved on meanwhile undoes this end.
+    bool paired = channel_transition(chan,CHAT_STATUS_REQ_PENDING,CHAT_STATUS_BUSY);
+    if( (paired) && (!remote) && (!channel_transition(peer_chan,CHAT_STATUS_REQ_SENT,CHAT_STATUS_BUSY)) )
+        paired = false;
+    if(!paired)
     {
-        set_client_chatting_status_by_fd(fd,CHAT_STATUS_FREE);
-        set_to_fd_by_fd(fd,INVALID_FD);
-    
+        release_channel(data,ch);
         UNLOCK_CLIENT_DATA_MUTEX();
-        LOGI("fd : %d,Client with fd : %d, no more exist.",fd,conn_fd);
+        LOGI("fd : %d,requester of channel %u no more exist.",fd,ch);
         msg_t client_not_exit_msg={0};
         strcpy(client_not_exit_msg.msg_data.buffer,"Client_not_exist");
         client_not_exit_msg.msg_type= MSG_CLIENT_NO_MORE_EXIST;
-        send_msg_to_fd(fd,client_not_exit_msg);
+        client_not_exit_msg.channel_id= ch;
+        send_msg_to_fd(fd,&client_not_exit_msg);
         return;
     }
-    LOGI("%d connects to %s.",fd,conn_client_name);
+
+    // A requester on another node gets its end switched by its own node on the ack.
+    chat_peer_t requester = { chan->peer_node, chan->peer_fd, chan->peer_channel };
+
+    msg_t accept_respt_msg={0};
+    strcpy(accept_respt_msg.msg_data.buffer,data->name);
+    accept_respt_msg.msg_type= MSG_CLIENT_ACCEPT_CONNECTION_ACK;
+
+    msg_t self_ack_msg={0};
+    self_ack_msg.msg_type = MSG_CLIENT_CHAT_READY;
+    self_ack_msg.channel_id = ch;
+    strcpy(self_ack_msg.msg_data.buffer,remote ? chan->peer_name : peer->name);
     UNLOCK_CLIENT_DATA_MUTEX();
-    LOGI("conn_cliennt_chat status : %s.",chat_status_to_str(conn_client_chat_status));
-    if(CHAT_STATUS_BUSY == conn_client_chat_status)
+
+    LOGI("%d connects to %d on channels %u : %u.",fd,requester.fd,ch,requester.channel);
+    send_msg_to_fd(fd,&self_ack_msg);
+    send_to_peer(&requester,&accept_respt_msg);
+}
+
+/* Offers and cancels only travel between peers that are chatting with each other. */
+void handle_file_ctrl(int fd, const msg_t* msg)
+{
+    uint8_t ch = msg->channel_id;
+    chat_peer_t peer;
+
+    if(get_chat_peer(fd,&ch,&peer))
     {
-        LOGI("fd: %d, [ %d ] is no more free.",fd,conn_fd);
-        LOCK_CLIENT_DATA_MUTEX();
-        set_client_chatting_status_by_fd(fd,CHAT_STATUS_FREE);
-        UNLOCK_CLIENT_DATA_MUTEX();
-        msg_t nack_resp_msg={0};
-        strcpy(nack_resp_msg.msg_data.buffer,conn_client_name);
-        nack_resp_msg.msg_type= MSG_CLIENT_NO_MORE_FREE;
-        send_msg_to_fd(fd,nack_resp_msg);
+        LOGI("fd : %d, relaying %s to fd : %d.",fd,msgTypeToStr(msg->msg_type),peer.fd);
+        send_to_peer(&peer,msg);
+    }
+    else if(MSG_FILE_OFFER==msg->msg_type)
+    {
+        LOGI("fd : %d, file offer without chat peer.",fd);
+        send_frame(fd,MSG_FILE_CANCEL,msg->channel_id,msg);
+    }
+}
+
+/*
+ * The chunk following this frame never enters user space: the I/O layer
+ * splices it from the sender's socket into the receiver's socket.
+ */
+void handle_file_data(int fd, const msg_t* msg)
+{
+    file_xfer_hdr_t hdr;
+    memcpy(&hdr,msg->msg_data.buffer,sizeof(hdr));
+    if(hdr.chunk_len > FILE_CHUNK_MAX_LEN)
+    {
+        // The stream cannot be resynchronised past an unknown length.
+        LOGE("fd : %d, file chunk of %u bytes exceeds limit.",fd,hdr.chunk_len);
+        srv_io_close_fd(fd);
         return;
     }
 
-    if(CHAT_STATUS_REQ_PENDING!=my_chat_status)
+    uint8_t ch = msg->channel_id;
+    chat_peer_t peer;
+    int conn_fd = INVALID_FD;
+
+    metrics_inc(METRIC_FILE_CHUNKS);
+    // A peer on another node gets the chunk through the link to its node.
+    if( (get_chat_peer(fd,&ch,&peer)) && (SERVER_SUCC==send_to_peer(&peer,msg)) )
+        conn_fd = (NODE_LOCAL == peer.node) ? peer.fd : cluster_link_fd(peer.node);
+
+    srv_io_err_t err = srv_io_relay_start(fd,conn_fd,hdr.chunk_len);
+    if(IO_SUCC!=err)
     {
-        LOGI("fd : %d, There is no current pending request. Ignoring accept request.",fd);
-        msg_t accept_ign_msg={0};
-        strcpy(accept_ign_msg.msg_data.buffer,"SOMETHING_IS_WRONG");
-        accept_ign_msg.msg_type= MSG_CLIENT_ACCEPT_CONNECTION_ACK;
-        send_msg_to_fd(fd,accept_ign_msg);
+        LOGE("fd : %d, cannot relay file chunk, err : %s.",fd,ioErrToStr(err));
+        srv_io_close_fd(fd);
         return;
     }
-    else
+
+    if(INVALID_FD==conn_fd)
     {
-        msg_t accept_respt_msg={0};
+        LOGI("fd : %d, no chat peer, discarding file chunk.",fd);
+        send_frame(fd,MSG_FILE_CANCEL,msg->channel_id,msg);
+    }
+}
 
-        LOCK_CLIENT_DATA_MUTEX();
-        set_client_chatting_status_by_fd(fd,CHAT_STATUS_BUSY);
-        set_client_chatting_status_by_fd(conn_fd,CHAT_STATUS_BUSY);
+/* A client that cannot have shared memory simply stays on its socket. */
+void handle_shm_upgrade(int fd)
+{
+    msg_t reply={0};
+    reply.msg_type = MSG_SHM_UPGRADE_ACK;
+    reply.req_id = reply_req_id;
+    if(shm_upgrade(fd,&reply))
+        return;
+    reply.msg_type = MSG_SHM_UPGRADE_NACK;
+    send_msg_to_fd(fd,&reply);
+}
 
-        set_to_fd_by_fd(fd,conn_fd);
-        set_to_fd_by_fd(conn_fd,fd);  
+static void send_retry_after(int fd, msg_type_t reply_type, const msg_t* msg, uint32_t retry_after_ms)
+{
+    msg_t reply={0};
+    reply.msg_type = reply_type;
+    reply.channel_id = msg->channel_id;
+    rate_limit_info_t info = { (uint32_t)msg->msg_type, retry_after_ms };
+    memcpy(reply.msg_data.buffer,&info,sizeof(info));
+    send_msg_to_fd(fd,&reply);
+}
 
-        char *conn_name = get_client_name_by_fd(conn_fd);
-        char *my_name   = get_client_name_by_fd(fd);
+void send_rate_limited(int fd, const msg_t* msg, uint32_t retry_after_ms)
+{
+    LOGI("fd : %d, throttled %s, retry after %u ms.",fd,msgTypeToStr(msg->msg_type),retry_after_ms);
+    metrics_inc(METRIC_RATE_LIMITED);
+    send_retry_after(fd,MSG_RATE_LIMITED,msg,retry_after_ms);
+}
+
+void send_server_busy(int fd, const msg_t* msg, uint32_t retry_after_ms)
+{
+    LOGI("fd : %d, shed %s under overload, retry after %u ms.",fd,msgTypeToStr(msg->msg_type),retry_after_ms);
+    metrics_inc(METRIC_OVERLOAD_SHED);
+    send_retry_after(fd,MSG_SERVER_BUSY,msg,retry_after_ms);
+}
+
+void handle_tx_compressed(int fd, const msg_t* msg)
+{
+    uint8_t ch = msg->channel_id;
+    chat_peer_t peer;
+    if(!get_chat_peer(fd,&ch,&peer))
+    {
+        LOGE("fd : %d, compressed msg without chat peer.",fd);
+        return;
+    }
+    // The peer's codecs are known to its own node, which delivers it.
+    if(NODE_LOCAL != peer.node)
+    {
+        send_to_peer(&peer,msg);
+        return;
+    }
+    deliver_compressed(fd,peer.fd,peer.channel,msg);
+}
+
+/* gen 0 sends on the loop, anything else posts from a worker. */
+static void send_inflated(int conn_fd, uint32_t gen, uint8_t peer_ch, const char* text, int len)
+{
+    metrics_inc(METRIC_COMPRESSED_INFLATED);
+    for(int off=0; off<len; off+=MAX_MSG_LEN-1)
+    {
+        msg_t plain_msg={0};
+        int piece = ((len-off) < (MAX_MSG_LEN-1)) ? (len-off) : (MAX_MSG_LEN-1);
+        plain_msg.msg_type = MSG_CLIENT_RX_TYPE;
+        plain_msg.channel_id = peer_ch;
+        memcpy(plain_msg.msg_data.buffer,text+off,piece);
+        if(0 == gen)
+            send_msg_to_fd(conn_fd,&plain_msg);
+        else
+            mailbox_post(conn_fd,gen,&plain_msg);
+    }
+}
+
+/*
+ * The peer may have left while the worker inflated, its end of the chat has
+ * to still point back. The pieces are posted to the peer's mailbox from here.
+ */
+static void inflate_run(void* arg)
+{
+    inflate_job_t* job = arg;
+    job->len = srv_inflate_text(&job->msg,job->text,sizeof(job->text));
+
+    LOCK_CLIENT_DATA_MUTEX();
+    chat_channel_t* chan = get_channel(get_client_data_by_fd(job->conn_fd),job->peer_ch);
+    bool linked = (chan) && (CHAT_STATUS_BUSY == chan->status) && (NODE_LOCAL == chan->peer_node) && (job->src_fd == chan->peer_fd);
+    UNLOCK_CLIENT_DATA_MUTEX();
+    if( (linked) && (job->len < 0) )
+        LOGE("fd : %d, dropping undecodable compressed msg.",job->conn_fd);
+    else if(linked)
+        send_inflated(job->conn_fd,job->gen,job->peer_ch,job->text,job->len);
+}
+
+/*
+ * A peer that negotiated the codec gets the frame as is. Otherwise the text
+ * is inflated and delivered as plain frames of at most MAX_MSG_LEN-1 bytes,
+ * on a worker when the sender is local: later frames of the sender wait.
+ */
+void deliver_compressed(int src_fd, int conn_fd, uint8_t peer_ch, const msg_t* msg)
+{
+    client_data_t* peer = get_client_data_by_fd(conn_fd);
+    uint32_t peer_codecs = (peer) ? peer->codecs : CODEC_NONE;
+
+    compressed_hdr_t hdr;
+    memcpy(&hdr,msg->msg_data.buffer,sizeof(hdr));
+    if(peer_codecs & hdr.codec)
+    {
+        metrics_inc(METRIC_COMPRESSED_RELAYED);
+        send_frame(conn_fd,MSG_CLIENT_RX_COMPRESSED,peer_ch,msg);
+        return;
+    }
+
+    uint32_t gen = srv_io_conn_gen(conn_fd);
+    inflate_job_t* job = ( (INVALID_FD != src_fd) && (0 != gen) && (workpool_enabled()) ) ? arena_alloc(sizeof(*job)) : NULL;
+    if(job)
+    {
+        job->src_fd = src_fd;
+        job->conn_fd = conn_fd;
+        job->gen = gen;
+        job->peer_ch = peer_ch;
+        job->msg = *msg;
+        workpool_submit(src_fd,inflate_run,free_job,job);
+        return;
+    }
+
+    char text[CHAT_TEXT_MAX_LEN];
+    int len = srv_inflate_text(msg,text,sizeof(text));
+    if(len < 0)
+    {
+        LOGE("fd : %d, dropping undecodable compressed msg.",conn_fd);
+        return;
+    }
+    send_inflated(conn_fd,0,peer_ch,text,len);
+}
+
+/*
+ * Frame from a client on another node for one here. It is delivered only
+ * while the addressed channel is still bound to that node, req_id names the
+ * receiving fd and channel_id its channel.
+ */
+bool handle_node_relay(uint8_t node, int link_fd, msg_t* msg)
+{
+    int fd = msg->req_id;
+    uint8_t ch = msg->channel_id;
+    file_xfer_hdr_t hdr={0};
+    if(MSG_FILE_DATA == msg->msg_type)
+    {
+        memcpy(&hdr,msg->msg_data.buffer,sizeof(hdr));
+        if(hdr.chunk_len > FILE_CHUNK_MAX_LEN)
+        {
+            LOGE("node %s, file chunk of %u bytes exceeds limit.",cluster_node_addr(node),hdr.chunk_len);
+            return false;
+        }
+    }
+
+    bool deliver = false;
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(fd);
+    chat_channel_t* chan = get_channel(data,ch);
+    if( (chan) && (CHAT_STATUS_FREE != chan->status) && (node == chan->peer_node) )
+    {
+        switch(msg->msg_type)
+        {
+            case MSG_CLIENT_ACCEPT_CONNECTION_ACK:
+                deliver = channel_transition(chan,CHAT_STATUS_REQ_SENT,CHAT_STATUS_BUSY);
+                break;
+
+            case MSG_CONNECTION_REQ_EXPIRED:
+            case MSG_CLIENT_DECLINE_CONNECTION_ACK:
+            case MSG_CLIENT_TERMINATION:
+            case MSG_CLIENT_DISCONNECTED:
+                release_channel(data,ch);
+                deliver = true;
+                break;
+
+            case MSG_CLIENT_RX_TYPE:
+            case MSG_CLIENT_TX_COMPRESSED:
+            case MSG_FILE_OFFER:
+            case MSG_FILE_CANCEL:
+            case MSG_FILE_DATA:
+                deliver = (CHAT_STATUS_BUSY == chan->status);
+                break;
+
+            default:
+                break;
+        }
+    }
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    if(MSG_FILE_DATA == msg->msg_type)
+    {
+        // An undeliverable chunk still has to be read off the link.
+        if( (!deliver) || (SERVER_SUCC != send_msg_to_fd(fd,msg)) )
+            fd = INVALID_FD;
+        srv_io_err_t err = srv_io_relay_start(link_fd,fd,hdr.chunk_len);
+        if(IO_SUCC != err)
+        {
+            LOGE("node %s, cannot relay file chunk, err : %s.",cluster_node_addr(node),ioErrToStr(err));
+            return false;
+        }
+        return true;
+    }
+    if(!deliver)
+    {
+        LOGI("node %s, dropping %s for fd : %d, channel %u.",cluster_node_addr(node),msgTypeToStr(msg->msg_type),fd,ch);
+        return true;
+    }
+    if(MSG_CLIENT_TX_COMPRESSED == msg->msg_type)
+        deliver_compressed(INVALID_FD,fd,ch,msg);
+    else
+        send_msg_to_fd(fd,msg);
+    return true;
+}
+
+/* Connect request routed here from origin, false when the name is not connected to this node. */
+bool handle_node_connect_req(uint8_t origin, node_connect_t* req)
+{
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(get_client_fd_by_name(req->to_name));
+    if( (!data) || (!data->name_registered) )
+    {
         UNLOCK_CLIENT_DATA_MUTEX();
+        return false;
+    }
 
-        if((0==strcmp(conn_name,UNDEF_NAME)) || (0==strcmp(my_name,UNDEF_NAME)))
+    msg_t conn_req_send_msg={0};
+    uint8_t ch = NO_CHANNEL;
+    if(NO_CHANNEL == find_channel_by_remote_name(data,req->from_name))
+        ch = alloc_channel(data,CHAT_STATUS_REQ_PENDING,req->from_fd);
+    if(NO_CHANNEL == ch)
+    {
+        req->result = MSG_CLIENT_BUSY;
+    }
+    else
+    {
+        chat_channel_t* chan = get_channel(data,ch);
+        chan->peer_node = origin;
+        chan->peer_channel = req->from_ch;
+        strcpy(chan->peer_name,req->from_name);
+        srv_timer_arm(&chan->conn_req_timer,config_tuning()->conn_req_timeout_ms);
+        conn_req_send_msg.msg_type = MSG_CONNECTION_REQ_RX;
+        conn_req_send_msg.channel_id = ch;
+        strcpy(conn_req_send_msg.msg_data.buffer,req->from_name);
+        req->result = MSG_CLIENT_FREE;
+        req->to_fd = data->fd;
+        req->to_ch = ch;
+    }
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    LOGI("Conn request from [ %s ] at node %s : [ %s ], %s.",req->from_name,cluster_node_addr(origin),req->to_name,msgTypeToStr(req->result));
+    if(MSG_CLIENT_FREE == req->result)
+        send_msg_to_fd(req->to_fd,&conn_req_send_msg);
+    cluster_connect_result(req);
+    return true;
+}
+
+/* Back at the origin, binds the requester's channel to the target on node. */
+void handle_node_connect_result(uint8_t node, node_connect_t* res)
+{
+    if( (MSG_CLIENT_FREE != res->result) && (MSG_CLIENT_BUSY != res->result) )
+        res->result = MSG_CLIENT_NOT_EXIST;
+    msg_t conn_resp_msg={0};
+    conn_resp_msg.msg_type = res->result;
+    strcpy(conn_resp_msg.msg_data.buffer,res->to_name);
+
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(res->from_fd);
+    chat_channel_t* chan = get_channel(data,res->from_ch);
+    if( (!chan) || (CHAT_STATUS_REQ_SENT != chan->status) || (NODE_NONE != chan->peer_node) ||
+        (strcmp(chan->peer_name,res->to_name)) )
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGI("fd : %d, channel %u no more waits for [ %s ].",res->from_fd,res->from_ch,res->to_name);
+        if( (MSG_CLIENT_FREE == res->result) && (NODE_LOCAL != node) )
         {
-            LOGE("fd : %d, Undef name found.",fd);
-            return;
+            // The target was already asked, withdraw the request.
+            chat_peer_t target = { node, res->to_fd, res->to_ch };
+            msg_t expired_msg={0};
+            expired_msg.msg_type = MSG_CONNECTION_REQ_EXPIRED;
+            strcpy(expired_msg.msg_data.buffer,res->from_name);
+            send_to_peer(&target,&expired_msg);
         }
+        return;
+    }
+
+    srv_timer_cancel(&chan->conn_req_timer);
+    uint16_t req_id = chan->req_id;
+    if( (MSG_CLIENT_FREE == res->result) && (NODE_LOCAL != node) )
+    {
+        chan->peer_node = node;
+        chan->peer_fd = res->to_fd;
+        chan->peer_channel = res->to_ch;
+        conn_resp_msg.channel_id = res->from_ch;
+    }
+    else
+    {
+        if(MSG_CLIENT_FREE == res->result)
+            conn_resp_msg.msg_type = MSG_CLIENT_NOT_EXIST;
+        release_channel(data,res->from_ch);
+    }
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    LOGI("fd : %d, conn request for [ %s ] : %s.",res->from_fd,res->to_name,msgTypeToStr(conn_resp_msg.msg_type));
+    send_deferred_reply(res->from_fd,req_id,&conn_resp_msg);
+}
+
+/*
+ * Owner's answer to a name claim. Re-claims after a ring change carry the
+ * client's current name, a grant nobody waits for anymore is given back.
+ */
+void handle_name_claim_result(node_name_claim_t* claim)
+{
+    LOCK_CLIENT_DATA_MUTEX();
+    client_data_t* data = get_client_data_by_fd(claim->fd);
+    if( (data) && (data->name_registered) && (0==strcmp(data->name,claim->name)) )
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        if(!claim->granted)
+            LOGE("fd : %d, name %s is held by another node.",claim->fd,claim->name);
+        return;
+    }
+    if( (!data) || (strcmp(data->claim_name,claim->name)) )
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        if(claim->granted)
+            cluster_release_name(claim->name);
+        return;
+    }
+
+    msg_t reply={0};
+    uint16_t req_id = data->claim_req_id;
+    data->claim_name[0] = '\0';
+    if( (claim->granted) && (NAME_NOT_EXIST == check_client_with_same_name_exist_or_not(claim->name)) &&
+        (SERVER_QUEUE_SUCC == rename_client(data,claim->name)) )
+    {
+        LOGI("Name changed of client with fd :%d to %s.",claim->fd,claim->name);
+        reply.msg_type = MSG_SET_NAME_ACK_TYPE;
+    }
+    else
+    {
+        LOGE("fd : %d, name %s refused.",claim->fd,claim->name);
+        reply.msg_type = MSG_SET_NAME_NACK_TYPE;
+        if(claim->granted)
+            cluster_release_name(claim->name);
+    }
+    UNLOCK_CLIENT_DATA_MUTEX();
+    send_deferred_reply(claim->fd,req_id,&reply);
+}
 
-        strcpy(accept_respt_msg.msg_data.buffer,my_name);
-        accept_respt_msg.msg_type= MSG_CLIENT_ACCEPT_CONNECTION_ACK;
+void node_down_cb(client_data_t* data, void* arg)
+{
+    uint8_t node = *(uint8_t*)arg;
+    for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
+    {
+        chat_channel_t* chan = get_channel(data,ch);
+        if( (CHAT_STATUS_FREE == chan->status) || (node != chan->peer_node) ) continue;
+
+        msg_t terminate_msg={0};
+        terminate_msg.msg_type = (CHAT_STATUS_REQ_PENDING == chan->status) ? MSG_CONNECTION_REQ_EXPIRED : MSG_CLIENT_TERMINATION;
+        terminate_msg.channel_id = ch;
+        strcpy(terminate_msg.msg_data.buffer,chan->peer_name);
+        release_channel(data,ch);
+        send_msg_to_fd(data->fd,&terminate_msg);
+    }
 
-        msg_t self_ack_msg={0};
-        self_ack_msg.msg_type = MSG_CLIENT_CHAT_READY;
-        strcpy(self_ack_msg.msg_data.buffer,conn_name);
-        send_msg_to_fd(fd,self_ack_msg);
-        send_msg_to_fd(conn_fd,accept_respt_msg);
+    // The owner asked may have been the node that left.
+    if('\0' != data->claim_name[0])
+    {
+        msg_t nack_msg={0};
+        nack_msg.msg_type = MSG_SET_NAME_NACK_TYPE;
+        data->claim_name[0] = '\0';
+        send_deferred_reply(data->fd,data->claim_req_id,&nack_msg);
     }
 }
 
+/* Conversations with clients of a node that left end as if those clients disconnected. */
+void handle_node_down(uint8_t node)
+{
+    LOCK_CLIENT_DATA_MUTEX();
+    for_each_client(node_down_cb,&node);
+    UNLOCK_CLIENT_DATA_MUTEX();
+}
+
+void reclaim_name_cb(client_data_t* data, void* arg)
+{
+    (void)arg;
+    if( (data->name_registered) && (CLAIM_DENIED == cluster_claim_name(data->name,data->fd,0)) )
+        LOGE("fd : %d, name %s is held by another node.",data->fd,data->name);
+}
+
+/* Names may have moved to another owner, tell the new owners about ours. */
+void handle_ring_change(void)
+{
+    LOCK_CLIENT_DATA_MUTEX();
+    for_each_client(reclaim_name_cb,NULL);
+    UNLOCK_CLIENT_DATA_MUTEX();
+}
+
 char* get_current_time(void) {
-    static char buf[20];
+    // Workers log too, each thread formats into its own buffer.
+    static __thread char buf[20];
     time_t now = time(NULL);
     strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
     return buf;
 }
+
+static void export_client(client_data_t* data, handover_client_t* rec)
+{
+    memset(rec,0,sizeof(*rec));
+    rec->fd = data->fd;
+    strcpy(rec->name,data->name);
+    rec->handshake_done = data->handshake_done;
+    rec->codecs = data->codecs;
+    rec->handshake_left_ms = (uint32_t)srv_timer_remaining_ms(&data->handshake_timer);
+    rec->idle_left_ms = (uint32_t)srv_timer_remaining_ms(&data->idle_timer);
+    rec->last_rx_ms = data->last_rx_ms;
+    rec->last_activity_ms = data->last_activity_ms;
+    rec->rate = data->rate;
+    for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
+    {
+        chat_channel_t* chan = get_channel(data,ch);
+        handover_channel_t* out = &rec->channels[ch-1];
+        out->status = (uint8_t)chan->status;
+        out->peer_channel = chan->peer_channel;
+        out->req_id = chan->req_id;
+        out->peer_fd = chan->peer_fd;
+        out->conn_req_left_ms = (uint32_t)srv_timer_remaining_ms(&chan->conn_req_timer);
+    }
+}
+
+typedef struct
+{
+    client_export_cb_t cb;
+    void* arg;
+}export_ctx_t;
+
+static void export_client_cb(client_data_t* data, void* arg)
+{
+    export_ctx_t* ctx = (export_ctx_t*)arg;
+    handover_client_t rec;
+    export_client(data,&rec);
+    ctx->cb(&rec,ctx->arg);
+}
+
+void export_clients(client_export_cb_t cb, void* arg)
+{
+    export_ctx_t ctx = { cb, arg };
+    LOCK_CLIENT_DATA_MUTEX();
+    for_each_client(export_client_cb,&ctx);
+    UNLOCK_CLIENT_DATA_MUTEX();
+}
+
+/* Registers an inherited client as handle_new_connection() would, with its timers picking up where they were. */
+bool adopt_client(int fd, const handover_client_t* rec, const uint8_t* rx, const uint8_t* tx)
+{
+    if(!reserve_client_slot())
+    {
+        LOGE("fd : %d, no client slot left to adopt it.",fd);
+        return false;
+    }
+    LOCK_CLIENT_DATA_MUTEX();
+    srv_queue_err_type_t ret_val = add_client_node_to_queue(&fd);
+    if(ret_val!=SERVER_QUEUE_SUCC)
+    {
+        UNLOCK_CLIENT_DATA_MUTEX();
+        LOGE("Adopting client node failed : %s. err : %d.",queueErrToStr(ret_val),ret_val);
+        release_client_slot();
+        return false;
+    }
+    client_data_t* data = get_client_data_by_fd(fd);
+    init_client_timers(fd,data);
+    if(rec->name[0])
+        set_name_of_client_by_client_fd(fd,(char*)rec->name);
+    data->handshake_done = rec->handshake_done;
+    data->codecs = rec->codecs;
+    data->rate = rec->rate;
+    data->last_rx_ms = rec->last_rx_ms;
+    data->last_activity_ms = rec->last_activity_ms;
+    for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
+    {
+        const handover_channel_t* in = &rec->channels[ch-1];
+        if(CHAT_STATUS_FREE == in->status) continue;
+        chat_channel_t* chan = get_channel(data,ch);
+        chan->status = (client_chat_status_t)in->status;
+        chan->peer_node = NODE_LOCAL;
+        chan->peer_fd = in->peer_fd;
+        chan->peer_channel = in->peer_channel;
+        chan->req_id = in->req_id;
+        if(in->conn_req_left_ms)
+            srv_timer_arm(&chan->conn_req_timer,in->conn_req_left_ms);
+    }
+    // An expired but not yet run deadline reads as 0, it fires on the first tick.
+    if(!data->handshake_done)
+        srv_timer_arm(&data->handshake_timer,rec->handshake_left_ms ? rec->handshake_left_ms : 1);
+    else
+        srv_timer_arm(&data->idle_timer,rec->idle_left_ms ? rec->idle_left_ms : 1);
+    UNLOCK_CLIENT_DATA_MUTEX();
+
+    if(IO_SUCC != srv_io_adopt_fd(fd,rx,rec->rx_len,tx,rec->tx_len))
+    {
+        LOGE("fd : %d, cannot register with I/O backend.",fd);
+        LOCK_CLIENT_DATA_MUTEX();
+        remove_client_node_from_queue_by_fd(fd);
+        UNLOCK_CLIENT_DATA_MUTEX();
+        return false;
+    }
+    metrics_inc(METRIC_ACCEPTED_TOTAL);
+    LOGI("fd : %d, adopted client %s (fd %d in the old server).",fd,rec->name,rec->fd);
+    return true;
+}
+
+static void remap_peers_cb(client_data_t* data, void* arg)
+{
+    const int* fd_map = (const int*)arg;
+    for(uint8_t ch=1; ch<=MAX_CHANNELS; ch++)
+    {
+        chat_channel_t* chan = get_channel(data,ch);
+        if( (CHAT_STATUS_FREE == chan->status) || (INVALID_FD == chan->peer_fd) ) continue;
+        int peer_fd = ( (chan->peer_fd >= 0) && (chan->peer_fd < IO_MAX_FDS) ) ? fd_map[chan->peer_fd] : INVALID_FD;
+        if(INVALID_FD == peer_fd)
+        {
+            // The peer was not taken over, the conversation ends here.
+            release_channel(data,ch);
+            continue;
+        }
+        chan->peer_fd = peer_fd;
+        chan->peer_gen = get_client_data_by_fd(peer_fd)->gen;
+    }
+}
+
+void remap_adopted_peers(const int* fd_map)
+{
+    LOCK_CLIENT_DATA_MUTEX();
+    for_each_client(remap_peers_cb,(void*)fd_map);
+    UNLOCK_CLIENT_DATA_MUTEX();
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "server_overload.h"
+#include "server_timer.h"
+#include "server_io.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+static const char *overloadLevelStr[] = {
+    "normal",
+    "shedding",
+    "rejecting"
+};
+
+static overload_config_t config;
+static overload_level_t level = OVERLOAD_NONE;
+static srv_timer_t sample_timer;
+
+/* Worst lag since the last sample, and the last memory reading. */
+static uint64_t lag_max_ms = 0;
+static uint64_t rss_bytes = 0;
+static uint64_t next_mem_sample_ms = 0;
+static uint64_t calm_since_ms = 0;
+
+const char* overload_level_to_str(overload_level_t lvl)
+{
+    if(lvl >= OVERLOAD_LEVEL_MAX) return "none";
+    return overloadLevelStr[lvl];
+}
+
+void overload_config_defaults(overload_config_t* cfg)
+{
+    cfg->lag_ms = OVERLOAD_DEFAULT_LAG_MS;
+    cfg->queue_mb = OVERLOAD_DEFAULT_QUEUE_MB;
+    cfg->mem_mb = OVERLOAD_DEFAULT_MEM_MB;
+}
+
+bool overload_config_parse(overload_config_t* cfg, const char* spec)
+{
+    const char* eq = strchr(spec,'=');
+    if(!eq) return false;
+    size_t name_len = eq - spec;
+    char* end = NULL;
+    unsigned long val = strtoul(eq+1,&end,10);
+    if( (end == eq+1) || ('\0' != *end) ) return false;
+
+    if( (strlen("lag") == name_len) && (0 == strncmp(spec,"lag",name_len)) )
+        cfg->lag_ms = (uint32_t)val;
+    else if( (strlen("queue") == name_len) && (0 == strncmp(spec,"queue",name_len)) )
+        cfg->queue_mb = (uint32_t)val;
+    else if( (strlen("mem") == name_len) && (0 == strncmp(spec,"mem",name_len)) )
+        cfg->mem_mb = (uint32_t)val;
+    else
+        return false;
+    return true;
+}
+
+static uint64_t read_rss_bytes(void)
+{
+    FILE *fp = fopen(STATM_PATH,"r");
+    if(!fp)
+    {
+        LOGE("Cannot open %s.",STATM_PATH);
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    if(2 != fscanf(fp,"%lu %lu",&size,&resident))
+        resident = 0;
+    fclose(fp);
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+/* Share of its limit the most loaded signal is at, in percent. */
+static uint64_t load_percent(uint64_t queued)
+{
+    uint64_t pct = 0;
+    if( (config.lag_ms) && (lag_max_ms*100/config.lag_ms > pct) )
+        pct = lag_max_ms*100/config.lag_ms;
+    if( (config.queue_mb) && (queued*100/((uint64_t)config.queue_mb*MIB) > pct) )
+        pct = queued*100/((uint64_t)config.queue_mb*MIB);
+    if( (config.mem_mb) && (rss_bytes*100/((uint64_t)config.mem_mb*MIB) > pct) )
+        pct = rss_bytes*100/((uint64_t)config.mem_mb*MIB);
+    return pct;
+}
+
+/* Climbs at once, drops only after every signal stayed low for OVERLOAD_HOLD_MS. */
+static void sample_cb(void* arg)
+{
+    (void)arg;
+    uint64_t now = srv_now_ms();
+    if( (config.mem_mb) && (now >= next_mem_sample_ms) )
+    {
+        rss_bytes = read_rss_bytes();
+        next_mem_sample_ms = now + OVERLOAD_MEM_SAMPLE_MS;
+    }
+    uint64_t queued = srv_io_tx_queued_bytes();
+    uint64_t pct = load_percent(queued);
+    overload_level_t target = OVERLOAD_NONE;
+    if(pct >= 100)
+        target = OVERLOAD_REJECT;
+    else if(pct >= OVERLOAD_SHED_PERCENT)
+        target = OVERLOAD_SHED;
+
+    if(target >= level)
+        calm_since_ms = now;
+    if( (target > level) || ((target < level) && (now - calm_since_ms >= OVERLOAD_HOLD_MS)) )
+    {
+        LOGI("Overload %s -> %s, loop lag : %lu ms, queued : %lu KiB, rss : %lu MiB.",
+             overload_level_to_str(level),overload_level_to_str(target),lag_max_ms,queued/1024,rss_bytes/MIB);
+        level = target;
+    }
+    lag_max_ms = 0;
+    srv_timer_arm(&sample_timer,OVERLOAD_SAMPLE_MS);
+}
+
+void overload_init(const overload_config_t* cfg)
+{
+    level = OVERLOAD_NONE;
+    lag_max_ms = 0;
+    rss_bytes = 0;
+    next_mem_sample_ms = 0;
+    overload_set_config(cfg);
+    srv_timer_init(&sample_timer,sample_cb,NULL);
+    srv_timer_arm(&sample_timer,OVERLOAD_SAMPLE_MS);
+}
+
+void overload_set_config(const overload_config_t* cfg)
+{
+    config = *cfg;
+    LOGI("Overload limits, loop lag : %u ms, queued : %u MiB, rss : %u MiB (0 is unwatched).",
+         config.lag_ms,config.queue_mb,config.mem_mb);
+}
+
+void overload_note_lag(uint64_t lag_ms)
+{
+    if(lag_ms > lag_max_ms)
+        lag_max_ms = lag_ms;
+    metrics_set_max(METRIC_LOOP_LAG_MAX_MS,lag_ms);
+}
+
+bool overload_admit(msg_type_t type, uint32_t* retry_after_ms)
+{
+    overload_level_t needed;
+    switch(type)
+    {
+        case MSG_GET_CLIENT_LIST_TYPE:
+            needed = OVERLOAD_SHED;
+            break;
+        case MSG_CONNECT_TO_CLIENT:
+        case MSG_SET_NAME_REQ_TYPE:
+            needed = OVERLOAD_REJECT;
+            break;
+        default:
+            return true;
+    }
+    if(level < needed)
+        return true;
+    *retry_after_ms = (OVERLOAD_REJECT == level) ? OVERLOAD_RETRY_REJECT_MS : OVERLOAD_RETRY_SHED_MS;
+    return false;
+}
+
+bool overload_admit_conn(uint32_t* retry_after_ms)
+{
+    if(OVERLOAD_REJECT != level)
+        return true;
+    *retry_after_ms = OVERLOAD_RETRY_REJECT_MS;
+    return false;
+}
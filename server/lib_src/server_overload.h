@@ -0,0 +1,57 @@
+#ifndef SERVER_OVERLOAD_H
+#define SERVER_OVERLOAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chat_app_common.h"
+
+#define OVERLOAD_SAMPLE_MS        100
+#define OVERLOAD_MEM_SAMPLE_MS    1000
+/* Every signal has to stay below its mark this long before the level drops. */
+#define OVERLOAD_HOLD_MS          2000
+/* Requests are shed from this share of a limit on, new connections refused at the limit. */
+#define OVERLOAD_SHED_PERCENT     50
+#define OVERLOAD_RETRY_SHED_MS    1000
+#define OVERLOAD_RETRY_REJECT_MS  5000
+
+#define OVERLOAD_DEFAULT_LAG_MS   200
+#define OVERLOAD_DEFAULT_QUEUE_MB 64
+#define OVERLOAD_DEFAULT_MEM_MB   1024
+
+#define STATM_PATH "/proc/self/statm"
+#define MIB        (1024*1024)
+
+typedef enum{
+    OVERLOAD_NONE=0,
+    OVERLOAD_SHED,
+    OVERLOAD_REJECT,
+    OVERLOAD_LEVEL_MAX
+}overload_level_t;
+
+/* Limits of the watched signals, 0 leaves a signal unwatched. */
+typedef struct{
+    uint32_t lag_ms;
+    uint32_t queue_mb;
+    uint32_t mem_mb;
+}overload_config_t;
+
+void overload_config_defaults(overload_config_t* cfg);
+/* "lag=ms", "queue=MiB" or "mem=MiB", false on a malformed spec. */
+bool overload_config_parse(overload_config_t* cfg, const char* spec);
+/* Starts sampling, needs the timer service. */
+void overload_init(const overload_config_t* cfg);
+/* New limits, the current level is kept until the next sample. */
+void overload_set_config(const overload_config_t* cfg);
+
+/* How late the event loop ran its due timers, fed once per iteration. */
+void overload_note_lag(uint64_t lag_ms);
+/*
+ * False when msg_type is shed at the current level, retry_after_ms tells the
+ * client when to try again. Roster listing goes first, then new chats and
+ * names; traffic of established chats is never shed.
+ */
+bool overload_admit(msg_type_t type, uint32_t* retry_after_ms);
+bool overload_admit_conn(uint32_t* retry_after_ms);
+const char* overload_level_to_str(overload_level_t level);
+
+#endif
@@ -6,10 +6,21 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
 #include "logger.h"
 
 client_node_t* client_list=NULL;
-uint8_t total_available_clients=0;
+atomic_int total_available_clients=0;
+
+/* fd -> client, so lookups by fd are a plain index; gen is the last generation handed out on the fd. */
+typedef struct
+{
+    client_data_t* data;
+    uint32_t gen;
+}client_slot_t;
+
+static client_slot_t client_index[IO_MAX_FDS];
 
 const char* queueErrStr[]={
     "UNDEFINED_QUEUE_ERR",
@@ -29,9 +40,35 @@ const char* chat_status_str[]={
     "CHAT_STATUS_FREE",
     "CHAT_STATUS_BUSY",
     "CHAT_STATUS_CLIENT_NOT_FOUND",
-    "CHAT_STATUS_REQ_PENDING"
+    "CHAT_STATUS_REQ_PENDING",
+    "CHAT_STATUS_REQ_SENT"
 };
 
+bool reserve_client_slot(void)
+{
+    int count = atomic_load_explicit(&total_available_clients,memory_order_relaxed);
+    do
+    {
+        if(count>=(int)config_tuning()->max_clients)
+        {
+            LOGE("Max client limit reached, total_available_clients : %d.",count);
+            return false;
+        }
+    }while(!atomic_compare_exchange_weak_explicit(&total_available_clients,&count,count+1,
+                                                  memory_order_acq_rel,memory_order_relaxed));
+    return true;
+}
+
+void release_client_slot(void)
+{
+    atomic_fetch_sub_explicit(&total_available_clients,1,memory_order_acq_rel);
+}
+
+int get_total_available_clients(void)
+{
+    return atomic_load_explicit(&total_available_clients,memory_order_relaxed);
+}
+
 srv_queue_err_type_t add_client_node_to_queue(int* fd)
 {
     LOGD("");
@@ -40,12 +77,10 @@ srv_queue_err_type_t add_client_node_to_queue(int* fd)
         LOGE("Null ptr found.");
         return ERR_NULL_PTR;
     }
-
-    if(total_available_clients>=MAX_CLIENT) 
+    if( (*fd < 0) || (*fd >= IO_MAX_FDS) )
     {
-        LOGE("Max client limit reached, cannot connect more client now \
-                [ total_available_clients= %d ] !!!\n",total_available_clients);
-        return ERR_SERVER_QUEUE_FULL;
+        LOGE("fd : %d, outside client index.",*fd);
+        return ERR_INVALID_ID;
     }
 
     client_node_t *new_node = malloc(sizeof(client_node_t));
@@ -57,9 +92,25 @@ srv_queue_err_type_t add_client_node_to_queue(int* fd)
 
     new_node->data.fd = *fd;
     new_node->next = NULL;
-    new_node->data.to_fd = INVALID_FD;
-    new_node->data.chat_status = CHAT_STATUS_FREE;
-    new_node->data.thread_id = pthread_self();
+    new_node->data.handshake_done = false;
+    new_node->data.codecs = CODEC_NONE;
+    new_node->data.name_registered = false;
+    new_node->data.claim_name[0] = '\0';
+    new_node->data.claim_req_id = 0;
+    new_node->data.last_rx_ms = 0;
+    new_node->data.last_activity_ms = 0;
+    srv_timer_init(&new_node->data.handshake_timer,NULL,NULL);
+    srv_timer_init(&new_node->data.idle_timer,NULL,NULL);
+    for(int i=0; i<MAX_CHANNELS; i++)
+    {
+        new_node->data.channels[i].status = CHAT_STATUS_FREE;
+        new_node->data.channels[i].peer_node = NODE_LOCAL;
+        new_node->data.channels[i].peer_fd = INVALID_FD;
+        new_node->data.channels[i].peer_gen = 0;
+        new_node->data.channels[i].peer_channel = NO_CHANNEL;
+        new_node->data.channels[i].peer_name[0] = '\0';
+        srv_timer_init(&new_node->data.channels[i].conn_req_timer,NULL,NULL);
+    }
 
     memset(new_node->data.name,'\0',MAX_CLIENT_NAME_LEN);
     sprintf(new_node->data.name,"temp_client_name_%d",new_node->data.fd);
@@ -73,11 +124,24 @@ srv_queue_err_type_t add_client_node_to_queue(int* fd)
         head->next = new_node;
     }
 
-    total_available_clients++;
+    client_slot_t* slot = &client_index[*fd];
+    if(0 == ++slot->gen)
+        ++slot->gen;
+    new_node->data.gen = slot->gen;
+    slot->data = &new_node->data;
+
     LOGI("Added client with fd: %d.", new_node->data.fd);
     return SERVER_QUEUE_SUCC;
 }
 
+static void cancel_client_timers(client_data_t* data)
+{
+    srv_timer_cancel(&data->handshake_timer);
+    srv_timer_cancel(&data->idle_timer);
+    for(int i=0; i<MAX_CHANNELS; i++)
+        srv_timer_cancel(&data->channels[i].conn_req_timer);
+}
+
 srv_queue_err_type_t remove_client_node_from_queue_by_fd(int fd)
 {
     LOGD("");
@@ -96,13 +160,13 @@ srv_queue_err_type_t remove_client_node_from_queue_by_fd(int fd)
         if (client_list->data.fd == fd) 
         {
             client_node_t* temp = client_list;
-            LOGI("closig fd : %d.",temp->data.fd);
-            close(temp->data.fd);
+            LOGI("removing fd : %d.",temp->data.fd);
+            cancel_client_timers(&temp->data);
+            client_index[fd].data = NULL;
             client_list = client_list->next;
-            pthread_detach(temp->data.thread_id);
             free(temp);
             LOGI("removed client with fd: %d.", fd);
-            total_available_clients--;
+            release_client_slot();
             ret = SERVER_QUEUE_SUCC;
         }
         else
@@ -123,11 +187,11 @@ srv_queue_err_type_t remove_client_node_from_queue_by_fd(int fd)
             else
             {
                 prev->next = curr->next;
-                LOGI("closig fd : %d.",curr->data.fd);
-                close(curr->data.fd);
-                pthread_detach(curr->data.thread_id);
+                LOGI("removing fd : %d.",curr->data.fd);
+                cancel_client_timers(&curr->data);
+                client_index[fd].data = NULL;
                 free(curr);
-                total_available_clients--;
+                release_client_slot();
                 LOGI("removed client with fd: %d.", fd);
                 ret = SERVER_QUEUE_SUCC; 
             }
@@ -162,25 +226,33 @@ srv_queue_err_type_t set_name_of_client_by_client_fd(int fd,char* name)
     }
     else
     {
-        client_node_t* temp_node = client_list;
-
-        while( (NULL != temp_node) && (fd != temp_node->data.fd) ) 
-            temp_node=temp_node->next;
-        
-        if(NULL == temp_node) 
+        client_data_t* data = get_client_data_by_fd(fd);
+        if(NULL == data) 
         {
             LOGE("No client found with fd : %d.",fd);
         }
         else
         {
-            strncpy(temp_node->data.name,name,MAX_CLIENT_NAME_LEN-1);
-            temp_node->data.name[MAX_CLIENT_NAME_LEN - 1] = '\0';
+            strncpy(data->name,name,MAX_CLIENT_NAME_LEN-1);
+            data->name[MAX_CLIENT_NAME_LEN - 1] = '\0';
             ret_val = SERVER_QUEUE_SUCC;  
         }
     }
     return ret_val;
 }
 
+client_data_t* get_client_data_by_fd(int fd)
+{
+    if( (fd < 0) || (fd >= IO_MAX_FDS) ) return NULL;
+    return client_index[fd].data;
+}
+
+client_data_t* get_client_data_by_handle(int fd, uint32_t gen)
+{
+    client_data_t* data = get_client_data_by_fd(fd);
+    return ( (data) && (gen == data->gen) ) ? data : NULL;
+}
+
 char* get_client_name_by_fd(int sock)
 {
     LOGD("");
@@ -309,6 +381,17 @@ name_find_type_t check_client_with_same_name_exist_or_not(char* name)
         return NAME_EXISTS;
 }
 
+void for_each_client(client_iter_cb_t cb, void* arg)
+{
+    client_node_t* temp = client_list;
+    while(temp)
+    {
+        client_node_t* next = temp->next;
+        cb(&temp->data,arg);
+        temp = next;
+    }
+}
+
 void free_all_client_nodes(void)
 {
     LOGD("");
@@ -316,161 +399,148 @@ void free_all_client_nodes(void)
     while(client_list)
     {
         temp = client_list->next;
+        client_index[client_list->data.fd].data = NULL;
         free(client_list);
         client_list = temp;
     }
     LOGI("Freed-up all nodes memory.");
 }
 
-void join_all_client_threads(void)
+chat_channel_t* get_channel(client_data_t* data, uint8_t channel)
 {
-    client_node_t* temp=client_list;
-    while(temp)
-    {
-        LOGI("Joiinng %lu to main.",temp->data.thread_id);
-        pthread_join(temp->data.thread_id,NULL);
-        temp = temp->next;
-    }
-    LOGI("All threads are joined.");
+    if( (!data) || (NO_CHANNEL==channel) || (channel > MAX_CHANNELS) ) return NULL;
+    return &data->channels[channel-1];
 }
 
-client_chat_status_t get_client_chatting_status_by_name(char* name)
+/* NO_CHANNEL picks the lowest channel in the given status. */
+uint8_t find_channel(client_data_t* data, uint8_t channel, client_chat_status_t status)
 {
-    LOGD("");
-    client_chat_status_t ret = CHAT_STATUS_CLIENT_NOT_FOUND;
-
-    if(!name) 
+    if(!data) return NO_CHANNEL;
+    if(NO_CHANNEL != channel)
     {
-        LOGE("Null ptr found.");
-        return ret;
+        chat_channel_t* chan = get_channel(data,channel);
+        return (chan && (status == chan->status)) ? channel : NO_CHANNEL;
     }
-
-    client_node_t* temp = client_list;
-    while(temp && (strcmp(name, temp->data.name))) 
-        temp = temp->next;
-
-    if(temp) 
-    {
-        LOGI("Client chat status of %s is : %s",temp->data.name, chat_status_to_str(temp->data.chat_status));
-        ret = temp->data.chat_status;
-    }
-    else
+    for(int i=0; i<MAX_CHANNELS; i++)
     {
-        LOGE("No client found with name : %s.",name);
+        if(status == data->channels[i].status)
+            return i+1;
     }
-    return ret;
+    return NO_CHANNEL;
 }
 
-client_chat_status_t get_client_chatting_status_by_fd(int fd)
+uint8_t find_channel_by_peer(client_data_t* data, const client_data_t* peer)
 {
-    LOGD("");
-    client_chat_status_t ret = CHAT_STATUS_CLIENT_NOT_FOUND;
-
-    if(INVALID_FD==fd) return ret;
-
-    client_node_t* temp = client_list;
-    while(temp && (fd!=temp->data.fd)) 
-        temp = temp->next;
-
-    if(temp) 
-    {
-        LOGI("Client chat status of %s is : %s",temp->data.name, chat_status_to_str(temp->data.chat_status));
-        ret = temp->data.chat_status;
-    }
-    else
+    if( (!data) || (!peer) ) return NO_CHANNEL;
+    for(int i=0; i<MAX_CHANNELS; i++)
     {
-        LOGE("No client found with fd : %d.",fd);
+        if( (CHAT_STATUS_FREE != data->channels[i].status) && (NODE_LOCAL == data->channels[i].peer_node) &&
+            (peer->fd == data->channels[i].peer_fd) && (peer->gen == data->channels[i].peer_gen) )
+            return i+1;
     }
-    return ret;
+    return NO_CHANNEL;
 }
 
-
-chat_err_t set_client_chatting_status_by_fd(int fd,client_chat_status_t chat_status)
+/* Conversations with clients of other nodes are looked up by name. */
+uint8_t find_channel_by_remote_name(client_data_t* data, const char* name)
 {
-    LOGD("");
-    chat_err_t ret = ERR_CHAT_CLIENT_NOT_FOUND;
-
-    if(chat_status >= CHAT_STATUS_MAX) 
+    if(!data) return NO_CHANNEL;
+    for(int i=0; i<MAX_CHANNELS; i++)
     {
-        LOGE("Invalid chat status found.");
-        ret = ERR_CHAT_INVALID_CHAT_STATUS;
+        if( (CHAT_STATUS_FREE != data->channels[i].status) && (NODE_LOCAL != data->channels[i].peer_node) &&
+            (0==strcmp(name,data->channels[i].peer_name)) )
+            return i+1;
     }
-    else if(INVALID_FD == fd)
-    {
-        LOGE("Invalid fd found.");
-    }
-    else
-    {
-        client_node_t* temp = client_list;
-        while(temp && (!(fd == temp->data.fd))) 
-            temp = temp->next;
-    
-        if(temp) 
-        {
-            LOGI("Setting chat status to : %s of client with name : %s.",chat_status_to_str(chat_status),temp->data.name);
-            temp->data.chat_status = chat_status;
-            ret = CHAT_SUCCESS;
-        }
-        else
-        {
-            LOGE("No client found with id : %d.",fd);
-        }
-    }
-    return ret;
+    return NO_CHANNEL;
 }
 
-chat_err_t set_to_fd_by_fd(int my_fd,int to_fd)
+/*
+ * A channel moves FREE -> REQ_SENT or REQ_PENDING -> BUSY -> FREE, and back
+ * to FREE from anywhere. A step only applies from the state the caller
+ * expects. Pairing handlers all run on the event loop, which serializes them.
+ */
+static bool transition_allowed(client_chat_status_t from, client_chat_status_t to)
 {
-    LOGD("");
-    if(INVALID_FD==my_fd)
-    {
-        LOGE("Invalid fd found.");
-        return ERR_CHAT_CLIENT_NOT_FOUND;
-    }
-    client_node_t* temp = client_list;
-    while(temp && (my_fd != temp->data.fd))
-        temp = temp->next;
-
-    if(temp) 
-    {
-        temp->data.to_fd = to_fd;
-        LOGI("set : to fd of %d is %d.",temp->data.fd,temp->data.to_fd);
-
-        return CHAT_SUCCESS;
-    }
-    else
-    {
-        LOGE("No client found with fd : %d.",my_fd);
-        return ERR_CHAT_CLIENT_NOT_FOUND;
+    switch(to)
+    {
+        case CHAT_STATUS_REQ_SENT:
+        case CHAT_STATUS_REQ_PENDING:
+            return (CHAT_STATUS_FREE == from);
+        case CHAT_STATUS_BUSY:
+            return (CHAT_STATUS_REQ_SENT == from) || (CHAT_STATUS_REQ_PENDING == from);
+        case CHAT_STATUS_FREE:
+            return true;
+        default:
+            return false;
     }
 }
 
-int get_conn_fd_by_fd(int my_fd)
+bool channel_transition(chat_channel_t* chan, client_chat_status_t from, client_chat_status_t to)
 {
-    LOGD("");
-    if(INVALID_FD==my_fd)
+    if(!chan) return false;
+    if(!transition_allowed(from,to))
     {
-        LOGE("Invalid fd found.");
-        return INVALID_FD;
+        LOGE("channel cannot go from %s to %s.",chat_status_to_str(from),chat_status_to_str(to));
+        return false;
     }
+    if(from != chan->status)
+        return false;
+    chan->status = to;
+    return true;
+}
 
-    client_node_t* temp = client_list;
-    while(temp && (!(my_fd == temp->data.fd))) 
-        temp = temp->next;
+uint8_t alloc_channel(client_data_t* data, client_chat_status_t status, int peer_fd)
+{
+    for(uint8_t channel=1; (data) && (channel<=MAX_CHANNELS); channel++)
+    {
+        chat_channel_t* chan = get_channel(data,channel);
+        if(!channel_transition(chan,CHAT_STATUS_FREE,status))
+            continue;
+        chan->peer_node = NODE_LOCAL;
+        chan->peer_fd = peer_fd;
+        client_data_t* peer = get_client_data_by_fd(peer_fd);
+        chan->peer_gen = (peer) ? peer->gen : 0;
+        chan->peer_channel = NO_CHANNEL;
+        chan->peer_name[0] = '\0';
+        LOGI("fd : %d, channel %u : %s with fd : %d.",data->fd,channel,chat_status_to_str(status),peer_fd);
+        return channel;
+    }
+    LOGI("fd : %d, all %d channels in use.",data ? data->fd : INVALID_FD,MAX_CHANNELS);
+    return NO_CHANNEL;
+}
 
-    if(temp) 
-    {
-        LOGI("Found client with fd : %d, name : %s. conn_fd : %d."\
-                ,temp->data.fd,temp->data.name,temp->data.to_fd);
-        return temp->data.to_fd;
-    }
-    else
-    {
-        LOGE("No client found with fd : %d.",my_fd);
-        return INVALID_FD;
-    }
+void release_channel(client_data_t* data, uint8_t channel)
+{
+    chat_channel_t* chan = get_channel(data,channel);
+    if(!chan) return;
+    srv_timer_cancel(&chan->conn_req_timer);
+    chan->status = CHAT_STATUS_FREE;
+    chan->peer_node = NODE_LOCAL;
+    chan->peer_fd = INVALID_FD;
+    chan->peer_gen = 0;
+    chan->peer_channel = NO_CHANNEL;
+    chan->peer_name[0] = '\0';
+    LOGI("fd : %d, channel %u released.",data->fd,channel);
 }
 
+/*
+ * The peer's end of a channel, only while it still points back at this one.
+ * Both ends are checked by generation, a recycled fd never matches.
+ */
+chat_channel_t* get_linked_channel(client_data_t* data, uint8_t channel, client_data_t** peer_out)
+{
+    chat_channel_t* chan = get_channel(data,channel);
+    if( (!chan) || (CHAT_STATUS_FREE == chan->status) || (NODE_LOCAL != chan->peer_node) ) return NULL;
+
+    client_data_t* peer = get_client_data_by_handle(chan->peer_fd,chan->peer_gen);
+    chat_channel_t* peer_chan = get_channel(peer,chan->peer_channel);
+    if( (!peer_chan) || (CHAT_STATUS_FREE == peer_chan->status) || (data->fd != peer_chan->peer_fd) ||
+        (data->gen != peer_chan->peer_gen) || (channel != peer_chan->peer_channel) )
+        return NULL;
+    if(peer_out)
+        *peer_out = peer;
+    return peer_chan;
+}
 
 const char *chat_status_to_str(client_chat_status_t c )
 {
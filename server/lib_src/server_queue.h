@@ -1,6 +1,7 @@
 #ifndef SERVER_QUEUE_H
 #define SERVER_QUEUE_H
 
+#include <stdbool.h>
 #include "chat_app_common.h"
 
 #define MAX_QUEUE_LEN        20
@@ -25,6 +26,7 @@ typedef enum{
     CHAT_STATUS_BUSY,
     CHAT_STATUS_CLIENT_NOT_FOUND,
     CHAT_STATUS_REQ_PENDING,
+    CHAT_STATUS_REQ_SENT,
     CHAT_STATUS_MAX
 }client_chat_status_t;
 
@@ -41,6 +43,10 @@ typedef enum{
     NAME_FIND_ERR
 }name_find_type_t;
 
+bool reserve_client_slot(void);
+void release_client_slot(void);
+int get_total_available_clients(void);
+
 srv_queue_err_type_t add_client_node_to_queue(int* fd);
 srv_queue_err_type_t remove_client_node_from_queue_by_fd(int fd);
 
@@ -55,14 +61,7 @@ srv_queue_err_type_t set_name_of_client_by_client_fd(int fd,char* name);
 srv_queue_err_type_t get_client_list(char *list);
 name_find_type_t check_client_with_same_name_exist_or_not(char* name);
 void free_all_client_nodes(void);
-void join_all_client_threads(void);
-
-chat_err_t set_client_chatting_status_by_fd(int fd,client_chat_status_t chat_status);
-client_chat_status_t get_client_chatting_status_by_name(char* name);
-client_chat_status_t get_client_chatting_status_by_fd(int fd);
-int get_conn_fd_by_fd(int my_fd);
 
 const char *chat_status_to_str(client_chat_status_t c );
-chat_err_t set_to_fd_by_fd(int my_fd,int to_fd);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "server_ratelimit.h"
+#include "logger.h"
+
+static const char *rateClassStr[] = {
+    "list",
+    "connect",
+    "name",
+    "chat",
+    "other"
+};
+
+static rate_config_t config;
+
+const char* rate_class_to_str(rate_class_t cls)
+{
+    if(cls >= RATE_CLASS_MAX) return "none";
+    return rateClassStr[cls];
+}
+
+void rate_config_defaults(rate_config_t* cfg)
+{
+    memset(cfg,0,sizeof(*cfg));
+    cfg->limits[RATE_CLASS_LIST]    = (rate_limit_t){ 5, 16 };
+    cfg->limits[RATE_CLASS_CONNECT] = (rate_limit_t){ 5, 16 };
+    cfg->limits[RATE_CLASS_NAME]    = (rate_limit_t){ 2, 16 };
+    cfg->limits[RATE_CLASS_CHAT]    = (rate_limit_t){ 1000, 4000 };
+    cfg->limits[RATE_CLASS_OTHER]   = (rate_limit_t){ 100, 200 };
+    cfg->max_strikes = RATE_DEFAULT_MAX_STRIKES;
+}
+
+bool rate_config_parse(rate_config_t* cfg, const char* spec)
+{
+    const char* eq = strchr(spec,'=');
+    if(!eq) return false;
+    size_t name_len = eq - spec;
+    char* end = NULL;
+    unsigned long per_sec = strtoul(eq+1,&end,10);
+    if(end == eq+1) return false;
+
+    if( (strlen("strikes") == name_len) && (0 == strncmp(spec,"strikes",name_len)) )
+    {
+        if('\0' != *end) return false;
+        cfg->max_strikes = (uint32_t)per_sec;
+        return true;
+    }
+
+    unsigned long burst = per_sec ? per_sec : 1;
+    if('/' == *end)
+    {
+        const char* burst_str = end+1;
+        burst = strtoul(burst_str,&end,10);
+        if( (end == burst_str) || (0 == burst) ) return false;
+    }
+    if('\0' != *end) return false;
+
+    for(int i=0; i<RATE_CLASS_MAX; i++)
+    {
+        if( (strlen(rateClassStr[i]) != name_len) || (strncmp(spec,rateClassStr[i],name_len)) ) continue;
+        cfg->limits[i].per_sec = (uint32_t)per_sec;
+        cfg->limits[i].burst = (uint32_t)burst;
+        return true;
+    }
+    return false;
+}
+
+void rate_init(const rate_config_t* cfg)
+{
+    config = *cfg;
+    for(int i=0; i<RATE_CLASS_MAX; i++)
+    {
+        if(config.limits[i].per_sec)
+            LOGI("Rate limit %-8s : %u/s, burst %u.",rateClassStr[i],config.limits[i].per_sec,config.limits[i].burst);
+        else
+            LOGI("Rate limit %-8s : none.",rateClassStr[i]);
+    }
+    LOGI("Clients are dropped after %u throttled requests in %d ms.",config.max_strikes,RATE_STRIKE_WINDOW_MS);
+}
+
+void rate_state_init(rate_state_t* st, uint64_t now_ms)
+{
+    memset(st,0,sizeof(*st));
+    for(int i=0; i<RATE_CLASS_MAX; i++)
+    {
+        st->tokens_milli[i] = (uint64_t)config.limits[i].burst * 1000;
+        st->refill_ms[i] = now_ms;
+    }
+}
+
+/* RATE_CLASS_MAX for frames that are never throttled. */
+static rate_class_t rate_class_of(msg_type_t type)
+{
+    switch(type)
+    {
+        case MSG_GET_CLIENT_LIST_TYPE:
+            return RATE_CLASS_LIST;
+        case MSG_CONNECT_TO_CLIENT:
+            return RATE_CLASS_CONNECT;
+        case MSG_SET_NAME_REQ_TYPE:
+            return RATE_CLASS_NAME;
+        case MSG_CLIENT_TX_TYPE:
+        case MSG_CLIENT_TX_COMPRESSED:
+            return RATE_CLASS_CHAT;
+        // Raw chunk bytes follow MSG_FILE_DATA, and a session moves one file at a time anyway.
+        case MSG_HEARTBEAT_ACK:
+        case MSG_FILE_OFFER:
+        case MSG_FILE_DATA:
+        case MSG_FILE_CANCEL:
+            return RATE_CLASS_MAX;
+        default:
+            return RATE_CLASS_OTHER;
+    }
+}
+
+rate_verdict_t rate_check(rate_state_t* st, msg_type_t type, uint64_t now_ms, uint32_t* retry_after_ms)
+{
+    rate_class_t cls = rate_class_of(type);
+    if( (RATE_CLASS_MAX == cls) || (0 == config.limits[cls].per_sec) )
+        return RATE_PASS;
+
+    const rate_limit_t* limit = &config.limits[cls];
+    uint64_t cap = (uint64_t)limit->burst * 1000;
+    if(now_ms > st->refill_ms[cls])
+    {
+        st->tokens_milli[cls] += (now_ms - st->refill_ms[cls]) * limit->per_sec;
+        if(st->tokens_milli[cls] > cap)
+            st->tokens_milli[cls] = cap;
+        st->refill_ms[cls] = now_ms;
+    }
+    if(st->tokens_milli[cls] >= 1000)
+    {
+        st->tokens_milli[cls] -= 1000;
+        return RATE_PASS;
+    }
+
+    *retry_after_ms = (uint32_t)((1000 - st->tokens_milli[cls] + limit->per_sec - 1) / limit->per_sec);
+    if(now_ms - st->strikes_since_ms >= RATE_STRIKE_WINDOW_MS)
+    {
+        st->strikes = 0;
+        st->strikes_since_ms = now_ms;
+    }
+    st->strikes++;
+    if( (config.max_strikes) && (st->strikes >= config.max_strikes) )
+        return RATE_EVICT;
+    return RATE_THROTTLE;
+}
@@ -0,0 +1,60 @@
+#ifndef SERVER_RATELIMIT_H
+#define SERVER_RATELIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chat_app_common.h"
+
+/* Throttled requests within RATE_STRIKE_WINDOW_MS after which the client is dropped. */
+#define RATE_DEFAULT_MAX_STRIKES  20
+#define RATE_STRIKE_WINDOW_MS     10000
+
+typedef enum{
+    RATE_CLASS_LIST=0,
+    RATE_CLASS_CONNECT,
+    RATE_CLASS_NAME,
+    RATE_CLASS_CHAT,
+    RATE_CLASS_OTHER,
+    RATE_CLASS_MAX
+}rate_class_t;
+
+/* Tokens added per second and bucket depth; 0 per_sec leaves the class unlimited. */
+typedef struct{
+    uint32_t per_sec;
+    uint32_t burst;
+}rate_limit_t;
+
+typedef struct{
+    rate_limit_t limits[RATE_CLASS_MAX];
+    uint32_t max_strikes;
+}rate_config_t;
+
+/* Embedded in each client, tokens are kept in thousandths so slow rates refill smoothly. */
+typedef struct{
+    uint64_t tokens_milli[RATE_CLASS_MAX];
+    uint64_t refill_ms[RATE_CLASS_MAX];
+    uint32_t strikes;
+    uint64_t strikes_since_ms;
+}rate_state_t;
+
+typedef enum{
+    RATE_PASS=0,
+    RATE_THROTTLE,
+    RATE_EVICT
+}rate_verdict_t;
+
+void rate_config_defaults(rate_config_t* cfg);
+/* "class=per_sec/burst" or "strikes=n", false on a malformed spec. */
+bool rate_config_parse(rate_config_t* cfg, const char* spec);
+void rate_init(const rate_config_t* cfg);
+
+void rate_state_init(rate_state_t* st, uint64_t now_ms);
+/*
+ * Takes a token for msg_type from its class. A frame without a token is
+ * throttled, retry_after_ms tells when one is back; too many of those in a
+ * row evict the client.
+ */
+rate_verdict_t rate_check(rate_state_t* st, msg_type_t type, uint64_t now_ms, uint32_t* retry_after_ms);
+const char* rate_class_to_str(rate_class_t cls);
+
+#endif
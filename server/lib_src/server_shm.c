@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "server_shm.h"
+#include "server_mgmt.h"
+#include "server_metrics.h"
+#include "logger.h"
+
+/* Frame that found the client's ring full, sent in order once it has room. */
+typedef struct shm_backlog_t
+{
+    struct shm_backlog_t* next;
+    msg_t msg;
+}shm_backlog_t;
+
+typedef struct shm_link_t
+{
+    int fd;
+    shm_region_t* region;
+    /* Kept open so a hot upgrade can hand the region over. */
+    int region_fd;
+    int client_efd;
+    /* Set once the client broke the protocol, its socket is closing. */
+    bool dead;
+    /* Own copies of our ends, the client can scribble over the shared ones. */
+    uint32_t rx_head;
+    uint32_t tx_tail;
+    shm_backlog_t* backlog_head;
+    shm_backlog_t* backlog_tail;
+    struct shm_link_t* next;
+    struct shm_link_t* prev;
+}shm_link_t;
+
+/* Shared by every client, they write to it after touching a ring. */
+static int doorbell_fd = INVALID_FD;
+/* fd -> link for the send path, the list for the doorbell. */
+static shm_link_t** links_by_fd = NULL;
+static shm_link_t* links = NULL;
+
+static shm_link_t* link_by_fd(int fd)
+{
+    if( (!links_by_fd) || (fd < 0) || (fd >= IO_MAX_FDS) ) return NULL;
+    return links_by_fd[fd];
+}
+
+static void link_add(shm_link_t* link)
+{
+    link->next = links;
+    if(links)
+        links->prev = link;
+    links = link;
+    links_by_fd[link->fd] = link;
+}
+
+static void link_free(shm_link_t* link)
+{
+    while(link->backlog_head)
+    {
+        shm_backlog_t* item = link->backlog_head;
+        link->backlog_head = item->next;
+        free(item);
+    }
+    if(link->region)
+        munmap(link->region,sizeof(shm_region_t));
+    if(INVALID_FD != link->region_fd)
+        close(link->region_fd);
+    if(INVALID_FD != link->client_efd)
+        close(link->client_efd);
+    free(link);
+}
+
+int shm_init(int inherited_doorbell)
+{
+    links_by_fd = calloc(IO_MAX_FDS,sizeof(shm_link_t*));
+    // Clients moved over by a hot upgrade still ring the old doorbell.
+    doorbell_fd = (INVALID_FD != inherited_doorbell) ? inherited_doorbell : eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if( (!links_by_fd) || (INVALID_FD == doorbell_fd) )
+    {
+        LOGE("Shared memory init failed, errno : %d.",errno);
+        shm_fini();
+        return -1;
+    }
+    if(IO_SUCC != srv_io_add_doorbell(doorbell_fd,shm_doorbell))
+    {
+        shm_fini();
+        return -1;
+    }
+    LOGI("Shared memory transport ready, ring slots : %d.",SHM_RING_SLOTS);
+    return 0;
+}
+
+void shm_fini(void)
+{
+    while(links)
+        shm_link_closed(links->fd);
+    free(links_by_fd);
+    links_by_fd = NULL;
+    if(INVALID_FD != doorbell_fd)
+        close(doorbell_fd);
+    doorbell_fd = INVALID_FD;
+}
+
+static bool is_unix_socket(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return (0 == getsockname(fd,(struct sockaddr*)&addr,&len)) && (AF_UNIX == addr.ss_family);
+}
+
+bool shm_upgrade(int fd, const msg_t* ack)
+{
+    if( (INVALID_FD == doorbell_fd) || (fd < 0) || (fd >= IO_MAX_FDS) || (links_by_fd[fd]) )
+        return false;
+    if(!is_unix_socket(fd))
+    {
+        LOGE("fd : %d, shared memory is only offered on the UNIX socket.",fd);
+        return false;
+    }
+
+    shm_link_t* link = calloc(1,sizeof(*link));
+    if(!link)
+    {
+        LOGE("fd : %d, calloc failed for shared memory link.",fd);
+        return false;
+    }
+    link->fd = fd;
+    link->client_efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    link->region_fd = memfd_create(SHM_REGION_NAME,MFD_CLOEXEC);
+    int region_fd = link->region_fd;
+    if( (INVALID_FD == link->client_efd) || (INVALID_FD == region_fd) || (ftruncate(region_fd,sizeof(shm_region_t))) )
+    {
+        LOGE("fd : %d, shared memory setup failed, errno : %d.",fd,errno);
+        link_free(link);
+        return false;
+    }
+    void* region = mmap(NULL,sizeof(shm_region_t),PROT_READ|PROT_WRITE,MAP_SHARED,region_fd,0);
+    if(MAP_FAILED == region)
+    {
+        LOGE("fd : %d, [ mmap ] of shared memory failed, errno : %d.",fd,errno);
+        link_free(link);
+        return false;
+    }
+    // A fresh memfd reads as zeroes, both rings start empty.
+    link->region = region;
+    link->region->magic = SHM_REGION_MAGIC;
+    link->region->slots = SHM_RING_SLOTS;
+
+    int fds[SHM_FD_COUNT];
+    fds[SHM_FD_REGION] = region_fd;
+    fds[SHM_FD_CLIENT_WAKE] = link->client_efd;
+    fds[SHM_FD_SERVER_WAKE] = doorbell_fd;
+    srv_io_err_t err = srv_io_send_fds(fd,ack,sizeof(*ack),fds,SHM_FD_COUNT);
+    if(IO_SUCC != err)
+    {
+        LOGE("fd : %d, cannot hand over shared memory, err : %s.",fd,ioErrToStr(err));
+        link_free(link);
+        return false;
+    }
+
+    link_add(link);
+    metrics_inc(METRIC_SHM_UPGRADES);
+    LOGI("fd : %d, moved onto shared memory.",fd);
+    return true;
+}
+
+void shm_link_closed(int fd)
+{
+    shm_link_t* link = link_by_fd(fd);
+    if(!link) return;
+    if(link->prev)
+        link->prev->next = link->next;
+    else
+        links = link->next;
+    if(link->next)
+        link->next->prev = link->prev;
+    links_by_fd[fd] = NULL;
+    link_free(link);
+}
+
+static void wake_client(shm_link_t* link)
+{
+    metrics_inc(METRIC_SHM_WAKEUPS);
+    shm_wake(link->client_efd);
+}
+
+bool shm_send(int fd, const msg_t* hdr, const msg_data_t* data)
+{
+    shm_link_t* link = link_by_fd(fd);
+    if(!link) return false;
+    metrics_inc(METRIC_TX_MSGS);
+    metrics_inc(METRIC_SHM_TX_MSGS);
+
+    if(!link->backlog_head)
+    {
+        shm_push_t ret = shm_ring_push_frame(&link->region->to_client,&link->tx_tail,hdr,data);
+        if(SHM_PUSH_WAKE == ret)
+            wake_client(link);
+        if(SHM_PUSH_FULL != ret)
+            return true;
+    }
+
+    // The client rings the doorbell once it makes room.
+    shm_backlog_t* item = malloc(sizeof(*item));
+    if(!item)
+    {
+        LOGE("fd : %d, malloc failed for shared memory backlog.",fd);
+        srv_io_close_fd(fd);
+        return true;
+    }
+    item->next = NULL;
+    memcpy(&item->msg,hdr,MSG_HDR_LEN);
+    item->msg.msg_data = *data;
+    if(link->backlog_tail)
+        link->backlog_tail->next = item;
+    else
+        link->backlog_head = item;
+    link->backlog_tail = item;
+    return true;
+}
+
+static void backlog_flush(shm_link_t* link)
+{
+    bool wake = false;
+    while(link->backlog_head)
+    {
+        shm_backlog_t* item = link->backlog_head;
+        shm_push_t ret = shm_ring_push(&link->region->to_client,&link->tx_tail,&item->msg);
+        if(SHM_PUSH_FULL == ret)
+            break;
+        wake |= (SHM_PUSH_WAKE == ret);
+        link->backlog_head = item->next;
+        if(!link->backlog_head)
+            link->backlog_tail = NULL;
+        free(item);
+    }
+    if(wake)
+        wake_client(link);
+}
+
+/* True when the budget ran out before the ring did. */
+static bool link_drain(shm_link_t* link)
+{
+    bool wake = false;
+    int budget = SHM_DRAIN_BUDGET;
+    msg_t msg;
+    while( (budget > 0) && (!link->dead) && (shm_ring_pop(&link->region->to_server,&link->rx_head,&msg,&wake)) )
+    {
+        budget--;
+        metrics_inc(METRIC_RX_MSGS);
+        metrics_inc(METRIC_SHM_RX_MSGS);
+        // Raw file chunks cannot follow a frame on the ring.
+        if( (shm_frame_on_socket(msg.msg_type)) || (!handle_rx_frame(link->fd,&msg)) )
+        {
+            LOGE("fd : %d, closing after bad frame on shared memory.",link->fd);
+            link->dead = true;
+            srv_io_close_fd(link->fd);
+        }
+    }
+    if(wake)
+        wake_client(link);
+    return (0 == budget);
+}
+
+void shm_doorbell(void)
+{
+    shm_wake_clear(doorbell_fd);
+    bool more = false;
+    // Handlers only defer closes, so no link leaves the list meanwhile.
+    for(shm_link_t* link=links; link; link=link->next)
+    {
+        backlog_flush(link);
+        if(link_drain(link))
+            more = true;
+    }
+    // Other sockets get their turn before the rest is drained.
+    if(more)
+        shm_wake(doorbell_fd);
+}
+
+int shm_doorbell_fd(void)
+{
+    return doorbell_fd;
+}
+
+int shm_export(int fd, shm_link_state_t* state, int* fds)
+{
+    shm_link_t* link = link_by_fd(fd);
+    if( (!link) || (link->dead) ) return 0;
+    state->rx_head = link->rx_head;
+    state->tx_tail = link->tx_tail;
+    state->backlog = 0;
+    for(shm_backlog_t* item=link->backlog_head; item; item=item->next)
+        state->backlog++;
+    fds[0] = link->region_fd;
+    fds[1] = link->client_efd;
+    return 2;
+}
+
+void shm_export_backlog(int fd, msg_t* out)
+{
+    shm_link_t* link = link_by_fd(fd);
+    for(shm_backlog_t* item=link ? link->backlog_head : NULL; item; item=item->next)
+        *out++ = item->msg;
+}
+
+bool shm_adopt(int fd, const shm_link_state_t* state, const int* fds, const msg_t* backlog)
+{
+    if( (INVALID_FD == doorbell_fd) || (fd < 0) || (fd >= IO_MAX_FDS) || (links_by_fd[fd]) )
+        return false;
+    shm_link_t* link = calloc(1,sizeof(*link));
+    if(!link)
+    {
+        LOGE("fd : %d, calloc failed for shared memory link.",fd);
+        return false;
+    }
+    link->fd = fd;
+    link->region_fd = fds[0];
+    link->client_efd = fds[1];
+    void* region = mmap(NULL,sizeof(shm_region_t),PROT_READ|PROT_WRITE,MAP_SHARED,link->region_fd,0);
+    if(MAP_FAILED == region)
+    {
+        LOGE("fd : %d, [ mmap ] of shared memory failed, errno : %d.",fd,errno);
+        link_free(link);
+        return false;
+    }
+    link->region = region;
+    link->rx_head = state->rx_head;
+    link->tx_tail = state->tx_tail;
+    link_add(link);
+    for(uint32_t i=0; i<state->backlog; i++)
+        shm_send(fd,&backlog[i],&backlog[i].msg_data);
+    // Whatever the client wrote meanwhile is drained on the first loop iteration.
+    shm_wake(doorbell_fd);
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef SERVER_SHM_H
+#define SERVER_SHM_H
+
+#include <stdbool.h>
+#include "chat_app_common.h"
+#include "chat_shm.h"
+
+/* Frames taken from one client's ring per doorbell, the rest waits for the next loop iteration. */
+#define SHM_DRAIN_BUDGET   64
+
+/* Our ends of a client's rings, carried over by a hot upgrade. */
+typedef struct
+{
+    uint32_t rx_head;
+    uint32_t tx_tail;
+    /* Frames waiting for room in the client's ring, they follow the state. */
+    uint32_t backlog;
+}shm_link_state_t;
+
+/* Creates the doorbell, or takes over inherited_doorbell, and registers it with the I/O backend. */
+int shm_init(int inherited_doorbell);
+void shm_fini(void);
+
+/* Moves a client on the UNIX socket onto a ring pair, ack goes out with the descriptors. */
+bool shm_upgrade(int fd, const msg_t* ack);
+/* Puts hdr's header and data on fd's ring as one frame, false when fd has none. */
+bool shm_send(int fd, const msg_t* hdr, const msg_data_t* data);
+/* The doorbell rang: drains the clients' rings and refills ours. */
+void shm_doorbell(void);
+void shm_link_closed(int fd);
+
+/*
+ * Hot upgrade. shm_export() fills state and the region and client eventfd
+ * descriptors, it returns how many it set: 0 for a socket without rings.
+ * shm_adopt() takes them over in the new process, doorbell included.
+ */
+int shm_doorbell_fd(void);
+int shm_export(int fd, shm_link_state_t* state, int* fds);
+void shm_export_backlog(int fd, msg_t* out);
+bool shm_adopt(int fd, const shm_link_state_t* state, const int* fds, const msg_t* backlog);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "server_shutdown.h"
+#include "server_io.h"
+#include "logger.h"
+
+static volatile sig_atomic_t requested = 0;
+static int wake_fd = INVALID_FD;
+
+static void shutdown_signal_handler(int sig)
+{
+    (void)sig;
+    shutdown_request();
+}
+
+/* Only wakes the loop, which checks the flag after every iteration. */
+static void shutdown_wake(void)
+{
+    uint64_t val;
+    while( (read(wake_fd,&val,sizeof(val)) < 0) && (EINTR == errno) );
+}
+
+int shutdown_init(void)
+{
+    wake_fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if( (INVALID_FD == wake_fd) || (IO_SUCC != srv_io_add_doorbell(wake_fd,shutdown_wake)) )
+    {
+        LOGE("Shutdown eventfd setup failed, errno : %d.",errno);
+        shutdown_fini();
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = shutdown_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; // <- do NOT set SA_RESTART
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    return 0;
+}
+
+void shutdown_request(void)
+{
+    // write() is async-signal-safe, errno is put back for the code we interrupted.
+    int saved_errno = errno;
+    requested = 1;
+    if(INVALID_FD != wake_fd)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(wake_fd,&one,sizeof(one));
+        (void)ret;
+    }
+    errno = saved_errno;
+}
+
+bool shutdown_requested(void)
+{
+    return 0 != requested;
+}
+
+void shutdown_fini(void)
+{
+    if(INVALID_FD != wake_fd)
+        close(wake_fd);
+    wake_fd = INVALID_FD;
+}
@@ -0,0 +1,20 @@
+#ifndef SERVER_SHUTDOWN_H
+#define SERVER_SHUTDOWN_H
+
+#include <stdbool.h>
+
+/* Replies and shutdown notices get this long to leave before every socket is closed. */
+#define SHUTDOWN_DRAIN_MS   1000
+
+/*
+ * Installs the SIGINT and SIGTERM handlers and registers an eventfd with the
+ * I/O backend: the handler only sets a flag and rings the eventfd, so a
+ * signal arriving just before the loop blocks still wakes it at once.
+ */
+int shutdown_init(void);
+/* Async-signal-safe. */
+void shutdown_request(void);
+bool shutdown_requested(void);
+void shutdown_fini(void);
+
+#endif
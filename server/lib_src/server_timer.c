@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "server_timer.h"
+#include "logger.h"
+
+/*
+ * Hierarchical timing wheel: level 0 holds timers due within 64 ticks,
+ * each higher level covers 64 times the range of the one below. Timers
+ * are re-inserted one level down when the lower level wraps, so arm and
+ * cancel are list operations and a tick only touches one slot per level.
+ */
+static srv_timer_t wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t cur_tick = 0;
+static uint64_t wheel_start_ms = 0;
+static uint64_t armed_count = 0;
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t srv_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void timer_list_unlink(srv_timer_t* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void timer_list_add_tail(srv_timer_t* head, srv_timer_t* timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void wheel_insert(srv_timer_t* timer)
+{
+    uint64_t max_delta = (1ULL << (TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS)) - 1;
+
+    if(timer->expires <= cur_tick)
+        timer->expires = cur_tick + 1;
+    if(timer->expires - cur_tick > max_delta)
+        timer->expires = cur_tick + max_delta;
+
+    uint64_t delta = timer->expires - cur_tick;
+    int level = 0;
+    while( (level < TIMER_WHEEL_LEVELS-1) && (delta >= (1ULL << (TIMER_WHEEL_BITS*(level+1)))) )
+        level++;
+
+    unsigned int slot = (timer->expires >> (TIMER_WHEEL_BITS*level)) & TIMER_WHEEL_MASK;
+    timer_list_add_tail(&wheel[level][slot],timer);
+}
+
+static void wheel_cascade(int level, unsigned int slot)
+{
+    srv_timer_t* head = &wheel[level][slot];
+    while(head->next != head)
+    {
+        srv_timer_t* timer = head->next;
+        timer_list_unlink(timer);
+        wheel_insert(timer);
+    }
+}
+
+/* Advances one tick and moves the expired timers onto fired_head. */
+static void wheel_advance(srv_timer_t* fired_head)
+{
+    cur_tick++;
+
+    int level = 1;
+    uint64_t index = cur_tick;
+    while( (level < TIMER_WHEEL_LEVELS) && (0 == (index & TIMER_WHEEL_MASK)) )
+    {
+        index >>= TIMER_WHEEL_BITS;
+        wheel_cascade(level,index & TIMER_WHEEL_MASK);
+        level++;
+    }
+
+    srv_timer_t* head = &wheel[0][cur_tick & TIMER_WHEEL_MASK];
+    while(head->next != head)
+    {
+        srv_timer_t* timer = head->next;
+        timer_list_unlink(timer);
+        timer_list_add_tail(fired_head,timer);
+    }
+}
+
+void srv_timer_init(srv_timer_t* timer, srv_timer_cb_t cb, void* arg)
+{
+    if(!timer) return;
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->cb = cb;
+    timer->arg = arg;
+}
+
+srv_timer_err_t srv_timer_arm(srv_timer_t* timer, uint64_t timeout_ms)
+{
+    if( (!timer) || (!timer->cb) )
+    {
+        LOGE("Null timer or timer callback found.");
+        return ERR_TIMER_NULL_PTR;
+    }
+
+    uint64_t ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    uint64_t now_tick = (srv_now_ms() - wheel_start_ms) / TIMER_TICK_MS;
+
+    pthread_mutex_lock(&wheel_mutex);
+    if(timer->prev)
+        timer_list_unlink(timer);
+    else
+        armed_count++;
+    // The loop may have slept past several ticks, count from wall time not cur_tick.
+    if(now_tick < cur_tick)
+        now_tick = cur_tick;
+    timer->expires = now_tick + (ticks ? ticks : 1);
+    wheel_insert(timer);
+    pthread_mutex_unlock(&wheel_mutex);
+    return TIMER_SUCC;
+}
+
+void srv_timer_cancel(srv_timer_t* timer)
+{
+    if(!timer) return;
+    pthread_mutex_lock(&wheel_mutex);
+    if(timer->prev)
+    {
+        timer_list_unlink(timer);
+        armed_count--;
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+bool srv_timer_is_armed(srv_timer_t* timer)
+{
+    if(!timer) return false;
+    pthread_mutex_lock(&wheel_mutex);
+    bool armed = (NULL != timer->prev);
+    pthread_mutex_unlock(&wheel_mutex);
+    return armed;
+}
+
+uint64_t srv_timer_remaining_ms(srv_timer_t* timer)
+{
+    if(!timer) return 0;
+    pthread_mutex_lock(&wheel_mutex);
+    uint64_t deadline = timer->prev ? wheel_start_ms + timer->expires*TIMER_TICK_MS : 0;
+    pthread_mutex_unlock(&wheel_mutex);
+    uint64_t now = srv_now_ms();
+    return (deadline > now) ? (deadline - now) : 0;
+}
+
+void srv_timer_run_expired(void)
+{
+    uint64_t target_tick = (srv_now_ms() - wheel_start_ms) / TIMER_TICK_MS;
+
+    while(1)
+    {
+        srv_timer_t fired_head;
+        fired_head.next = &fired_head;
+        fired_head.prev = &fired_head;
+
+        pthread_mutex_lock(&wheel_mutex);
+        if(cur_tick >= target_tick)
+        {
+            pthread_mutex_unlock(&wheel_mutex);
+            break;
+        }
+        wheel_advance(&fired_head);
+
+        // Callbacks run unlocked and may re-arm, so pop them one at a time.
+        while(fired_head.next != &fired_head)
+        {
+            srv_timer_t* timer = fired_head.next;
+            timer_list_unlink(timer);
+            armed_count--;
+            srv_timer_cb_t cb = timer->cb;
+            void* arg = timer->arg;
+            pthread_mutex_unlock(&wheel_mutex);
+
+            cb(arg);
+
+            pthread_mutex_lock(&wheel_mutex);
+        }
+        pthread_mutex_unlock(&wheel_mutex);
+    }
+}
+
+/*
+ * Time until the first non-empty level 0 slot, or until level 0 wraps
+ * and a higher level may cascade timers down. -1 when nothing is armed.
+ */
+int srv_timer_next_timeout_ms(void)
+{
+    pthread_mutex_lock(&wheel_mutex);
+    if(0 == armed_count)
+    {
+        pthread_mutex_unlock(&wheel_mutex);
+        return -1;
+    }
+
+    uint64_t ticks = TIMER_WHEEL_SLOTS - (cur_tick & TIMER_WHEEL_MASK);
+    for(uint64_t i=1;i<ticks;i++)
+    {
+        srv_timer_t* head = &wheel[0][(cur_tick + i) & TIMER_WHEEL_MASK];
+        if(head->next != head)
+        {
+            ticks = i;
+            break;
+        }
+    }
+    uint64_t deadline = wheel_start_ms + (cur_tick + ticks)*TIMER_TICK_MS;
+    pthread_mutex_unlock(&wheel_mutex);
+
+    uint64_t now = srv_now_ms();
+    return (deadline > now) ? (int)(deadline - now) : 0;
+}
+
+void srv_timer_service_start(void)
+{
+    pthread_mutex_lock(&wheel_mutex);
+    for(int level=0;level<TIMER_WHEEL_LEVELS;level++)
+    {
+        for(unsigned int slot=0;slot<TIMER_WHEEL_SLOTS;slot++)
+        {
+            wheel[level][slot].next = &wheel[level][slot];
+            wheel[level][slot].prev = &wheel[level][slot];
+        }
+    }
+    cur_tick = 0;
+    armed_count = 0;
+    wheel_start_ms = srv_now_ms();
+    pthread_mutex_unlock(&wheel_mutex);
+    LOGI("Timer service started, tick : %d ms.",TIMER_TICK_MS);
+}
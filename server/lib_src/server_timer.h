@@ -0,0 +1,44 @@
+#ifndef SERVER_TIMER_H
+#define SERVER_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_TICK_MS        100
+#define TIMER_WHEEL_BITS     6
+#define TIMER_WHEEL_SLOTS    (1U<<TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK     (TIMER_WHEEL_SLOTS-1)
+#define TIMER_WHEEL_LEVELS   4
+
+typedef void (*srv_timer_cb_t)(void* arg);
+
+/* Intrusive wheel entry, embed it in the object that owns the timeout. */
+typedef struct srv_timer_t {
+    struct srv_timer_t* next;
+    struct srv_timer_t* prev;
+    uint64_t expires;
+    srv_timer_cb_t cb;
+    void* arg;
+} srv_timer_t;
+
+typedef enum{
+    TIMER_SUCC=0,
+    ERR_TIMER_NULL_PTR,
+    ERR_TIMER_MAX
+}srv_timer_err_t;
+
+void srv_timer_init(srv_timer_t* timer, srv_timer_cb_t cb, void* arg);
+srv_timer_err_t srv_timer_arm(srv_timer_t* timer, uint64_t timeout_ms);
+void srv_timer_cancel(srv_timer_t* timer);
+bool srv_timer_is_armed(srv_timer_t* timer);
+/* Time left until an armed timer fires, 0 when it is not armed. */
+uint64_t srv_timer_remaining_ms(srv_timer_t* timer);
+
+/* Driven by the I/O loop: sleep for next_timeout, then run what expired. */
+void srv_timer_service_start(void);
+int srv_timer_next_timeout_ms(void);
+void srv_timer_run_expired(void);
+
+uint64_t srv_now_ms(void);
+
+#endif
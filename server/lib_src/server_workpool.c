@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "server_workpool.h"
+#include "server_io.h"
+#include "server_metrics.h"
+#include "server_arena.h"
+#include "logger.h"
+
+typedef struct work_item
+{
+    int key;
+    work_run_t run;
+    work_done_t done;
+    void* arg;
+    /* Loop side: the worker is done with it, or it never went to one. */
+    bool finished;
+    /* Its key went away, it belongs to no FIFO any more. */
+    bool cancelled;
+    struct work_item* next;
+    struct work_item* next_done;
+}work_item_t;
+
+/* Everything of one key not handed back yet, oldest first. Loop only. */
+typedef struct work_key
+{
+    int key;
+    uint32_t queued;
+    /*
+     * Set while a done callback runs. What it queues belongs where the item
+     * stood, ahead of anything that arrived later: after cursor, or at the head.
+     */
+    bool flushing;
+    /* Holds the connection's reads while more than WORKPOOL_KEY_BACKLOG wait. */
+    bool rx_held;
+    work_item_t* cursor;
+    work_item_t* head;
+    work_item_t* tail;
+    struct work_key* next;
+}work_key_t;
+
+/*
+ * The loop pushes at the tail. The owner takes the oldest job from the head,
+ * an idle worker steals the newest one from the tail of another.
+ */
+typedef struct
+{
+    pthread_t thread;
+    uint32_t id;
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t tail;
+    work_item_t* ring[WORKPOOL_DEQUE_LEN];
+}work_deque_t;
+
+static work_deque_t* deques = NULL;
+static uint32_t thread_count = 0;
+static uint32_t next_deque = 0;
+static atomic_uint queued_jobs = 0;
+static atomic_bool stopping = false;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+/* Finished jobs, pushed by any worker and taken all at once by the loop. */
+static _Atomic(work_item_t*) done_stack = NULL;
+static int done_fd = INVALID_FD;
+
+static work_key_t* keys[WORKPOOL_KEY_BUCKETS];
+static uint32_t in_flight = 0;
+
+static work_key_t* key_find(int key)
+{
+    for(work_key_t* k = keys[(unsigned)key % WORKPOOL_KEY_BUCKETS]; k; k = k->next)
+    {
+        if(k->key == key) return k;
+    }
+    return NULL;
+}
+
+/* Keys and items are made and dropped on the loop only, they come from its arena. */
+static void* arena_zalloc(size_t len)
+{
+    void* ptr = arena_alloc(len);
+    if(ptr) memset(ptr,0,len);
+    return ptr;
+}
+
+static work_key_t* key_add(int key)
+{
+    work_key_t* k = arena_zalloc(sizeof(*k));
+    if(!k) return NULL;
+    k->key = key;
+    k->next = keys[(unsigned)key % WORKPOOL_KEY_BUCKETS];
+    keys[(unsigned)key % WORKPOOL_KEY_BUCKETS] = k;
+    return k;
+}
+
+static void key_remove(work_key_t* k)
+{
+    work_key_t** link = &keys[(unsigned)k->key % WORKPOOL_KEY_BUCKETS];
+    while( (*link) && (*link != k) ) link = &(*link)->next;
+    if(*link) *link = k->next;
+    arena_free(k);
+}
+
+/* A key over its backlog stops its connection's reads, not the loop. */
+static void key_backlog(work_key_t* k)
+{
+    bool over = (k->queued >= WORKPOOL_KEY_BACKLOG);
+    if(over == k->rx_held) return;
+    k->rx_held = over;
+    if(over)
+        srv_io_rx_hold(k->key);
+    else
+        srv_io_rx_release(k->key);
+}
+
+static void key_append(work_key_t* k, work_item_t* item)
+{
+    work_item_t** link = &k->head;
+    if(!k->flushing)
+        link = (k->tail) ? &k->tail->next : &k->head;
+    else if(k->cursor)
+        link = &k->cursor->next;
+    item->next = *link;
+    *link = item;
+    if(!item->next)
+        k->tail = item;
+    if(k->flushing)
+        k->cursor = item;
+    k->queued++;
+    key_backlog(k);
+}
+
+/* Hands back everything at the head of k that is done, stops at the first job still running. */
+static void key_flush(work_key_t* k)
+{
+    if(k->flushing) return;
+    k->flushing = true;
+    while( (k->head) && (k->head->finished) )
+    {
+        work_item_t* item = k->head;
+        k->head = item->next;
+        if(!k->head) k->tail = NULL;
+        k->queued--;
+        k->cursor = NULL;
+        item->done(item->arg,false);
+        arena_free(item);
+    }
+    k->flushing = false;
+    key_backlog(k);
+    if(!k->head)
+        key_remove(k);
+}
+
+static bool deque_push(work_deque_t* dq, work_item_t* item)
+{
+    bool ok = false;
+    pthread_mutex_lock(&dq->lock);
+    if(dq->tail - dq->head < WORKPOOL_DEQUE_LEN)
+    {
+        dq->ring[dq->tail++ % WORKPOOL_DEQUE_LEN] = item;
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static work_item_t* deque_take(work_deque_t* dq, bool steal)
+{
+    work_item_t* item = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if(dq->head != dq->tail)
+        item = steal ? dq->ring[--dq->tail % WORKPOOL_DEQUE_LEN] : dq->ring[dq->head++ % WORKPOOL_DEQUE_LEN];
+    pthread_mutex_unlock(&dq->lock);
+    if(item)
+        atomic_fetch_sub(&queued_jobs,1);
+    return item;
+}
+
+static work_item_t* find_work(work_deque_t* self)
+{
+    work_item_t* item = deque_take(self,false);
+    for(uint32_t i=1; (!item) && (i<thread_count); i++)
+    {
+        item = deque_take(&deques[(self->id + i) % thread_count],true);
+        if(item)
+            metrics_inc(METRIC_WORK_STOLEN);
+    }
+    return item;
+}
+
+static void complete(work_item_t* item)
+{
+    work_item_t* head = atomic_load(&done_stack);
+    do
+    {
+        item->next_done = head;
+    }while(!atomic_compare_exchange_weak(&done_stack,&head,item));
+    // Only the push onto an empty stack rings, the loop takes the whole stack per ring.
+    if(!head)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(done_fd,&one,sizeof(one));
+        (void)ret;
+    }
+}
+
+static void* worker_main(void* arg)
+{
+    work_deque_t* self = arg;
+    while(!atomic_load(&stopping))
+    {
+        work_item_t* item = find_work(self);
+        if(item)
+        {
+            item->run(item->arg);
+            complete(item);
+            continue;
+        }
+        pthread_mutex_lock(&idle_lock);
+        while( (!atomic_load(&stopping)) && (0 == atomic_load(&queued_jobs)) )
+            pthread_cond_wait(&idle_cond,&idle_lock);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+/* Takes every finished job off the stack and hands back what is no longer waiting on another. */
+static void workpool_collect(void)
+{
+    uint64_t val;
+    while( (read(done_fd,&val,sizeof(val)) < 0) && (EINTR == errno) );
+
+    // The stack is newest first, turned around so keys see their jobs in order.
+    work_item_t* item = atomic_exchange(&done_stack,NULL);
+    work_item_t* fifo = NULL;
+    while(item)
+    {
+        work_item_t* next = item->next_done;
+        item->next_done = fifo;
+        fifo = item;
+        item = next;
+    }
+    while(fifo)
+    {
+        item = fifo;
+        fifo = item->next_done;
+        in_flight--;
+        item->finished = true;
+        if(item->cancelled)
+        {
+            item->done(item->arg,true);
+            arena_free(item);
+            continue;
+        }
+        work_key_t* k = key_find(item->key);
+        if(k)
+            key_flush(k);
+    }
+}
+
+int workpool_init(uint32_t threads)
+{
+    if(0 == threads)
+    {
+        LOGI("Worker pool off, heavy handlers run on the loop.");
+        return 0;
+    }
+    done_fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if( (INVALID_FD == done_fd) || (IO_SUCC != srv_io_add_doorbell(done_fd,workpool_collect)) )
+    {
+        LOGE("Worker pool eventfd setup failed, errno : %d.",errno);
+        if(INVALID_FD != done_fd)
+            close(done_fd);
+        done_fd = INVALID_FD;
+        return -1;
+    }
+    deques = calloc(threads,sizeof(*deques));
+    if(!deques)
+        return -1;
+
+    // Signals stay with the loop thread, workers start with all of them blocked.
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK,&all,&saved);
+    atomic_store(&stopping,false);
+    for(thread_count=0; thread_count<threads; thread_count++)
+    {
+        work_deque_t* dq = &deques[thread_count];
+        dq->id = thread_count;
+        pthread_mutex_init(&dq->lock,NULL);
+        if(0 != pthread_create(&dq->thread,NULL,worker_main,dq))
+        {
+            LOGE("Cannot start worker %u.",thread_count);
+            pthread_mutex_destroy(&dq->lock);
+            break;
+        }
+        char name[16];
+        snprintf(name,sizeof(name),"chat-work-%u",thread_count);
+        pthread_setname_np(dq->thread,name);
+    }
+    pthread_sigmask(SIG_SETMASK,&saved,NULL);
+    if(0 == thread_count)
+    {
+        workpool_fini();
+        return -1;
+    }
+    LOGI("Worker pool started, %u threads.",thread_count);
+    return 0;
+}
+
+bool workpool_enabled(void)
+{
+    return 0 != thread_count;
+}
+
+/* Out of memory with work of key in flight: it cannot run in order, so its connection goes. */
+static void key_drop(int key, work_done_t done, void* arg)
+{
+    LOGE("fd : %d, no memory to queue work behind %u items, closing.",key,key_find(key)->queued);
+    srv_io_close_fd(key);
+    done(arg,true);
+}
+
+void workpool_submit(int key, work_run_t run, work_done_t done, void* arg)
+{
+    work_key_t* k = key_find(key);
+    work_item_t* item = (thread_count) ? arena_zalloc(sizeof(*item)) : NULL;
+    if( (!item) || ((!k) && (!(k = key_add(key)))) )
+    {
+        // No pool or no memory: in order is still in order when it runs right here.
+        arena_free(item);
+        if( (k) && (!k->flushing) )
+        {
+            key_drop(key,done,arg);
+            return;
+        }
+        run(arg);
+        done(arg,false);
+        return;
+    }
+    item->key = key;
+    item->run = run;
+    item->done = done;
+    item->arg = arg;
+    key_append(k,item);
+
+    bool queued = false;
+    for(uint32_t i=0; (!queued) && (i<thread_count); i++)
+        queued = deque_push(&deques[next_deque++ % thread_count],item);
+    if(!queued)
+    {
+        // Every deque is full, the loop does the job itself.
+        run(arg);
+        item->finished = true;
+        key_flush(k);
+        return;
+    }
+    in_flight++;
+    metrics_inc(METRIC_WORK_OFFLOADED);
+    atomic_fetch_add(&queued_jobs,1);
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+void workpool_defer(int key, work_done_t done, void* arg)
+{
+    work_key_t* k = key_find(key);
+    work_item_t* item = (k) ? arena_zalloc(sizeof(*item)) : NULL;
+    if(!item)
+    {
+        if( (k) && (!k->flushing) )
+            key_drop(key,done,arg);
+        else
+            done(arg,false);
+        return;
+    }
+    item->key = key;
+    item->done = done;
+    item->arg = arg;
+    item->finished = true;
+    key_append(k,item);
+    metrics_inc(METRIC_WORK_DEFERRED);
+}
+
+bool workpool_busy(int key)
+{
+    return NULL != key_find(key);
+}
+
+void workpool_cancel(int key)
+{
+    work_key_t* k = key_find(key);
+    if(!k) return;
+    work_item_t* item = k->head;
+    while(item)
+    {
+        work_item_t* next = item->next;
+        item->next = NULL;
+        if(item->finished)
+        {
+            item->done(item->arg,true);
+            arena_free(item);
+        }
+        else
+        {
+            // Still with a worker, handed back cancelled once it finished.
+            item->cancelled = true;
+        }
+        item = next;
+    }
+    k->head = k->tail = NULL;
+    if(k->rx_held)
+        srv_io_rx_release(key);
+    key_remove(k);
+}
+
+bool workpool_pending(void)
+{
+    return 0 != in_flight;
+}
+
+void workpool_fini(void)
+{
+    if(thread_count)
+    {
+        atomic_store(&stopping,true);
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+        for(uint32_t i=0; i<thread_count; i++)
+            pthread_join(deques[i].thread,NULL);
+    }
+    // What never ran or was never collected is handed back cancelled, with its key or alone.
+    work_item_t* item = atomic_exchange(&done_stack,NULL);
+    while(item)
+    {
+        work_item_t* next = item->next_done;
+        item->finished = true;
+        if(item->cancelled)
+        {
+            item->done(item->arg,true);
+            arena_free(item);
+        }
+        item = next;
+    }
+    for(uint32_t i=0; i<thread_count; i++)
+    {
+        while( (item = deque_take(&deques[i],false)) )
+        {
+            item->finished = true;
+            if(item->cancelled)
+            {
+                item->done(item->arg,true);
+                arena_free(item);
+            }
+        }
+        pthread_mutex_destroy(&deques[i].lock);
+    }
+    for(int b=0; b<WORKPOOL_KEY_BUCKETS; b++)
+    {
+        while(keys[b])
+            workpool_cancel(keys[b]->key);
+    }
+    free(deques);
+    deques = NULL;
+    thread_count = 0;
+    in_flight = 0;
+    if(INVALID_FD != done_fd)
+        close(done_fd);
+    done_fd = INVALID_FD;
+}
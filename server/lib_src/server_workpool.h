@@ -0,0 +1,47 @@
+#ifndef SERVER_WORKPOOL_H
+#define SERVER_WORKPOOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WORKPOOL_DEFAULT_THREADS  2
+#define WORKPOOL_MAX_THREADS      64
+/* Jobs one worker's deque holds, a full pool runs the job on the loop. */
+#define WORKPOOL_DEQUE_LEN        1024
+/* Work queued behind one key before its connection stops being read, see srv_io_rx_hold(). */
+#define WORKPOOL_KEY_BACKLOG      256
+#define WORKPOOL_KEY_BUCKETS      256
+
+/* Runs on a worker thread, must not touch loop-owned state. */
+typedef void (*work_run_t)(void* arg);
+/*
+ * Runs on the loop once every earlier piece of work of the same key is done,
+ * cancelled when the key went away meanwhile; it owns arg either way.
+ */
+typedef void (*work_done_t)(void* arg, bool cancelled);
+
+/*
+ * Starts threads workers, 0 leaves the pool off and every submission runs
+ * inline. Results come back through an eventfd registered with the I/O
+ * backend, so the I/O backend has to be up.
+ */
+int workpool_init(uint32_t threads);
+void workpool_fini(void);
+bool workpool_enabled(void);
+
+/*
+ * Loop side. Work is ordered by key, a connection's fd: workpool_submit()
+ * runs run on a worker and then done on the loop, workpool_defer() only
+ * queues done behind what key already has in flight. Both run at once
+ * when nothing is in the way.
+ */
+void workpool_submit(int key, work_run_t run, work_done_t done, void* arg);
+void workpool_defer(int key, work_done_t done, void* arg);
+/* Whether work submitted for key now would have to wait. */
+bool workpool_busy(int key);
+/* The key is gone: done of everything still queued for it is cancelled. */
+void workpool_cancel(int key);
+/* Whether any work is still in flight. */
+bool workpool_pending(void);
+
+#endif
@@ -1,13 +1,139 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "server_mgmt.h"
 #include "logger.h"
 
-int main()
+static void print_usage(const char* prog)
 {
-    srv_err_type ret = init_srv();
+    printf("Usage : %s [epoll|uring] [-f config_file] [-p port] [-u unix_path] [-w workers] [-r class=rate[/burst]]... [-o signal=limit]... [-t] [-c] [-a advertise_ip] [-j ip:port]...\n",prog);
+    printf("        %s [-p port] -q config|reload\n",prog);
+    printf("  -f config_file   key = value settings, options after it override them, SIGHUP reloads it\n");
+    printf("  -p port          listen port, default %d\n",SERVER_PORT);
+    printf("  -u unix_path     UNIX socket for local clients, default " SERVER_UNIX_PATH_FMT ", empty disables\n",SERVER_PORT);
+    printf("  -w workers       threads for heavy handlers, default %d, 0 runs them on the loop\n",WORKPOOL_DEFAULT_THREADS);
+    printf("  -r class=rate[/burst]\n");
+    printf("                   requests per second and burst per client, class is list, connect, name, chat or other, rate 0 is unlimited\n");
+    printf("  -r strikes=n     drop a client after n throttled requests in %d ms, 0 never drops\n",RATE_STRIKE_WINDOW_MS);
+    printf("  -o signal=limit  overload limit, signal is lag (ms), queue (MiB) or mem (MiB), 0 unwatches it\n");
+    printf("                   defaults lag=%d queue=%d mem=%d, requests are shed from %d%% of a limit on\n",
+           OVERLOAD_DEFAULT_LAG_MS,OVERLOAD_DEFAULT_QUEUE_MB,OVERLOAD_DEFAULT_MEM_MB,OVERLOAD_SHED_PERCENT);
+    printf("  -t               take the sockets and clients over from the server running on port, then let it exit\n");
+    printf("  -c               run as a cluster node\n");
+    printf("  -a advertise_ip  address other nodes reach this one at, default %s\n",CLUSTER_DEFAULT_IP);
+    printf("  -j ip:port       join the cluster through this node, implies -c\n");
+    printf("  -q command       ask the server on port for its effective configuration, or to reload it\n");
+}
+
+int main(int argc, char* argv[])
+{
+    srv_config_t config = {0};
+    config.io_backend = IO_BACKEND_URING;
+    config.port = SERVER_PORT;
+    strcpy(config.advertise_ip,CLUSTER_DEFAULT_IP);
+    config.workers = WORKPOOL_DEFAULT_THREADS;
+    config_tuning_defaults(&config.tuning);
+
+    bool unix_path_set = false;
+    const char* query = NULL;
+    int opt;
+    while( (opt = getopt(argc,argv,"f:p:u:w:r:o:tca:j:q:")) != -1 )
+    {
+        switch(opt)
+        {
+            case 'f':
+                if(!config_file_load(optarg,&config,&unix_path_set))
+                {
+                    printf("Bad configuration file : %s\n",optarg);
+                    return -1;
+                }
+                break;
+            case 'p':
+                config.port = (uint16_t)atoi(optarg);
+                break;
+            case 'u':
+                snprintf(config.unix_path,sizeof(config.unix_path),"%s",optarg);
+                unix_path_set = true;
+                break;
+            case 'w':
+                config.workers = (uint32_t)atoi(optarg);
+                if(config.workers > WORKPOOL_MAX_THREADS)
+                {
+                    printf("At most %d workers.\n",WORKPOOL_MAX_THREADS);
+                    return -1;
+                }
+                break;
+            case 'r':
+                if(!rate_config_parse(&config.tuning.rate,optarg))
+                {
+                    printf("Bad rate limit : %s\n",optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'o':
+                if(!overload_config_parse(&config.tuning.overload,optarg))
+                {
+                    printf("Bad overload limit : %s\n",optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 't':
+                config.takeover = true;
+                break;
+            case 'c':
+                config.cluster = true;
+                break;
+            case 'a':
+                snprintf(config.advertise_ip,sizeof(config.advertise_ip),"%s",optarg);
+                break;
+            case 'j':
+                if(config.seed_count >= CLUSTER_MAX_NODES)
+                {
+                    printf("At most %d seeds.\n",CLUSTER_MAX_NODES);
+                    return -1;
+                }
+                snprintf(config.seeds[config.seed_count++],CLUSTER_ADDR_LEN,"%s",optarg);
+                config.cluster = true;
+                break;
+            case 'q':
+                query = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if(optind < argc)
+    {
+        config.io_backend = io_backend_from_str(argv[optind]);
+        if(IO_BACKEND_MAX == config.io_backend)
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    if(0 == config.port)
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if(query)
+        return config_admin_query(config.port,query);
+    if( (config.takeover) && (config.cluster) )
+    {
+        printf("Cluster nodes cannot be upgraded in place.\n");
+        return -1;
+    }
+    if(!unix_path_set)
+        snprintf(config.unix_path,sizeof(config.unix_path),SERVER_UNIX_PATH_FMT,config.port);
+
+    srv_err_type ret = init_srv(&config);
     if(ret!=SERVER_SUCC) return -1;
 
     ret = wait_for_client_conn_and_accept();
     LOGI("[ server ] terminating, reason : %d .",ret);
     return 0;
-}
\ No newline at end of file
+}